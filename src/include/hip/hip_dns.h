@@ -49,6 +49,7 @@ struct dns_hdr {
 #define HIP_RR_TYPE 55
 #define HIP_RR_PKALG_DSA 1
 #define HIP_RR_PKALG_RSA 2
+#define HIP_RR_PKALG_ECDSA 3
 
 #define DNS_FLAG_MASK_STDQUERY  0x0001
 #define DNS_FLAG_AUTHORITATIVE  0x0400
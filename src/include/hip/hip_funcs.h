@@ -107,7 +107,7 @@ int hip_send_I1(hip_hit* hit, hip_assoc *hip_a);
 int hip_send_R1(struct sockaddr *src, struct sockaddr *dst, hip_hit *hiti,
                 hi_node *hi, hip_assoc *hip_rvs);
 int hip_generate_R1(__u8 *data, hi_node *hi, hipcookie *cookie,
-                    dh_cache_entry *dh_entry);
+                    dh_cache_entry *dh_entry, int *cookie_offset);
 int hip_send_I2(hip_assoc *hip_a);
 int hip_send_R2(hip_assoc *hip_a);
 int hip_send_update(hip_assoc *hip_a, struct sockaddr *newaddr,
@@ -144,7 +144,7 @@ int hip_finish_rekey(hip_assoc *hip_a, int rebuild);
 int hip_handle_BOS(__u8 *data, struct sockaddr *src);
 int hip_handle_CER(__u8 *data, hip_assoc *hip_a);
 int validate_signature(const __u8 *data, int data_len, tlv_head *tlv,
-                       DSA *dsa, RSA *rsa);
+                       DSA *dsa, RSA *rsa, EC_KEY *ecdsa);
 int handle_hi(hi_node **hi_p, const __u8 *data);
 int complete_base_exchange(hip_assoc *hip_a);
 int rebuild_sa(hip_assoc *hip_a, struct sockaddr *newaddr, __u32 newspi,
@@ -160,12 +160,15 @@ int flush_hip_associations();
 void hip_handle_esp(char *data, int length);
 void start_base_exchange(struct sockaddr *dst);
 void start_expire(__u32 spi);
+void start_icmp_update(__u32 spi);
 void receive_udp_hip_packet(char *buff, int len);
 void start_loss_multihoming(char *data, int len);
 int handle_notify_loss(__u8 *data, int data_len);
-void hip_handle_multihoming_timeouts(struct timeval *now);
+void hip_handle_multihoming_timeout(hip_assoc *hip_a, struct timeval *now);
 
 /* hip_keymat.c */
+int dh_secret_size(__u8 group_id);
+int compute_dh_secret(hip_assoc *hip_a);
 int set_secret_key(unsigned char *key, hip_assoc *hip_a);
 unsigned char *get_key(hip_assoc *hip_a, int type, int peer);
 void compute_keys(hip_assoc *hip_a);
@@ -183,7 +186,7 @@ int add_addresses_from_dns(char *name, hi_node *hi);
 int save_identities_file(int);
 int read_conf_file(char *);
 int read_reg_file(void);
-__u16 conf_transforms_to_mask();
+__u32 conf_transforms_to_mask();
 hi_node *create_new_hi_node();
 void append_hi_node(hi_node **head, hi_node *append);
 int add_peer_hit(hip_hit peer_hit, struct sockaddr *peer_addr);
@@ -196,8 +199,14 @@ int get_addr_from_list(sockaddr_list *list, int family,
 int get_other_addr_from_list(sockaddr_list *list, struct sockaddr *exclude,
                              struct sockaddr *addr);
 hip_assoc *init_hip_assoc(hi_node *my_host_id, const hip_hit *peer_hit);
-void replace_hip_assoc(hip_assoc *a_old, hip_assoc *a_new);
+hip_assoc *init_pending_hip_assoc(hi_node *my_host_id,
+                                  const hip_hit *peer_hit);
+hip_assoc *adopt_hip_assoc(hip_assoc *a_old, hip_assoc *a_new);
 int free_hip_assoc(hip_assoc *hip_a);
+void free_pending_hip_assoc(hip_assoc *hip_a);
+void hip_assoc_index(hip_assoc *hip_a);
+void hip_assoc_unindex(hip_assoc *hip_a);
+void hip_assoc_trim();
 void free_hi_node(hi_node *hi);
 void clear_retransmissions(hip_assoc *hip_a);
 void set_state(hip_assoc *hip_a, int state);
@@ -258,6 +267,7 @@ void logrsa(RSA *rsa);
 void logdh(DH *dh);
 void logbn(BIGNUM *bn);
 int bn2bin_safe(const BIGNUM *a, unsigned char *to, int len);
+int ec2bin_safe(const EC_KEY *ec, unsigned char *to, int len);
 void log_hipa_fromto(int level, char *msg,  hip_assoc *hip_a,__u8 from,__u8 to);
 void log_hipopts();
 #ifdef __WIN32__
@@ -305,18 +315,30 @@ int update_peer_list_address(const hip_hit peer_hit,
 int add_other_addresses_to_hi(hi_node *hi, int mine);
 
 /* hip_cache.c */
-void init_all_R1_caches();
-void init_R1_cache(hi_node *hi);
+int init_all_R1_caches();
 hipcookie *generate_cookie();
 void replace_next_R1();
+void count_puzzle_load(int type);
+void adapt_puzzle_difficulty(struct timeval *now);
 int compute_R1_cache_index(hip_hit *hiti, __u8 current);
 int calculate_r1_length(hi_node *hi);
 void init_dh_cache();
 dh_cache_entry *new_dh_cache_entry(__u8 group_id);
 dh_cache_entry *get_dh_entry(__u8 group_id, int new);
-void unuse_dh_entry(DH *dh);
+void unuse_dh_entry(DH *dh, EC_KEY *ec);
 void expire_old_dh_entries();
 
+/* hip_main.c */
+void hip_assoc_wakeup(hip_assoc *hip_a);
+
+/* hip_crypto.c */
+int hip_crypto_init(int workers);
+int hip_crypto_fd();
+hip_crypto_job *hip_crypto_find(const hip_hit peer_hit, const hip_hit my_hit);
+int hip_crypto_submit(hip_crypto_job *job);
+void hip_crypto_complete();
+int hip_crypto_backlog();
+
 /* hip_status.c */
 int hip_status_open();
 void hip_handle_status_request(__u8 *buff, int len, struct sockaddr *addr);
@@ -39,9 +39,12 @@
 
 /* global variables */
 
-/* Array storing HIP association structs (this is the state machine state) */
-extern hip_assoc hip_assoc_table[MAX_CONNECTIONS];
+/* Slabs storing HIP association structs (this is the state machine state) */
+extern hip_assoc_slab *hip_assoc_slabs[HIP_ASSOC_MAX_SLABS];
 extern int max_hip_assoc;
+/* association number i, for 0 <= i < max_hip_assoc */
+#define HIP_ASSOC(i) (&hip_assoc_slabs[(i) >> HIP_ASSOC_SLAB_BITS]-> \
+                      a[(i) & (HIP_ASSOC_SLAB_SIZE - 1)])
 extern const hip_hit zero_hit;
 
 /* Linked list of my host identities */
@@ -58,9 +61,9 @@ extern dh_cache_entry *dh_cache;
 
 /* Diffie-Hellman constants */
 extern const unsigned char *dhprime[DH_MAX];
-extern const int dhprime_len[DH_MAX]; /* only used by new_dh_cache_entry()
-                                       *    use DH_size() elsewhere */
+extern const int dhprime_len[DH_MAX]; /* length of the public value */
 extern unsigned char dhgen[DH_MAX];
+extern const int ecdh_curve[DH_MAX];  /* curve NID, 0 for MODP groups */
 
 
 extern int s_hip; /* RAW socket handle */
@@ -74,6 +77,7 @@ extern struct hip_opt OPT;
 
 /* Global configuration data */
 extern struct hip_conf HCNF;
+extern int g_conf_loaded;
 
 extern int espsp[2]; /* ESP thread socket pair */
 extern int g_state;
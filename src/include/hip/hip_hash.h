@@ -0,0 +1,120 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2005-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  hip_hash.h
+ *
+ *  \brief  Resizable hash tables with lock-free readers, used by the SADB.
+ *
+ */
+
+#ifndef _HIP_HASH_H_
+#define _HIP_HASH_H_
+
+#ifdef __MACOSX__
+#include <sys/types.h>
+#include <mac/mac_types.h>
+#else
+#ifdef __WIN32__
+#include <win32/types.h>
+#else
+#include <asm/types.h>          /* __u16, __u32, etc */
+#endif /* __WIN32__ */
+#endif
+
+/*
+ * definitions
+ */
+#define HIP_HASH_MIN_SIZE       64      /* buckets, a power of two */
+#define HIP_HASH_MAX_LOAD       2       /* grow beyond this many items/bucket */
+#define HIP_HASH_REHASH_STEP    64      /* old buckets migrated per write */
+#define HIP_HASH_KEY_LEN        16      /* SipHash key */
+
+#define HIP_HASH_LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define HIP_HASH_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* chain node; the items themselves carry no linkage, so one item could
+ * be present in two bucket arrays while the table is being resized */
+typedef struct _hip_hash_node
+{
+  struct _hip_hash_node *next;
+  __u32 hash;
+  void *item;
+} hip_hash_node;
+
+typedef struct _hip_hash_buckets
+{
+  __u32 mask;                           /* number of buckets - 1 */
+  hip_hash_node *b[1];                  /* mask + 1 chains follow */
+} hip_hash_buckets;
+
+/* returns nonzero when item matches key */
+typedef int (*hip_hash_match_fn)(const void *item, const void *key);
+/* frees ptr with free_fn once no lock-free reader can reference it */
+typedef void (*hip_hash_retire_fn)(void *ptr, void (*free_fn)(void *ptr));
+
+/*
+ * Readers may call hip_hash_lookup() and walk the table with
+ * hip_hash_first()/hip_hash_next() without locks. All other calls
+ * must be serialized by the owner of the table. While the table grows,
+ * cur is the new bucket array and old is the previous one; old buckets
+ * below migrate_pos have been copied into cur.
+ */
+typedef struct _hip_hash_table
+{
+  hip_hash_buckets *cur;
+  hip_hash_buckets *old;
+  __u32 migrate_pos;
+  __u32 count;
+  hip_hash_match_fn match;
+  hip_hash_retire_fn retire;
+} hip_hash_table;
+
+typedef struct _hip_hash_iter
+{
+  hip_hash_buckets *cur;
+  hip_hash_buckets *old;
+  __u32 bucket;                         /* next bucket to visit */
+  __u32 old_start;                      /* first unmigrated old bucket */
+  int in_old;
+  hip_hash_node *node;                  /* current node */
+} hip_hash_iter;
+
+/*
+ * functions
+ */
+void hip_hash_seed(const __u8 *key);
+__u32 hip_hash_key(const void *data, int len);
+int hip_hash_init(hip_hash_table *t, __u32 size, hip_hash_match_fn match,
+                  hip_hash_retire_fn retire);
+void hip_hash_destroy(hip_hash_table *t, void (*free_item)(void *item));
+void *hip_hash_lookup(hip_hash_table *t, __u32 hash, const void *key);
+int hip_hash_insert(hip_hash_table *t, __u32 hash, void *item);
+void hip_hash_insert_node(hip_hash_table *t, hip_hash_node *n, __u32 hash,
+                          void *item);
+void *hip_hash_remove(hip_hash_table *t, __u32 hash, const void *key);
+int hip_hash_rehash_step(hip_hash_table *t);
+void *hip_hash_first(hip_hash_table *t, hip_hash_iter *it);
+void *hip_hash_next(hip_hash_iter *it);
+
+#endif /* _HIP_HASH_H_ */
@@ -139,10 +139,21 @@ typedef enum {
   ESP_BLOWFISH_CBC_HMAC_SHA1,           /* 4 */
   ESP_NULL_HMAC_SHA1,                   /* 5 */
   ESP_NULL_HMAC_MD5,                    /* 6 */
-  SUITE_ID_MAX,                         /* 7 */
+  ESP_AES128_GCM = 13,                  /* 13 (RFC 7402, 16-byte ICV) */
+  SUITE_ID_MAX,                         /* 14 */
 } SUITE_IDS;
+/* RFC 7402 suites 7-12 are not implemented */
+#define SUITE_ID_SUPPORTED(a) (((a > RESERVED) && \
+                                (a <= ESP_NULL_HMAC_MD5)) || \
+                               (a == ESP_AES128_GCM))
 #define ENCR_NULL(a) ((a == ESP_NULL_HMAC_SHA1) || \
                       (a == ESP_NULL_HMAC_MD5))
+/* AEAD suites are only valid for ESP, not for the HIP ENCRYPTED parameter */
+#define ESP_AEAD(a) (a == ESP_AES128_GCM)
+/* EVP AES-GCM is available since OpenSSL 1.0.1 */
+#ifdef EVP_CTRL_GCM_SET_IVLEN
+#define HIP_ESP_AES_GCM
+#endif
 /* Supported transforms are compressed into a bitmask... */
 /* Default HIP transforms proposed when none are specified in config */
 #define DEFAULT_HIP_TRANS \
@@ -153,30 +164,37 @@ typedef enum {
    (1 << ESP_NULL_HMAC_SHA1) | \
    (1 << ESP_NULL_HMAC_MD5))
 /* Default ESP transforms proposed when none are specified in config */
-#define ESP_OFFSET 8
+#define ESP_OFFSET 16
 #define DEFAULT_ESP_TRANS \
   ((1 << (ESP_OFFSET + ESP_AES_CBC_HMAC_SHA1)) | \
    (1 << (ESP_OFFSET + ESP_3DES_CBC_HMAC_SHA1)) | \
    (1 << (ESP_OFFSET + ESP_3DES_CBC_HMAC_MD5)) | \
    (1 << (ESP_OFFSET + ESP_BLOWFISH_CBC_HMAC_SHA1)) | \
    (1 << (ESP_OFFSET + ESP_NULL_HMAC_SHA1)) | \
-   (1 << (ESP_OFFSET + ESP_NULL_HMAC_MD5)))
+   (1 << (ESP_OFFSET + ESP_NULL_HMAC_MD5)) | \
+   (1 << (ESP_OFFSET + ESP_AES128_GCM)))
 
 /* HI (signature) algorithms  */
 typedef enum {
   HI_ALG_RESERVED,
   HI_ALG_DSA = 3,
   HI_ALG_RSA = 5,
+  HI_ALG_ECDSA = 7,
 } HI_ALGORITHMS;
 #define HIP_RSA_DFT_EXP RSA_F4 /* 0x10001L = 65537; 3 and 17 are also common */
 #define HI_TYPESTR(a)  ((a == HI_ALG_DSA) ? "DSA" : \
-                        (a == HI_ALG_RSA) ? "RSA" : "UNKNOWN")
+                        (a == HI_ALG_RSA) ? "RSA" : \
+                        (a == HI_ALG_ECDSA) ? "ECDSA" : "UNKNOWN")
+/* ECDSA HI curves (RFC 7401), only NIST P-256 is supported */
+#define HI_ECC_CURVE_NIST_P256 1
+#define HIP_ECDSA_CURVE NID_X9_62_prime256v1
 
 /* SADB algorithms */
 #define SADB_EALG_3DESCBC 3
 #define SADB_X_EALG_BLOWFISHCBC 7
 #define SADB_EALG_NULL 11
 #define SADB_X_EALG_AESCBC 12
+#define SADB_X_EALG_AES_GCM_ICV16 20
 #define SADB_AALG_MD5HMAC 2
 #define SADB_AALG_SHA1HMAC 3
 
@@ -219,6 +237,7 @@ typedef enum {
   KEY_LEN_3DES = 24,            /* 192 bits (3x64-bit keys) RFC 2451 */
   KEY_LEN_AES = 16,             /* 128 bits per RFC 3686; also 192, 256-bits */
   KEY_LEN_BLOWFISH = 16,        /* 128 bits per RFC 2451 */
+  KEY_LEN_AES128_GCM = 20,      /* 128 bits + 32-bit salt per RFC 4106 */
 } HIP_KEYLENS;
 
 /* Diffie-Hellman Group IDs */
@@ -230,6 +249,9 @@ typedef enum {
   DH_MODP_3072,
   DH_MODP_6144,
   DH_MODP_8192,
+  DH_ECP_256,           /* ECDH groups, with RFC 7401 IDs */
+  DH_ECP_384,
+  DH_ECP_521,
   DH_MAX
 } DH_GROUP_IDS;
 /* choose default DH group here */
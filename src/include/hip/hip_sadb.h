@@ -54,6 +54,9 @@
 #include <openssl/des.h>        /* DES_key_schedule */
 #include <openssl/aes.h>        /* aes_key */
 #include <openssl/blowfish.h>   /* bf_key */
+#include <openssl/evp.h>        /* EVP_CIPHER_CTX */
+#include <openssl/hmac.h>       /* HMAC_CTX */
+#include <hip/hip_timer.h>       /* hip_timer */
 
 /*
  * Algorithms
@@ -74,14 +77,28 @@
 #define SADB_X_EALG_BLOWFISHCBC         7
 #define SADB_EALG_NULL                  11
 #define SADB_X_EALG_AESCBC              12
+#define SADB_X_EALG_AES_GCM_ICV16       20
 #define SADB_X_EALG_SERPENTCBC          252
 #define SADB_X_EALG_TWOFISHCBC          253
 
+#define ESP_GCM_ICV_LEN                 16 /* RFC 4106 16-byte ICV */
+#define ESP_GCM_SALT_LEN                4  /* salt follows the AES key */
+#define ESP_GCM_NONCE_LEN               12 /* salt + 8-byte IV */
+
+/* CBC IV generation, per SA; AES-GCM always uses the sequence number */
+#define ESP_IV_RANDOM                   0  /* RAND_bytes() per packet */
+#define ESP_IV_COUNTER                  1  /* encrypted sequence number */
+
 
 /*
  * definitions
  */
-#define SADB_SIZE 512
+#define SADB_SIZE 512 /* initial buckets, the tables grow as needed */
+#define SADB_MAX_READERS 64 /* threads reading the SADB without locks */
+#define SADB_TIMER_BATCH 64 /* expire messages/unbuffers per timer tick */
+#define SADB_CTR_CHUNK 4096 /* per-thread SA counters allocated together */
+#define SADB_CTR_CHUNKS 256 /* SAs with traffic counters, in chunks */
+#define SADB_CTR_NONE 0xFFFFFFFF /* SA has no traffic counters */
 #define LSI4(a) (((struct sockaddr_in*)a)->sin_addr.s_addr)
 #define ESP_SEQNO_MAX (0xFFFFFFFF - 0x20)
 #define check_esp_seqno_overflow(e) e && (e->sequence_hi == 0xFFFFFFFF) && \
@@ -90,60 +107,114 @@
 /*
  * HIP Security Association entry
  *
- * Note that this is different than the hip_assoc/hip_assoc_table[] used by
+ * Note that this is different than the hip_assoc slabs used by
  * the main hipd thread. The SADB is used primarily by the ESP input/output
  * threads (the data plane).
+ *
+ * The entry holds only what the ESP threads use for every packet: header
+ * fields, cipher contexts and replay state in the first 128 bytes, then
+ * addresses, then the entry lock. HITs, keys, and lifetime live in the
+ * separately allocated hip_sadb_cold record. Traffic counters are kept
+ * per ESP thread, indexed by ctr_index (see hip_sadb_inc_bytes()).
  */
+struct _hip_sadb_cold;
 typedef struct _hip_sadb_entry
 {
-  struct _hip_sadb_entry *next;
   __u32 spi;                            /* primary index into SADB */
-  __u32 spinat;                         /* spinat for mobile router */
   __u32 mode;           /* ESP mode :  0-default 1-transport 2-tunnel 3-beet */
   int direction;                        /* 1-in/2-out */
+  __u32 a_type;                         /* crypto parameters            */
+  __u32 e_type;
+  __u32 e_keylen;
+  __u32 spinat;                         /* spinat for mobile router */
+  __u32 lsi4;                           /* peer's IPv4 LSI, host order */
+  __u32 sequence;                       /* outgoing or highest received seq no*/
+  __u32 sequence_hi;                    /* high-order bits of 64-bit ESN */
+  int iv_gen;                           /* ESP_IV_RANDOM or ESP_IV_COUNTER */
+  int cipher_enc;                       /* cipher_ctx keyed to encrypt */
+  __u32 replay_win_words;               /* window size in 64-bit words */
   __u16 hit_magic;                      /* for quick checksum calculation */
+  EVP_CIPHER_CTX *cipher_ctx;           /* keyed AES-CBC/GCM context */
+  HMAC_CTX *hmac_ctx;                   /* keyed HMAC, reset per packet */
+  EVP_CIPHER_CTX *iv_ctx;               /* encrypts the CBC IV counter */
+  __u8 iv_salt[8];                      /* random high half of IV counter */
+  __u8 *e_key;                          /* raw key, followed by GCM salt */
+  BF_KEY *bf_key;                       /* BLOWFISH key */
+  DES_key_schedule *ks;                 /* 3-DES keys, 3 schedules */
+  __u64 *replay_win_map;                /* anti-replay bitmap, bit 0 = max */
+  __u64 replay_win_max;                 /* right side of received window */
   sockaddr_list *src_addrs;             /* source addresses             */
   sockaddr_list *dst_addrs;             /* destination addresses        */
+  __u32 ctr_index;                      /* slot in per-thread counters */
+  __u32 lost;                           /* number of packets lost */
+  struct _hip_sadb_cold *cold;          /* management data */
+  hip_mutex_t rw_lock;
+} hip_sadb_entry;
+
+/* SA management data, not used on the per-packet path */
+typedef struct _hip_sadb_cold
+{
+  hip_sadb_entry *entry;                /* the hot record */
   struct sockaddr_storage src_hit;       /* source HIT */
   struct sockaddr_storage dst_hit;       /* destination HIT */
   struct sockaddr_storage lsi;          /* peer's IPv4 <prefix>.x.x.x LSI */
-  __u32 a_type;                         /* crypto parameters            */
-  __u32 e_type;
-  __u32 a_keylen;
-  __u32 e_keylen;
   __u8 *a_key;                          /* raw crypto keys */
-  __u8 *e_key;
+  __u32 a_keylen;
+  __u32 replay_dups;                    /* duplicates dropped by window */
+  __u32 replay_old;                     /* dropped as older than window */
   __u64 lifetime;                       /* seconds until expiration */
   struct timeval exptime;               /* expiration timestamp */
+  hip_timer exp_timer;                  /* fires at exptime */
+} hip_sadb_cold;
+
+/* SA traffic counters, one set per ESP thread; summed when read */
+typedef struct _hip_sadb_counters
+{
   __u64 bytes;                          /* bytes tx/rx */
   __u32 packets;                        /* number of packets tx/rx*/
-  __u32 lost;                           /* number of packets lost */
   __u32 dropped;                        /* number of packets dropped */
   struct timeval usetime;               /* last used timestamp */
-  __u32 sequence;                       /* outgoing or highest received seq no*/
-  __u32 sequence_hi;                    /* high-order bits of 64-bit ESN */
-  __u64 replay_win_max;                 /* right side of received window */
-  __u64 replay_win_map;                 /* anti-replay bitmap */
-  char iv[8];
-  DES_key_schedule ks[3];               /* 3-DES keys */
-  AES_KEY *aes_key;                     /* AES key */
-  BF_KEY *bf_key;                       /* BLOWFISH key */
-  hip_mutex_t rw_lock;
-} hip_sadb_entry;
+} hip_sadb_counters;
+
+/* one SA to install or remove with hip_sadb_apply(); a delete uses only
+ * the SPI, and the pointers of an add need only last for the call */
+#define SADB_OP_ADD 1
+#define SADB_OP_DELETE 2
+typedef struct _hip_sadb_op
+{
+  int op;                               /* SADB_OP_ADD or SADB_OP_DELETE */
+  __u32 spi;
+  __u32 mode;
+  int direction;                        /* 1-in/2-out */
+  struct sockaddr *src_hit;
+  struct sockaddr *dst_hit;
+  struct sockaddr *src;
+  struct sockaddr *dst;
+  struct sockaddr *src_lsi;
+  struct sockaddr *dst_lsi;
+  __u32 spinat;
+  __u8 *e_key;
+  __u32 e_type;
+  __u32 e_keylen;
+  __u8 *a_key;
+  __u32 a_type;
+  __u32 a_keylen;
+  __u32 lifetime;
+} hip_sadb_op;
 
 /* HIP SADB desintation cache entry */
 typedef struct _hip_sadb_dst_entry
 {
-  struct _hip_sadb_dst_entry *next;
   struct sockaddr_storage addr;
   hip_sadb_entry *sadb_entry;
-  hip_mutex_t rw_lock;
 } hip_sadb_dst_entry;
 
 /* HIP LSI table entry */
 #define LSI_PKT_BUFFER_SIZE 2000
 /* number of seconds to keep LSI entries */
 #define LSI_ENTRY_LIFETIME 120
+/* usec to wait after the SA is added before sending buffered packets */
+#define LSI_UNBUFFER_DELAY 200000
 typedef struct _hip_lsi_entry
 {
   struct _hip_lsi_entry *next;
@@ -155,18 +226,18 @@ typedef struct _hip_lsi_entry
   int next_packet;
   int send_packets;
   struct timeval creation_time;
+  hip_timer timer;              /* unbuffering and expiry */
 } hip_lsi_entry;
 /* protocol selector entry */
-#define PROTO_SEL_SIZE 512
+#define PROTO_SEL_SIZE 512 /* initial buckets */
 #define PROTO_SEL_ENTRY_LIFETIME 900
 #define PROTO_SEL_DEFAULT_FAMILY AF_INET
-#define hip_proto_sel_hash(a) (a % PROTO_SEL_SIZE)
 typedef struct _hip_proto_sel_entry
 {
-  struct _hip_proto_sel_entry *next;
   __u32 selector;               /* upper layer protocol-specific selector */
   int family;                   /* guidance on which address family to use */
   struct timeval last_used;
+  hip_timer timer;              /* aging */
 } hip_proto_sel_entry;
 
 
@@ -184,8 +255,8 @@ int hip_sadb_add(__u32 mode, int direction,
                  __u8 *a_key, __u32 a_type, __u32 a_keylen,
                  __u32 lifetime);
 int hip_sadb_delete(__u32 spi);
+int hip_sadb_apply(hip_sadb_op *ops, int num);
 int hip_sadb_add_del_addr(__u32 spi, struct sockaddr *addr, int flags);
-void hip_remove_expired_lsi_entries(struct timeval *now);
 void hip_add_lsi(struct sockaddr *addr, struct sockaddr *lsi4,
                  struct sockaddr *lsi6);
 int buffer_packet(struct sockaddr *lsi, __u8 *data, int len);
@@ -194,11 +265,16 @@ hip_lsi_entry *hip_lookup_lsi(struct sockaddr *lsi);
 hip_sadb_entry *hip_sadb_lookup_spi(__u32 spi);
 hip_sadb_entry *hip_sadb_lookup_addr(struct sockaddr *addr);
 hip_sadb_entry *hip_sadb_get_next(hip_sadb_entry *placemark);
-void hip_sadb_expire(struct timeval *now);
+int hip_sadb_reader_add();
+void hip_sadb_reader_remove(int reader);
+void hip_sadb_quiescent(int reader);
 int hip_sadb_get_usage(__u32 spi, __u64 *bytes, struct timeval *usetime);
 int hip_sadb_get_lost(__u32 spi, __u32 *lost);
-void hip_sadb_inc_bytes(hip_sadb_entry *entry, __u64 bytes, struct timeval *now,
-                        int lock);
+int hip_sadb_get_replay_drops(__u32 spi, __u32 *dups, __u32 *old);
+void hip_sadb_get_counters(hip_sadb_entry *entry, hip_sadb_counters *sum);
+void hip_sadb_inc_bytes(hip_sadb_entry *entry, int reader, __u64 bytes,
+                        struct timeval *now);
+void hip_sadb_inc_dropped(hip_sadb_entry *entry, int reader);
 __u32 hip_sadb_inc_loss(hip_sadb_entry *entry, __u32 loss,
                         struct sockaddr *dst);
 void hip_sadb_reset_loss(hip_sadb_entry *entry, struct sockaddr *dst);
@@ -207,7 +283,11 @@ int hip_select_family_by_proto(__u32 lsi, __u8 proto, __u8 *header,
                                struct timeval *now);
 int hip_add_proto_sel_entry(__u32 lsi, __u8 proto, __u8 *header, int family,
                             int dir, struct timeval *now);
-void hip_remove_expired_sel_entries(struct timeval *now);
 void print_sadb();
 
+/* hip_esp_iv.c */
+__u32 get_next_seqno(hip_sadb_entry *entry);
+int hip_esp_iv_init(hip_sadb_entry *entry);
+int hip_esp_next_iv(hip_sadb_entry *entry, __u8 *iv, int iv_len);
+
 #endif
@@ -47,6 +47,7 @@
 #ifdef __WIN32__
 void hip_esp_output(void *arg);
 void hip_esp_input(void *arg);
+void hip_sadb_timers(void *arg);
 void tunreader(void *arg);
 void hip_dns(void *arg);
 void hipd_main(void *arg);
@@ -57,6 +58,7 @@ extern int socketpair(int, int, int, int sv[2]);
 #else
 void *hip_esp_output(void *arg);
 void *hip_esp_input(void *arg);
+void *hip_sadb_timers(void *arg);
 void *tunreader(void *arg);
 void *hip_dns(void *arg);
 void *hipd_main(void *arg);
@@ -0,0 +1,104 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2005-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  hip_timer.h
+ *
+ *  \brief  Hierarchical timer wheel for SADB and hipd housekeeping.
+ *
+ */
+
+#ifndef _HIP_TIMER_H_
+#define _HIP_TIMER_H_
+
+#ifdef __MACOSX__
+#include <sys/types.h>
+#include <mac/mac_types.h>
+#else
+#ifdef __WIN32__
+#include <win32/types.h>
+#else
+#include <asm/types.h>          /* __u16, __u32, etc */
+#endif /* __WIN32__ */
+#endif
+#include <stddef.h>             /* offsetof() */
+#ifdef __WIN32__
+#include <winsock2.h>           /* struct timeval */
+#else
+#include <sys/time.h>           /* struct timeval */
+#endif
+
+/*
+ * definitions
+ */
+#define HIP_TIMER_TICK_MS       100     /* wheel resolution */
+#define HIP_TIMER_LEVELS        4
+#define HIP_TIMER_SLOT_BITS     6
+#define HIP_TIMER_SLOTS         (1 << HIP_TIMER_SLOT_BITS)
+#define HIP_TIMER_SLOT_MASK     (HIP_TIMER_SLOTS - 1)
+/* longest delay the wheel holds directly, about 19 days; later timers are
+ * parked at the far end and re-filed when they get there */
+#define HIP_TIMER_MAX_TICKS     ((1ULL << (HIP_TIMER_LEVELS * \
+                                           HIP_TIMER_SLOT_BITS)) - 1)
+
+/* get the structure containing timer t as member */
+#define hip_timer_entry(t, type, member) \
+  ((type *)((char *)(t) - offsetof(type, member)))
+
+/*
+ * Timer embedded in the object that it expires. next is NULL while the
+ * timer is not armed.
+ */
+typedef struct _hip_timer
+{
+  struct _hip_timer *next;
+  struct _hip_timer *prev;
+  __u64 expires;                        /* in ticks */
+  void (*fn)(struct _hip_timer *t, struct timeval *now);
+} hip_timer;
+
+/*
+ * Timer wheel; the caller serializes all calls, including the ones made
+ * from timer callbacks, which run inside hip_timer_run().
+ */
+typedef struct _hip_timer_wheel
+{
+  __u64 tick;                           /* next tick to run */
+  hip_timer slots[HIP_TIMER_LEVELS][HIP_TIMER_SLOTS]; /* list heads */
+} hip_timer_wheel;
+
+/*
+ * functions
+ */
+void hip_timer_wheel_init(hip_timer_wheel *w, struct timeval *now);
+void hip_timer_init(hip_timer *t,
+                    void (*fn)(hip_timer *t, struct timeval *now));
+void hip_timer_add(hip_timer_wheel *w, hip_timer *t, struct timeval *expires);
+void hip_timer_reduce(hip_timer_wheel *w, hip_timer *t,
+                      struct timeval *expires);
+void hip_timer_del(hip_timer *t);
+int hip_timer_pending(hip_timer *t);
+void hip_timer_run(hip_timer_wheel *w, struct timeval *now);
+int hip_timer_next(hip_timer_wheel *w, struct timeval *now, int max_ms);
+
+#endif /* _HIP_TIMER_H_ */
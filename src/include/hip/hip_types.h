@@ -57,9 +57,11 @@
 #include <openssl/bn.h>
 #include <openssl/hmac.h>
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
 #include <time.h>
 
 #include <hip/hip_proto.h>
+#include <hip/hip_timer.h>
 
 #ifdef HIP_VPLS
 #define NIPQUAD(addr) \
@@ -86,7 +88,10 @@
  * Implementation limits
  */
 #define MAX_HITS 255
-#define MAX_CONNECTIONS MAX_HITS
+#define HIP_ASSOC_SLAB_BITS 8
+#define HIP_ASSOC_SLAB_SIZE (1 << HIP_ASSOC_SLAB_BITS) /* assocs per slab */
+#define HIP_ASSOC_MAX_SLABS 256
+#define MAX_CONNECTIONS (HIP_ASSOC_SLAB_SIZE * HIP_ASSOC_MAX_SLABS)
 #define MAX_OPAQUE_SIZE 255 /* how many bytes we may echo in response */
 #define MAX_HI_NAMESIZE 255 /* number of bytes for HI Domain Identifier */
 #define MAX_HI_BITS 2048 /* number of bits of largest HI accepted - this
@@ -98,7 +103,7 @@
 #ifdef HIP_VPLS
 #define MAX_LEGACY_HOSTS 255 /* how many legacy hosts can attached to endbox */
 #endif /* HIP_VPLS */
-#define MAX_MR_CLIENTS MAX_CONNECTIONS /* Number of mobile router clients */
+#define MAX_MR_CLIENTS MAX_HITS /* Number of mobile router clients */
 
 /*
  * IPsec-related constants
@@ -106,12 +111,14 @@
 #define DSA_PRIV 20 /* Size in bytes of DSA private key and Q value */
 #define HIP_KEY_SIZE 24 /* Must be large enough to hold largest possible key */
 #define HIP_DSA_SIG_SIZE 41 /* T(1) + R(20) + S(20)  from RFC 2536 */
+#define HIP_ECDSA_SIZE 32 /* Size in bytes of P-256 coordinates, r and s */
 #define MAX_SIG_SIZE 512 /* RFC 3110 4096-bits max RSA length */
 #define NUMKEYS 8 /* HIP, HMAC, HIP, HMAC, ESP, AUTH, ESP, AUTH */
 #define KEYMAT_SIZE (4 * NUMKEYS * HIP_KEY_SIZE) /* 768 bytes, enough space for
                                                   *  32 ESP keys */
 #define MAX_CERT_LEN 128 /* max lengh of a certificate URL */
-/* 3DES keys = 192 bits, 24 bytes; SHA-1 keys = 160 bits, 20 bytes.
+/* 3DES keys = 192 bits, 24 bytes; SHA-1 keys = 160 bits, 20 bytes;
+ * AES-128-GCM keys = 128 bits plus 32-bit salt, 20 bytes.
  * We need 4 3DES and 2 SHA for our 6 keys, 136 bytes, so 144 is enough.
  */
 
@@ -134,7 +141,7 @@
  */
 #define SPI_RESERVED 255
 #define HIP_ALIGN 4
-#define R1_CACHE_SIZE 8
+#define R1_CACHE_MAX 65536
 #define ACCEPTABLE_R1_COUNT_RANGE 2
 #ifndef HIP_UPDATE_BIND_CHECKS
 #define HIP_UPDATE_BIND_CHECKS 5
@@ -146,6 +153,7 @@ typedef enum {
   ESP_EXPIRE_SPI,
   ESP_UDP_CTL,
   ESP_ADDR_LOSS,
+  ESP_ICMP_PARAMPROB,
 } ESP_MESSAGES;
 
 typedef struct _espmsg {
@@ -290,6 +298,7 @@ struct rekey_info {
   __u8 need_ack;       /* set to FALSE when update_id has been ACKed */
   __u8 dh_group_id;             /* new DH group given by peer	*/
   DH *dh;                       /* new DH given by the peer	*/
+  EC_KEY *ec;                   /* or ECDH key, for ECDH groups */
   struct timeval rk_time;       /* creation time, so struct can be freed */
 };
 
@@ -330,6 +339,18 @@ struct reg_entry {
   __u8 max_lifetime;
 };
 
+/*
+ * Hash indexes over the association slabs, see hip_assoc_index()
+ */
+#define HIP_ASSOC_IDX_HITS      0       /* (peer HIT, my HIT) */
+#define HIP_ASSOC_IDX_PEER      1       /* peer HIT */
+#define HIP_ASSOC_IDX_SPI_IN    2       /* spi_in */
+#define HIP_ASSOC_IDX_SPI_OUT   3       /* spi_out */
+#define HIP_ASSOC_IDX_ADDRS     4       /* (peer address, my address) */
+#define HIP_ASSOC_NUM_IDX       5
+#define HIP_ASSOC_HASH_MIN      256     /* buckets per index, a power of two */
+#define HIP_ASSOC_HASH_LOAD     2       /* grow beyond this many assocs/bucket */
+
 /*
  * HIP association entry
  *
@@ -361,10 +382,12 @@ typedef struct _hip_assoc {
   /* Other crypto */
   __u16 hip_transform;
   __u16 esp_transform;
-  __u16 available_transforms;       /* bit mask used to flag available xfrms */
+  __u32 available_transforms;       /* bit mask used to flag available xfrms */
   __u8 dh_group_id;
   DH *dh;
   DH *peer_dh;          /* needed for rekeying */
+  EC_KEY *ec;           /* used instead of dh for ECDH groups */
+  EC_KEY *peer_ec;
   __u8 *dh_secret;       /* without packing, these cause memset segfaults! */
   __u16 keymat_index;
   __u16 mr_keymat_index;
@@ -376,12 +399,60 @@ typedef struct _hip_assoc {
 #ifdef __MACOSX__
   __u16 ipfw_rule;
 #endif
+  /* hash index chains */
+  struct _hip_assoc *idx_next[HIP_ASSOC_NUM_IDX];
+  __u32 idx_hash[HIP_ASSOC_NUM_IDX];
+  __u8 idx_linked;                  /* bit mask of linked indexes */
+  /* next retransmit, timeout or registration deadline, see
+   * hip_assoc_wakeup() */
+  hip_timer timer;
+  /* slab bookkeeping, preserved by free_hip_assoc() */
+  __u8 allocated;
+  int slot;                         /* position in the slabs */
+  struct _hip_assoc *free_next;
 } hip_assoc;
 #define HIPA_SRC(h) ((struct sockaddr*)&h->hi->addrs.addr)
 #define HIPA_DST(h) ((struct sockaddr*)&h->peer_hi->addrs.addr)
 #define HIPA_SRC_LSI(h) ((struct sockaddr*)&h->hi->lsi)
 #define HIPA_DST_LSI(h) ((struct sockaddr*)&h->peer_hi->lsi)
 
+/*
+ * Associations are allocated from slabs of HIP_ASSOC_SLAB_SIZE entries
+ * that are created on demand; empty slabs at the end are released by
+ * hip_assoc_trim(). Entries never move, so hip_assoc pointers stay valid
+ * until free_hip_assoc().
+ */
+typedef struct _hip_assoc_slab
+{
+  hip_assoc *free;                  /* free entries in this slab */
+  int used;                         /* allocated entries */
+  hip_assoc a[HIP_ASSOC_SLAB_SIZE];
+} hip_assoc_slab;
+
+/*
+ * A job for the crypto worker pool, see hip_crypto.c. work() runs on a
+ * worker thread and may only touch the job and its pending association;
+ * finish() runs afterwards on the hipd thread.
+ */
+typedef struct _hip_crypto_job
+{
+  struct _hip_crypto_job *next;
+  void (*work)(struct _hip_crypto_job *job);
+  void (*finish)(struct _hip_crypto_job *job);
+  hip_assoc *hip_a;                 /* from init_pending_hip_assoc() */
+  __u8 *data;                       /* private copy of the packet */
+  int location;                     /* offset of the next TLV to parse */
+  struct sockaddr_storage src;
+  struct sockaddr_storage dst;
+  __u16 keymat_index;               /* proposed by the peer */
+  int cert;                         /* offset of the CERT TLV, or 0 */
+  int status;                       /* result of work(), 0 for success */
+  __u16 notify;                     /* NOTIFY code to send, or 0 */
+  __u16 notify_type;                /* unsupported critical parameter */
+  struct _dh_cache_entry *dh_entry; /* DH key generated for the pool */
+  int priority;                     /* run first, may use reserved slots */
+} hip_crypto_job;
+
 /*
  * list of struct sockaddrs
  */
@@ -400,16 +471,28 @@ typedef struct _sockaddr_list
 /*
  * R1 Cache
  */
-typedef struct _r1_cache_entry
+typedef struct _r1_template
 {
-  /* the precomputed R1 packet */
+  struct _r1_template *next;
+  /* the precomputed R1 packet, signed with a zero puzzle I */
   __u8 *packet;
   int len;
+  int cookie_offset;                /* where the puzzle is patched in */
+  /* what the signature covers besides the HI */
+  struct _dh_cache_entry *dh_entry;
+  __u64 r1_gen_count;
+  __u8 k;
+  int ref_count;                    /* cache slots using this R1 */
+} r1_template;
+
+typedef struct _r1_cache_entry
+{
   /* stored cookie solutions */
-  hipcookie *current_puzzle;        /* the cookie that is in packet */
+  hipcookie *current_puzzle;        /* the cookie that is sent */
   hipcookie *previous_puzzle;       /* old cookie */
-  /* the DH context used in the R1 */
-  struct _dh_cache_entry *dh_entry;
+  /* the signed R1s that the puzzles were sent in */
+  struct _r1_template *current_r1;
+  struct _r1_template *previous_r1;
   /* time of entry creation */
   struct timeval creation_time;
 } r1_cache_entry;
@@ -477,7 +560,9 @@ typedef struct _hi_node {
   int size;                     /* Size in bytes of the Host Identity	*/
   DSA *dsa;                     /* HI in DSA format			*/
   RSA *rsa;                     /* HI in RSA format			*/
-  struct _r1_cache_entry r1_cache[R1_CACHE_SIZE];       /* the R1 cache	*/
+  EC_KEY *ecdsa;                /* HI in ECDSA format			*/
+  struct _r1_cache_entry *r1_cache;     /* the R1 cache, r1_cache_size slots */
+  struct _r1_template *r1_templates;    /* signed R1s used by the cache */
   __u64 r1_gen_count;           /* R1 generation counter		*/
   __u32 update_id;              /* this host's Update ID		*/
   /* Options */
@@ -511,6 +596,7 @@ typedef struct _dh_cache_entry
   struct _dh_cache_entry *next;         /* the cache is a linked-list   */
   __u8 group_id;                        /* can have various group_ids   */
   DH *dh;                               /* the Diffie-Hellman context	*/
+  EC_KEY *ec;                           /* or ECDH key, for ECDH groups */
   __u8 is_current;                      /* if this is the latest DH context
                                          *  for this group_id, then TRUE */
   int ref_count;        /* number of hip_assoc that point to this entry */
@@ -811,7 +897,7 @@ typedef struct _thread_arg {
 /*
  * Struct to use in tracking invalid SPIs
  */
-#define MAX_UNKNOWN_SPI_ENTRIES 2*MAX_CONNECTIONS
+#define MAX_UNKNOWN_SPI_ENTRIES 2*MAX_HITS
 typedef struct _unknown_spi_entry
 {
   struct _unknown_spi_entry *next;
@@ -864,6 +950,8 @@ struct name {
  */
 struct hip_conf {
   __u32 cookie_difficulty;              /* 2 raised to this power	*/
+  __u32 cookie_difficulty_max;          /* adaptive K up to this, 0=off */
+  __u32 cookie_adapt_rate;              /* I2s per second that raise K */
   __u32 cookie_lifetime;                /* valid 2^(life-32) seconds	*/
   __u32 packet_timeout;                 /* seconds			*/
   __u32 max_retries;                    /* retransmissions		*/
@@ -873,12 +961,22 @@ struct hip_conf {
   __u8 send_hi_name;                    /* flag to include DI (FQDN) in HI */
   __u8 dh_group;                        /* which DH group to propose in R1 */
   __u32 dh_lifetime;                    /* seconds until DH expires	*/
+  __u32 dh_pool_low;                    /* refill the DH key pool below */
+  __u32 dh_pool_high;                   /* this many fresh DH keys */
   __u32 r1_lifetime;                    /* seconds until an R1 is replaced */
+  __u32 r1_cache_size;                  /* precomputed R1s per HI */
   __u32 failure_timeout;                /* seconds to wait in state E_FAILED */
   __u32 msl;                            /* max segment lifetime */
   __u32 ual;                            /* seconds until unused SA expires */
   __u32 icmp_timeout;                   /* seconds until again respond to ICMP
                                          * after a successfule ICMP UPDATE */
+  __u32 esp_queues;                     /* number of TAP queues/ESP workers */
+  __u8 esp_tap_socketpair;              /* T/F tunreader feeds ESP output */
+  __u32 esp_batch;                      /* ESP packets per recv/send call */
+  __u32 esp_replay_window;              /* anti-replay window in packets */
+  __u8 esp_iv_counter;                  /* T/F CBC IVs from a counter */
+  __u32 crypto_workers;                 /* threads for I2 crypto, 0=none */
+  __u32 puzzle_threads;                 /* threads solving puzzles, 0=CPUs */
   __u16 esp_transforms[SUITE_ID_MAX];       /* ESP transforms proposed in R1 */
   __u16 hip_transforms[SUITE_ID_MAX];       /* HIP transforms proposed in R1 */
   char *log_filename;                   /* non-default pathname for log	     */
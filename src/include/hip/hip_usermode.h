@@ -47,6 +47,7 @@
 #ifdef __WIN32__
 void hip_esp_output(void *arg);
 void hip_esp_input(void *arg);
+void hip_sadb_timers(void *arg);
 void tunreader(void *arg);
 void hip_dns(void *arg);
 void hipd_main(void *arg);
@@ -58,6 +59,7 @@ extern int socketpair(int, int, int, int sv[2]);
 #else
 void *hip_esp_output(void *arg);
 void *hip_esp_input(void *arg);
+void *hip_sadb_timers(void *arg);
 void *tunreader(void *arg);
 void *hip_dns(void *arg);
 void *hipd_main(void *arg);
@@ -84,6 +86,40 @@ int str_to_addr(unsigned char *data, struct sockaddr *addr);
 #define HIP_TAP_INTERFACE_MTU 1400
 #endif
 
+#ifndef __WIN32__
+/*
+ * Multi-queue TAP support. Each queue has its own TAP descriptor, tunreader,
+ * ESP output and ESP input worker. Outgoing frames are steered to a queue by
+ * hashing the destination LSI/HIT, so each SA has one ESP output worker; in
+ * direct mode the kernel flow hash picks the TAP queue, and frames read on
+ * the wrong queue are passed to the right worker over its socketpair.
+ * Incoming ESP packets are steered by a socket filter on the SPI.
+ */
+#define MAX_ESP_QUEUES 16
+typedef struct _esp_queue {
+  int index;
+  int tapfd;                    /* TAP queue descriptor */
+  int readsp[2];                /* tunreader -> ESP output socketpair */
+  int s_esp;                    /* per-queue ESP input sockets */
+  int s_esp_udp;
+  int s_esp6;
+} esp_queue;
+extern esp_queue esp_queues[MAX_ESP_QUEUES];
+extern int num_esp_queues;
+extern int esp_direct_tap;
+int esp_queue_select(__u8 *frame, int len);
+int esp_queue_attach_filter(int s, int family, int spi_offset, int queue);
+#endif /* !__WIN32__ */
+
+#define MAX_ESP_BATCH 32        /* recvmmsg()/sendmmsg() batch size */
+extern int esp_batch;
+int esp_recv_batch(int s, __u8 **bufs, int *lens, int num);
+
+#define REPLAY_WIN_WORD 64      /* anti-replay bitmap word, in packets */
+#define MAX_REPLAY_WIN 4096     /* largest anti-replay window */
+extern int esp_replay_win;
+extern int esp_iv_gen;
+
 #define DNS_PORT 53
 #define HIP_DNS_SUFFIX ".hip"
 extern __u64 g_tap_mac;
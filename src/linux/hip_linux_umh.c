@@ -72,11 +72,16 @@ extern void add_local_hip_nameserver(__u32 ip);
 extern int get_preferred_lsi(struct sockaddr *lsi);
 extern int is_dns_thread_disabled();
 extern int is_mobile_router();
+extern void init_esp_queues();
 
 #ifdef __MACOSX__
 #define DISABLE_HIPMR
 #endif /* __MACOSX__ */
 
+#ifndef IFF_MULTI_QUEUE
+#define IFF_MULTI_QUEUE 0x0100
+#endif
+
 /*
  * Globals
  */
@@ -86,50 +91,81 @@ extern int s_esp, s_esp_udp, s_esp_udp_dg, s_esp6;
 int g_state;
 char tap_dev_name[16];
 
+/*
+ * init_tap()
+ *
+ * Open the TAP device. When num_esp_queues > 1, the device is created with
+ * IFF_MULTI_QUEUE and one descriptor is opened for each queue and stored in
+ * esp_queues[]. Returns the descriptor of the first queue.
+ */
 int init_tap()
 {
 #ifndef __MACOSX__
   struct ifreq ifr;
   int err;
 #endif
-  int tap;
+  int tap, i;
   printf("init_tap()\n");
 
-
-  /* Open TAP device */
-  /* XXX note: for FreeBSD, should execute ifconfig before this open */
-#ifdef __MACOSX__
-  if ((tap = open("/dev/tap0", O_RDWR)) < 0)
+#ifndef __MACOSX__
+init_tap_retry:
+#endif
+  for (i = 0; i < num_esp_queues; i++)
     {
+      /* Open TAP device */
+      /* XXX note: for FreeBSD, should execute ifconfig before this open */
+#ifdef __MACOSX__
+      if ((tap = open("/dev/tap0", O_RDWR)) < 0)
+        {
 #else
-  if ((tap = open("/dev/net/tun", O_RDWR)) < 0)
-    {
+      if ((tap = open("/dev/net/tun", O_RDWR)) < 0)
+        {
 #endif
-      printf("Opening TAP device failed. Do you have the correct ");
-      printf("module loaded (modprobe tun)?\n");
-      return(-1);
-    }
+          printf("Opening TAP device failed. Do you have the correct ");
+          printf("module loaded (modprobe tun)?\n");
+          return(-1);
+        }
 
 #ifndef __MACOSX__
-  /* setup address */
-  memset(&ifr, 0, sizeof(ifr));
-  ifr.ifr_flags = IFF_TAP;              /* TAP device */
-  ifr.ifr_flags |= IFF_NO_PI;           /* Do not provide packet information */
-  sprintf(ifr.ifr_name, "hip0");
-
-  /* set TAP-32 status to connected */
-  if ((err = ioctl(tap, TUNSETIFF, (void*)&ifr)) < 0)
-    {
-      close(tap);
-      printf("Error setting TAP parameters.\n");
-      return(-1);
+      /* setup address */
+      memset(&ifr, 0, sizeof(ifr));
+      ifr.ifr_flags = IFF_TAP;          /* TAP device */
+      ifr.ifr_flags |= IFF_NO_PI;       /* Do not provide packet information */
+      if (num_esp_queues > 1)
+        {
+          ifr.ifr_flags |= IFF_MULTI_QUEUE;       /* one fd per queue */
+        }
+      sprintf(ifr.ifr_name, "hip0");
+
+      /* set TAP-32 status to connected */
+      if ((err = ioctl(tap, TUNSETIFF, (void*)&ifr)) < 0)
+        {
+          close(tap);
+          if (num_esp_queues > 1)
+            {
+              /* older kernels lack IFF_MULTI_QUEUE, use one queue */
+              printf("Multi-queue TAP not supported, using one queue.\n");
+              while (--i >= 0)
+                {
+                  close(esp_queues[i].tapfd);
+                }
+              num_esp_queues = 1;
+              goto init_tap_retry;
+            }
+          printf("Error setting TAP parameters.\n");
+          return(-1);
+        }
+      strncpy(tap_dev_name, ifr.ifr_name, sizeof(tap_dev_name));
+#endif
+      esp_queues[i].tapfd = tap;
     }
+  tap = esp_queues[0].tapfd;
 
-  strncpy(tap_dev_name, ifr.ifr_name, sizeof(tap_dev_name));
-#else
+#ifdef __MACOSX__
   strcpy(tap_dev_name,"tap0");
 #endif
-  printf("Using TAP device %s.\n", tap_dev_name);
+  printf("Using TAP device %s with %d queue%s.\n", tap_dev_name,
+         num_esp_queues, (num_esp_queues > 1) ? "s" : "");
 
   /* The netlink socket is not available yet, so setup
    * of the tap address occurs later in post_init_tap().
@@ -224,7 +260,8 @@ post_init_tap_retry:
 void init_hip(int ac, char **av)
 {
   pthread_t tunreader_thrd, esp_output_thrd, esp_input_thrd;
-  pthread_t hipd_thrd, dns_thrd, status_thrd;
+  esp_queue *q;
+  pthread_t hipd_thrd, dns_thrd, status_thrd, sadb_timer_thrd;
 #ifndef DISABLE_HIPMR
   pthread_t mr_thrd;
 #endif
@@ -301,6 +338,60 @@ void init_hip(int ac, char **av)
       exit(1);
     }
 
+  /*
+   * The number of TAP queues comes from hip.conf, which is loaded by the
+   * hipd thread; wait for it before creating the TAP device.
+   */
+  while (!g_conf_loaded)
+    {
+      usleep(10000);
+    }
+  num_esp_queues = (int)HCNF.esp_queues;
+#ifdef __MACOSX__
+  num_esp_queues = 1;
+#endif
+  if (num_esp_queues < 1)
+    {
+      num_esp_queues = 1;
+    }
+  else if (num_esp_queues > MAX_ESP_QUEUES)
+    {
+      printf("Limiting esp_queues to %d.\n", MAX_ESP_QUEUES);
+      num_esp_queues = MAX_ESP_QUEUES;
+    }
+  esp_batch = (int)HCNF.esp_batch;
+#ifdef __MACOSX__
+  esp_batch = 1;        /* no recvmmsg()/sendmmsg() */
+#endif
+  if (esp_batch < 1)
+    {
+      esp_batch = 1;
+    }
+  else if (esp_batch > MAX_ESP_BATCH)
+    {
+      printf("Limiting esp_batch to %d.\n", MAX_ESP_BATCH);
+      esp_batch = MAX_ESP_BATCH;
+    }
+  /* whole bitmap words, between REPLAY_WIN_WORD and MAX_REPLAY_WIN */
+  esp_replay_win = (int)HCNF.esp_replay_window;
+  if (esp_replay_win < REPLAY_WIN_WORD)
+    {
+      esp_replay_win = REPLAY_WIN_WORD;
+    }
+  else if (esp_replay_win > MAX_REPLAY_WIN)
+    {
+      printf("Limiting esp_replay_window to %d.\n", MAX_REPLAY_WIN);
+      esp_replay_win = MAX_REPLAY_WIN;
+    }
+  esp_replay_win -= esp_replay_win % REPLAY_WIN_WORD;
+  esp_iv_gen = HCNF.esp_iv_counter ? ESP_IV_COUNTER : ESP_IV_RANDOM;
+#ifdef HIP_VPLS
+  /* tunreader provides the endbox heartbeat and hello */
+  esp_direct_tap = FALSE;
+#else
+  esp_direct_tap = !HCNF.esp_tap_socketpair;
+#endif
+
   /*
    * tap device
    */
@@ -313,21 +404,12 @@ void init_hip(int ac, char **av)
       printf("Error initializing TAP device.\n");
       exit(1);
     }
-
-  if (pthread_create(&tunreader_thrd, NULL, tunreader, NULL))
-    {
-      printf("Error creating tunreader thread.\n");
-      exit(1);
-    }
+  /* socketpairs must exist before any tunreader can steer to them */
+  init_esp_queues();
 
   /*
-   * ESP handlers
+   * ESP input sockets
    */
-  if (pthread_create(&esp_output_thrd, NULL, hip_esp_output, NULL))
-    {
-      printf("Error creating ESP output thread.\n");
-      exit(1);
-    }
 #ifdef __MACOSX__
   if ((s_esp = init_esp_input(AF_INET, SOCK_RAW, IPPROTO_DIVERT, 5150,
                               "IPv4 divert")) < 0)
@@ -335,22 +417,8 @@ void init_hip(int ac, char **av)
       printf("Error creating IPv4 divert socket for ESP input.\n");
       exit(1);
     }
-#else
-  if ((s_esp = init_esp_input(AF_INET, SOCK_RAW, IPPROTO_ESP, 0,
-                              "IPv4 ESP")) < 0)
-    {
-      printf("Error creating IPv4 ESP input socket.\n");
-      exit(1);
-    }
-  /* set this socket to receive ICMP parameter problem messages */
-  setsockopt(s_esp, SOL_IP, IP_RECVERR, &optval, sizeof(optval));
+  esp_queues[0].s_esp = s_esp;
 #endif
-  if ((s_esp_udp = init_esp_input(AF_INET, SOCK_RAW, IPPROTO_UDP,
-                                  HIP_UDP_PORT, "IPv4 UDP")) < 0)
-    {
-      printf("Error creating IPv4 UDP input socket.\n");
-      exit(1);
-    }
   /* this socket is to prevent ICMP port unreachable messages */
   if ((s_esp_udp_dg = init_esp_input(AF_INET, SOCK_DGRAM, IPPROTO_UDP,
                                      HIP_UDP_PORT, "IPv4 UDP dg")) < 0)
@@ -358,18 +426,79 @@ void init_hip(int ac, char **av)
       printf("Error creating IPv4 UDP datagram socket.\n");
       exit(1);
     }
-#ifndef __MACOSX__
-  if ((s_esp6 = init_esp_input(AF_INET6, SOCK_RAW, IPPROTO_ESP, 0,
-                               "IPv6 ESP")) < 0)
+  for (i = 0; i < num_esp_queues; i++)
     {
-      printf("Error creating IPv6 ESP input socket.\n");
-      exit(1);
+      q = &esp_queues[i];
+#ifndef __MACOSX__
+      if ((q->s_esp = init_esp_input(AF_INET, SOCK_RAW, IPPROTO_ESP, 0,
+                                     "IPv4 ESP")) < 0)
+        {
+          printf("Error creating IPv4 ESP input socket.\n");
+          exit(1);
+        }
+      /* set this socket to receive ICMP parameter problem messages */
+      setsockopt(q->s_esp, SOL_IP, IP_RECVERR, &optval, sizeof(optval));
+#endif
+      if ((q->s_esp_udp = init_esp_input(AF_INET, SOCK_RAW, IPPROTO_UDP,
+                                         HIP_UDP_PORT, "IPv4 UDP")) < 0)
+        {
+          printf("Error creating IPv4 UDP input socket.\n");
+          exit(1);
+        }
+#ifndef __MACOSX__
+      if ((q->s_esp6 = init_esp_input(AF_INET6, SOCK_RAW, IPPROTO_ESP, 0,
+                                      "IPv6 ESP")) < 0)
+        {
+          printf("Error creating IPv6 ESP input socket.\n");
+          exit(1);
+        }
+      /* raw sockets each receive a copy of every packet, so filter on
+       * the SPI to let only this queue's share through */
+      if ((num_esp_queues > 1) &&
+          ((esp_queue_attach_filter(q->s_esp, AF_INET, 0, i) < 0) ||
+           (esp_queue_attach_filter(q->s_esp_udp, AF_INET, sizeof(udphdr),
+                                    i) < 0) ||
+           (esp_queue_attach_filter(q->s_esp6, AF_INET6, 0, i) < 0)))
+        {
+          printf("Error attaching ESP queue %d socket filter.\n", i);
+          exit(1);
+        }
+#endif
     }
+  /* the first queue's sockets are also used for ESP output */
+#ifndef __MACOSX__
+  s_esp = esp_queues[0].s_esp;
+  s_esp6 = esp_queues[0].s_esp6;
 #endif
+  s_esp_udp = esp_queues[0].s_esp_udp;
 
-  if (pthread_create(&esp_input_thrd, NULL, hip_esp_input, NULL))
+  /*
+   * tunreader and ESP handlers, one of each per queue
+   */
+  for (i = 0; i < num_esp_queues; i++)
+    {
+      q = &esp_queues[i];
+      /* in direct mode, the ESP output thread reads the TAP itself */
+      if (!esp_direct_tap &&
+          pthread_create(&tunreader_thrd, NULL, tunreader, q))
+        {
+          printf("Error creating tunreader thread.\n");
+          exit(1);
+        }
+      if (pthread_create(&esp_output_thrd, NULL, hip_esp_output, q))
+        {
+          printf("Error creating ESP output thread.\n");
+          exit(1);
+        }
+      if (pthread_create(&esp_input_thrd, NULL, hip_esp_input, q))
+        {
+          printf("Error creating ESP input thread.\n");
+          exit(1);
+        }
+    }
+  if (pthread_create(&sadb_timer_thrd, NULL, hip_sadb_timers, NULL))
     {
-      printf("Error creating ESP input thread.\n");
+      printf("Error creating SADB timer thread.\n");
       exit(1);
     }
   hip_sleep(1);       /* Wait a sec for config */
@@ -1412,7 +1412,7 @@ void handle_local_address_change(int add, struct sockaddr *newaddr,int if_index)
   /* add/delete on all */
   for (i = 0; i < max_hip_assoc; i++)
     {
-      hip_a = &hip_assoc_table[i];
+      hip_a = HIP_ASSOC(i);
       /* perform basic check of association */
       if ((hip_a->state == 0) || !hip_a->hi || !hip_a->peer_hi)
         {
@@ -1469,6 +1469,7 @@ void readdress_association(hip_assoc *hip_a, struct sockaddr *newaddr,
   hip_a->hi->addrs.lifetime = 0;       /* XXX need to copy from somewhere? */
   hip_a->hi->addrs.preferred = TRUE;
   make_address_active(&hip_a->hi->addrs);
+  hip_assoc_index(hip_a);
 
   /* must send ESP_INFO with new UPDATE message */
   if (!hip_a->rekey)
@@ -1529,6 +1530,7 @@ void readdress_association_x2(hip_assoc *hip_a, struct sockaddr *newsrcaddr,
                                             **/
   hip_a->peer_hi->addrs.preferred = TRUE;
   make_address_active(&hip_a->peer_hi->addrs);
+  hip_assoc_index(hip_a);
 
   /* must send ESP_INFO with new UPDATE message */
   if (!hip_a->rekey)
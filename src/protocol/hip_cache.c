@@ -63,33 +63,234 @@
 
 static __u32 current_rand;  /* current random num. used to get cookie index  */
 static __u32 previous_rand; /* previous random num. used to get cookie index */
-static int current_index = 0; /* index of R1 cache slot replaced next */
+static int current_step = 0; /* part of the R1 cache replaced next */
+static __u8 puzzle_k;       /* current puzzle difficulty */
+static int puzzle_k_pending = FALSE; /* some R1s still have an older K */
+static __u32 puzzle_i1_count = 0; /* I1s received since last adaptation */
+static __u32 puzzle_i2_count = 0; /* I2s received since last adaptation */
+static struct timeval puzzle_adapt_time; /* time of last adaptation */
+
+/* replace_next_R1() gives new puzzles to one of this many parts of
+ * the R1 cache at a time */
+#define R1_CACHE_STEPS 8
+/* adapt_puzzle_difficulty() raises K when the crypto workers have had
+ * this percentage of the jobs they may queue */
+#define PUZZLE_BACKLOG_HIGH 50
+/* seconds between changes of K */
+#define PUZZLE_ADAPT_INTERVAL 10
 
 /************************************
  *       R1 Cache functions         *
  ***********************************/
 /* The R1 cache is a hash table of precomputed R1s. Each Host Identity bears
  * it's own R1 cache so that packets can be pre-signed for that HI.
- * Periodically one of the entries is expired and re-created in a round-robin
- * fashion. Each R1 cache entry contains its own cookie puzzle, and the
- * previously-used cookie puzzle. Entries also point to the DH entry of the
- * context used in the R1 packet.
+ * The signature does not cover the OPAQUE and I fields of the puzzle, so
+ * entries using the same DH context, R1 generation and puzzle difficulty
+ * share one signed R1 template, and the entry's puzzle is patched into a
+ * copy of it when the R1 is sent. Periodically part of the entries are
+ * given a new puzzle in a round-robin fashion. Each R1 cache entry contains
+ * its own cookie puzzle, and the previously-used cookie puzzle, along with
+ * the templates they were sent in. An entry is only given a new puzzle
+ * once its current one has been sent for a cookie lifetime, so that the
+ * previous puzzle it drops has expired for the initiators.
  */
 
+static int init_R1_cache(hi_node *hi);
+
+/*
+ * new_puzzle()
+ *
+ * in:		cookie = puzzle to fill in
+ *              k = difficulty
+ *
+ * Picks a new random I for a cookie puzzle.
+ */
+static void new_puzzle(hipcookie *cookie, __u8 k)
+{
+  memset(cookie, 0, sizeof(hipcookie));
+
+  /* generate random 64-bit I */
+  RAND_bytes((unsigned char*)&cookie->i, 8);
+  /* lifetime is set from configuration */
+  cookie->k = k;
+  cookie->lifetime = (__u8)HCNF.cookie_lifetime;
+  cookie->opaque = 0;
+}
+
+/*
+ * get_R1_template()
+ *
+ * in:		hi = the HI whose R1 is needed
+ *              k = puzzle difficulty, which is covered by the signature
+ *
+ * out:		a signed R1 for the current DH entry and R1 generation,
+ *              NULL on error
+ *
+ * Returns a referenced R1 template, building and signing it only when no
+ * cache entry uses a matching one yet.
+ */
+static r1_template *get_R1_template(hi_node *hi, __u8 k)
+{
+  r1_template *r1;
+  dh_cache_entry *dh_entry;
+  hipcookie cookie;
+  int len;
+
+  dh_entry = get_dh_entry(HCNF.dh_group, FALSE);
+  for (r1 = hi->r1_templates; r1; r1 = r1->next)
+    {
+      if ((r1->dh_entry == dh_entry) &&
+          (r1->r1_gen_count == hi->r1_gen_count) &&
+          (r1->k == k))
+        {
+          r1->ref_count++;
+          return(r1);
+        }
+    }
+
+  len = calculate_r1_length(hi);
+  r1 = (r1_template*) malloc(sizeof(r1_template));
+  if (!r1 || !(r1->packet = (__u8 *) malloc(len)))
+    {
+      log_(WARN, "Malloc error! Trying to create R1 packet (%d bytes).\n",
+           len);
+      free(r1);
+      return(NULL);
+    }
+  memset(r1->packet, 0, len);
+
+  /* I is zero for the signature, K and lifetime are signed */
+  memset(&cookie, 0, sizeof(hipcookie));
+  cookie.k = k;
+  cookie.lifetime = (__u8)HCNF.cookie_lifetime;
+  r1->len = hip_generate_R1(r1->packet, hi, &cookie, dh_entry,
+                            &r1->cookie_offset);
+  r1->dh_entry = dh_entry;
+  dh_entry->ref_count++;
+  r1->r1_gen_count = hi->r1_gen_count;
+  r1->k = k;
+  r1->ref_count = 1;
+  r1->next = hi->r1_templates;
+  hi->r1_templates = r1;
+  return(r1);
+}
+
+/*
+ * put_R1_template()
+ *
+ * in:		hi = the HI owning the template
+ *              r1 = template no longer used by a cache entry, may be NULL
+ *
+ * Drops a reference to an R1 template, freeing it with the last one.
+ */
+static void put_R1_template(hi_node *hi, r1_template *r1)
+{
+  r1_template **p;
+
+  if (!r1 || (--r1->ref_count > 0))
+    {
+      return;
+    }
+  for (p = &hi->r1_templates; *p; p = &(*p)->next)
+    {
+      if (*p == r1)
+        {
+          *p = r1->next;
+          break;
+        }
+    }
+  r1->dh_entry->ref_count--;
+  free(r1->packet);
+  free(r1);
+}
+
+/*
+ * rotate_R1_puzzle()
+ *
+ * in:		hi = the HI owning the cache entry
+ *              entry = R1 cache entry to give a new puzzle
+ *
+ * The current puzzle becomes the previous one, and the memory of the
+ * expiring previous puzzle is reused for the new current puzzle.
+ */
+static void rotate_R1_puzzle(hi_node *hi, r1_cache_entry *entry)
+{
+  r1_template *r1;
+  hipcookie *cookie;
+
+  if (!(r1 = get_R1_template(hi, puzzle_k)))
+    {
+      return;
+    }
+  cookie = entry->previous_puzzle;
+  if (!cookie && !(cookie = (hipcookie*) malloc(sizeof(hipcookie))))
+    {
+      put_R1_template(hi, r1);
+      return;
+    }
+  put_R1_template(hi, entry->previous_r1);
+  entry->previous_puzzle = entry->current_puzzle;
+  entry->previous_r1 = entry->current_r1;
+
+  new_puzzle(cookie, r1->k);
+  entry->current_puzzle = cookie;
+  entry->current_r1 = r1;
+  if (D_VERBOSE == OPT.debug_R1)
+    {
+      log_(NORM, "Cookie sent in R1: ");
+      print_cookie(cookie);
+    }
+  gettimeofday(&entry->creation_time, NULL);
+}
+
+/*
+ * R1_puzzle_expired()
+ *
+ * in:		entry = R1 cache entry
+ *              now = current time
+ * out:		TRUE if the entry's current puzzle has been sent for at least
+ *              the cookie lifetime, so it may be rotated
+ */
+static int R1_puzzle_expired(r1_cache_entry *entry, struct timeval *now)
+{
+  int lifetime = (int)HCNF.cookie_lifetime - 32;
+
+  /* the lifetime is 2^(cookie_lifetime - 32) seconds */
+  lifetime = (lifetime < 0) ? 1 : (1 << ((lifetime > 30) ? 30 : lifetime));
+  return(TDIFF((*now), entry->creation_time) >= lifetime);
+}
 
 /*
  * ini_all_R1_caches
  *
- * in/out:	none
+ * in:		none
+ * out:		0 on success, -1 on error
  *
  * Initialize all of my Host Identities
  * (Call init_R1_cache for every HI in my_hi_head.)
  */
-void init_all_R1_caches()
+int init_all_R1_caches()
 {
   hi_node *h;
   /* assume random number generator already seeded by init_crypto() */
 
+  if ((HCNF.r1_cache_size < 1) || (HCNF.r1_cache_size > R1_CACHE_MAX))
+    {
+      log_(WARN, "Invalid r1_cache_size %d, using 8.\n",
+           HCNF.r1_cache_size);
+      HCNF.r1_cache_size = 8;
+    }
+  if (HCNF.cookie_difficulty_max &&
+      ((HCNF.cookie_difficulty_max < HCNF.cookie_difficulty) ||
+       (HCNF.cookie_difficulty_max > 64)))
+    {
+      log_(WARN, "Invalid cookie_difficulty_max %d, adaptive puzzle "
+           "difficulty disabled.\n", HCNF.cookie_difficulty_max);
+      HCNF.cookie_difficulty_max = 0;
+    }
+  puzzle_k = (__u8)HCNF.cookie_difficulty;
+  gettimeofday(&puzzle_adapt_time, NULL);
+
   /* pick a new random number for cookie mapping function */
   RAND_bytes((unsigned char *)&current_rand, 4);
   previous_rand = 0;
@@ -97,29 +298,28 @@ void init_all_R1_caches()
   /* initialize the cache for every one of our HIs */
   for (h = my_hi_head; h; h = h->next)
     {
-      init_R1_cache(h);
+      if (init_R1_cache(h) < 0)
+        {
+          return(-1);
+        }
     }
+  return(0);
 }
 
 /*
  * init_R1_cache()
  *
  * in:		hi = the HI containing the R1 cache to initialize
+ * out:		0 on success, -1 on error
  *
  * Populate the R1 cache with pre-computed R1s.
  */
-void init_R1_cache(hi_node *hi)
+static int init_R1_cache(hi_node *hi)
 {
-  int i, len;
-  r1_cache_entry *entry;
-
-  if (!hi)
-    {
-      return;
-    }
+  int i;
 
   log_(NORM, "Initializing R1 cache entries for identity %s (%d slots)."
-       "\n", hi->name, R1_CACHE_SIZE);
+       "\n", hi->name, HCNF.r1_cache_size);
 
   /* increase generation counter for this new set of R1s */
   if (hi->r1_gen_count > 0)
@@ -127,27 +327,25 @@ void init_R1_cache(hi_node *hi)
       hi->r1_gen_count++;
     }
 
-  len = calculate_r1_length(hi);
+  hi->r1_cache = (r1_cache_entry*) calloc(HCNF.r1_cache_size,
+                                          sizeof(r1_cache_entry));
+  if (!hi->r1_cache)
+    {
+      log_(WARN, "Malloc error! Creating %d R1 cache slots.\n",
+           HCNF.r1_cache_size);
+      return(-1);
+    }
 
-  for (i = 0; i < R1_CACHE_SIZE; i++)
+  /* all slots share the template signed by the first one */
+  for (i = 0; i < (int)HCNF.r1_cache_size; i++)
     {
-      entry = &hi->r1_cache[i];
-      entry->current_puzzle = generate_cookie();
-      entry->dh_entry = get_dh_entry(HCNF.dh_group, FALSE);
-      entry->dh_entry->ref_count++;
-      entry->packet = (__u8 *) malloc(len);
-      if (entry->packet == NULL)
+      rotate_R1_puzzle(hi, &hi->r1_cache[i]);
+      if (!hi->r1_cache[i].current_r1)
         {
-          log_(NORM, "Malloc error! creating R1 packet.\n");
+          return(-1);
         }
-      memset(entry->packet, 0, len);
-      entry->len = hip_generate_R1(entry->packet, hi,
-                                   entry->current_puzzle,
-                                   entry->dh_entry);
-      entry->previous_puzzle = NULL;
-      gettimeofday(&entry->creation_time, NULL);
     }
-
+  return(0);
 }
 
 /*
@@ -162,15 +360,11 @@ hipcookie *generate_cookie()
 {
   hipcookie *cookie;
   cookie = (hipcookie*) malloc(sizeof(hipcookie));
-  memset(cookie, 0, sizeof(hipcookie));
-
-  /* generate random 64-bit I */
-  RAND_bytes((unsigned char*)&cookie->i, 8);
-  /* K and lifetime are set from configuration */
-  cookie->k = (__u8)HCNF.cookie_difficulty;
-  cookie->lifetime = (__u8)HCNF.cookie_lifetime;
-  cookie->opaque = 0;
-
+  if (cookie)
+    {
+      /* K is set from configuration, or adapted to the load */
+      new_puzzle(cookie, puzzle_k);
+    }
   return(cookie);
 }
 
@@ -179,60 +373,47 @@ hipcookie *generate_cookie()
  *
  * in/out:	none
  *
- * Called every few minutes to expire and replace one R1.
+ * Called every few minutes to expire and replace the puzzles in the next
+ * 1/R1_CACHE_STEPS of the R1 cache, so that a full cycle takes the same
+ * time regardless of the cache size. A new R1 is signed only when the
+ * DH entry, R1 generation or puzzle difficulty has changed. Entries that
+ * were given a new puzzle within the cookie lifetime keep it.
  * Also picks a new random number for the cookie index mapping function.
  */
 void replace_next_R1()
 {
   hi_node *h;
-  r1_cache_entry *entry;
-  int packet_len;
-
-  /*log_(NORMT, "Expiring the R1 in cache slot %d.\n", current_index);*/
+  int i, first, last;
+  struct timeval now;
 
   /* every so often pick a new random number
-   * (twice per cycle through current_index) */
-  if ((current_index % (R1_CACHE_SIZE / 2)) == 2)
+   * (twice per cycle through current_step) */
+  if ((current_step % (R1_CACHE_STEPS / 2)) == 2)
     {
       previous_rand = current_rand;
       RAND_bytes((unsigned char*)&current_rand, 4);
     }
 
+  first = current_step * HCNF.r1_cache_size / R1_CACHE_STEPS;
+  last = (current_step + 1) * HCNF.r1_cache_size / R1_CACHE_STEPS;
+  /*log_(NORMT, "Expiring the R1s in cache slots %d-%d.\n", first, last);*/
+  gettimeofday(&now, NULL);
+
   /* for all local Host Identities */
   for (h = my_hi_head; h; h = h->next)
     {
-
-      entry = &h->r1_cache[current_index];
-      /* new R1 entry may use a different cookie, DH entry */
-      entry->dh_entry->ref_count--;
-      if (entry->previous_puzzle)
-        {
-          free(entry->previous_puzzle);
-        }
-      entry->previous_puzzle = entry->current_puzzle;
-      /* generate a new R1 entry */
-      entry->current_puzzle = generate_cookie();
-      entry->dh_entry = get_dh_entry(HCNF.dh_group, FALSE);
-      entry->dh_entry->ref_count++;
-      free(entry->packet);
-      packet_len = calculate_r1_length(h);
-      entry->packet = (__u8 *) malloc(packet_len);
-      if (entry->packet == NULL)
+      for (i = first; i < last; i++)
         {
-          log_(NORMT, "Malloc error! Trying to create R1 packet (%d bytes).\n",
-               packet_len);
+          if (R1_puzzle_expired(&h->r1_cache[i], &now))
+            {
+              rotate_R1_puzzle(h, &h->r1_cache[i]);
+            }
         }
-      memset(entry->packet, 0, packet_len);
-      entry->len = hip_generate_R1(entry->packet,
-                                   h,
-                                   entry->current_puzzle,
-                                   entry->dh_entry);
-      gettimeofday(&entry->creation_time, NULL);
-
-      /* index is about to roll over, so all R1s have been replaced
+
+      /* step is about to roll over, so all R1s have been replaced
        * at this point, we can increase the R1 generation count
        */
-      if ((current_index + 1 >= R1_CACHE_SIZE) &&
+      if ((current_step + 1 >= R1_CACHE_STEPS) &&
           (h->r1_gen_count > 0))
         {
           h->r1_gen_count++;
@@ -240,13 +421,138 @@ void replace_next_R1()
 
     }     /* end for */
 
-  current_index++;
-  if (current_index >= R1_CACHE_SIZE)
+  current_step++;
+  if (current_step >= R1_CACHE_STEPS)
+    {
+      current_step = 0;
+    }
+}
+
+/*
+ * count_puzzle_load()
+ *
+ * in:		type = HIP_I1 or HIP_I2
+ *
+ * Counts the I1s and I2s received, for adapt_puzzle_difficulty().
+ */
+void count_puzzle_load(int type)
+{
+  if (type == HIP_I1)
+    {
+      puzzle_i1_count++;
+    }
+  else
     {
-      current_index = 0;
+      puzzle_i2_count++;
     }
 }
 
+/*
+ * apply_puzzle_difficulty()
+ *
+ * in:		now = current time
+ *
+ * Gives a puzzle with the current K to the R1 cache entries that still
+ * have an older K, once their current puzzle may be replaced.
+ */
+static void apply_puzzle_difficulty(struct timeval *now)
+{
+  hi_node *h;
+  r1_cache_entry *entry;
+  int i;
+
+  if (!puzzle_k_pending)
+    {
+      return;
+    }
+  puzzle_k_pending = FALSE;
+  for (h = my_hi_head; h; h = h->next)
+    {
+      for (i = 0; i < (int)HCNF.r1_cache_size; i++)
+        {
+          entry = &h->r1_cache[i];
+          if ((entry->current_puzzle->k != puzzle_k) &&
+              R1_puzzle_expired(entry, now))
+            {
+              rotate_R1_puzzle(h, entry);
+            }
+          if (entry->current_puzzle->k != puzzle_k)
+            {
+              puzzle_k_pending = TRUE;
+            }
+        }
+    }
+}
+
+/*
+ * adapt_puzzle_difficulty()
+ *
+ * in:		now = current time
+ *
+ * Called periodically when cookie_difficulty_max is set. Raises K by two
+ * when the I2 rate since the last call is above cookie_adapt_rate or the
+ * crypto workers are backlogged, and lowers it by one when both the I1 and
+ * I2 rates are below a quarter of that, keeping K between cookie_difficulty
+ * and cookie_difficulty_max. A new K is applied one R1 cache entry at a
+ * time, as soon as the entry's current puzzle has been sent for a cookie
+ * lifetime; the R1 generation does not change, so that I2s answering the
+ * puzzles sent before remain valid.
+ */
+void adapt_puzzle_difficulty(struct timeval *now)
+{
+  int ms, k, backlog;
+  __u32 i1_rate, i2_rate;
+
+  if (!HCNF.cookie_difficulty_max)
+    {
+      return;
+    }
+  apply_puzzle_difficulty(now);
+
+  ms = (now->tv_sec - puzzle_adapt_time.tv_sec) * 1000 +
+       (now->tv_usec - puzzle_adapt_time.tv_usec) / 1000;
+  if (ms < PUZZLE_ADAPT_INTERVAL * 1000)
+    {
+      return;
+    }
+  i1_rate = (__u32)((__u64)puzzle_i1_count * 1000 / ms);
+  i2_rate = (__u32)((__u64)puzzle_i2_count * 1000 / ms);
+  backlog = hip_crypto_backlog();
+  puzzle_i1_count = 0;
+  puzzle_i2_count = 0;
+  puzzle_adapt_time = *now;
+
+  k = puzzle_k;
+  if ((i2_rate > HCNF.cookie_adapt_rate) ||
+      (backlog >= PUZZLE_BACKLOG_HIGH))
+    {
+      k += 2;
+    }
+  else if ((i1_rate < HCNF.cookie_adapt_rate / 4) &&
+           (i2_rate < HCNF.cookie_adapt_rate / 4) && (backlog == 0))
+    {
+      k--;
+    }
+  if (k > (int)HCNF.cookie_difficulty_max)
+    {
+      k = HCNF.cookie_difficulty_max;
+    }
+  if (k < (int)HCNF.cookie_difficulty)
+    {
+      k = HCNF.cookie_difficulty;
+    }
+  if (k == puzzle_k)
+    {
+      return;
+    }
+
+  log_(NORMT, "Puzzle difficulty %d -> %d (I1 %u/s, I2 %u/s, crypto "
+       "backlog %d%%).\n", puzzle_k, k, i1_rate, i2_rate, backlog);
+  puzzle_k = (__u8)k;
+  puzzle_k_pending = TRUE;
+  apply_puzzle_difficulty(now);
+}
+
 /*
  * compute_cookie_index()
  *
@@ -281,7 +587,7 @@ int compute_R1_cache_index(hip_hit *hiti, __u8 current)
       r += *p++;
     }
 
-  r %= R1_CACHE_SIZE;
+  r %= HCNF.r1_cache_size;
 
   return (r);
 }
@@ -336,8 +642,26 @@ int calculate_r1_length(hi_node *hi)
  * no longer used for new R1 packets. Entries are deleted once stale and
  * no longer referenced.
  *
+ * New entries are taken from a pool of fresh keys per DH group, which the
+ * crypto workers refill to HCNF.dh_pool_high keys whenever it drops below
+ * HCNF.dh_pool_low, so that rekeying and R1 rotation do not wait on
+ * DH_generate_key(). The pool of the configured group is filled at
+ * startup, other groups get a pool once they have been used. Refills are
+ * priority jobs, so that they are not stuck behind a flood of I2s.
+ * Without crypto workers, keys are generated when needed.
  */
 
+/* fresh DH entries not yet in the cache, only used by the hipd thread */
+static struct _dh_pool {
+  dh_cache_entry *head;
+  int count;            /* entries ready for use */
+  int pending;          /* entries being generated by the workers */
+} dh_pool[DH_MAX];
+
+#define DH_POOL_MAX 64
+
+static void dh_pool_refill(__u8 group_id, int low);
+
 /*
  * init_dh_cache()
  *
@@ -351,21 +675,30 @@ void init_dh_cache()
     {
       return;
     }
+  if (HCNF.dh_pool_high > DH_POOL_MAX)
+    {
+      log_(WARN, "Limiting dh_pool_high to %d.\n", DH_POOL_MAX);
+      HCNF.dh_pool_high = DH_POOL_MAX;
+    }
+  if (HCNF.dh_pool_low > HCNF.dh_pool_high)
+    {
+      log_(WARN, "dh_pool_low is above dh_pool_high, using %d.\n",
+           HCNF.dh_pool_high);
+      HCNF.dh_pool_low = HCNF.dh_pool_high;
+    }
   dh_cache = new_dh_cache_entry(HCNF.dh_group);
+  dh_pool_refill(HCNF.dh_group, HCNF.dh_pool_high);
 }
 
 /*
- * new_dh_cache_entry()
+ * alloc_dh_cache_entry()
  *
  * in:		group_id = the DH group for the new entry
  *
- * out:		returns a new malloc'd DH cache entry
- *
- * Build a new DH cache entry for the requested DH group.
+ * out:		returns a new malloc'd DH cache entry without a key
  */
-dh_cache_entry *new_dh_cache_entry(__u8 group_id)
+static dh_cache_entry *alloc_dh_cache_entry(__u8 group_id)
 {
-  int err;
   dh_cache_entry *entry;
 
   entry = (dh_cache_entry*) malloc(sizeof(dh_cache_entry));
@@ -374,6 +707,13 @@ dh_cache_entry *new_dh_cache_entry(__u8 group_id)
   entry->is_current = TRUE;
   entry->ref_count  = 0;
 
+  if (ecdh_curve[group_id])
+    {
+      entry->dh = NULL;
+      entry->ec = EC_KEY_new_by_curve_name(ecdh_curve[group_id]);
+      return(entry);
+    }
+  entry->ec    = NULL;
   entry->dh    = DH_new();
   entry->dh->g = BN_new();
   entry->dh->p = BN_new();
@@ -382,14 +722,153 @@ dh_cache_entry *new_dh_cache_entry(__u8 group_id)
             dhprime_len[group_id], entry->dh->p);
   /* Put generator corresponding to group_id into dh->g */
   BN_set_word(entry->dh->g, dhgen[group_id]);
+  return(entry);
+}
+
+/*
+ * generate_dh_key()
+ *
+ * in:		entry = DH cache entry from alloc_dh_cache_entry()
+ * out:		0 on success, -1 on error
+ */
+static int generate_dh_key(dh_cache_entry *entry)
+{
+  if (entry->ec)
+    {
+      return((EC_KEY_generate_key(entry->ec) == 1) ? 0 : -1);
+    }
   /* By not setting dh->priv_key, allow crypto lib to pick at random */
-  if ((err = DH_generate_key(entry->dh)) != 1)
+  return((DH_generate_key(entry->dh) == 1) ? 0 : -1);
+}
+
+/*
+ * free_dh_cache_entry()
+ */
+static void free_dh_cache_entry(dh_cache_entry *entry)
+{
+  if (entry->dh)
     {
-      log_(ERR, "DH key generation failed.\n");
-      log_(NORMT, "DH key generation failed.\n");
-      exit(1);
+      DH_free(entry->dh);
+    }
+  if (entry->ec)
+    {
+      EC_KEY_free(entry->ec);
+    }
+  memset(entry, 0, sizeof(dh_cache_entry));
+  free(entry);
+}
+
+/*
+ * dh_pool_work()
+ *
+ * Runs on a crypto worker; generates the key of a pool entry.
+ */
+static void dh_pool_work(hip_crypto_job *job)
+{
+  job->status = generate_dh_key(job->dh_entry);
+}
+
+/*
+ * dh_pool_finish()
+ *
+ * Runs on the hipd thread; adds a generated entry to its group's pool.
+ */
+static void dh_pool_finish(hip_crypto_job *job)
+{
+  dh_cache_entry *entry = job->dh_entry;
+  struct _dh_pool *pool = &dh_pool[entry->group_id];
+
+  pool->pending--;
+  if (job->status < 0)
+    {
+      log_(WARN, "DH key generation failed.\n");
+      free_dh_cache_entry(entry);
+    }
+  else
+    {
+      entry->next = pool->head;
+      pool->head = entry;
+      pool->count++;
+    }
+  free(job);
+}
+
+/*
+ * dh_pool_refill()
+ *
+ * in:		group_id = the DH group whose pool is checked
+ *              low = refill when fewer keys are ready or pending
+ *
+ * Have the crypto workers generate keys for a pool that is running low.
+ */
+static void dh_pool_refill(__u8 group_id, int low)
+{
+  struct _dh_pool *pool = &dh_pool[group_id];
+  hip_crypto_job *job;
+
+  /* without workers, keys are generated only when needed */
+  if ((hip_crypto_fd() < 0) ||
+      (pool->count + pool->pending >= low))
+    {
+      return;
     }
+  while (pool->count + pool->pending < (int)HCNF.dh_pool_high)
+    {
+      job = (hip_crypto_job*) malloc(sizeof(hip_crypto_job));
+      if (!job)
+        {
+          return;
+        }
+      memset(job, 0, sizeof(hip_crypto_job));
+      job->work = dh_pool_work;
+      job->finish = dh_pool_finish;
+      job->dh_entry = alloc_dh_cache_entry(group_id);
+      job->priority = TRUE;
+      if (hip_crypto_submit(job) < 0)
+        {
+          free_dh_cache_entry(job->dh_entry);
+          free(job);
+          return;
+        }
+      pool->pending++;
+    }
+}
+
+/*
+ * new_dh_cache_entry()
+ *
+ * in:		group_id = the DH group for the new entry
+ *
+ * out:		returns a new malloc'd DH cache entry
+ *
+ * Build a new DH cache entry for the requested DH group, taking a fresh
+ * key from the pool when there is one.
+ */
+dh_cache_entry *new_dh_cache_entry(__u8 group_id)
+{
+  dh_cache_entry *entry;
+  struct _dh_pool *pool = &dh_pool[group_id];
+
+  if (pool->head)
+    {
+      entry = pool->head;
+      pool->head = entry->next;
+      pool->count--;
+      entry->next = NULL;
+    }
+  else
+    {
+      entry = alloc_dh_cache_entry(group_id);
+      if (generate_dh_key(entry) < 0)
+        {
+          log_(ERR, "DH key generation failed.\n");
+          log_(NORMT, "DH key generation failed.\n");
+          exit(1);
+        }
+    }
+  /* the lifetime starts when the entry is used */
   gettimeofday(&entry->creation_time, NULL);
+  dh_pool_refill(group_id, HCNF.dh_pool_low);
   return(entry);
 }
 
@@ -431,18 +910,23 @@ dh_cache_entry *get_dh_entry(__u8 group_id, int new)
  * unuse_dh_entry()
  *
  * in:		dh = pointer to DH context contained in the entry
+ *              ec = or pointer to the ECDH key contained in the entry
  * out:		None.
  *
  * Given a DH context, find the corresponding cache entry and decrement
  * its usage count.
  */
-void unuse_dh_entry(DH *dh)
+void unuse_dh_entry(DH *dh, EC_KEY *ec)
 {
   dh_cache_entry *entry;
 
+  if (!dh && !ec)
+    {
+      return;
+    }
   for (entry = dh_cache; entry != NULL; entry = entry->next)
     {
-      if (entry->dh == dh)
+      if ((entry->dh == dh) && (entry->ec == ec))
         {
           if (entry->ref_count > 0)
             {
@@ -509,9 +993,7 @@ void expire_old_dh_entries()
                       dh_cache = next;
                     }
                 }
-              DH_free(old->dh);
-              memset(old, 0, sizeof(dh_cache_entry));
-              free(old);
+              free_dh_cache_entry(old);
             }
         }
       if (entry)
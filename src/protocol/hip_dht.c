@@ -519,7 +519,8 @@ int hip_dht_lookup_address(hip_hit *hit, struct sockaddr *addr, int retry)
           hiph->hdr_len = (len / 8) - 1;
           if (validate_signature(hdrr, len, tlv,
                                  peer_hi->dsa,
-                                 peer_hi->rsa) < 0)
+                                 peer_hi->rsa,
+                                 peer_hi->ecdsa) < 0)
             {
               log_(WARN, "HDRR has invalid signature.\n");
               err = -1;
@@ -1549,7 +1550,7 @@ void delete_address_from_list(sockaddr_list **list, struct sockaddr *addr,
   return;
 }
 
-void unuse_dh_entry(DH *dh)
+void unuse_dh_entry(DH *dh, EC_KEY *ec)
 {
   return;
 }
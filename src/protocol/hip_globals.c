@@ -32,13 +32,14 @@
  */
 #include <openssl/dsa.h>        /* DSA support                  */
 #include <openssl/dh.h>         /* Diffie-Hellman contexts      */
+#include <openssl/obj_mac.h>    /* ECDH curve NIDs              */
 #include <hip/hip_types.h>
 #include <hip/hip_proto.h>
 
 /* globals */
 
-hip_assoc hip_assoc_table[MAX_CONNECTIONS];
-int max_hip_assoc = 0;        /* last entry added to the table */
+hip_assoc_slab *hip_assoc_slabs[HIP_ASSOC_MAX_SLABS];
+int max_hip_assoc = 0;        /* last entry allocated + 1 */
 hi_node *my_hi_head = NULL;
 sockaddr_list *my_addr_head = NULL;
 hi_node *peer_hi_head = NULL;
@@ -59,6 +60,7 @@ struct hip_opt OPT;
 
 /* Global configuration data */
 struct hip_conf HCNF;
+int g_conf_loaded = 0; /* set once hip.conf has been read */
 
 /*
  * Diffie-Hellman primes
@@ -307,6 +309,9 @@ const unsigned char *dhprime[DH_MAX] = {
   dhprime_modp_3072,
   dhprime_modp_6144,
   dhprime_modp_8192,
+  0,
+  0,
+  0,
 };
 
 const int dhprime_len[DH_MAX] = {
@@ -317,9 +322,19 @@ const int dhprime_len[DH_MAX] = {
   sizeof(dhprime_modp_3072),
   sizeof(dhprime_modp_6144),
   sizeof(dhprime_modp_8192),
+  64,   /* ECDH public values are x and y, each padded to the field size */
+  96,
+  132,
 };
 
-unsigned char dhgen[DH_MAX] = { 0,0x02,0x02,0x02,0x02,0x02,0x02 };
+unsigned char dhgen[DH_MAX] = { 0,0x02,0x02,0x02,0x02,0x02,0x02,0,0,0 };
+
+const int ecdh_curve[DH_MAX] = {
+  0, 0, 0, 0, 0, 0, 0,
+  NID_X9_62_prime256v1,
+  NID_secp384r1,
+  NID_secp521r1,
+};
 
 const unsigned char khi_context_id[16] = {
   0xf0, 0xef, 0xf0, 0x2f, 0xbf, 0xf4, 0x3d, 0x0f,
@@ -64,6 +64,7 @@
 #include <openssl/dsa.h>        /* DSA support                  */
 #include <openssl/asn1.h>       /* DSAparams_dup()              */
 #include <openssl/dh.h>         /* Diffie-Hellman contexts      */
+#include <openssl/ecdsa.h>      /* ECDSA signatures             */
 #include <openssl/sha.h>        /* SHA1 algorithms              */
 #include <openssl/rand.h>       /* RAND_bytes()                 */
 #include <hip/hip_types.h>
@@ -81,8 +82,8 @@
 int hip_parse_I1(hip_assoc *hip_a, const __u8 *data, hip_hit *hiti,
                  hip_hit *hitr);
 int hip_parse_R1(const __u8 *data, hip_assoc *hip_a);
-int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
-                 struct sockaddr *src, struct sockaddr *dst);
+int hip_parse_I2(hip_crypto_job *job, hi_node *my_host_id);
+int hip_verify_I2(hip_crypto_job *job);
 int hip_parse_R2(__u8 *data, hip_assoc *hip_a);
 int hip_parse_close(const __u8 *data, hip_assoc *hip_a, __u32 *nonce);
 int validate_hmac(const __u8 *data, int data_len, __u8 *hmac, int hmac_len,
@@ -90,7 +91,8 @@ int validate_hmac(const __u8 *data, int data_len, __u8 *hmac, int hmac_len,
 hi_node *check_if_my_hit(hip_hit *hit);
 int handle_transforms(hip_assoc *hip_a, __u16 *transforms, int length, int esp);
 int handle_cert(hip_assoc *hip_a, const __u8 *data);
-int handle_dh(hip_assoc *hip_a, const __u8 *data, __u8 *g, DH *dh);
+int handle_dh(hip_assoc *hip_a, const __u8 *data, __u8 *g,
+              struct rekey_info *rk);
 int handle_acks(hip_assoc *hip_a, tlv_ack *ack);
 int handle_esp_info(tlv_esp_info *ei, __u32 spi_out, struct rekey_info *rk);
 int handle_locators(hip_assoc *hip_a, locator **locators,
@@ -554,7 +556,6 @@ int hip_parse_R1(const __u8 *data, hip_assoc *hip_a)
   tlv_head *tlv;
   int location, data_len;
   int len, type, length;
-  unsigned char *dh_secret_key;
   int last_type = 0, status = -1, sig_verified = FALSE;
   __u8 g_id = 0;
   __u16 *p;
@@ -643,7 +644,8 @@ int hip_parse_R1(const __u8 *data, hip_assoc *hip_a)
           hiph->hdr_len = (len / 8) - 1;
           if (validate_signature(data, len, tlv,
                                  hip_a->peer_hi->dsa,
-                                 hip_a->peer_hi->rsa) < 0)
+                                 hip_a->peer_hi->rsa,
+                                 hip_a->peer_hi->ecdsa) < 0)
             {
               log_(WARN, "Invalid signature.\n");
               hip_send_notify(hip_a,
@@ -691,6 +693,11 @@ int hip_parse_R1(const __u8 *data, hip_assoc *hip_a)
                   DH_free(hip_a->peer_dh);
                   hip_a->peer_dh = NULL;
                 }
+              if (hip_a->peer_ec)
+                {
+                  EC_KEY_free(hip_a->peer_ec);
+                  hip_a->peer_ec = NULL;
+                }
               if (hip_a->dh_secret)
                 {
                   free(hip_a->dh_secret);
@@ -708,6 +715,12 @@ int hip_parse_R1(const __u8 *data, hip_assoc *hip_a)
                 {
                   DSA_free(saved_peer_hi.dsa);
                 }
+              if (saved_peer_hi.ecdsa &&
+                  (saved_peer_hi.ecdsa !=
+                   hip_a->peer_hi->ecdsa))
+                {
+                  EC_KEY_free(saved_peer_hi.ecdsa);
+                }
               memset(hip_a->keymat, 0, KEYMAT_SIZE);
               hip_a->keymat_index = 0;
             }
@@ -739,28 +752,18 @@ int hip_parse_R1(const __u8 *data, hip_assoc *hip_a)
           dh_entry->ref_count++;
           hip_a->dh_group_id = g_id;
           hip_a->dh = dh_entry->dh;
+          hip_a->ec = dh_entry->ec;
 
           /* compute key from our dh and peer's pub_key and
-           * store in dh_secret_key */
-          dh_secret_key = malloc(DH_size(hip_a->dh));
-          if (!dh_secret_key)
+           * store in hip_a->dh_secret */
+          if (compute_dh_secret(hip_a) < 0)
             {
-              log_(WARN, "hip_parse_R1() malloc() error");
               return(-1);
             }
-          memset(dh_secret_key, 0, DH_size(hip_a->dh));
-          len = DH_compute_key(dh_secret_key,
-                               hip_a->peer_dh->pub_key,
-                               hip_a->dh);
-          logdh(hip_a->dh);
-          if (len != DH_size(hip_a->dh))
+          if (hip_a->dh)
             {
-              log_(NORM, "Warning: secret key len = %d,",len);
-              log_(NORM, " expected %d\n",DH_size(hip_a->dh));
+              logdh(hip_a->dh);
             }
-          set_secret_key(dh_secret_key, hip_a);
-          /* Do not free(dh_secret_key), which is now
-           * dh->dh_secret  */
         }
       else if (type == PARAM_HIP_TRANSFORM)
         {
@@ -906,6 +909,11 @@ restore_saved_peer_hi:
     {
       RSA_free(hip_a->peer_hi->rsa);
     }
+  if (hip_a->peer_hi->ecdsa &&
+      (hip_a->peer_hi->ecdsa != saved_peer_hi.ecdsa))
+    {
+      EC_KEY_free(hip_a->peer_hi->ecdsa);
+    }
   memcpy(hip_a->peer_hi, &saved_peer_hi, sizeof(saved_peer_hi));
   return(-1);
 }
@@ -942,7 +950,7 @@ int hip_handle_R1(__u8 *buff, hip_assoc *hip_a, struct sockaddr *src)
       return(-1);
     }
   /* Set ip, hit, size, hi_t of peer_hi */
-  if (hip_a->dh == NULL)
+  if ((hip_a->dh == NULL) && (hip_a->ec == NULL))
     {
       log_(WARN, "Error: after parsing R1, DH is null.\n");
     }
@@ -953,6 +961,7 @@ int hip_handle_R1(__u8 *buff, hip_assoc *hip_a, struct sockaddr *src)
     {
       memcpy(HIPA_DST(hip_a), src, SALEN(src));
     }
+  hip_assoc_index(hip_a);
   /* Update peer_hi_head and fill in LSI*/
   update_peer_list(hip_a);
   /* hip_send_I2 takes cookie from R1 */
@@ -990,44 +999,32 @@ int hip_handle_R1(__u8 *buff, hip_assoc *hip_a, struct sockaddr *src)
  *
  * function hip_parse_I2()
  *
- * in:		data = raw socket bytes
- *              hip_a is pointer to HIP connection instance
- *              cookie = pointer to store extracted cookie
+ * in:		job = holds a copy of the I2 packet and its addresses
+ *              my_host_id = my HI that the I2 was sent to
  *
- * out:		Returns -1 if failure, packet length otherwise.
+ * out:		Returns -1 if failure, 0 otherwise.
  *
- * parse HIP Second Initiator packet
+ * Parse a HIP Second Initiator packet up to the puzzle solution. When the
+ * solution is valid, a pending association is created in job->hip_a, and
+ * the remaining parameters are left for hip_verify_I2().
  *
  */
-int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
-                 struct sockaddr *src, struct sockaddr *dst)
+int hip_parse_I2(hip_crypto_job *job, hi_node *my_host_id)
 {
   hiphdr *hiph;
   int location, data_len;
-  int i, j, len, key_len, iv_len, last_type = 0, err = 0;
+  int i, j, last_type = 0;
   int type, length;
-  hip_assoc *hip_a = NULL, *hip_a_existing;
-  __u16 proposed_keymat_index = 0;
+  hip_assoc *hip_a = NULL;
   __u32 proposed_spi_out = 0;
   tlv_head *tlv;
   tlv_esp_info *esp_info;
-  unsigned char *hmac;
   hipcookie cookie;
   __u64 solution = 0, r1count = 0;
-  __u16 *p;
-  __u8 g_id = 0;
-  unsigned char *dh_secret_key;
   dh_cache_entry *dh_entry = NULL;
-  unsigned char *key, *enc_data = NULL, *unenc_data = NULL;
-  DES_key_schedule ks1, ks2, ks3;
-  BF_KEY bfkey;
-  AES_KEY aes_key;
-  u_int8_t secret_key1[8], secret_key2[8], secret_key3[8];
-  unsigned char cbc_iv[16];
-  int got_dh = 0, comp_keys = 0, status;
-  __u8 valid_cert = FALSE;
-
-  hip_a_existing = *hip_ar;
+  r1_template *r1;
+  __u8 *data = job->data;
+  struct sockaddr *src = SA(&job->src), *dst = SA(&job->dst);
 
   /* Find hip header */
   location = 0;
@@ -1035,19 +1032,15 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
   data_len = location + ((hiph->hdr_len + 1) * 8);
   location += sizeof(hiphdr);
 
-  status = -1;
-  /* Parse TLVs */
-  while (location < data_len)
+  /* Parse TLVs up to the puzzle solution */
+  while ((location < data_len) && !hip_a)
     {
       tlv = (tlv_head*) &data[location];
       type = ntohs(tlv->type);
       length = ntohs(tlv->length);
-      /* check if hip_a has been initalized*/
-      if ((type > PARAM_SOLUTION) && !hip_a)
+      if (type > PARAM_SOLUTION)
         {
-          log_(NORM,
-               "I2 packet does not contain puzzle solution.\n");
-          return(-1);
+          break;
         }
       if (check_tlv_type_length(type, length, last_type, "I2") < 0)
         {
@@ -1061,7 +1054,7 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
       if (type == PARAM_ESP_INFO)
         {
           esp_info = (tlv_esp_info*)tlv;
-          proposed_keymat_index = ntohs(esp_info->keymat_index);
+          job->keymat_index = ntohs(esp_info->keymat_index);
           proposed_spi_out = ntohl(esp_info->new_spi);
         }
       else if (type == PARAM_R1_COUNTER)
@@ -1095,35 +1088,35 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
           log_(NORM, "solution: 0x%llx\n",solution);
           i = compute_R1_cache_index(&hiph->hit_sndr, TRUE);
           j = compute_R1_cache_index(&hiph->hit_sndr, FALSE);
-          /* locate cookie using current random number */
-          if ((validate_solution(
-                 my_host_id->r1_cache[i].current_puzzle,
-                 &cookie,
-                 &hiph->hit_sndr, &hiph->hit_rcvr,
-                 solution) == 0) ||
-              (validate_solution(
-                 my_host_id->r1_cache[i].previous_puzzle,
-                 &cookie,
-                 &hiph->hit_sndr, &hiph->hit_rcvr,
-                 solution) == 0))
-            {
-              dh_entry = my_host_id->r1_cache[i].dh_entry;
-              /* locate cookie using previous random number */
-            }
-          else if ((validate_solution(
-                      my_host_id->r1_cache[j].
-                      current_puzzle,
-                      &cookie,
-                      &hiph->hit_sndr, &hiph->hit_rcvr,
-                      solution) == 0) ||
-                   (validate_solution(
-                      my_host_id->r1_cache[j].
-                      previous_puzzle,
-                      &cookie,
-                      &hiph->hit_sndr, &hiph->hit_rcvr,
-                      solution) == 0))
-            {
-              dh_entry = my_host_id->r1_cache[j].dh_entry;
+          /* locate cookie using current random number, then
+           * using previous random number; the DH entry is the one
+           * from the R1 the matching puzzle was sent in */
+          if (validate_solution(my_host_id->r1_cache[i].current_puzzle,
+                                &cookie, &hiph->hit_sndr,
+                                &hiph->hit_rcvr, solution) == 0)
+            {
+              r1 = my_host_id->r1_cache[i].current_r1;
+            }
+          else if (validate_solution(
+                     my_host_id->r1_cache[i].previous_puzzle,
+                     &cookie, &hiph->hit_sndr,
+                     &hiph->hit_rcvr, solution) == 0)
+            {
+              r1 = my_host_id->r1_cache[i].previous_r1;
+            }
+          else if (validate_solution(
+                     my_host_id->r1_cache[j].current_puzzle,
+                     &cookie, &hiph->hit_sndr,
+                     &hiph->hit_rcvr, solution) == 0)
+            {
+              r1 = my_host_id->r1_cache[j].current_r1;
+            }
+          else if (validate_solution(
+                     my_host_id->r1_cache[j].previous_puzzle,
+                     &cookie, &hiph->hit_sndr,
+                     &hiph->hit_rcvr, solution) == 0)
+            {
+              r1 = my_host_id->r1_cache[j].previous_r1;
             }
           else
             {
@@ -1132,10 +1125,13 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
                 {
                   return(-1);
                 }
+              r1 = my_host_id->r1_cache[i].current_r1;
             }
-          /* create HIP association state here */
-          hip_a = init_hip_assoc(my_host_id,
-                                 (const hip_hit *)&hiph->hit_sndr);
+          dh_entry = r1->dh_entry;
+          /* create HIP association state here, kept out of the
+           * table until the rest of the I2 has been verified */
+          hip_a = init_pending_hip_assoc(my_host_id,
+                                         (const hip_hit *)&hiph->hit_sndr);
           if (!hip_a)
             {
               log_(WARN,
@@ -1145,6 +1141,7 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
             }
           hip_a->dh_group_id = dh_entry->group_id;
           hip_a->dh = dh_entry->dh;
+          hip_a->ec = dh_entry->ec;
           dh_entry->ref_count++;
           dh_entry->is_current = FALSE;               /* mark the entry so it
                                                        *  will not be used again
@@ -1163,13 +1160,87 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
               hip_a->udp = TRUE;
             }
         }
-      else if (type == PARAM_DIFFIE_HELLMAN)
+      else
+        {
+          if (check_tlv_unknown_critical(type, length) < 0)
+            {
+              return(-1);
+            }
+        }
+      location += tlv_length_to_parameter_length(length);
+    }
+  if (!hip_a)
+    {
+      log_(NORM, "I2 packet does not contain puzzle solution.\n");
+      return(-1);
+    }
+
+  job->hip_a = hip_a;
+  job->location = location;
+  return(0);
+}
+
+/*
+ *
+ * function hip_verify_I2()
+ *
+ * in:		job = from hip_parse_I2()
+ *
+ * out:		Returns -1 if failure, 0 otherwise. job->notify is set to the
+ *              NOTIFY code to send to the peer, if any.
+ *
+ * Verify the rest of an I2: compute the DH secret and keys, decrypt the
+ * peer's HI, and check the HMAC and signature. This may run on a crypto
+ * worker, so it only modifies the job and its pending association.
+ *
+ */
+int hip_verify_I2(hip_crypto_job *job)
+{
+  hiphdr *hiph;
+  int location, data_len;
+  int len, key_len, iv_len, last_type = PARAM_SOLUTION, err = 0;
+  int type, length;
+  hip_assoc *hip_a = job->hip_a;
+  tlv_head *tlv;
+  tlv_esp_info *esp_info;
+  unsigned char *hmac;
+  __u16 *p;
+  __u8 g_id = 0;
+  unsigned char *key, *enc_data = NULL, *unenc_data = NULL;
+  DES_key_schedule ks1, ks2, ks3;
+  BF_KEY bfkey;
+  AES_KEY aes_key;
+  u_int8_t secret_key1[8], secret_key2[8], secret_key3[8];
+  unsigned char cbc_iv[16];
+  int got_dh = 0, comp_keys = 0, status;
+  __u8 *data = job->data;
+
+  hiph = (hiphdr*) data;
+  data_len = (hiph->hdr_len + 1) * 8;
+  location = job->location;
+
+  status = -1;
+  /* Parse TLVs */
+  while (location < data_len)
+    {
+      tlv = (tlv_head*) &data[location];
+      type = ntohs(tlv->type);
+      length = ntohs(tlv->length);
+      if (check_tlv_type_length(type, length, last_type, "I2") < 0)
+        {
+          return(-1);
+        }
+      else
+        {
+          last_type = type;
+        }
+
+      if (type == PARAM_DIFFIE_HELLMAN)
         {
           if (handle_dh(hip_a, &data[location], &g_id,
                         NULL) < 0)
             {
-              hip_send_notify(hip_a, NOTIFY_INVALID_DH_CHOSEN,
-                              NULL, 0);
+              job->notify = NOTIFY_INVALID_DH_CHOSEN;
               return(-1);
             }
           /* We chose g_id in R1, so I2 should match */
@@ -1177,53 +1248,35 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
             {
               log_(NORM, "Got DH group %d, expected %d.",
                    g_id, hip_a->dh_group_id);
-              hip_send_notify(hip_a, NOTIFY_INVALID_DH_CHOSEN,
-                              NULL, 0);
+              job->notify = NOTIFY_INVALID_DH_CHOSEN;
               return(-1);
             }
           /* compute key from our dh and peer's pub_key and
-           * store in dh_secret_key */
-          dh_secret_key = malloc(DH_size(hip_a->dh));
-          if (!dh_secret_key)
+           * store in hip_a->dh_secret */
+          if (compute_dh_secret(hip_a) < 0)
             {
-              log_(WARN, "hip_parse_I2() malloc() error");
+              job->notify = NOTIFY_INVALID_DH_CHOSEN;
               return(-1);
             }
-          memset(dh_secret_key, 0, DH_size(hip_a->dh));
-          len = DH_compute_key(dh_secret_key,
-                               hip_a->peer_dh->pub_key,
-                               hip_a->dh);
-          if (len != DH_size(hip_a->dh))
-            {
-              log_(NORM,"Warning: secret key len = %d,", len);
-              log_(NORM,"expected %d\n", DH_size(hip_a->dh));
-            }
-          set_secret_key(dh_secret_key, hip_a);
           got_dh = 1;
-          /* Do not free(dh_secret_key), which is now
-           * dh->dh_secret  */
         }
       else if (type == PARAM_HIP_TRANSFORM)
         {
           p = &((tlv_hip_transform*)tlv)->transform_id;
           if ((handle_transforms(hip_a, p, length, FALSE)) < 0)
             {
-              hip_send_notify(
-                hip_a,
-                NOTIFY_INVALID_HIP_TRANSFORM_CHOSEN,
-                NULL,
-                0);
+              job->notify = NOTIFY_INVALID_HIP_TRANSFORM_CHOSEN;
               return(-1);
             }
           /* Must compute keys here so we can use them below. */
           if (got_dh)
             {
               compute_keys(hip_a);
-              if (proposed_keymat_index >
+              if (job->keymat_index >
                   hip_a->keymat_index)
                 {
                   hip_a->keymat_index =
-                    proposed_keymat_index;
+                    job->keymat_index;
                 }
               comp_keys = 1;
             }
@@ -1253,11 +1306,7 @@ int hip_parse_I2(const __u8 *data, hip_assoc **hip_ar, hi_node *my_host_id,
           if ((handle_transforms(hip_a, p, length - 2,
                                  TRUE)) < 0)
             {
-              hip_send_notify(
-                hip_a,
-                NOTIFY_INVALID_ESP_TRANSFORM_CHOSEN,
-                NULL,
-                0);
+              job->notify = NOTIFY_INVALID_ESP_TRANSFORM_CHOSEN;
               return(-1);
             }
         }
@@ -1444,7 +1493,7 @@ I2_ERROR:
           free(unenc_data);
           if ((err) && (!OPT.permissive))
             {
-              hip_send_notify(hip_a, err, NULL, 0);
+              job->notify = err;
               return(-1);
             }
         }
@@ -1453,8 +1502,7 @@ I2_ERROR:
           if (handle_hi(&hip_a->peer_hi, &data[location]) < 0)
             {
               log_(WARN, "Error with I2 HI.\n");
-              hip_send_notify(hip_a, NOTIFY_INVALID_SYNTAX,
-                              NULL, 0);
+              job->notify = NOTIFY_INVALID_SYNTAX;
               return(-1);
             }
           if (!validate_hit(hiph->hit_sndr,
@@ -1462,8 +1510,7 @@ I2_ERROR:
             {
               log_(WARN, "HI in I2 does not match ");
               log_(NORM, "the sender's HIT\n");
-              hip_send_notify(hip_a, NOTIFY_INVALID_HIT,
-                              NULL, 0);
+              job->notify = NOTIFY_INVALID_HIT;
               return(-1);
             }
           else
@@ -1474,15 +1521,8 @@ I2_ERROR:
         }
       else if (type == PARAM_CERT)
         {
-          if (HCNF.peer_certificate_required &&
-              (handle_cert(hip_a, &data[location]) < 0))
-            {
-              hip_send_notify(hip_a,
-                              NOTIFY_AUTHENTICATION_FAILED,
-                              NULL, 0);
-              return(-1);
-            }
-          valid_cert = TRUE;
+          /* checked by hip_I2_finish() on the hipd thread */
+          job->cert = location;
         }
       else if ((type == PARAM_ECHO_RESPONSE) ||
                (type == PARAM_ECHO_RESPONSE_NOSIG))
@@ -1505,9 +1545,7 @@ I2_ERROR:
                             hip_a->hip_transform))
             {
               log_(WARN, "Invalid HMAC.\n");
-              hip_send_notify(hip_a,
-                              NOTIFY_HMAC_FAILED,
-                              NULL, 0);
+              job->notify = NOTIFY_HMAC_FAILED;
               if (!OPT.permissive)
                 {
                   return(-1);
@@ -1520,7 +1558,7 @@ I2_ERROR:
         }
       else if (type == PARAM_HIP_SIGNATURE)
         {
-          if ((hip_a == NULL) || (hip_a->peer_hi == NULL))
+          if (hip_a->peer_hi == NULL)
             {
               log_(WARN, "Received signature parameter "
                    "without any Host Identity context for "
@@ -1532,28 +1570,16 @@ I2_ERROR:
           hiph->hdr_len = (len / 8) - 1;
           if (validate_signature(data, len, tlv,
                                  hip_a->peer_hi->dsa,
-                                 hip_a->peer_hi->rsa) < 0)
+                                 hip_a->peer_hi->rsa,
+                                 hip_a->peer_hi->ecdsa) < 0)
             {
               log_(WARN, "Invalid signature.\n");
-              hip_send_notify(hip_a,
-                              NOTIFY_AUTHENTICATION_FAILED,
-                              NULL, 0);
+              job->notify = NOTIFY_AUTHENTICATION_FAILED;
               if (!OPT.permissive)
                 {
                   return(-1);
                 }
             }
-          /* adopt the new hip_assoc now */
-          if (hip_a_existing)
-            {
-              log_(NORM, "Replacing old association.\n");
-              replace_hip_assoc(hip_a_existing, hip_a);
-              *hip_ar = hip_a_existing;
-            }
-          else
-            {
-              *hip_ar = hip_a;
-            }
           /* exit w/OK */
           status = 0;
         }
@@ -1578,122 +1604,104 @@ I2_ERROR:
           if (check_tlv_unknown_critical(type, length) < 0)
             {
               /* cookie has been solved, send NOTIFY */
-              if (hip_a)
-                {
-                  __u16 t;
-                  t = (__u16)type;
-                  hip_send_notify(
-                    hip_a,
-                    NOTIFY_UNSUPPORTED_CRITICAL_PARAMETER_TYPE,
-                    (__u8*)&t,
-                    sizeof(__u16));
-                }
+              job->notify = NOTIFY_UNSUPPORTED_CRITICAL_PARAMETER_TYPE;
+              job->notify_type = (__u16)type;
               return(-1);
             }
         }
       location += tlv_length_to_parameter_length(length);
     }
-  if (HCNF.peer_certificate_required && !valid_cert)
+
+  return(status);
+}
+
+/* this is the SPI from the last received I2 packet, so we know
+ * whether or not it is a retransmission */
+static __u32 last_I2_spi = 0;
+
+/*
+ * hip_I2_free()
+ *
+ * Free an I2 job and its association, unless that has been adopted.
+ */
+static void hip_I2_free(hip_crypto_job *job)
+{
+  if (job->hip_a)
     {
-      hip_send_notify(hip_a, NOTIFY_AUTHENTICATION_FAILED, NULL, 0);
-      return(-1);
+      free_pending_hip_assoc(job->hip_a);
     }
+  free(job->data);
+  free(job);
+}
 
-  return(status);
+/*
+ * hip_I2_work()
+ *
+ * Crypto worker part of handling an I2.
+ */
+static void hip_I2_work(hip_crypto_job *job)
+{
+  job->status = hip_verify_I2(job);
 }
 
-int hip_handle_I2(__u8 *buff, hip_assoc *hip_a_existing,
-                  struct sockaddr *src, struct sockaddr *dst)
+/*
+ * hip_I2_finish()
+ *
+ * hipd part of handling an I2 once hip_verify_I2() is done: send any
+ * NOTIFY, adopt the new association, and reply with R2.
+ */
+static void hip_I2_finish(hip_crypto_job *job)
 {
   int err = 0;
-  hi_node *my_host_id = NULL;
-  hip_assoc *hip_a = NULL;
+  hip_assoc *hip_a, *hip_a_existing;
   __u32 old_spi_in = 0, old_spi_out = 0;
-  struct timeval time1;
-  hiphdr *hiph;
   int old_state = 0;
-  /* this is the SPI from the last received I2 packet, so we know
-   * whether or not it is a retransmission */
-  static __u32 last_I2_spi = 0;
+  struct sockaddr *src = SA(&job->src), *dst = SA(&job->dst);
 
-  /* Accept I2 in all states but E_FAILED.
-   * Special treatment when in ESTABLISHED. */
-  if (hip_a_existing && (hip_a_existing->state == E_FAILED))
+  if (job->notify == NOTIFY_UNSUPPORTED_CRITICAL_PARAMETER_TYPE)
     {
-      log_(NORM, "HIP_I2 packet not accepted in state=%d.\n",
-           hip_a_existing->state);
-      return(-1);
+      hip_send_notify(job->hip_a, job->notify,
+                      (__u8*)&job->notify_type, sizeof(__u16));
     }
-  hiph = (hiphdr*) buff;
-
-  /*
-   * Is this my HIT?  If so, get corresponding HI. If not, fail
-   */
-  if ((my_host_id = check_if_my_hit(&hiph->hit_rcvr)) == NULL)
+  else if (job->notify)
     {
-      log_(NORM, "Received I2 with a recv. HIT that is not mine.\n");
-      return(-1);
+      hip_send_notify(job->hip_a, job->notify, NULL, 0);
     }
-
-  /*
-   * Retransmit R2 if in state R2_SENT and this is a similar
-   * I2 to the one that triggered moving to R2_SENT
-   */
-  if (hip_a_existing && (hip_a_existing->state == R2_SENT))
+  /* the configuration library may not be thread-safe */
+  if ((job->status == 0) && HCNF.peer_certificate_required &&
+      (!job->cert || (handle_cert(job->hip_a, &job->data[job->cert]) < 0)))
     {
-      /* XXX should we instead process, then send R2? */
-      if ((hip_a_existing->rexmt_cache.packet != NULL) &&
-          (hip_a_existing->rexmt_cache.retransmits <
-           HCNF.max_retries) && (0 == OPT.no_retransmit) &&
-          (last_I2_spi == ntohl(
-             ((tlv_esp_info*)&buff[sizeof(hiphdr)])->new_spi )))
-        {
-          log_(NORM, "Received I2 in R2_SENT, retransmitting ");
-          log_(NORM, "R2...\n");
-          hip_retransmit(hip_a,hip_a_existing->rexmt_cache.packet,
-                         hip_a_existing->rexmt_cache.len,
-                         dst, src);
-          gettimeofday(&time1, NULL);
-          hip_a_existing->rexmt_cache.xmit_time.tv_sec
-            = time1.tv_sec;
-          hip_a_existing->rexmt_cache.xmit_time.tv_usec
-            = time1.tv_usec;
-          hip_a_existing->rexmt_cache.retransmits++;
-          set_state(hip_a_existing, R2_SENT);               /* update time */
-          return(0);
-        }
-      /* If we get here, then we already have SAs that need to be
-       * dropped because we are in R2_SENT, but this is a new I2
-       * packet from a new HIP exchange. So we simply rush our
-       * R2_SENT timer to become ESTABLISHED now.
-       */
-      log_(NORM, "Moving from state R2_SENT=>ESTABLISHED because ");
-      log_(NORM, "a new HIP association requested.\n");
-      set_state(hip_a_existing, ESTABLISHED);
-      /* Compare HITs in state I2_SENT
-       */
+      hip_send_notify(job->hip_a, NOTIFY_AUTHENTICATION_FAILED, NULL, 0);
+      job->status = -1;
     }
-  else if (hip_a_existing && (hip_a_existing->state == I2_SENT))
+  if (job->status < 0)
     {
-      /* peer HIT larger than my HIT */
-      if (compare_hits(hiph->hit_sndr, hiph->hit_rcvr) > 0)
-        {
-          log_(NORMT, "Dropping I2 in state I2_SENT because ");
-          log_(NORM, "local HIT is smaller than peer HIT.\n");
-          return(0);
-        }
-      /* local HIT is greater than peer HIT, send R2... */
+      log_(WARN, "Error while processing I2, dropping.\n");
+      /* stay in same state here */
+      hip_I2_free(job);
+      return;
+    }
+
+  /* look again, the association may have changed in the meantime */
+  hip_a_existing = find_hip_association(src, dst, (hiphdr*) job->data);
+  if (hip_a_existing && (hip_a_existing->state == E_FAILED))
+    {
+      log_(NORM, "HIP_I2 packet not accepted in state=%d.\n",
+           hip_a_existing->state);
+      hip_I2_free(job);
+      return;
     }
 
   /*
    * Prepare to drop old SAs
    */
-  if (hip_a_existing && (hip_a_existing->state == ESTABLISHED))
+  if (hip_a_existing && ((hip_a_existing->state == ESTABLISHED) ||
+                         (hip_a_existing->state == R2_SENT)))
     {
-      old_state = hip_a_existing->state;
+      old_state = ESTABLISHED;
       old_spi_in = hip_a_existing->spi_in;
       old_spi_out = hip_a_existing->spi_out;
-      log_(NORM, "Existing association already in ESTABLISHED, ");
+      log_(NORM, "Existing association already established, ");
       log_(NORM, "preparing to drop SAs.\n");
     }
   else
@@ -1702,22 +1710,26 @@ int hip_handle_I2(__u8 *buff, hip_assoc *hip_a_existing,
     }
 
 
-  /*
-   * Process the I2, with appropriate checks
-   */
-  hip_a = hip_a_existing;       /* may be NULL */
-  if (hip_parse_I2(buff, &hip_a, my_host_id, src, dst) < 0)
+  /* adopt the new hip_assoc now */
+  if (hip_a_existing)
     {
-      log_(WARN, "Error while processing I2, dropping.\n");
-      /* stay in same state here */
-      return(-1);
+      log_(NORM, "Replacing old association.\n");
     }
+  if (!(hip_a = adopt_hip_assoc(hip_a_existing, job->hip_a)))
+    {
+      log_(WARN, "Unable to create a HIP association "
+           "while receiving I2.\n");
+      hip_I2_free(job);
+      return;
+    }
+  job->hip_a = NULL;
 
   clear_retransmissions(hip_a);
   make_address_active(&hip_a->peer_hi->addrs);
   add_other_addresses_to_hi(hip_a->hi, TRUE);
   /* Need to send an SPI to peer */
   hip_a->spi_in = get_next_spi();
+  hip_assoc_index(hip_a);
   /* build R2 and Responder's SA */
   if ((err = hip_send_R2(hip_a)) > 0)
     {
@@ -1788,7 +1800,124 @@ int hip_handle_I2(__u8 *buff, hip_assoc *hip_a_existing,
     {
       log_(NORM, "Failed to send R2: %s.\n", strerror(errno));
     }
-  return(err);
+  hip_I2_free(job);
+}
+
+int hip_handle_I2(__u8 *buff, hip_assoc *hip_a_existing,
+                  struct sockaddr *src, struct sockaddr *dst)
+{
+  hi_node *my_host_id = NULL;
+  hip_crypto_job *job;
+  struct timeval time1;
+  hiphdr *hiph;
+  int len;
+
+  /* Accept I2 in all states but E_FAILED.
+   * Special treatment when in ESTABLISHED. */
+  if (hip_a_existing && (hip_a_existing->state == E_FAILED))
+    {
+      log_(NORM, "HIP_I2 packet not accepted in state=%d.\n",
+           hip_a_existing->state);
+      return(-1);
+    }
+  hiph = (hiphdr*) buff;
+
+  /*
+   * Is this my HIT?  If so, get corresponding HI. If not, fail
+   */
+  if ((my_host_id = check_if_my_hit(&hiph->hit_rcvr)) == NULL)
+    {
+      log_(NORM, "Received I2 with a recv. HIT that is not mine.\n");
+      return(-1);
+    }
+
+  /*
+   * Retransmit R2 if in state R2_SENT and this is a similar
+   * I2 to the one that triggered moving to R2_SENT
+   */
+  if (hip_a_existing && (hip_a_existing->state == R2_SENT))
+    {
+      /* XXX should we instead process, then send R2? */
+      if ((hip_a_existing->rexmt_cache.packet != NULL) &&
+          (hip_a_existing->rexmt_cache.retransmits <
+           HCNF.max_retries) && (0 == OPT.no_retransmit) &&
+          (last_I2_spi == ntohl(
+             ((tlv_esp_info*)&buff[sizeof(hiphdr)])->new_spi )))
+        {
+          log_(NORM, "Received I2 in R2_SENT, retransmitting ");
+          log_(NORM, "R2...\n");
+          hip_retransmit(hip_a_existing,
+                         hip_a_existing->rexmt_cache.packet,
+                         hip_a_existing->rexmt_cache.len,
+                         dst, src);
+          gettimeofday(&time1, NULL);
+          hip_a_existing->rexmt_cache.xmit_time.tv_sec
+            = time1.tv_sec;
+          hip_a_existing->rexmt_cache.xmit_time.tv_usec
+            = time1.tv_usec;
+          hip_a_existing->rexmt_cache.retransmits++;
+          set_state(hip_a_existing, R2_SENT);               /* update time */
+          return(0);
+        }
+      /* If we get here, then we already have SAs that need to be
+       * dropped because we are in R2_SENT, but this is a new I2
+       * packet from a new HIP exchange. So we simply rush our
+       * R2_SENT timer to become ESTABLISHED now.
+       */
+      log_(NORM, "Moving from state R2_SENT=>ESTABLISHED because ");
+      log_(NORM, "a new HIP association requested.\n");
+      set_state(hip_a_existing, ESTABLISHED);
+      /* Compare HITs in state I2_SENT
+       */
+    }
+  else if (hip_a_existing && (hip_a_existing->state == I2_SENT))
+    {
+      /* peer HIT larger than my HIT */
+      if (compare_hits(hiph->hit_sndr, hiph->hit_rcvr) > 0)
+        {
+          log_(NORMT, "Dropping I2 in state I2_SENT because ");
+          log_(NORM, "local HIT is smaller than peer HIT.\n");
+          return(0);
+        }
+      /* local HIT is greater than peer HIT, send R2... */
+    }
+
+  /* the peer may retransmit while its first I2 is being verified */
+  if (hip_crypto_find(hiph->hit_sndr, hiph->hit_rcvr))
+    {
+      log_(NORM, "Already verifying an I2 from this HIT, dropping.\n");
+      return(0);
+    }
+
+  /*
+   * Check the puzzle here, and leave the expensive crypto to
+   * hip_verify_I2() on a crypto worker
+   */
+  len = (hiph->hdr_len + 1) * 8;
+  if (!(job = (hip_crypto_job*) calloc(1, sizeof(hip_crypto_job))) ||
+      !(job->data = malloc(len)))
+    {
+      log_(WARN, "hip_handle_I2() malloc() error\n");
+      free(job);
+      return(-1);
+    }
+  memcpy(job->data, buff, len);
+  memcpy(&job->src, src, SALEN(src));
+  memcpy(&job->dst, dst, SALEN(dst));
+  job->work = hip_I2_work;
+  job->finish = hip_I2_finish;
+  if (hip_parse_I2(job, my_host_id) < 0)
+    {
+      log_(WARN, "Error while processing I2, dropping.\n");
+      hip_I2_free(job);
+      return(-1);
+    }
+  if (hip_crypto_submit(job) < 0)
+    {
+      hip_I2_free(job);
+      return(-1);
+    }
+  return(0);
 }
 
 /*
@@ -1920,7 +2049,8 @@ int hip_parse_R2(__u8 *data, hip_assoc *hip_a)
           hiph->hdr_len = (len / 8) - 1;
           if (validate_signature(data, len, tlv,
                                  hip_a->peer_hi->dsa,
-                                 hip_a->peer_hi->rsa) < 0)
+                                 hip_a->peer_hi->rsa,
+                                 hip_a->peer_hi->ecdsa) < 0)
             {
               log_(WARN, "Invalid signature.\n");
               hip_send_notify(hip_a,
@@ -1933,6 +2063,7 @@ int hip_parse_R2(__u8 *data, hip_assoc *hip_a)
             }
           /* packet is OK, accept SPI and keymat index */
           hip_a->spi_out = proposed_spi_out;
+          hip_assoc_index(hip_a);
           if (proposed_keymat_index > hip_a->keymat_index)
             {
               hip_a->keymat_index = proposed_keymat_index;
@@ -2163,7 +2294,8 @@ int hip_parse_update(const __u8 *data, hip_assoc *hip_a, struct rekey_info *rk,
           hiph->hdr_len = (len / 8) - 1;
           if (validate_signature(data, len, tlv,
                                  hip_a->peer_hi->dsa,
-                                 hip_a->peer_hi->rsa) < 0)
+                                 hip_a->peer_hi->rsa,
+                                 hip_a->peer_hi->ecdsa) < 0)
             {
               log_(WARN, "Invalid signature.\n");
               hip_send_notify(hip_a,
@@ -2317,10 +2449,8 @@ int hip_parse_update(const __u8 *data, hip_assoc *hip_a, struct rekey_info *rk,
                   return(-1);
                 }
             }
-          /* Save the DH context in rk->dh for later use */
-          rk->dh = DH_new();
-          if (handle_dh(NULL, &data[location], &g_id,
-                        rk->dh) < 0)
+          /* Save the DH context in rk->dh or ec for later use */
+          if (handle_dh(NULL, &data[location], &g_id, rk) < 0)
             {
               return(-1);
             }
@@ -2632,6 +2762,10 @@ int hip_handle_update(__u8 *data, hip_assoc *hip_a, struct sockaddr *src,
         {
           DH_free(hip_a->peer_rekey->dh);
         }
+      if (hip_a->peer_rekey->ec)
+        {
+          EC_KEY_free(hip_a->peer_rekey->ec);
+        }
       memcpy(hip_a->peer_rekey, &rk, sizeof(struct rekey_info));
     }
 
@@ -2762,13 +2896,14 @@ int hip_handle_update(__u8 *data, hip_assoc *hip_a, struct sockaddr *src,
    * cleanup unused structures
    */
   if ((hip_a->rekey) && !hip_a->rekey->need_ack &&
-      !hip_a->rekey->new_spi && !hip_a->rekey->dh)
+      !hip_a->rekey->new_spi && !hip_a->rekey->dh && !hip_a->rekey->ec)
     {
       free(hip_a->rekey);
       hip_a->rekey = NULL;
     }
   if ((hip_a->peer_rekey) && !hip_a->peer_rekey->need_ack &&
-      !hip_a->peer_rekey->new_spi && !hip_a->peer_rekey->dh)
+      !hip_a->peer_rekey->new_spi && !hip_a->peer_rekey->dh &&
+      !hip_a->peer_rekey->ec)
     {
       free(hip_a->peer_rekey);
       hip_a->peer_rekey = NULL;
@@ -2810,7 +2945,7 @@ int handle_update_rekey(hip_assoc *hip_a)
 
         }
       /* We initiated the rekey, which will finish in
-       * hip_handle_state_timeouts()
+       * hip_handle_state_timeout()
        */
       return(need_to_send_update);
     }
@@ -2837,7 +2972,8 @@ int handle_update_rekey(hip_assoc *hip_a)
    * hip_finish_rekey() here because there may be pending
    * expires on the ESP socket.
    *
-   * Thus, defer until hip_handle_state_timeouts()
+   * Thus, defer until hip_handle_state_timeout(), which runs
+   * one second after this packet.
    */
   return(need_to_send_update);
 }
@@ -2973,6 +3109,7 @@ int handle_update_readdress(hip_assoc *hip_a, struct sockaddr **addrcheck)
               hip_a->spi_in = new_spi;
               hip_a->spi_out = new_peer_spi;
             }
+          hip_assoc_index(hip_a);
           /* choose address to verify */
         }
       else if (!hip_a->peer_hi->skip_addrcheck &&
@@ -3072,8 +3209,7 @@ void finish_address_check(hip_assoc *hip_a, __u32 nonce, struct sockaddr *src)
  */
 int hip_finish_rekey(hip_assoc *hip_a, int rebuild)
 {
-  int len, keymat_index, err;
-  unsigned char *dh_secret_key;
+  int keymat_index, err;
 
   /*
    * Rekey from section 8.11.3
@@ -3083,50 +3219,52 @@ int hip_finish_rekey(hip_assoc *hip_a, int rebuild)
    * 1. if new DH from peer or me, generate new keying material
    */
   err = 0;
-  if (hip_a->rekey->dh || hip_a->peer_rekey->dh)
+  if (hip_a->rekey->dh || hip_a->rekey->ec ||
+      hip_a->peer_rekey->dh || hip_a->peer_rekey->ec)
     {
       log_(NORM, "At least one DH found in UPDATE exchange, ");
       log_(NORM, "computing new secret key.\n");
-      if ((hip_a->rekey->dh && hip_a->peer_rekey->dh) &&
+      if ((hip_a->rekey->dh || hip_a->rekey->ec) &&
+          (hip_a->peer_rekey->dh || hip_a->peer_rekey->ec) &&
           (hip_a->rekey->dh_group_id !=
            hip_a->peer_rekey->dh_group_id))
         {
           log_(WARN, "Warning: UPDATE DH group mismatch!\n");
         }
 
-      if (hip_a->rekey->dh)
+      if (hip_a->rekey->dh || hip_a->rekey->ec)
         {
-          unuse_dh_entry(hip_a->dh);
+          unuse_dh_entry(hip_a->dh, hip_a->ec);
           hip_a->dh_group_id = hip_a->rekey->dh_group_id;
           hip_a->dh  = hip_a->rekey->dh;
+          hip_a->ec  = hip_a->rekey->ec;
           hip_a->rekey->dh = NULL;               /* moved to hip_a->dh */
+          hip_a->rekey->ec = NULL;
         }
-      if (hip_a->peer_rekey->dh)
+      if (hip_a->peer_rekey->dh || hip_a->peer_rekey->ec)
         {
+          if (hip_a->peer_dh)
+            {
+              DH_free(hip_a->peer_dh);
+            }
+          if (hip_a->peer_ec)
+            {
+              EC_KEY_free(hip_a->peer_ec);
+            }
           hip_a->peer_dh = hip_a->peer_rekey->dh;
+          hip_a->peer_ec = hip_a->peer_rekey->ec;
           hip_a->peer_rekey->dh = NULL;               /* moved to ->peer_dh*/
+          hip_a->peer_rekey->ec = NULL;
         }
 
       /*
        * compute a new secret key from our dh and peer's pub_key
        * and recompute the keymat
        */
-      dh_secret_key = malloc(DH_size(hip_a->dh));
-      if (!dh_secret_key)
+      if (compute_dh_secret(hip_a) < 0)
         {
-          log_(WARN, "hip_finish_rekey() malloc() error");
           return(-1);
         }
-      memset(dh_secret_key, 0, DH_size(hip_a->dh));
-      len = DH_compute_key(dh_secret_key,
-                           hip_a->peer_dh->pub_key,
-                           hip_a->dh);
-      if (len != DH_size(hip_a->dh))
-        {
-          log_(WARN, "Warning: secret key len = %d, ", len);
-          log_(NORM, "expected %d\n", DH_size(hip_a->dh));
-        }
-      set_secret_key(dh_secret_key, hip_a);
       keymat_index = 0;
       compute_keymat(hip_a);
       /* 2. set new keymat_index to 0, or choose lowest keymat index
@@ -3171,6 +3309,7 @@ int hip_finish_rekey(hip_assoc *hip_a, int rebuild)
                       hip_a, FALSE, TRUE);
       hip_a->spi_out = hip_a->peer_rekey->new_spi;
       hip_a->spi_in = hip_a->rekey->new_spi;
+      hip_assoc_index(hip_a);
       free(hip_a->peer_rekey);
       free(hip_a->rekey);           /* any DH already unused */
       hip_a->peer_rekey = NULL;
@@ -3294,7 +3433,8 @@ int hip_parse_close(const __u8 *data, hip_assoc *hip_a, __u32 *nonce)
           hiph->hdr_len = (len / 8) - 1;
           if (validate_signature(data, len, tlv,
                                  hip_a->peer_hi->dsa,
-                                 hip_a->peer_hi->rsa) < 0)
+                                 hip_a->peer_hi->rsa,
+                                 hip_a->peer_hi->ecdsa) < 0)
             {
               log_(WARN, "Invalid signature.\n");
               hip_send_notify(hip_a,
@@ -3515,7 +3655,8 @@ int hip_parse_notify(__u8 *data,
           hiph->hdr_len = (len / 8) - 1;
           if (validate_signature(data, len, tlv,
                                  hip_a->peer_hi->dsa,
-                                 hip_a->peer_hi->rsa) < 0)
+                                 hip_a->peer_hi->rsa,
+                                 hip_a->peer_hi->ecdsa) < 0)
             {
               log_(WARN, "Invalid signature.\n");
               /* Don't send NOTIFY responding to a NOTIFY
@@ -3722,7 +3863,7 @@ int hip_handle_BOS(__u8 *data, struct sockaddr *src)
   hiph->checksum = 0;
   hiph->hdr_len = (len / 8) - 1;
   if (validate_signature( data, location, tlv, peer_hi->dsa,
-                          peer_hi->rsa) < 0)
+                          peer_hi->rsa, peer_hi->ecdsa) < 0)
     {
       log_(WARN, "Invalid signature in BOS.\n");
       err = -1;
@@ -3757,12 +3898,13 @@ int hip_handle_CER(__u8 *data, hip_assoc *hip_a)
  * out:		Returns 0 if signature is correct, -1 if incorrect or error.
  */
 int validate_signature(const __u8 *data, int data_len, tlv_head *tlv,
-                       DSA *dsa, RSA *rsa)
+                       DSA *dsa, RSA *rsa, EC_KEY *ecdsa)
 {
   int err;
   SHA_CTX c;
   unsigned char md[SHA_DIGEST_LENGTH];
   DSA_SIG dsa_sig;
+  ECDSA_SIG *ecdsa_sig;
   int length, sig_len;
   tlv_hip_sig *sig = (tlv_hip_sig*)tlv;
   __u8 alg;
@@ -3810,6 +3952,23 @@ int validate_signature(const __u8 *data, int data_len, tlv_head *tlv,
             }
         }
       break;
+    case HI_ALG_ECDSA:
+      if (!ecdsa)
+        {
+          log_(WARN, "validate_signature(): ");
+          log_(NORM, "no ECDSA context!\n");
+          return(-1);
+        }
+      /* r and s are read at fixed offsets, so the size is enforced */
+      if (length != (1 + 2 * HIP_ECDSA_SIZE))
+        {
+          log_(WARN, "Invalid ECDSA signature size of %d ",
+               length);
+          log_(NORM, "(should be %d).\n",
+               1 + 2 * HIP_ECDSA_SIZE);
+          return(-1);
+        }
+      break;
     default:
       log_(WARN, "Invalid signature algorithm.\n");
       return(-1);
@@ -3842,6 +4001,19 @@ int validate_signature(const __u8 *data, int data_len, tlv_head *tlv,
       err = RSA_verify(NID_sha1, md, SHA_DIGEST_LENGTH,
                        sig->signature, sig_len, rsa);
       break;
+    case HI_ALG_ECDSA:
+      ecdsa_sig = ECDSA_SIG_new();
+      if (!ecdsa_sig)
+        {
+          err = -1;
+          break;
+        }
+      BN_bin2bn(&sig->signature[0], HIP_ECDSA_SIZE, ecdsa_sig->r);
+      BN_bin2bn(&sig->signature[HIP_ECDSA_SIZE], HIP_ECDSA_SIZE,
+                ecdsa_sig->s);
+      err = ECDSA_do_verify(md, SHA_DIGEST_LENGTH, ecdsa_sig, ecdsa);
+      ECDSA_SIG_free(ecdsa_sig);
+      break;
     default:
       err = -1;
       break;
@@ -3992,13 +4164,18 @@ int handle_transforms(hip_assoc *hip_a, __u16 *transforms, int length, int esp)
     {
       transform_id = ntohs(*transform_id_packet);
 
-      if ((transform_id <= RESERVED) ||
-          (transform_id >= SUITE_ID_MAX))
+      if (!SUITE_ID_SUPPORTED(transform_id))
         {
           log_(WARN, "Ignoring invalid transform (%d).\n",
                transform_id);
           continue;
         }
+      if (!esp && ESP_AEAD(transform_id))
+        {
+          log_(WARN, "Ignoring ESP-only transform (%d) for HIP.\n",
+               transform_id);
+          continue;
+        }
       if ((hip_a->available_transforms >>
            (transform_id + offset)) & 0x1)
         {
@@ -4029,15 +4206,19 @@ int handle_transforms(hip_assoc *hip_a, __u16 *transforms, int length, int esp)
  *
  *
  * Parse a Diffie-Hellman parameter, storing its group ID into g and
- * the public key into hip_a->peer_dh or dh
+ * the public key into hip_a->peer_dh or peer_ec, or into rk when given
  */
-int handle_dh(hip_assoc *hip_a, const __u8 *data, __u8 *g, DH *dh)
+int handle_dh(hip_assoc *hip_a, const __u8 *data, __u8 *g,
+              struct rekey_info *rk)
 {
   __u8 g_id, g_id2;
   int len, len2;
   unsigned char *pub_key, *pub;
   tlv_diffie_hellman *tlv_dh;
   tlv_diffie_hellman_pub_value *pub_val2;
+  DH *dh = NULL;
+  EC_KEY *ec = NULL;
+  EC_POINT *point;
 
   tlv_dh = (tlv_diffie_hellman*) data;
 
@@ -4096,39 +4277,77 @@ int handle_dh(hip_assoc *hip_a, const __u8 *data, __u8 *g, DH *dh)
     }
 decode_dh:
   /* g_id, len, pub are set before this */
-  pub_key = malloc(len);
-  memcpy(pub_key, pub, len);
+  *g = g_id;
+  if (ecdh_curve[g_id] && (len != dhprime_len[g_id]))
+    {
+      log_(WARN, "ECDH public value has wrong length %d.\n", len);
+      return(-1);
+    }
+  /* room for the point format octet of an ECDH value */
+  pub_key = malloc(len + 1);
+  if (!pub_key)
+    {
+      return(-1);
+    }
+  pub_key[0] = POINT_CONVERSION_UNCOMPRESSED;
+  memcpy(&pub_key[1], pub, len);
 
 #ifndef HIP_VPLS
   log_(NORM, "Got DH public value of len %d: 0x", len);
-  print_hex(pub_key, len);
+  print_hex(&pub_key[1], len);
   log_(NORM, "\n");
 #endif
 
-  /* store the public key in hip_a->peer_dh */
-  if (dh == NULL)
+  if (ecdh_curve[g_id])
     {
-      if (hip_a->peer_dh)
+      /* decoding checks that the point is on the curve */
+      ec = EC_KEY_new_by_curve_name(ecdh_curve[g_id]);
+      point = ec ? EC_POINT_new(EC_KEY_get0_group(ec)) : NULL;
+      if (!point ||
+          !EC_POINT_oct2point(EC_KEY_get0_group(ec), point, pub_key,
+                              len + 1, NULL) ||
+          !EC_KEY_set_public_key(ec, point))
         {
-          DH_free(hip_a->peer_dh);
+          log_(WARN, "Invalid ECDH public value for group %d.\n", g_id);
+          EC_POINT_free(point);
+          EC_KEY_free(ec);
+          free(pub_key);
+          return(-1);
         }
-      hip_a->peer_dh = DH_new();
-      hip_a->peer_dh->g = BN_new();
-      BN_set_word(hip_a->peer_dh->g, dhgen[g_id]);
-      hip_a->peer_dh->p = BN_bin2bn(dhprime[g_id],
-                                    dhprime_len[g_id], NULL);
-      hip_a->peer_dh->pub_key = BN_bin2bn(pub_key, len, NULL);
-      /* or return the public key */
+      EC_POINT_free(point);
     }
   else
     {
+      dh = DH_new();
       dh->g = BN_new();
       BN_set_word(dh->g, dhgen[g_id]);
       dh->p = BN_bin2bn(dhprime[g_id], dhprime_len[g_id], NULL);
-      dh->pub_key = BN_bin2bn(pub_key, len, NULL);
+      dh->pub_key = BN_bin2bn(&pub_key[1], len, NULL);
     }
-
   free(pub_key);
+
+  /* store the public key in hip_a->peer_dh or peer_ec */
+  if (rk == NULL)
+    {
+      if (hip_a->peer_dh)
+        {
+          DH_free(hip_a->peer_dh);
+        }
+      if (hip_a->peer_ec)
+        {
+          EC_KEY_free(hip_a->peer_ec);
+        }
+      hip_a->peer_dh = dh;
+      hip_a->peer_ec = ec;
+      /* or return the public key */
+    }
+  else
+    {
+      rk->dh_group_id = g_id;
+      rk->dh = dh;
+      rk->ec = ec;
+    }
+
   return(0);
 }
 
@@ -4167,7 +4386,7 @@ int handle_cert(hip_assoc *hip_a, const __u8 *data)
  *              data  = pointer to start of HI TLV
  *
  * out:		*hi_p is created or modified,
- *              (*hi_p)->dsa or (*hi_p)->rsa must not exist, and is created
+ *              (*hi_p)->dsa, rsa or ecdsa must not exist, and is created
  *              Returns length of HI TLV used, -1 if error.
  *
  * Reads HI TLV into a hi_node structure.
@@ -4540,6 +4759,68 @@ int complete_base_exchange(hip_assoc *hip_a)
   return(err);
 }
 
+/*
+ * replace_sa()
+ *
+ * in:		hip_a = association containing keys and transform
+ *              old_spi = SPI of the SA being replaced
+ *              spi = SPI of the new SA, may equal old_spi
+ *              direction = 1 for incoming, 2 for outgoing
+ *              (remaining arguments as for hip_sadb_add())
+ *
+ * Remove an SA and add its replacement in one SADB transaction, so the ESP
+ * threads see either the old or the new SA. If the old SA is missing or
+ * the new SPI is in use, falls back to a separate delete and add.
+ * Returns 0 on success, negative on error.
+ */
+static int replace_sa(hip_assoc *hip_a, __u32 old_spi, __u32 spi,
+                      int direction,
+                      struct sockaddr *src_hit, struct sockaddr *dst_hit,
+                      struct sockaddr *src, struct sockaddr *dst,
+                      struct sockaddr *src_lsi, struct sockaddr *dst_lsi)
+{
+  hip_sadb_op ops[2];
+  int err = 0, in = (direction == 1);
+
+  memset(ops, 0, sizeof(ops));
+  ops[0].op = SADB_OP_DELETE;
+  ops[0].spi = old_spi;
+  ops[1].op = SADB_OP_ADD;
+  ops[1].spi = spi;
+  ops[1].mode = hip_a->udp ? 3 : 0;
+  ops[1].direction = direction;
+  ops[1].src_hit = src_hit;
+  ops[1].dst_hit = dst_hit;
+  ops[1].src = src;
+  ops[1].dst = dst;
+  ops[1].src_lsi = src_lsi;
+  ops[1].dst_lsi = dst_lsi;
+  ops[1].spinat = hip_a->spi_nat;
+  ops[1].e_key = get_key(hip_a, ESP_ENCRYPTION, in);
+  ops[1].e_type = transform_to_ealg(hip_a->esp_transform);
+  ops[1].e_keylen = enc_key_len(hip_a->esp_transform);
+  ops[1].a_key = get_key(hip_a, ESP_AUTH, in);
+  ops[1].a_type = transform_to_aalg(hip_a->esp_transform);
+  ops[1].a_keylen = auth_key_len(hip_a->esp_transform);
+  ops[1].lifetime = HCNF.sa_lifetime;
+
+  if (hip_sadb_apply(ops, 2) == 0)
+    {
+      return(0);
+    }
+  if (hip_sadb_apply(&ops[0], 1) < 0)
+    {
+      log_(WARN, "Error removing old SA with SPI 0x%x\n", old_spi);
+      err--;
+    }
+  if (hip_sadb_apply(&ops[1], 1) < 0)
+    {
+      log_(WARN, "Error building new SA with SPI 0x%x\n", spi);
+      err--;
+    }
+  return(err);
+}
+
 /*
  * rebuild_sa()
  *
@@ -4601,31 +4882,9 @@ int rebuild_sa(hip_assoc *hip_a, struct sockaddr *newaddr, __u32 newspi,
       dst_new = dst_old;
     }
 
-  if (hip_sadb_delete(spi) < 0)
-    {
-      log_(WARN, "Error removing old SA: %s\n",
-           strerror(errno));
-      err--;
-    }
-
   /* new SPI is used if it is nonzero */
-  if (hip_sadb_add(hip_a->udp ? 3 : 0, direction,
-                   src_hit, dst_hit, src_new, dst_new, src_lsi, dst_lsi,
-                   (newspi > 0) ? newspi : spi,
-                   hip_a->spi_nat,
-                   get_key(hip_a, ESP_ENCRYPTION, in),
-                   transform_to_ealg(hip_a->esp_transform),
-                   enc_key_len(hip_a->esp_transform),
-                   get_key(hip_a, ESP_AUTH, in),
-                   transform_to_aalg(hip_a->esp_transform),
-                   auth_key_len(hip_a->esp_transform),
-                   HCNF.sa_lifetime)
-      < 0)
-    {
-      err = -1;
-      log_(WARN, "Error building new SA: %s.\n",
-           strerror(errno));
-    }
+  err = replace_sa(hip_a, spi, (newspi > 0) ? newspi : spi, direction,
+                   src_hit, dst_hit, src_new, dst_new, src_lsi, dst_lsi);
 
   hip_a->used_bytes_in = 0;
   hip_a->used_bytes_out = 0;
@@ -4672,31 +4931,8 @@ int rebuild_sa_x2(hip_assoc *hip_a, struct sockaddr *src_new,
       dst_lsi = HIPA_DST_LSI(hip_a);
     }
 
-  if (hip_sadb_delete(spi) < 0)
-    {
-      log_(WARN, "Error removing old outgoing SA: %s\n",
-           strerror(errno));
-      err--;
-    }
-
-  if (hip_sadb_add(hip_a->udp ? 3 : 0, direction,
-                   src_hit, dst_hit, src_new, dst_new,
-                   src_lsi, dst_lsi,
-                   (newspi > 0) ? newspi : spi,
-                   hip_a->spi_nat,
-                   get_key(hip_a, ESP_ENCRYPTION, in),
-                   transform_to_ealg(hip_a->esp_transform),
-                   enc_key_len(hip_a->esp_transform),
-                   get_key(hip_a, ESP_AUTH, in),
-                   transform_to_aalg(hip_a->esp_transform),
-                   auth_key_len(hip_a->esp_transform),
-                   HCNF.sa_lifetime)
-      < 0)
-    {
-      log_(WARN, "Error building new outgoing SA: %s\n",
-           strerror(errno));
-      err--;
-    }
+  err = replace_sa(hip_a, spi, (newspi > 0) ? newspi : spi, direction,
+                   src_hit, dst_hit, src_new, dst_new, src_lsi, dst_lsi);
 
   hip_a->used_bytes_in = 0;
   hip_a->used_bytes_out = 0;
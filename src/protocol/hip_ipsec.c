@@ -210,15 +210,19 @@ int delete_associations(hip_assoc *hip_a, __u32 old_spi_in, __u32 old_spi_out)
  * flush_hip_associations()
  *
  * Called on exit to remove HIP associations from the SAD and SPD.
+ * The SAs are removed in one SADB transaction.
  */
 int flush_hip_associations()
 {
-  int i, count = 0;
+  int i, j, count = 0, num_ops = 0;
+  __u32 spis[2];
   hip_assoc *hip_a;
+  hip_sadb_op *ops;
 
+  ops = (hip_sadb_op*)calloc(2 * max_hip_assoc + 1, sizeof(hip_sadb_op));
   for (i = 0; i < max_hip_assoc; i++)
     {
-      hip_a = &hip_assoc_table[i];
+      hip_a = HIP_ASSOC(i);
       switch (hip_a->state)
         {
         case I2_SENT:
@@ -229,13 +233,44 @@ int flush_hip_associations()
                           hip_a, FALSE, TRUE);
           hip_send_close(hip_a, FALSE);
           set_state(hip_a, CLOSED);
-          delete_associations(hip_a, 0, 0);
+          if (!ops)
+            {
+              delete_associations(hip_a, 0, 0);
+              break;
+            }
+          /* SAs are not built until the base exchange completes */
+          spis[0] = hip_a->spi_out;
+          spis[1] = hip_a->spi_in;
+          for (j = 0; j < 2; j++)
+            {
+              if (hip_sadb_lookup_spi(spis[j]))
+                {
+                  ops[num_ops].op = SADB_OP_DELETE;
+                  ops[num_ops++].spi = spis[j];
+                }
+            }
+#ifdef __MACOSX__
+          if (hip_a->ipfw_rule > 0)
+            {
+              log_(WARN, "deleting divert rule...\n");
+              del_divert_rule(hip_a->ipfw_rule);
+              hip_a->ipfw_rule = 0;
+            }
+#endif
           break;
         default:
           break;
         }
     }
 
+  if (ops)
+    {
+      if (hip_sadb_apply(ops, num_ops) < 0)
+        {
+          log_(WARN, "Error removing %d SAs\n", num_ops);
+        }
+      free(ops);
+    }
   return(count);
 }
 
@@ -290,6 +325,9 @@ void hip_handle_esp(char *data, int length)
           start_loss_multihoming(&data[sizeof(espmsg)], len);
         }
       break;
+    case ESP_ICMP_PARAMPROB:
+      start_icmp_update(ntohl(msg->message_data));
+      break;
     default:
       log_(WARN, "unknown data received from the ESP thread: %d\n",
            msg->message_type);
@@ -394,6 +432,7 @@ void start_base_exchange(struct sockaddr *dst)
   memcpy(HIPA_DST(hip_a), dst, SALEN(dst));
   memcpy(&(hip_a->peer_hi->hit), hiph.hit_sndr, sizeof(hip_hit));
   add_other_addresses_to_hi(hip_a->peer_hi, FALSE);
+  hip_assoc_index(hip_a);
 
   /* use HIP over UDP unless disabled in conf file */
   if (!HCNF.disable_udp && (dst->sa_family == AF_INET))
@@ -662,6 +701,37 @@ void start_expire(__u32 spi)
     }
 }
 
+/*
+ * start_icmp_update()
+ *
+ * An ICMP Parameter Problem was received for ESP packets sent with the
+ * given outgoing SPI; send an UPDATE address check to the peer.
+ */
+void start_icmp_update(__u32 spi)
+{
+  hip_assoc *hip_a = find_hip_association_by_spi(spi, 2);
+  sockaddr_list *l;
+  struct timeval now;
+  __u32 nonce;
+
+  if (!hip_a || (hip_a->icmp_update_status != ICMP_UPDATE_UNSET))
+    {
+      return;
+    }
+  /* perform UPDATE address check */
+  l = &hip_a->peer_hi->addrs;
+  gettimeofday(&now, NULL);
+  hip_a->icmp_update_status = ICMP_UPDATE_TRIGGERED;
+  hip_a->rekey = malloc(sizeof(struct rekey_info));
+  memset(hip_a->rekey, 0, sizeof(struct rekey_info));
+  hip_a->rekey->update_id = hip_a->hi->update_id++;
+  hip_a->rekey->need_ack = TRUE;
+  hip_a->rekey->rk_time.tv_sec = now.tv_sec;
+  RAND_bytes((__u8*)&nonce, sizeof(__u32));
+  l->nonce = nonce;
+  hip_send_update(hip_a, NULL, NULL, SA(&l->addr));
+}
+
 /*
  * receive_udp_hip_packet
  *
@@ -852,6 +922,7 @@ int multihoming_update(hip_assoc *hip_a, struct sockaddr *dst)
       hip_a->mh->mh_last_loss.tv_sec = hip_a->mh->mh_time.tv_sec;
       hip_a->mh->mh_last_loss.tv_usec = hip_a->mh->mh_time.tv_usec;
       memcpy(&hip_a->mh->mh_addr, dst, SALEN(dst));
+      hip_assoc_wakeup(hip_a);
       return(0);
     }
   if (dst)
@@ -873,72 +944,72 @@ int multihoming_update(hip_assoc *hip_a, struct sockaddr *dst)
   return(1);
 }
 
-void hip_handle_multihoming_timeouts(struct timeval *now)
+/*
+ * hip_handle_multihoming_timeout()
+ *
+ * Stop multihoming after 30 seconds without a loss report, or switch to
+ * another locator after 120 seconds of continued loss.
+ */
+void hip_handle_multihoming_timeout(hip_assoc *hip_a, struct timeval *now)
 {
-  int i, if_index, err;
-  hip_assoc *hip_a;
+  int if_index, err;
   __u8 loss_locator[24];       /* 32-bit loss count, 32-bit SPI,
                                 *  128-bit IPv6/IPv4-in-IPv6 address */
   struct sockaddr_storage dst2;
   sockaddr_list *l;
 
-  for (i = 0; i < max_hip_assoc; i++)
+  if (!hip_a->mh || (hip_a->state == 0))
     {
-      hip_a = &hip_assoc_table[i];
-      if (!hip_a->mh || (hip_a->state == 0))
-        {
-          continue;
-        }
-      /* no loss report for 30 seconds, stop multihoming */
-      if (TDIFF(*now, hip_a->mh->mh_last_loss) > 30)
+      return;
+    }
+  /* no loss report for 30 seconds, stop multihoming */
+  if (TDIFF(*now, hip_a->mh->mh_last_loss) > 30)
+    {
+      log_(NORM, "Notifying peer of no loss for SPI 0x%x "
+           "address %s.\n",
+           hip_a->spi_in, logaddr(SA(&hip_a->mh->mh_addr)));
+      memset(loss_locator, 0, 4);
+      build_spi_locator(&loss_locator[4],
+                        htonl(hip_a->spi_in),
+                        SA(&hip_a->mh->mh_addr));
+      hip_send_notify(hip_a, NOTIFY_LOSS_DETECT,
+                      loss_locator, sizeof(loss_locator));
+      memset(hip_a->mh, 0, sizeof(*hip_a->mh));
+      free(hip_a->mh);
+      hip_a->mh = NULL;
+      /* loss report within the last 30 seconds, check total
+       * time
+       * spent multihoming */
+    }
+  else if (TDIFF(*now, hip_a->mh->mh_time) > 120)
+    {
+      log_(NORM, "Continued loss for SPI 0x%x address %s, "
+           "choosing new preferred locator.\n", hip_a->spi_in,
+           logaddr(SA(&hip_a->mh->mh_addr)));
+      /* prevent reaching this point rapidly/repeatedly */
+      hip_a->mh->mh_time.tv_sec = now->tv_sec;
+      /* stop multihoming and switch to another address */
+      err = get_other_addr_from_list(&hip_a->peer_hi->addrs,
+                                     SA(
+                                       &hip_a->mh->
+                                       mh_addr),
+                                     SA(&dst2));
+      if (err < 0)
         {
-          log_(NORM, "Notifying peer of no loss for SPI 0x%x "
-               "address %s.\n",
-               hip_a->spi_in, logaddr(SA(&hip_a->mh->mh_addr)));
-          memset(loss_locator, 0, 4);
-          build_spi_locator(&loss_locator[4],
-                            htonl(hip_a->spi_in),
-                            SA(&hip_a->mh->mh_addr));
-          hip_send_notify(hip_a, NOTIFY_LOSS_DETECT,
-                          loss_locator, sizeof(loss_locator));
-          memset(hip_a->mh, 0, sizeof(*hip_a->mh));
-          free(hip_a->mh);
-          hip_a->mh = NULL;
-          /* loss report within the last 30 seconds, check total
-           * time
-           * spent multihoming */
+          log_(WARN, "No other locator found for SPI "
+               "0x%x!\n", hip_a->spi_in);
+          return;
         }
-      else if (TDIFF(*now, hip_a->mh->mh_time) > 120)
+      if_index = 0;
+      for (l = &hip_a->peer_hi->addrs; l; l = l->next)
         {
-          log_(NORM, "Continued loss for SPI 0x%x address %s, "
-               "choosing new preferred locator.\n", hip_a->spi_in,
-               logaddr(SA(&hip_a->mh->mh_addr)));
-          /* prevent reaching this point rapidly/repeatedly */
-          hip_a->mh->mh_time.tv_sec = now->tv_sec;
-          /* stop multihoming and switch to another address */
-          err = get_other_addr_from_list(&hip_a->peer_hi->addrs,
-                                         SA(
-                                           &hip_a->mh->
-                                           mh_addr),
-                                         SA(&dst2));
-          if (err < 0)
+          if ((l->addr.ss_family == dst2.ss_family) &&
+              (!memcmp(SA2IP(&l->addr), SA2IP(&dst2),
+                       SAIPLEN(&dst2))))
             {
-              log_(WARN, "No other locator found for SPI "
-                   "0x%x!\n", hip_a->spi_in);
-              continue;
+              if_index = l->if_index;
             }
-          if_index = 0;
-          for (l = &hip_a->peer_hi->addrs; l; l = l->next)
-            {
-              if ((l->addr.ss_family == dst2.ss_family) &&
-                  (!memcmp(SA2IP(&l->addr), SA2IP(&dst2),
-                           SAIPLEN(&dst2))))
-                {
-                  if_index = l->if_index;
-                }
-            }
-          readdress_association(hip_a, SA(&dst2), if_index);
         }
+      readdress_association(hip_a, SA(&dst2), if_index);
     }
 }
-
@@ -35,6 +35,7 @@
 #include <openssl/sha.h>
 #include <openssl/des.h> /* DES_KEY_SZ == 8 bytes*/
 #include <openssl/dsa.h>
+#include <openssl/ecdh.h>
 #include <hip/hip_types.h>
 #include <hip/hip_proto.h>
 #include <hip/hip_globals.h>
@@ -53,6 +54,75 @@
  * 5 responder AUTH key (20 bytes (SHA))
  */
 
+/*
+ * dh_secret_size()
+ *
+ * in:		group_id = DH group
+ * out:		length of the shared secret for that group; the x coordinate
+ *              for ECDH groups, the size of the prime for MODP groups
+ */
+int dh_secret_size(__u8 group_id)
+{
+  if (ecdh_curve[group_id])
+    {
+      return(dhprime_len[group_id] / 2);
+    }
+  return(dhprime_len[group_id]);
+}
+
+/*
+ * compute_dh_secret()
+ *
+ * in:		hip_a = association with our key in dh or ec, and the peer's
+ *                      public value in peer_dh or peer_ec
+ * out:		Returns 0 on success, -1 on error.
+ *
+ * Compute the Diffie-Hellman secret Kij and store it in hip_a->dh_secret.
+ */
+int compute_dh_secret(hip_assoc *hip_a)
+{
+  unsigned char *dh_secret_key;
+  int len, size = dh_secret_size(hip_a->dh_group_id);
+
+  if (hip_a->ec ? !hip_a->peer_ec : (!hip_a->dh || !hip_a->peer_dh))
+    {
+      log_(WARN, "Missing DH value for group %d.\n", hip_a->dh_group_id);
+      return(-1);
+    }
+  dh_secret_key = malloc(size);
+  if (!dh_secret_key)
+    {
+      log_(WARN, "compute_dh_secret() malloc() error");
+      return(-1);
+    }
+  memset(dh_secret_key, 0, size);
+  if (hip_a->ec)
+    {
+      len = ECDH_compute_key(dh_secret_key, size,
+                             EC_KEY_get0_public_key(hip_a->peer_ec),
+                             hip_a->ec, NULL);
+    }
+  else
+    {
+      len = DH_compute_key(dh_secret_key, hip_a->peer_dh->pub_key,
+                           hip_a->dh);
+    }
+  if (len < 0)
+    {
+      log_(WARN, "Diffie-Hellman secret computation failed.\n");
+      free(dh_secret_key);
+      return(-1);
+    }
+  else if (len != size)
+    {
+      log_(NORM, "Warning: secret key len = %d, ", len);
+      log_(NORM, "expected %d\n", size);
+    }
+  /* Do not free(dh_secret_key), which is now hip_a->dh_secret */
+  set_secret_key(dh_secret_key, hip_a);
+  return(0);
+}
+
 /*
  * This function takes a Diffie Hellman computed key as binary input and
  * stores it in the hip_a->keymat
@@ -68,7 +138,7 @@ int set_secret_key(unsigned char *key, hip_assoc *hip_a)
       return(-1);
     }
 
-  keylen = DH_size(hip_a->dh);
+  keylen = dh_secret_size(hip_a->dh_group_id);
   if (hip_a->dh_secret)
     {
       free(hip_a->dh_secret);
@@ -173,7 +243,7 @@ int compute_keymat(hip_assoc *hip_a)
   result = BN_ucmp(hit1, hit2);
 
   /* Kij */
-  dh_secret_len = DH_size(hip_a->dh);
+  dh_secret_len = dh_secret_size(hip_a->dh_group_id);
   hashdata_len = dh_secret_len + (2 * HIT_SIZE) + (2 * sizeof(__u64)) + 1;
   hashdata = malloc(hashdata_len);
   memcpy(hashdata, hip_a->dh_secret, dh_secret_len);
@@ -384,6 +454,8 @@ int auth_key_len(int suite_id)
     case ESP_3DES_CBC_HMAC_MD5:
     case ESP_NULL_HMAC_MD5:
       return(KEY_LEN_MD5);
+    case ESP_AES128_GCM:                /* GCM has integrated auth */
+      return(KEY_LEN_NULL);
     default:
       break;
     }
@@ -404,6 +476,8 @@ int enc_key_len(int suite_id)
     case ESP_NULL_HMAC_SHA1:
     case ESP_NULL_HMAC_MD5:
       return(KEY_LEN_NULL);
+    case ESP_AES128_GCM:
+      return(KEY_LEN_AES128_GCM);
     default:
       break;
     }
@@ -419,6 +493,7 @@ int enc_iv_len(int suite_id)
     case ESP_3DES_CBC_HMAC_SHA1:
     case ESP_3DES_CBC_HMAC_MD5:
     case ESP_BLOWFISH_CBC_HMAC_SHA1:
+    case ESP_AES128_GCM:
       return(8);                /* 64-bit IV */
     case ESP_NULL_HMAC_SHA1:
     case ESP_NULL_HMAC_MD5:
@@ -443,6 +518,8 @@ int transform_to_ealg(int transform)
     case ESP_NULL_HMAC_SHA1:                    /* NULL enc */
     case ESP_NULL_HMAC_MD5:
       return(SADB_EALG_NULL);
+    case ESP_AES128_GCM:                        /* AES-GCM AEAD */
+      return(SADB_X_EALG_AES_GCM_ICV16);
     default:
       return(0);
     }
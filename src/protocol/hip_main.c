@@ -100,11 +100,15 @@ void hip_handle_packet(__u8* buff, int length, struct sockaddr *src);
 #else
 void hip_handle_packet(struct msghdr *msg, int length, __u16 family);
 #endif
-void hip_handle_state_timeouts(struct timeval *time1);
+void hip_handle_state_timeout(hip_assoc *hip_a, struct timeval *time1);
 void hip_handle_locator_state_timeouts(hip_assoc *hip_a, struct timeval *time1);
-void hip_handle_registrations(struct timeval *time1);
+void hip_handle_registration_timeout(hip_assoc *hip_a, struct timeval *time1);
 void hip_check_next_rvs(hip_assoc *hip_a);
-static void hip_retransmit_waiting_packets(struct timeval *time1);
+static void hip_retransmit_waiting_packet(hip_assoc *hip_a,
+                                          struct timeval *time1);
+static void hip_assoc_timeout(hip_timer *t, struct timeval *now);
+static void hip_assoc_schedule(hip_assoc *hip_a, struct timeval *now);
+static void hip_housekeeping(hip_timer *t, struct timeval *now);
 int hip_trigger(struct sockaddr *dst);
 int hip_trigger_rvs(struct sockaddr*rvs, hip_hit *responder);
 
@@ -115,6 +119,18 @@ void post_init_tap();
 void endbox_init();
 #endif
 
+/* seconds between runs of hip_housekeeping(), also the longest select() */
+#define HIP_HOUSEKEEPING_INTERVAL 5
+
+/*
+ * Timers of the HIP associations and of the housekeeping; only used by
+ * the main thread.
+ */
+static hip_timer_wheel hip_timers;
+static hip_timer hip_housekeeping_timer;
+static int last_expire = 0;
+static int need_select_preferred = FALSE;
+
 /*
  * main():  HIP daemon main event loop
  *     - read command line options
@@ -148,15 +164,11 @@ int main_loop(int argc, char **argv)
 #endif
   int num_icmp_errors = 0;
   int highest_descriptor = 0;
-  int flags = 0, err = 0, length = 0, last_expire = 0, i;
-  int need_select_preferred = FALSE;
+  int flags = 0, err = 0, length = 0, i, next_ms;
 #ifdef HIP_VPLS
   time_t last_time, now_time;
 #endif
 
-  /* Initializing global variables */
-  memset(hip_assoc_table, 0, sizeof(hip_assoc_table));
-
   /*
    * Set default options
    * later modified by command-line parameters
@@ -180,6 +192,8 @@ int main_loop(int argc, char **argv)
    */
   memset(&HCNF, 0, sizeof(struct hip_conf));
   HCNF.cookie_difficulty = 10;
+  HCNF.cookie_difficulty_max = 0;
+  HCNF.cookie_adapt_rate = 100;
   HCNF.cookie_lifetime = 39;       /* 2^(39-32) = 2^7 = 128 seconds */
   HCNF.packet_timeout = 5;
   HCNF.max_retries = 5;
@@ -189,15 +203,28 @@ int main_loop(int argc, char **argv)
   HCNF.send_hi_name = TRUE;
   HCNF.dh_group = DEFAULT_DH_GROUP_ID;
   HCNF.dh_lifetime = 900;
+  HCNF.dh_pool_low = 2;
+  HCNF.dh_pool_high = 8;
   HCNF.r1_lifetime = 300;
+  HCNF.r1_cache_size = 8;
   HCNF.msl = 5;
   HCNF.ual = 600;
   HCNF.failure_timeout = (HCNF.max_retries * HCNF.packet_timeout);
   HCNF.icmp_timeout = 0;
-  for (i = 0; i < (SUITE_ID_MAX - 1); i++)
+  HCNF.esp_queues = 1;
+  HCNF.esp_tap_socketpair = FALSE;
+  HCNF.esp_batch = 1;
+  HCNF.esp_replay_window = 1024;
+  HCNF.esp_iv_counter = TRUE;
+  HCNF.crypto_workers = 2;
+  HCNF.puzzle_threads = 0;
+  for (i = 0; i < ESP_NULL_HMAC_MD5; i++)
     {
       HCNF.esp_transforms[i] = HCNF.hip_transforms[i] = (__u16)(i + 1);
     }
+#ifdef HIP_ESP_AES_GCM
+  HCNF.esp_transforms[i] = ESP_AES128_GCM;      /* no AEAD suites for HIP */
+#endif
   HCNF.log_filename = NULL;
   HCNF.disable_dns_lookups = FALSE;
   HCNF.disable_notify = FALSE;
@@ -394,6 +421,7 @@ int main_loop(int argc, char **argv)
       log_(NORM, "Using configuration file:\t%s\n",
            HCNF.conf_filename);
     }
+  g_conf_loaded = TRUE;       /* defaults or file, init_hip() waits for this */
 
   /*
    * Load the my_host_identities.xml file.
@@ -508,11 +536,22 @@ int main_loop(int argc, char **argv)
 #ifndef __WIN32__
   hip_mr_set_external_ifs();
 #endif /* !__WIN32__ */
+  if (hip_crypto_init(HCNF.crypto_workers) < 0)
+    {
+      log_(WARN, "No crypto workers, all crypto is done by hipd.\n");
+    }
   /* Precompute R1s, cookies, DH material */
   init_dh_cache();
-  init_all_R1_caches();
+  if (init_all_R1_caches() < 0)
+    {
+      log_(ERR, "Unable to precompute R1s.\n");
+      goto hip_main_error_exit;
+    }
   gettimeofday(&time1, NULL);
   last_expire = time1.tv_sec;
+  hip_timer_wheel_init(&hip_timers, &time1);
+  hip_timer_init(&hip_housekeeping_timer, hip_housekeeping);
+  hip_timer_add(&hip_timers, &hip_housekeeping_timer, &time1);
   hip_dht_update_my_entries(1);       /* initalize and publish */
 #ifndef __WIN32__
   post_init_tap();
@@ -585,6 +624,10 @@ int main_loop(int argc, char **argv)
 #else /* IPV6_HIP */
   highest_descriptor = maxof(4, espsp[1], s_hip, s_net, s_stat);
 #endif /* IPV6_HIP */
+  if (hip_crypto_fd() > highest_descriptor)
+    {
+      highest_descriptor = hip_crypto_fd();
+    }
 
   log_(NORMT, "Listening for HIP control packets...\n");
 
@@ -613,8 +656,22 @@ int main_loop(int argc, char **argv)
       FD_SET((unsigned)espsp[1], &read_fdset);
       FD_SET((unsigned)s_net, &read_fdset);
       FD_SET((unsigned)s_stat, &read_fdset);
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
+      if (hip_crypto_fd() >= 0)
+        {
+          FD_SET((unsigned)hip_crypto_fd(), &read_fdset);
+        }
+      /* sleep until the next timer is due */
+      gettimeofday(&time1, NULL);
+      next_ms = hip_timer_next(&hip_timers, &time1,
+                               HIP_HOUSEKEEPING_INTERVAL * 1000);
+#ifdef HIP_VPLS
+      if ((HCNF.endbox_heartbeat_time > 0) && (next_ms > 1000))
+        {
+          next_ms = 1000;
+        }
+#endif
+      timeout.tv_sec = next_ms / 1000;
+      timeout.tv_usec = (next_ms % 1000) * 1000;
 
       /* setup message header with control and receive buffers */
 #ifndef __WIN32__
@@ -644,8 +701,18 @@ int main_loop(int argc, char **argv)
 #endif
 
       /* wait for socket activity */
-      if ((err = select((highest_descriptor + 1), &read_fdset,
-                        NULL, NULL, &timeout)) < 0)
+      err = select((highest_descriptor + 1), &read_fdset,
+                   NULL, NULL, &timeout);
+      if ((err > 0) && (hip_crypto_fd() >= 0) &&
+          FD_ISSET(hip_crypto_fd(), &read_fdset))
+        {
+          /* I2s verified by the crypto workers are finished on every
+           * pass, so that busy HIP sockets cannot hold them off */
+          hip_crypto_complete();
+          FD_CLR((unsigned)hip_crypto_fd(), &read_fdset);
+          err--;
+        }
+      if (err < 0)
         {
           /* sometimes select receives interrupt in addition
            * to the hip_exit() signal handler */
@@ -657,41 +724,7 @@ int main_loop(int argc, char **argv)
         }
       else if (err == 0)
         {
-          /* idle cycle - select() timeout */
-          /* retransmit any waiting packets */
-          gettimeofday(&time1, NULL);
-          hip_retransmit_waiting_packets(&time1);
-          hip_handle_state_timeouts(&time1);
-          hip_handle_registrations(&time1);
-          if (OPT.mh)
-            {
-              hip_handle_multihoming_timeouts(&time1);
-            }
-#ifndef __WIN32__       /* cleanup zombie processes from fork() */
-          waitpid(0, &err, WNOHANG);
-#endif
-          /* by default, every 5 minutes */
-          if ((time1.tv_sec - last_expire) >
-              (int)HCNF.r1_lifetime)
-            {
-              last_expire = time1.tv_sec;
-              /* expire old DH contexts */
-              expire_old_dh_entries();
-              /* precompute a new R1 for each HI, and
-               * sometimes pick a new random index for
-               * cookies */
-              replace_next_R1();
-            }
-          if (OPT.trigger)
-            {
-              hip_trigger(OPT.trigger);
-            }
-          if (need_select_preferred)
-            {
-              need_select_preferred = FALSE;
-              select_preferred_address();
-              hip_dht_update_my_entries(0);
-            }
+          /* idle cycle - select() timeout, timers are run below */
         }
       else if (FD_ISSET(s_hip, &read_fdset))
         {
@@ -828,6 +861,10 @@ int main_loop(int argc, char **argv)
                   /* changes to address require new
                    * preferred address */
                   need_select_preferred = TRUE;
+                  gettimeofday(&time1, NULL);
+                  time1.tv_sec++;
+                  hip_timer_reduce(&hip_timers, &hip_housekeeping_timer,
+                                   &time1);
                 }
             }
         }
@@ -859,6 +896,10 @@ int main_loop(int argc, char **argv)
         {
           log_(NORMT, "unknown socket activity.");
         }         /* select */
+
+      /* association timeouts and housekeeping */
+      gettimeofday(&time1, NULL);
+      hip_timer_run(&hip_timers, &time1);
     }     /* end for(;;) */
   return(0);
 hip_main_error_exit:
@@ -1005,6 +1046,7 @@ void hip_handle_packet(struct msghdr *msg, int length, __u16 family)
       if ((hip_a = find_hip_association(src, dst, hiph)))
         {
           memcpy(hip_a->peer_hi->hit, &hit_tmp, sizeof(hip_hit));
+          hip_assoc_index(hip_a);
           add_peer_hit(hit_tmp, src);
         }
       /* put the HIT back so signature will verify */
@@ -1034,12 +1076,14 @@ void hip_handle_packet(struct msghdr *msg, int length, __u16 family)
   switch (hiph->packet_type)
     {
     case HIP_I1:
+      count_puzzle_load(HIP_I1);
       err = hip_handle_I1((__u8 *)hiph, hip_a, src, dst);
       break;
     case HIP_R1:
       err = hip_handle_R1((__u8 *)hiph, hip_a, src);
       break;
     case HIP_I2:
+      count_puzzle_load(HIP_I2);
       err = hip_handle_I2((__u8 *)hiph, hip_a, src, dst);
       break;
     case HIP_R2:
@@ -1071,6 +1115,10 @@ void hip_handle_packet(struct msghdr *msg, int length, __u16 family)
       log_(NORMT, "Error with %s packet from %s\n",
            typestr, logaddr(src));
     }
+  if (hip_a && hip_a->allocated)
+    {
+      hip_assoc_wakeup(hip_a);
+    }
   return;
 }
 
@@ -1155,98 +1203,92 @@ hip_check_next_rvs(hip_assoc *hip_a)
 }
 
 /*
- * Iterate among HIP connections and retransmit packets if needed,
- * or free them if they have reached HCNF.max_retries
+ * Retransmit the waiting packet of a HIP connection if needed,
+ * or free it if it has reached HCNF.max_retries
  */
-void
-hip_retransmit_waiting_packets(struct timeval* time1)
+static void
+hip_retransmit_waiting_packet(hip_assoc *hip_a, struct timeval* time1)
 {
-  int i;
 #ifdef DO_EXTRA_DHT_LOOKUPS
   int err;
   struct sockaddr_storage ss_addr_tmp;
   struct sockaddr *addr_tmp = (struct sockaddr*)&ss_addr_tmp;
 #endif
   struct sockaddr *src, *dst;
-  hip_assoc *hip_a;
   hiphdr *hiph;
   char typestr[12];
   int offset;
 
-  for (i = 0; i < max_hip_assoc; i++)
-    {
-      hip_a = &hip_assoc_table[i];
 #ifndef __WIN32__
-      /* retransmit UPDATE-PROXY packets for mobile router clients
-       * that have registered and are ESTABLISHED */
-      if (OPT.mr && (hip_a->state == ESTABLISHED))
-        {
-          hip_mr_retransmit(time1, hip_a->peer_hi->hit);
-        }
+  /* retransmit UPDATE-PROXY packets for mobile router clients
+   * that have registered and are ESTABLISHED */
+  if (OPT.mr && (hip_a->state == ESTABLISHED))
+    {
+      hip_mr_retransmit(time1, hip_a->peer_hi->hit);
+    }
 #endif /* !__WIN32__ */
-      if ((hip_a->rexmt_cache.len < 1) ||
-          (TDIFF(*time1, hip_a->rexmt_cache.xmit_time) <=
-           (int)HCNF.packet_timeout))
-        {
-          continue;
-        }
+  if ((hip_a->rexmt_cache.len < 1) ||
+      (TDIFF(*time1, hip_a->rexmt_cache.xmit_time) <=
+       (int)HCNF.packet_timeout))
+    {
+      return;
+    }
 
-      /* See if a RVS is available */
-      if ((hip_a->rexmt_cache.retransmits >=
-           (int)HCNF.max_retries))
+  /* See if a RVS is available */
+  if ((hip_a->rexmt_cache.retransmits >=
+       (int)HCNF.max_retries))
+    {
+      hip_check_next_rvs(hip_a);
+    }
+
+  if ((OPT.no_retransmit == FALSE) &&
+      (hip_a->rexmt_cache.retransmits < (int)HCNF.max_retries) &&
+      (hip_a->state != R2_SENT))
+    {
+      src = SA(&hip_a->hi->addrs.addr);
+      dst = SA(&hip_a->rexmt_cache.dst);
+      if ((src->sa_family != dst->sa_family) &&
+          (get_addr_from_list(my_addr_head,
+                              dst->sa_family, src) < 0))
         {
-          hip_check_next_rvs(hip_a);
+          log_(WARN,
+               "Cannot determine source address for"
+               " retransmission to %s.\n",
+               logaddr(dst));
         }
-
-      if ((OPT.no_retransmit == FALSE) &&
-          (hip_a->rexmt_cache.retransmits < (int)HCNF.max_retries) &&
-          (hip_a->state != R2_SENT))
+      offset = 0;
+      if (hip_a->udp)
         {
-          src = SA(&hip_a->hi->addrs.addr);
-          dst = SA(&hip_a->rexmt_cache.dst);
-          if ((src->sa_family != dst->sa_family) &&
-              (get_addr_from_list(my_addr_head,
-                                  dst->sa_family, src) < 0))
-            {
-              log_(WARN,
-                   "Cannot determine source address for"
-                   " retransmission to %s.\n",
-                   logaddr(dst));
-            }
-          offset = 0;
-          if (hip_a->udp)
-            {
-              offset += sizeof(udphdr) + sizeof(__u32);
-            }
-          hiph = (hiphdr*) &hip_a->rexmt_cache.packet[offset];
-          /* TODO: the address may have changed, could
-           * perform a DHT lookup here and retransmit using the
-           * different address. */
-          hip_packet_type(hiph->packet_type, typestr);
-          log_(NORMT, "Retransmitting %s packet from %s to ",
-               typestr, logaddr(src));
-          log_(NORM,  "%s (attempt %d of %d)...\n", logaddr(dst),
-               hip_a->rexmt_cache.retransmits + 1,
-               HCNF.max_retries);
-          hip_retransmit(hip_a, hip_a->rexmt_cache.packet,
-                         hip_a->rexmt_cache.len, src, dst);
-          gettimeofday(&hip_a->rexmt_cache.xmit_time, NULL);
-          hip_a->rexmt_cache.retransmits++;
+          offset += sizeof(udphdr) + sizeof(__u32);
         }
-      else
+      hiph = (hiphdr*) &hip_a->rexmt_cache.packet[offset];
+      /* TODO: the address may have changed, could
+       * perform a DHT lookup here and retransmit using the
+       * different address. */
+      hip_packet_type(hiph->packet_type, typestr);
+      log_(NORMT, "Retransmitting %s packet from %s to ",
+           typestr, logaddr(src));
+      log_(NORM,  "%s (attempt %d of %d)...\n", logaddr(dst),
+           hip_a->rexmt_cache.retransmits + 1,
+           HCNF.max_retries);
+      hip_retransmit(hip_a, hip_a->rexmt_cache.packet,
+                     hip_a->rexmt_cache.len, src, dst);
+      gettimeofday(&hip_a->rexmt_cache.xmit_time, NULL);
+      hip_a->rexmt_cache.retransmits++;
+    }
+  else
+    {
+      /* move to state E_FAILED for I1_SENT/I2_SENT */
+      switch (hip_a->state)
         {
-          /* move to state E_FAILED for I1_SENT/I2_SENT */
-          switch (hip_a->state)
-            {
-            case I1_SENT:
-            case I2_SENT:
-              set_state(hip_a, E_FAILED);
-              break;
-            default:
-              break;
-            }
-          clear_retransmissions(hip_a);
+        case I1_SENT:
+        case I2_SENT:
+          set_state(hip_a, E_FAILED);
+          break;
+        default:
+          break;
         }
+      clear_retransmissions(hip_a);
     }
 }
 
@@ -1286,251 +1328,248 @@ int check_reg_info(struct reg_entry *regs, __u8 type, int state,
   return(0);
 }
 
-/* Iterate over HIP connections and handle state timeout.
+/* seconds that an association stays in CLOSING or CLOSED */
+static int hip_close_timeout(hip_assoc *hip_a)
+{
+  return(HCNF.ual + (hip_a->state == CLOSED) ?
+         (int)(2 * HCNF.msl) : (int)HCNF.msl);
+}
+
+/* Handle the state timeout of a HIP connection.
  */
-void hip_handle_state_timeouts(struct timeval *time1)
+void hip_handle_state_timeout(hip_assoc *hip_a, struct timeval *time1)
 {
-  int i, remove_rxmt, do_close, err;
-  hip_assoc *hip_a;
+  int remove_rxmt = FALSE, do_close = FALSE, err;
 
-  for (i = 0; i < max_hip_assoc; i++)
+  switch (hip_a->state)
     {
-      do_close = FALSE;
-      remove_rxmt = FALSE;
-      hip_a = &hip_assoc_table[i];
-      switch (hip_a->state)
+    case R2_SENT:         /* R2 -> ESTABLISHED */
+      if (check_last_used(hip_a, 1, time1) > 0)
         {
-        case R2_SENT:         /* R2 -> ESTABLISHED */
-          if (check_last_used(hip_a, 1, time1) > 0)
+          set_state(hip_a, ESTABLISHED);
+          remove_rxmt = TRUE;
+          log_(NORMT, "HIP association %d moved ", hip_a->slot);
+          log_(NORM,  "from R2_SENT=>ESTABLISHED ");
+          log_(NORM,  "due to incoming ESP data.\n");
+          if (OPT.mh &&
+              (hip_send_update_locators(hip_a) < 0))
             {
-              set_state(hip_a, ESTABLISHED);
-              remove_rxmt = TRUE;
-              log_(NORMT, "HIP association %d moved ", i);
-              log_(NORM,  "from R2_SENT=>ESTABLISHED ");
-              log_(NORM,  "due to incoming ESP data.\n");
-              if (OPT.mh &&
-                  (hip_send_update_locators(hip_a) < 0))
-                {
-                  log_(WARN,
-                       "Failed to send UPDATE with loca"
-                       "tors following incoming data.\n");
-                }
-              /* any packet sent during UAL minutes? */
-            }
-          else if (check_last_used(hip_a, 0, time1) > 0)
-            {
-              /* data being sent, compare time */
-              if (TDIFF(*time1, hip_a->use_time) >
-                  (int)HCNF.ual)
-                {
-                  do_close = TRUE;
-                }
-              /* no packet sent or received, check UAL minutes
-              **/
+              log_(WARN,
+                   "Failed to send UPDATE with loca"
+                   "tors following incoming data.\n");
             }
-          else if (TDIFF(*time1, hip_a->state_time) >
-                   (int)HCNF.ual)
+          /* any packet sent during UAL minutes? */
+        }
+      else if (check_last_used(hip_a, 0, time1) > 0)
+        {
+          /* data being sent, compare time */
+          if (TDIFF(*time1, hip_a->use_time) >
+              (int)HCNF.ual)
             {
               do_close = TRUE;
             }
-          break;
-        case CLOSING:
-        case CLOSED:
-          if (TDIFF(*time1, hip_a->state_time) >
-              (HCNF.ual + (hip_a->state == CLOSED) ?
-               (int)(2 * HCNF.msl) : (int)HCNF.msl))
-            {
-              set_state(hip_a, UNASSOCIATED);
-              log_(NORMT, "HIP association %d moved from", i);
-              log_(NORM, " %s=>UNASSOCIATED\n",
-                   (hip_a->state ==
-                    CLOSED) ? "CLOSED" : "CLOSING");
-              /* max_hip_assoc may decrease here, but this
-               * shouldn't ruin this for loop */
-              free_hip_assoc(hip_a);
-            }
-          break;
-        case E_FAILED:         /* E_FAILED -> UNASSOCIATED */
-          if (TDIFF(*time1, hip_a->state_time) >
-              (int)HCNF.failure_timeout)
-            {
-              set_state(hip_a, UNASSOCIATED);
-              log_(NORMT, "HIP association %d moved from", i);
-              log_(NORM,  " E_FAILED=>UNASSOCIATED\n");
-              free_hip_assoc(hip_a);
-            }
-          break;
-        case ESTABLISHED:
-          /*
-           * If a pending rekey has been completely ACKed and
-           * a NES has been received, we can finish the rekey.
-           */
-          if ((hip_a->rekey) && (!hip_a->rekey->need_ack) &&
-              (hip_a->peer_rekey) &&
-              (hip_a->peer_rekey->new_spi > 0))
-            {
-              hip_finish_rekey(hip_a, TRUE);
-              remove_rxmt = TRUE;
-              /*
-               * Fail rekey using stored creation time
-               */
-            }
-          else if (hip_a->rekey &&
-                   (TDIFF(*time1, hip_a->rekey->rk_time) >
-                    (int)HCNF.failure_timeout))
-            {
-              log_hipa_fromto(QOUT, "Rekey failed (timeout)",
-                              hip_a, TRUE, TRUE);
-              log_(NORMT, "HIP association %d moved from", i);
-              log_(NORM,  " %d=>UNASSOCIATED because of "
-                   "rekey failure.\n", hip_a->state);
-              set_state(hip_a, UNASSOCIATED);
-              delete_associations(hip_a, 0, 0);
-              free_hip_assoc(hip_a);
-              break;
-            }
-          /*
-           * Respond to ICMP Parameter Problem packet again
-           */
-          if (hip_a->icmp_update_status == ICMP_UPDATE_SUCCESSFUL &&
-              (TDIFF(*time1, hip_a->icmp_update_time) >
-               (int)HCNF.icmp_timeout))
-            {
-              hip_a->icmp_update_status = ICMP_UPDATE_UNSET;
-              hip_a->icmp_update_time.tv_sec  = 0;
-              hip_a->icmp_update_time.tv_usec = 0;
-            }
+          /* no packet sent or received, check UAL minutes
+          **/
+        }
+      else if (TDIFF(*time1, hip_a->state_time) >
+               (int)HCNF.ual)
+        {
+          do_close = TRUE;
+        }
+      break;
+    case CLOSING:
+    case CLOSED:
+      if (TDIFF(*time1, hip_a->state_time) > hip_close_timeout(hip_a))
+        {
+          set_state(hip_a, UNASSOCIATED);
+          log_(NORMT, "HIP association %d moved from", hip_a->slot);
+          log_(NORM, " %s=>UNASSOCIATED\n",
+               (hip_a->state ==
+                CLOSED) ? "CLOSED" : "CLOSING");
+          free_hip_assoc(hip_a);
+        }
+      break;
+    case UNASSOCIATED:     /* abandoned before the base exchange */
+      if (hip_a->allocated &&
+          (TDIFF(*time1, hip_a->state_time) >
+           (int)HCNF.failure_timeout))
+        {
+          free_hip_assoc(hip_a);
+        }
+      break;
+    case E_FAILED:         /* E_FAILED -> UNASSOCIATED */
+      if (TDIFF(*time1, hip_a->state_time) >
+          (int)HCNF.failure_timeout)
+        {
+          set_state(hip_a, UNASSOCIATED);
+          log_(NORMT, "HIP association %d moved from", hip_a->slot);
+          log_(NORM,  " E_FAILED=>UNASSOCIATED\n");
+          free_hip_assoc(hip_a);
+        }
+      break;
+    case ESTABLISHED:
+      /*
+       * If a pending rekey has been completely ACKed and
+       * a NES has been received, we can finish the rekey.
+       */
+      if ((hip_a->rekey) && (!hip_a->rekey->need_ack) &&
+          (hip_a->peer_rekey) &&
+          (hip_a->peer_rekey->new_spi > 0))
+        {
+          hip_finish_rekey(hip_a, TRUE);
+          remove_rxmt = TRUE;
           /*
-           * Check last used time
+           * Fail rekey using stored creation time
            */
-          /* don't send SADB_GETs multiple times per second! */
-          if (TDIFF(*time1, hip_a->use_time) < 2)
-            {
-              break;
-            }
-          /* Do not timeout SAs for MR registration */
-          if (check_reg_info(hip_a->regs, REGTYPE_MR, REG_GRANTED,
-                             time1))
-            {
-              hip_a->use_time.tv_sec = time1->tv_sec;
-              hip_a->use_time.tv_usec = time1->tv_usec;
-            }
-          err = check_last_used(hip_a, 1, time1);
-          err += check_last_used(hip_a, 0, time1);
-          /* no use time available, first check state time for UAL
-           * also check the use time because after a rekey,
-           * bytes=0 and check_last_used() will return 0, but it
-           * is not time to expire yet due to use_time */
-          if ((err == 0) &&
-              (TDIFF(*time1,
-                     hip_a->state_time) > (int)HCNF.ual))
+        }
+      else if (hip_a->rekey &&
+               (TDIFF(*time1, hip_a->rekey->rk_time) >
+                (int)HCNF.failure_timeout))
+        {
+          log_hipa_fromto(QOUT, "Rekey failed (timeout)",
+                          hip_a, TRUE, TRUE);
+          log_(NORMT, "HIP association %d moved from", hip_a->slot);
+          log_(NORM,  " %d=>UNASSOCIATED because of "
+               "rekey failure.\n", hip_a->state);
+          set_state(hip_a, UNASSOCIATED);
+          delete_associations(hip_a, 0, 0);
+          free_hip_assoc(hip_a);
+          break;
+        }
+      /*
+       * Respond to ICMP Parameter Problem packet again
+       */
+      if (hip_a->icmp_update_status == ICMP_UPDATE_SUCCESSFUL &&
+          (TDIFF(*time1, hip_a->icmp_update_time) >
+           (int)HCNF.icmp_timeout))
+        {
+          hip_a->icmp_update_status = ICMP_UPDATE_UNSET;
+          hip_a->icmp_update_time.tv_sec  = 0;
+          hip_a->icmp_update_time.tv_usec = 0;
+        }
+      /*
+       * Check last used time
+       */
+      /* don't send SADB_GETs multiple times per second! */
+      if (TDIFF(*time1, hip_a->use_time) < 2)
+        {
+          break;
+        }
+      /* Do not timeout SAs for MR registration */
+      if (check_reg_info(hip_a->regs, REGTYPE_MR, REG_GRANTED,
+                         time1))
+        {
+          hip_a->use_time.tv_sec = time1->tv_sec;
+          hip_a->use_time.tv_usec = time1->tv_usec;
+        }
+      err = check_last_used(hip_a, 1, time1);
+      err += check_last_used(hip_a, 0, time1);
+      /* no use time available, first check state time for UAL
+       * also check the use time because after a rekey,
+       * bytes=0 and check_last_used() will return 0, but it
+       * is not time to expire yet due to use_time */
+      if ((err == 0) &&
+          (TDIFF(*time1,
+                 hip_a->state_time) > (int)HCNF.ual))
+        {
+          /* state time has exceeded UAL */
+          if (hip_a->use_time.tv_sec == 0)
             {
-              /* state time has exceeded UAL */
-              if (hip_a->use_time.tv_sec == 0)
-                {
-                  do_close = TRUE;                       /* no bytes ever sent*/
-                }
-              else if (TDIFF(*time1,hip_a->use_time) >
-                       (int)HCNF.ual)
-                {
-                  do_close = TRUE;                       /* both state time and
-                                                          *  use time have
-                                                          *  exceeded UAL*/
-                }
-              /* last used time is available, check for UAL */
+              do_close = TRUE;                       /* no bytes ever sent*/
             }
-          else if ((err == 2) || (err == 1))
+          else if (TDIFF(*time1,hip_a->use_time) >
+                   (int)HCNF.ual)
             {
-              if (TDIFF(*time1, hip_a->use_time) >
-                  (int)HCNF.ual)
-                {
-                  do_close = TRUE;
-                }
+              do_close = TRUE;                       /* both state time and
+                                                      *  use time have
+                                                      *  exceeded UAL*/
             }
-          break;
-        default:
-          break;
+          /* last used time is available, check for UAL */
         }
-      /* move to CLOSING if flagged */
-      if (do_close)
+      else if ((err == 2) || (err == 1))
         {
-          log_hipa_fromto(QOUT, "Close initiated (timeout)",
-                          hip_a, FALSE, TRUE);
-          delete_associations(hip_a, 0, 0);
-#ifdef __MACOSX__
-          if (hip_a->ipfw_rule > 0)
+          if (TDIFF(*time1, hip_a->use_time) >
+              (int)HCNF.ual)
             {
-              del_divert_rule(hip_a->ipfw_rule);
-              hip_a->ipfw_rule = 0;
+              do_close = TRUE;
             }
-#endif
-          hip_send_close(hip_a, FALSE);
-          set_state(hip_a, CLOSING);
         }
-      /* clean up rxmt queue if flagged */
-      if (remove_rxmt && hip_a->rexmt_cache.packet)
+      break;
+    default:
+      break;
+    }
+  /* move to CLOSING if flagged */
+  if (do_close)
+    {
+      log_hipa_fromto(QOUT, "Close initiated (timeout)",
+                      hip_a, FALSE, TRUE);
+      delete_associations(hip_a, 0, 0);
+#ifdef __MACOSX__
+      if (hip_a->ipfw_rule > 0)
         {
-          clear_retransmissions(hip_a);
+          del_divert_rule(hip_a->ipfw_rule);
+          hip_a->ipfw_rule = 0;
         }
-      /* age peer locators, verify addresses */
-      hip_handle_locator_state_timeouts(hip_a, time1);
+#endif
+      hip_send_close(hip_a, FALSE);
+      set_state(hip_a, CLOSING);
     }
-
+  /* clean up rxmt queue if flagged */
+  if (remove_rxmt && hip_a->rexmt_cache.packet)
+    {
+      clear_retransmissions(hip_a);
+    }
+  /* age peer locators, verify addresses */
+  hip_handle_locator_state_timeouts(hip_a, time1);
 }
 
-/* Iterate over HIP connections and handle registrations.
+/* Handle the registration timeouts of a HIP connection.
  */
-void hip_handle_registrations(struct timeval *time1)
+void hip_handle_registration_timeout(hip_assoc *hip_a, struct timeval *time1)
 {
-  int i, do_update = 0;
-  hip_assoc *hip_a;
+  int do_update = 0;
   struct reg_info *reg;
   double tmp;
 
-  for (i = 0; i < max_hip_assoc; i++)
+  if (hip_a->state != ESTABLISHED)
     {
-      do_update = 0;
-      hip_a = &hip_assoc_table[i];
-      if (hip_a->state != ESTABLISHED)
-        {
-          continue;
-        }
-      if (!hip_a->regs)
-        {
-          continue;
-        }
-      for (reg = hip_a->regs->reginfos; reg; reg = reg->next)
+      return;
+    }
+  if (!hip_a->regs)
+    {
+      return;
+    }
+  for (reg = hip_a->regs->reginfos; reg; reg = reg->next)
+    {
+      /* we've requested a registration but haven't heard
+       * back after a certain amount of time */
+      if (reg->state == REG_REQUESTED)
         {
-          /* we've requested a registration but haven't heard
-           * back after a certain amount of time */
-          if (reg->state == REG_REQUESTED)
-            {
-              if (TDIFF(*time1, reg->state_time) >
-                  (int)HCNF.ual)
-                {
-                  reg->state = REG_OFFERED;
-                  do_update = 1;
-                }
-              /* an active registration has expired */
-            }
-          else if (reg->state == REG_GRANTED)
+          if (TDIFF(*time1, reg->state_time) >
+              (int)HCNF.ual)
             {
-              tmp = YLIFE (reg->lifetime);
-              tmp = pow (2, tmp);
-              tmp = 0.9 * tmp;
-              if (TDIFF(*time1,
-                        reg->state_time) > (int)tmp)
-                {
-                  reg->state = REG_OFFERED;
-                  do_update = 1;
-                }
+              reg->state = REG_OFFERED;
+              do_update = 1;
             }
+          /* an active registration has expired */
         }
-      if (do_update)
+      else if (reg->state == REG_GRANTED)
         {
-          hip_send_update(hip_a, NULL, NULL, NULL);
+          tmp = YLIFE (reg->lifetime);
+          tmp = pow (2, tmp);
+          tmp = 0.9 * tmp;
+          if (TDIFF(*time1,
+                    reg->state_time) > (int)tmp)
+            {
+              reg->state = REG_OFFERED;
+              do_update = 1;
+            }
         }
     }
+  if (do_update)
+    {
+      hip_send_update(hip_a, NULL, NULL, NULL);
+    }
 }
 
 /*
@@ -1591,6 +1630,220 @@ void hip_handle_locator_state_timeouts(hip_assoc *hip_a, struct timeval *time1)
     }     /* end for */
 }
 
+/*
+ * hip_assoc_wakeup()
+ *
+ * Have the timeouts of a HIP association checked one second from now,
+ * after any pending ESP messages have been read. Called whenever its
+ * state, retransmission or rekey information changes.
+ */
+void hip_assoc_wakeup(hip_assoc *hip_a)
+{
+  struct timeval expires;
+
+  /* pending associations get a timer once adopted into the table */
+  if (!hip_a->allocated)
+    {
+      return;
+    }
+  if (!hip_a->timer.fn)
+    {
+      hip_timer_init(&hip_a->timer, hip_assoc_timeout);
+    }
+  gettimeofday(&expires, NULL);
+  expires.tv_sec++;
+  hip_timer_reduce(&hip_timers, &hip_a->timer, &expires);
+}
+
+/*
+ * hip_assoc_timeout()
+ *
+ * Timer callback for a HIP association; handles its retransmission,
+ * state, registration and multihoming timeouts and then waits for the
+ * next one.
+ */
+static void hip_assoc_timeout(hip_timer *t, struct timeval *now)
+{
+  hip_assoc *hip_a = hip_timer_entry(t, hip_assoc, timer);
+
+  hip_retransmit_waiting_packet(hip_a, now);
+  hip_handle_state_timeout(hip_a, now);
+  if (!hip_a->allocated)         /* freed by the state timeout */
+    {
+      return;
+    }
+  hip_handle_registration_timeout(hip_a, now);
+  if (OPT.mh)
+    {
+      hip_handle_multihoming_timeout(hip_a, now);
+    }
+  hip_assoc_schedule(hip_a, now);
+}
+
+/* keep the earlier of two deadlines, in whole seconds */
+static void hip_assoc_deadline(struct timeval *next, time_t sec)
+{
+  if ((next->tv_sec == 0) || (sec < next->tv_sec))
+    {
+      next->tv_sec = sec;
+    }
+}
+
+/*
+ * hip_assoc_schedule()
+ *
+ * Arm the timer of a HIP association for the first second in which one
+ * of the checks in hip_assoc_timeout() can trigger. Incoming ESP data in
+ * R2_SENT and mobile router retransmissions are not known in advance and
+ * are polled every second.
+ */
+static void hip_assoc_schedule(hip_assoc *hip_a, struct timeval *now)
+{
+  struct timeval next = { 0, 0 };
+  struct reg_info *reg;
+  sockaddr_list *l;
+  time_t t;
+
+  if (hip_a->rexmt_cache.len > 0)
+    {
+      hip_assoc_deadline(&next, hip_a->rexmt_cache.xmit_time.tv_sec +
+                         HCNF.packet_timeout + 1);
+    }
+  switch (hip_a->state)
+    {
+    case R2_SENT:
+      hip_assoc_deadline(&next, now->tv_sec + 1);
+      break;
+    case CLOSING:
+    case CLOSED:
+      hip_assoc_deadline(&next, hip_a->state_time.tv_sec +
+                         hip_close_timeout(hip_a) + 1);
+      break;
+    case UNASSOCIATED:
+    case E_FAILED:
+      hip_assoc_deadline(&next, hip_a->state_time.tv_sec +
+                         HCNF.failure_timeout + 1);
+      break;
+    case ESTABLISHED:
+      if (hip_a->rekey)
+        {
+          hip_assoc_deadline(&next, hip_a->rekey->rk_time.tv_sec +
+                             HCNF.failure_timeout + 1);
+        }
+      if (hip_a->icmp_update_status == ICMP_UPDATE_SUCCESSFUL)
+        {
+          hip_assoc_deadline(&next, hip_a->icmp_update_time.tv_sec +
+                             HCNF.icmp_timeout + 1);
+        }
+      /* UAL, counted from the last use or the state change */
+      t = hip_a->state_time.tv_sec;
+      if (hip_a->use_time.tv_sec > t)
+        {
+          t = hip_a->use_time.tv_sec;
+        }
+      hip_assoc_deadline(&next, t + HCNF.ual + 1);
+      if (OPT.mr)
+        {
+          hip_assoc_deadline(&next, now->tv_sec + 1);
+        }
+      for (reg = hip_a->regs ? hip_a->regs->reginfos : NULL; reg;
+           reg = reg->next)
+        {
+          if (reg->state == REG_REQUESTED)
+            {
+              hip_assoc_deadline(&next, reg->state_time.tv_sec +
+                                 HCNF.ual + 1);
+            }
+          else if (reg->state == REG_GRANTED)
+            {
+              t = (int)(0.9 * pow(2, YLIFE(reg->lifetime)));
+              hip_assoc_deadline(&next, reg->state_time.tv_sec + t + 1);
+            }
+        }
+      break;
+    default:
+      break;
+    }
+  /* locator lifetimes; an expired locator is checked again as soon as
+   * no other UPDATE is pending */
+  if (hip_a->peer_hi && !hip_a->peer_hi->skip_addrcheck)
+    {
+      for (l = &hip_a->peer_hi->addrs; l; l = l->next)
+        {
+          if (l->lifetime == 0)
+            {
+              continue;
+            }
+          if (TDIFF(*now, l->creation_time) < l->lifetime)
+            {
+              hip_assoc_deadline(&next, l->creation_time.tv_sec +
+                                 l->lifetime);
+            }
+          else if (!hip_a->rekey)
+            {
+              hip_assoc_deadline(&next, now->tv_sec + 1);
+            }
+        }
+    }
+  if (OPT.mh && hip_a->mh)
+    {
+      hip_assoc_deadline(&next, hip_a->mh->mh_last_loss.tv_sec + 31);
+      hip_assoc_deadline(&next, hip_a->mh->mh_time.tv_sec + 121);
+    }
+
+  if (next.tv_sec == 0)
+    {
+      hip_timer_del(&hip_a->timer);
+      return;
+    }
+  hip_timer_add(&hip_timers, &hip_a->timer, &next);
+}
+
+/*
+ * hip_housekeeping()
+ *
+ * Periodic work that does not belong to an association: reap child
+ * processes, retry the trigger, rotate R1s and DH contexts, select a
+ * new preferred address, and release unused association slabs.
+ */
+static void hip_housekeeping(hip_timer *t, struct timeval *now)
+{
+  struct timeval next;
+#ifndef __WIN32__
+  int status;
+
+  /* cleanup zombie processes from fork() */
+  waitpid(0, &status, WNOHANG);
+#endif
+  /* by default, every 5 minutes */
+  if ((now->tv_sec - last_expire) > (int)HCNF.r1_lifetime)
+    {
+      last_expire = now->tv_sec;
+      /* expire old DH contexts */
+      expire_old_dh_entries();
+      /* precompute a new R1 for each HI, and
+       * sometimes pick a new random index for
+       * cookies */
+      replace_next_R1();
+    }
+  adapt_puzzle_difficulty(now);
+  if (OPT.trigger)
+    {
+      hip_trigger(OPT.trigger);
+    }
+  if (need_select_preferred)
+    {
+      need_select_preferred = FALSE;
+      select_preferred_address();
+      hip_dht_update_my_entries(0);
+    }
+  hip_assoc_trim();
+
+  next.tv_sec = now->tv_sec + HIP_HOUSEKEEPING_INTERVAL;
+  next.tv_usec = now->tv_usec;
+  hip_timer_add(&hip_timers, t, &next);
+}
+
 /*
  * Manually trigger HIP exchange
  */
@@ -1673,6 +1926,7 @@ int hip_trigger(struct sockaddr *dst)
   make_address_active(&hip_a->hi->addrs);
   memcpy(HIPA_DST(hip_a), dst, SALEN(dst));
   memcpy(&(hip_a->peer_hi->hit), hiph.hit_sndr, sizeof(hip_hit));
+  hip_assoc_index(hip_a);
 
   /* Remove the trigger */
   free(OPT.trigger);
@@ -1751,6 +2005,7 @@ int hip_trigger_rvs(struct sockaddr *rvs, hip_hit *rsp)
     }
   make_address_active(&hip_a->hi->addrs);
   memcpy(HIPA_DST(hip_a), rvs, SALEN(rvs));
+  hip_assoc_index(hip_a);
 
   /* Remove the trigger */
   free(OPT.trigger);
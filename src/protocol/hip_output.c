@@ -45,6 +45,7 @@
 #include <openssl/aes.h>        /* AES support			*/
 #include <openssl/dsa.h>        /* DSA support                  */
 #include <openssl/dh.h>         /* Diffie-Hellman contexts      */
+#include <openssl/ecdsa.h>      /* ECDSA signatures             */
 #include <openssl/sha.h>        /* SHA1 algorithms              */
 #include <openssl/rand.h>       /* RAND_seed()                  */
 #include <openssl/err.h>        /* ERR_ functions		*/
@@ -66,6 +67,9 @@
 #include <netinet/in.h>
 #endif
 #include <netinet/ip.h>         /* struct iphdr                 */
+#ifndef __MACOSX__
+#include <linux/filter.h>       /* struct sock_filter           */
+#endif
 #endif
 
 #include <hip/hip_types.h>
@@ -81,7 +85,7 @@
  * Forward declaration of local functions.
  */
 int hip_check_bind(struct sockaddr *src, int num_attempts);
-int build_tlv_dh(__u8 *data, __u8 group_id, DH *dh, int debug);
+int build_tlv_dh(__u8 *data, __u8 group_id, DH *dh, EC_KEY *ec, int debug);
 int build_tlv_transform(__u8 *data, int type, __u16 *transforms, __u16 single);
 int build_tlv_locators(__u8* data, sockaddr_list *addrs, __u32 spi, int force);
 int build_tlv_echo_response(__u16 type, __u16 length, __u8 *buff, __u8 *data);
@@ -248,12 +252,14 @@ int hip_send_R1(struct sockaddr *src, struct sockaddr *dst, hip_hit *hiti,
   int err, i, total_len, add_via;
   hiphdr *hiph;
   r1_cache_entry *r1_entry;
+  r1_template *r1;
   __u8 *data;
 
   /* make a copy of a pre-computed R1 from the cache */
   i = compute_R1_cache_index(hiti, TRUE);
   r1_entry = &hi->r1_cache[i];
-  total_len = r1_entry->len;
+  r1 = r1_entry->current_r1;
+  total_len = r1->len;
   log_(NORM,"Using premade R1 from %s cache slot %d.\n", hi->name, i);
 
   /* if received I1 with from parameter, add via_rvs parameter in R1 */
@@ -280,10 +286,13 @@ int hip_send_R1(struct sockaddr *src, struct sockaddr *dst, hip_hit *hiti,
     }
   memset(data, 0, total_len);
   hiph = (hiphdr*) data;
-  memcpy(data, r1_entry->packet, r1_entry->len);
+  memcpy(data, r1->packet, r1->len);
+  /* the signed R1 is shared by many slots, patch in this slot's puzzle */
+  memcpy(&data[r1->cookie_offset], r1_entry->current_puzzle,
+         sizeof(hipcookie));
   if (add_via)
     {
-      memcpy(&data[r1_entry->len], hip_rvs->from_via,
+      memcpy(&data[r1->len], hip_rvs->from_via,
              sizeof(tlv_via_rvs));
       hiph->hdr_len = (total_len / 8) - 1;
       free(hip_rvs->from_via);
@@ -323,9 +332,12 @@ int hip_send_R1(struct sockaddr *src, struct sockaddr *dst, hip_hit *hiti,
  *              cookie = the puzzle to insert into the R1
  *              dh_entry = the DH cache entry to use
  *
+ * out:		cookie_offset = where the cookie (OPAQUE and I) was inserted,
+ *                              since it is not covered by the signature
+ *
  */
 int hip_generate_R1(__u8 *data, hi_node *hi, hipcookie *cookie,
-                    dh_cache_entry *dh_entry)
+                    dh_cache_entry *dh_entry, int *cookie_offset)
 {
   hiphdr *hiph;
   int location = 0, cookie_location = 0;
@@ -387,7 +399,7 @@ int hip_generate_R1(__u8 *data, hi_node *hi, hipcookie *cookie,
 
   /* Diffie Hellman */
   location += build_tlv_dh(&data[location], dh_entry->group_id,
-                           dh_entry->dh, OPT.debug_R1);
+                           dh_entry->dh, dh_entry->ec, OPT.debug_R1);
 
   /* HIP transform */
   location += build_tlv_transform(&data[location],
@@ -420,6 +432,10 @@ int hip_generate_R1(__u8 *data, hi_node *hi, hipcookie *cookie,
 
   /* insert the cookie (OPAQUE and I) */
   memcpy(&data[cookie_location], cookie, sizeof(hipcookie));
+  if (cookie_offset)
+    {
+      *cookie_offset = cookie_location;
+    }
 
   /* if ECHO_REQUEST_NOSIG is needed, put it here */
 
@@ -559,7 +575,7 @@ int hip_send_I2(hip_assoc *hip_a)
 
   /* diffie_hellman */
   location += build_tlv_dh(&buff[location], hip_a->dh_group_id,
-                           hip_a->dh, OPT.debug);
+                           hip_a->dh, hip_a->ec, OPT.debug);
 
   /* hip transform */
   location += build_tlv_transform(&buff[location],
@@ -1123,13 +1139,14 @@ int hip_send_update(hip_assoc *hip_a, struct sockaddr *newaddr,
     }
 
   /* Add a Diffie-Hellman parameter when present
-   * in hip_a->rekey->dh
+   * in hip_a->rekey->dh or ec
    */
-  if (hip_a->rekey && hip_a->rekey->dh)
+  if (hip_a->rekey && (hip_a->rekey->dh || hip_a->rekey->ec))
     {
       location += build_tlv_dh(&buff[location],
                                hip_a->rekey->dh_group_id,
                                hip_a->rekey->dh,
+                               hip_a->rekey->ec,
                                OPT.debug);
     }
 
@@ -1673,6 +1690,180 @@ int hip_send_notify(hip_assoc *hip_a, int code, __u8 *data, int data_len)
                   NULL, FALSE));
 }
 
+#if !defined(__WIN32__) && !defined(__MACOSX__)
+/*
+ * Long-lived raw sockets for sending HIP control packets, indexed by
+ * address family and UDP encapsulation. They are not bound; the source
+ * address of each packet is given with IP_PKTINFO or IPV6_PKTINFO.
+ */
+static int hip_send_sockets[2][2] = { { -1, -1 }, { -1, -1 } };
+
+/*
+ * function hip_send_socket()
+ *
+ * in:		family = AF_INET or AF_INET6
+ *              udp = TRUE for UDP-encapsulated packets
+ *
+ * out:		returns the socket, or -1 on error
+ *
+ * Get the sending socket for a family and protocol, creating it on first
+ * use. A raw socket also receives a copy of every incoming packet of its
+ * protocol, so a filter drops those instead of queueing them.
+ */
+static int hip_send_socket(int family, int udp)
+{
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog;
+  int *s = &hip_send_sockets[(family == AF_INET6) ? 1 : 0][udp ? 1 : 0];
+
+  if (*s >= 0)
+    {
+      return(*s);
+    }
+  *s = socket(family, SOCK_RAW, udp ? H_PROTO_UDP : H_PROTO_HIP);
+  if (*s < 0)
+    {
+      log_(WARN, "hip_send_socket() socket() error: %s.\n",
+           strerror(errno));
+      return(-1);
+    }
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  if (setsockopt(*s, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                 sizeof(prog)) < 0)
+    {
+      log_(WARN, "hip_send_socket() filter error: %s.\n",
+           strerror(errno));
+    }
+  return(*s);
+}
+
+#endif /* !__WIN32__ && !__MACOSX__ */
+/*
+ * function hip_send_packet()
+ *
+ * in:		data = packet to send, starting with the UDP header if udp
+ *              len = data length
+ *              src = source address
+ *              dst = destination address
+ *              udp = TRUE for UDP-encapsulated packets
+ *
+ * out:		returns bytes sent, or -1 on error
+ *
+ * Send one HIP control packet from the given source address. Where
+ * IP_PKTINFO is available one sendmsg() on a long-lived socket is used,
+ * otherwise a socket is bound and connected for this packet.
+ */
+static int hip_send_packet(__u8 *data, int len, struct sockaddr *src,
+                           struct sockaddr *dst, int udp)
+{
+  int s, ret;
+#if !defined(__WIN32__) && !defined(__MACOSX__)
+  struct sockaddr_storage to;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  struct in_pktinfo *pktinfo;
+  struct in6_pktinfo *pktinfo6;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+  } cbuff;
+
+  if (src->sa_family != dst->sa_family)
+    {
+      log_(WARN, "hip_send_packet(): src and dst have different "
+           "address families\n");
+      return(-1);
+    }
+  if ((s = hip_send_socket(src->sa_family, udp)) < 0)
+    {
+      return(-1);
+    }
+
+  /* a raw IPv6 socket only accepts its own protocol as port */
+  memcpy(&to, dst, SALEN(dst));
+  if (to.ss_family == AF_INET6)
+    {
+      ((struct sockaddr_in6*)&to)->sin6_port = 0;
+    }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&cbuff, 0, sizeof(cbuff));
+  iov.iov_base = data;
+  iov.iov_len = len;
+  msg.msg_name = &to;
+  msg.msg_namelen = SALEN(dst);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuff.buf;
+  cmsg = (struct cmsghdr*) cbuff.buf;
+  if (src->sa_family == AF_INET)
+    {
+      cmsg->cmsg_level = IPPROTO_IP;
+      cmsg->cmsg_type = IP_PKTINFO;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+      pktinfo = (struct in_pktinfo*) CMSG_DATA(cmsg);
+      pktinfo->ipi_spec_dst = ((struct sockaddr_in*)src)->sin_addr;
+      msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+    }
+  else
+    {
+      cmsg->cmsg_level = IPPROTO_IPV6;
+      cmsg->cmsg_type = IPV6_PKTINFO;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+      pktinfo6 = (struct in6_pktinfo*) CMSG_DATA(cmsg);
+      pktinfo6->ipi6_addr = ((struct sockaddr_in6*)src)->sin6_addr;
+      /* link-local source addresses need their interface */
+      pktinfo6->ipi6_ifindex = ((struct sockaddr_in6*)src)->sin6_scope_id;
+      msg.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+    }
+
+  if ((ret = sendmsg(s, &msg, 0)) < 0)
+    {
+      log_(WARN, "sendmsg() from %s ", logaddr(src));
+      log_(NORM, "to %s error: %s.\n", logaddr(dst), strerror(errno));
+    }
+  return(ret);
+#else
+  s = socket(src->sa_family, SOCK_RAW, udp ? H_PROTO_UDP : H_PROTO_HIP);
+  if (s < 0)
+    {
+      log_(WARN, "hip_send_packet() socket() error: %s.\n",
+           strerror(errno));
+      return(-1);
+    }
+  if (bind(s, src, SALEN(src)) < 0)
+    {
+      log_(WARN, "bind(%s) error: %s.\n",
+           logaddr(src), strerror(errno));
+      closesocket(s);
+      return(-1);
+    }
+  if (connect(s, dst, SALEN(dst)) < 0)
+    {
+      log_(WARN, "connect(%s) error: %s.\n",
+           logaddr(dst), strerror(errno));
+      closesocket(s);
+      return(-1);
+    }
+#ifdef __WIN32__
+  ret = sendto(s, data, len, 0, dst, SALEN(dst));
+#else
+  ret = send(s, data, len, 0);
+#endif
+  if (ret < 0)
+    {
+      log_(WARN, "send(%s) error: %s.\n",
+           logaddr(dst), strerror(errno));
+    }
+  closesocket(s);
+  return(ret);
+#endif /* !__WIN32__ && !__MACOSX__ */
+}
+
 /*
  * function hip_send()
  *
@@ -1684,24 +1875,19 @@ int hip_send_notify(hip_assoc *hip_a, int code, __u8 *data, int data_len)
  *
  * out:		returns bytes sent
  *
- * Creates socket, binds, connects, and does sendmsg();
+ * Adds any UDP header and sends the packet with hip_send_packet();
  * packets are saved when sent so they can be retransmitted.
  *
  */
 int hip_send(__u8 *data, int len, struct sockaddr* src, struct sockaddr* dst,
              hip_assoc *hip_a, int retransmit)
 {
-  int s, flags, err = 0;
+  int err = 0;
   struct timeval time1;
   int out_len, offset, do_retransmit = FALSE, do_udp = FALSE;
   __u8 *out;
   udphdr *udph;
   __u32 *p32;
-#ifndef __WIN32__
-  /* on win32 we use send(), otherwise use sendmsg() */
-  struct msghdr msg = {0};
-  struct iovec iov;
-#endif /* __WIN32__ */
 
   out_len = len;
   offset = 0;
@@ -1759,55 +1945,17 @@ int hip_send(__u8 *data, int len, struct sockaddr* src, struct sockaddr* dst,
       *p32 = 0;           /* zero ESP SPI marker */
     }
 
-#ifndef __WIN32__
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  iov.iov_len = out_len;
-  iov.iov_base = out;
-#endif /* __WIN32__ */
-
-  s = socket(src->sa_family, SOCK_RAW, do_udp ? H_PROTO_UDP : H_PROTO_HIP);
-  if (s < 0)
-    {
-      log_(WARN, "hip_send() socket() error: %s.\n", strerror(errno));
-      err = -1;
-      goto queue_retrans;
-    }
-
-  if (bind(s, src, SALEN(src)) < 0)
-    {
-      log_(WARN, "bind(%s) error: %s.\n",
-           logaddr(src), strerror(errno));
-      err = -1;
-      goto queue_retrans;
-    }
-
-  if (connect(s, dst, SALEN(dst)) < 0)
+  log_(NORMT, "Sending HIP packet on %s socket\n", do_udp ? "UDP" : "RAW");
+  if ((len = hip_send_packet(out, out_len, src, dst, do_udp)) < 0)
     {
-      log_(WARN, "connect(%s) error: %s.\n",
-           logaddr(dst), strerror(errno));
       err = -1;
-      goto queue_retrans;
     }
-
-  log_(NORMT, "Sending HIP packet on %s socket\n", do_udp ? "UDP" : "RAW");
-  flags = 0;
-#ifndef __WIN32__
-  if ((len = sendmsg(s, &msg, flags)) != out_len)
+  else if (len != out_len)
     {
       log_(WARN, "Sent unexpected length: %d", len);
     }
-#else
-  if (sendto(s, out, out_len, 0, dst, SALEN(dst)) < 0)
-    {
-      log_(WARN, "sendto(%s) error: %s.\n",
-           logaddr(dst), strerror(errno));
-      err = -1;
-    }
-#endif
 
   /* queue packet for retransmission, even if there are errors */
-queue_retrans:
   if (hip_a != NULL)         /* XXX incorrect for RVS relaying */
     {
       clear_retransmissions(hip_a);
@@ -1821,14 +1969,13 @@ queue_retrans:
       hip_a->rexmt_cache.xmit_time.tv_usec = time1.tv_usec;
       hip_a->rexmt_cache.retransmits = 0;
       memcpy(&hip_a->rexmt_cache.dst, dst, SALEN(dst));
+      hip_assoc_wakeup(hip_a);
     }
   else if (do_udp)
     {
       free(out);
     }
 
-  closesocket(s);
-
   return ((err < 0) ? err : out_len);
 }
 
@@ -1838,7 +1985,7 @@ queue_retrans:
  * in:		hip_a = hip association
  *              data = packet data
  *              len = data length
- *              src = source address to bind to
+ *              src = source address to send from
  *              dst = destination address to send to
  *
  * out:		returns bytes sent if successful, -1 otherwise
@@ -1848,20 +1995,8 @@ queue_retrans:
 int hip_retransmit(hip_assoc *hip_a, __u8 *data, int len,
                    struct sockaddr *src, struct sockaddr *dst)
 {
-  int s, err, use_udp;
-#ifndef __WIN32__
-  struct msghdr msg;
-  struct iovec iov;
+  int use_udp;
 
-  msg.msg_name = 0L;
-  msg.msg_namelen = 0;
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = 0L;
-  msg.msg_controllen = 0;
-  iov.iov_len = len;
-  iov.iov_base = data;
-#endif
   if (!hip_a)
     {
       use_udp = FALSE;
@@ -1871,45 +2006,7 @@ int hip_retransmit(hip_assoc *hip_a, __u8 *data, int len,
       use_udp = hip_a->udp;
     }
 
-  s = socket(src->sa_family, SOCK_RAW,
-             use_udp ? H_PROTO_UDP : H_PROTO_HIP);
-  if (s < 0)
-    {
-      log_(WARN, "hip_retransmit() socket() error: %s.\n",
-           strerror(errno));
-      return(-1);
-    }
-
-  if (bind(s, src, SALEN(src)) < 0)
-    {
-      log_(WARN, "hip_retransmit() bind(%s) error: %s.\n",
-           logaddr(src), strerror(errno));
-      return(-1);
-    }
-  if (connect(s, dst, SALEN(dst)) < 0)
-    {
-      log_(WARN, "hip_retransmit() connect(%s) error: %s.\n",
-           logaddr(dst), strerror(errno));
-      return(-1);
-    }
-
-  /* send the packet */
-#ifndef __WIN32__
-  if ((err = sendmsg(s, &msg, 0)) < 0)
-    {
-      log_(WARN, "hip_retransmit() sendmsg() error: %s",
-           strerror(errno));
-    }
-#else
-  if ((err = sendto(s, data, len, 0, dst, SALEN(dst))) < 0)
-    {
-      log_(WARN, "hip_retransmit() sendto() error: %s",
-           strerror(errno));
-    }
-#endif
-  closesocket(s);
-
-  return(err);
+  return(hip_send_packet(data, len, src, dst, use_udp));
 }
 
 /*
@@ -1961,18 +2058,19 @@ int hip_check_bind(struct sockaddr *src, int num_attempts)
 
 /*
  * Fill in Diffie Hellman public key tlv, using the
- * context stored in hip_a->dh. hip_a->dh is intialized
+ * context stored in hip_a->dh, or the ECDH key in hip_a->ec.
+ * hip_a->dh is intialized
  * when building the R1 prior to calling this function,
  * and when parsing the R1 for the DH in I2.
  * Returns the number of bytes that it advances.
  */
-int build_tlv_dh(__u8 *data, __u8 group_id, DH *dh, int debug)
+int build_tlv_dh(__u8 *data, __u8 group_id, DH *dh, EC_KEY *ec, int debug)
 {
   tlv_diffie_hellman *d;
   unsigned char *bin;
   int len;
 
-  if (dh == NULL)
+  if ((dh == NULL) && (ec == NULL))
     {
       log_(WARN, "No Diffie Hellman context for DH tlv.\n");
       return(0);
@@ -1984,13 +2082,30 @@ int build_tlv_dh(__u8 *data, __u8 group_id, DH *dh, int debug)
 
   /* put dh->pub_key into tlv */
   len = dhprime_len[group_id];
-  bin = (unsigned char*) malloc(len);
+  bin = (unsigned char*) malloc(len + 1);
   if (!bin)
     {
       log_(WARN, "malloc error - generating Diffie Hellman\n");
       return(0);
     }
-  len = bn2bin_safe(dh->pub_key, bin, len);
+  if (ec)
+    {
+      /* x and y, without the leading octet of an uncompressed point */
+      if (EC_POINT_point2oct(EC_KEY_get0_group(ec),
+                             EC_KEY_get0_public_key(ec),
+                             POINT_CONVERSION_UNCOMPRESSED,
+                             bin, len + 1, NULL) != (size_t)(len + 1))
+        {
+          log_(WARN, "Error encoding ECDH public value.\n");
+          free(bin);
+          return(0);
+        }
+      memmove(bin, &bin[1], len);
+    }
+  else
+    {
+      len = bn2bin_safe(dh->pub_key, bin, len);
+    }
   memcpy(d->pub, bin, len);
 
   d->pub_len = ntohs((__u16)len);
@@ -2086,6 +2201,14 @@ int build_tlv_hostid_len(hi_node *hi, int use_hi_name)
           hi_len += 2;
         }
       break;
+    case HI_ALG_ECDSA:          /*       tlv + curve + X,Y */
+      if (!hi->ecdsa)
+        {
+          log_(WARN, "No ECDSA context when building length!\n");
+          return(0);
+        }
+      hi_len = sizeof(tlv_host_id) + 2 + 2 * hi->size;
+      break;
     default:
       break;
     }
@@ -2160,6 +2283,19 @@ int build_tlv_hostid(__u8 *data, hi_node *hi, int use_hi_name)
       /* public modulus */
       len += bn2bin_safe(hi->rsa->n, &data[len], RSA_size(hi->rsa));
       break;
+    case HI_ALG_ECDSA:
+      /* curve (2 bytes) */
+      data[len] = 0x0;
+      data[len + 1] = HI_ECC_CURVE_NIST_P256;
+      len += 2;
+      /* public key X | Y */
+      if (ec2bin_safe(hi->ecdsa, &data[len], hi->size) < 0)
+        {
+          log_(WARN, "Error encoding ECDSA HI.\n");
+          memset(&data[len], 0, 2 * hi->size);
+        }
+      len += 2 * hi->size;
+      break;
     default:
       break;
     }
@@ -2298,6 +2434,7 @@ int build_tlv_signature(hi_node *hi, __u8 *data, int location, int R1)
   SHA_CTX c;
   unsigned char md[SHA_DIGEST_LENGTH] = {0};
   DSA_SIG *dsa_sig;
+  ECDSA_SIG *ecdsa_sig;
   tlv_hip_sig *sig;
   unsigned int sig_len;
   int err;
@@ -2312,6 +2449,11 @@ int build_tlv_signature(hi_node *hi, __u8 *data, int location, int R1)
       log_(WARN, "No RSA context for building signature TLV.\n");
       return(0);
     }
+  else if ((hi->algorithm_id == HI_ALG_ECDSA) && !hi->ecdsa)
+    {
+      log_(WARN, "No ECDSA context for building signature TLV.\n");
+      return(0);
+    }
 
   /* calculate SHA1 hash of the HIP message */
   SHA1_Init(&c);
@@ -2355,6 +2497,22 @@ int build_tlv_signature(hi_node *hi, __u8 *data, int location, int R1)
                ERR_error_string(ERR_get_error(), NULL));
         }
       break;
+    case HI_ALG_ECDSA:
+      /* signature = r | s, as in RFC 4754 */
+      sig_len = 2 * HIP_ECDSA_SIZE;
+      memset(sig->signature, 0, sig_len);
+      ecdsa_sig = ECDSA_do_sign(md, SHA_DIGEST_LENGTH, hi->ecdsa);
+      if (!ecdsa_sig)
+        {
+          log_(WARN, "ECDSA_do_sign() error: %s",
+               ERR_error_string(ERR_get_error(), NULL));
+          break;
+        }
+      bn2bin_safe(ecdsa_sig->r, &sig->signature[0], HIP_ECDSA_SIZE);
+      bn2bin_safe(ecdsa_sig->s, &sig->signature[HIP_ECDSA_SIZE],
+                  HIP_ECDSA_SIZE);
+      ECDSA_SIG_free(ecdsa_sig);
+      break;
     default:
       break;
     }
@@ -2663,7 +2821,7 @@ int build_rekey(hip_assoc *hip_a)
   /* Check for peer-initiated rekeying parameters */
   if (hip_a->peer_rekey)
     {
-      if (hip_a->peer_rekey->dh)
+      if (hip_a->peer_rekey->dh || hip_a->peer_rekey->ec)
         {
           /* use peer-suggested group ID */
           new_group_id = hip_a->rekey->dh_group_id;
@@ -2696,6 +2854,7 @@ int build_rekey(hip_assoc *hip_a)
       hip_a->rekey->keymat_index = 0;
       hip_a->rekey->dh_group_id = new_group_id;
       hip_a->rekey->dh = dh_entry->dh;
+      hip_a->rekey->ec = dh_entry->ec;
     }
 
   gettimeofday(&hip_a->rekey->rk_time, NULL);
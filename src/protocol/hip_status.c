@@ -270,7 +270,7 @@ int status_dump_assoc(char *buff)
 
   for (i = 0; i < max_hip_assoc; i++)
     {
-      a = &hip_assoc_table[i];
+      a = HIP_ASSOC(i);
       /* skip empty entries */
       if (a->state == UNASSOCIATED)
         {
@@ -0,0 +1,336 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2005-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ *  \file  hip_crypto.c
+ *
+ *  \brief  Worker threads for the expensive crypto of hipd.
+ *
+ *  hipd hands jobs that would otherwise stall its single thread, such as
+ *  verifying an I2 (DH, keymat, HMAC and signature), to a pool of worker
+ *  threads. Each job runs its work() function on a worker, and the job
+ *  is then passed back over a socket pair that hipd selects on, so that
+ *  its finish() function runs on the hipd thread. With no workers, jobs
+ *  run to completion when submitted. Priority jobs, such as refilling the
+ *  DH key pool, are queued ahead of the others and have slots of their
+ *  own, so that a flood of I2s cannot hold them back.
+ *
+ */
+#include <stdio.h>              /* printf() */
+#include <stdlib.h>             /* free() */
+#include <string.h>             /* strerror() */
+#include <errno.h>              /* errno */
+#ifdef __WIN32__
+#include <winsock2.h>
+#include <win32/types.h>
+#else
+#include <unistd.h>             /* close(), usleep() */
+#include <pthread.h>
+#include <sys/socket.h>         /* socketpair() */
+#endif
+#include <hip/hip_types.h>
+#include <hip/hip_funcs.h>
+#include <hip/hip_globals.h>
+
+#define HIP_CRYPTO_MAX_WORKERS  16
+#define HIP_CRYPTO_MAX_PENDING  256     /* jobs submitted and not finished */
+#define HIP_CRYPTO_RESERVED     64      /* additional slots for priority jobs */
+
+/* jobs not yet finished, only used by the hipd thread */
+static hip_crypto_job *hip_crypto_pending[HIP_CRYPTO_MAX_PENDING +
+                                          HIP_CRYPTO_RESERVED];
+static int hip_crypto_num_pending = 0;
+static int hip_crypto_peak_pending = 0; /* since hip_crypto_backlog() */
+static int hip_crypto_workers = 0;
+/* workers write finished jobs to [0], hipd reads them from [1] */
+static int hip_crypto_sp[2] = { -1, -1 };
+
+#ifndef __WIN32__
+/* jobs waiting for a worker */
+static pthread_mutex_t hip_crypto_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hip_crypto_cond = PTHREAD_COND_INITIALIZER;
+static hip_crypto_job *hip_crypto_queue = NULL;
+static hip_crypto_job *hip_crypto_queue_tail = NULL;
+static hip_crypto_job *hip_crypto_queue_prio = NULL; /* last priority job */
+
+/*
+ * hip_crypto_worker()
+ *
+ * Worker thread; runs queued jobs and passes them back to hipd.
+ */
+static void *hip_crypto_worker(void *arg)
+{
+  hip_crypto_job *job;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&hip_crypto_mutex);
+      while (!hip_crypto_queue)
+        {
+          pthread_cond_wait(&hip_crypto_cond, &hip_crypto_mutex);
+        }
+      job = hip_crypto_queue;
+      hip_crypto_queue = job->next;
+      if (!hip_crypto_queue)
+        {
+          hip_crypto_queue_tail = NULL;
+        }
+      if (job == hip_crypto_queue_prio)
+        {
+          hip_crypto_queue_prio = NULL;
+        }
+      pthread_mutex_unlock(&hip_crypto_mutex);
+
+      job->next = NULL;
+      job->work(job);
+      /* retry until hipd has the job, since only its finish() frees the
+       * pending slot, the packet and the association reference */
+      while (write(hip_crypto_sp[0], &job, sizeof(job)) < 0)
+        {
+          if (errno != EINTR)
+            {
+              log_(WARN, "Crypto worker write() error - %d %s\n",
+                   errno, strerror(errno));
+              usleep(10000);
+            }
+        }
+    }
+  return(NULL);
+}
+
+#endif /* __WIN32__ */
+
+/*
+ * hip_crypto_init()
+ *
+ * in:		workers = number of worker threads to start
+ * out:		Returns 0 on success, -1 if no workers could be started, in
+ *              which case jobs are run by the hipd thread.
+ */
+int hip_crypto_init(int workers)
+{
+#ifndef __WIN32__
+  pthread_t thrd;
+  int i;
+
+  if (workers > HIP_CRYPTO_MAX_WORKERS)
+    {
+      log_(WARN, "Limiting crypto_workers to %d.\n",
+           HIP_CRYPTO_MAX_WORKERS);
+      workers = HIP_CRYPTO_MAX_WORKERS;
+    }
+  if (workers < 1)
+    {
+      return(0);
+    }
+#ifdef __MACOSX__
+  if (socketpair(AF_UNIX, SOCK_DGRAM, PF_UNSPEC, hip_crypto_sp))
+    {
+#else
+  if (socketpair(AF_UNIX, SOCK_DGRAM, PF_UNIX, hip_crypto_sp))
+    {
+#endif
+      log_(WARN, "Crypto worker socketpair() error - %d %s\n",
+           errno, strerror(errno));
+      hip_crypto_sp[0] = hip_crypto_sp[1] = -1;
+      return(-1);
+    }
+  for (i = 0; i < workers; i++)
+    {
+      if (pthread_create(&thrd, NULL, hip_crypto_worker, NULL))
+        {
+          log_(WARN, "Error creating crypto worker thread.\n");
+          break;
+        }
+      pthread_detach(thrd);
+    }
+  if (i == 0)
+    {
+      close(hip_crypto_sp[0]);
+      close(hip_crypto_sp[1]);
+      hip_crypto_sp[0] = hip_crypto_sp[1] = -1;
+      return(-1);
+    }
+  hip_crypto_workers = i;
+  log_(NORM, "Started %d crypto worker thread%s.\n", i, (i > 1) ? "s" : "");
+  return(0);
+#else
+  /* no pthread conditionals on WIN32 */
+  return((workers > 0) ? -1 : 0);
+#endif /* __WIN32__ */
+}
+
+/*
+ * hip_crypto_fd()
+ *
+ * Returns the descriptor that becomes readable when a job is finished by
+ * a worker, or -1 when there are no workers.
+ */
+int hip_crypto_fd()
+{
+  return(hip_crypto_sp[1]);
+}
+
+/*
+ * hip_crypto_find()
+ *
+ * Returns a job that has not finished yet for a packet sent from peer_hit
+ * to my_hit, or NULL. Only the packet's HITs are read, which the workers
+ * do not change.
+ */
+hip_crypto_job *hip_crypto_find(const hip_hit peer_hit, const hip_hit my_hit)
+{
+  int i;
+  hiphdr *hiph;
+
+  for (i = 0; i < hip_crypto_num_pending; i++)
+    {
+      if (!hip_crypto_pending[i]->data)
+        {
+          continue;
+        }
+      hiph = (hiphdr*) hip_crypto_pending[i]->data;
+      if (hits_equal(hiph->hit_sndr, peer_hit) &&
+          hits_equal(hiph->hit_rcvr, my_hit))
+        {
+          return(hip_crypto_pending[i]);
+        }
+    }
+  return(NULL);
+}
+
+/*
+ * hip_crypto_submit()
+ *
+ * in:		job = job with work() and finish() set
+ * out:		Returns 0 when the job was accepted, or -1 if too many jobs
+ *              are pending, in which case the job is left to the caller.
+ *
+ * Queue a job for the workers. With no workers it is run and finished
+ * before returning. A job with priority set is queued behind the other
+ * priority jobs, ahead of the rest.
+ */
+int hip_crypto_submit(hip_crypto_job *job)
+{
+  int max = HIP_CRYPTO_MAX_PENDING;
+
+  job->next = NULL;
+  if (hip_crypto_workers < 1)
+    {
+      job->work(job);
+      job->finish(job);
+      return(0);
+    }
+  if (job->priority)
+    {
+      max += HIP_CRYPTO_RESERVED;
+    }
+  if (hip_crypto_num_pending >= max)
+    {
+      log_(WARN, "Too many crypto jobs pending (%d), dropping.\n",
+           hip_crypto_num_pending);
+      return(-1);
+    }
+  hip_crypto_pending[hip_crypto_num_pending++] = job;
+  if (hip_crypto_num_pending > hip_crypto_peak_pending)
+    {
+      hip_crypto_peak_pending = hip_crypto_num_pending;
+    }
+#ifndef __WIN32__
+  pthread_mutex_lock(&hip_crypto_mutex);
+  if (job->priority)
+    {
+      if (hip_crypto_queue_prio)
+        {
+          job->next = hip_crypto_queue_prio->next;
+          hip_crypto_queue_prio->next = job;
+        }
+      else
+        {
+          job->next = hip_crypto_queue;
+          hip_crypto_queue = job;
+        }
+      hip_crypto_queue_prio = job;
+      if (!job->next)
+        {
+          hip_crypto_queue_tail = job;
+        }
+    }
+  else if (hip_crypto_queue_tail)
+    {
+      hip_crypto_queue_tail->next = job;
+      hip_crypto_queue_tail = job;
+    }
+  else
+    {
+      hip_crypto_queue = hip_crypto_queue_tail = job;
+    }
+  pthread_cond_signal(&hip_crypto_cond);
+  pthread_mutex_unlock(&hip_crypto_mutex);
+#endif /* __WIN32__ */
+  return(0);
+}
+
+/*
+ * hip_crypto_complete()
+ *
+ * Called by hipd when hip_crypto_fd() is readable; finishes the jobs
+ * that the workers are done with.
+ */
+void hip_crypto_complete()
+{
+#ifndef __WIN32__
+  hip_crypto_job *job;
+  int i;
+
+  while (recv(hip_crypto_sp[1], (char *)&job, sizeof(job),
+              MSG_DONTWAIT) == sizeof(job))
+    {
+      for (i = 0; i < hip_crypto_num_pending; i++)
+        {
+          if (hip_crypto_pending[i] == job)
+            {
+              hip_crypto_pending[i] =
+                hip_crypto_pending[--hip_crypto_num_pending];
+              break;
+            }
+        }
+      job->finish(job);
+    }
+#endif /* __WIN32__ */
+}
+
+/*
+ * hip_crypto_backlog()
+ *
+ * out:		Returns the most jobs that were pending at once since the
+ *              last call, as a percentage of the jobs that may be pending.
+ */
+int hip_crypto_backlog()
+{
+  int peak = hip_crypto_peak_pending;
+
+  hip_crypto_peak_pending = hip_crypto_num_pending;
+  return(peak * 100 / HIP_CRYPTO_MAX_PENDING);
+}
@@ -55,6 +55,7 @@
 #ifndef __MACOSX__
 #include <linux/types.h>
 #include <linux/errqueue.h>
+#include <linux/filter.h>       /* struct sock_filter */
 #endif /* __MACOSX__ */
 #endif /* __WIN32__ */
 #include <string.h>             /* memset, etc */
@@ -93,6 +94,16 @@ unknown_spi_entry *unknown_spi_head;
 #endif
 int readsp[2] = { 0,0 };
 int s_esp, s_esp_udp, s_esp_udp_dg, s_esp6;
+#ifndef __WIN32__
+esp_queue esp_queues[MAX_ESP_QUEUES];
+int num_esp_queues = 1;
+int esp_direct_tap = FALSE;     /* ESP output reads the TAP itself */
+/* protects the unknown SPI list, which is shared by the input workers */
+pthread_mutex_t unknown_spi_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+int esp_batch = 1;              /* packets per recvmmsg()/sendmmsg() */
+int esp_replay_win = REPLAY_WIN_WORD;   /* anti-replay window for new SAs */
+int esp_iv_gen = ESP_IV_RANDOM;         /* CBC IV generator for new SAs */
 
 #ifdef __MACOSX__
 extern char *logaddr(struct sockaddr *addr);
@@ -107,11 +118,31 @@ __u64 g_tap_mac;
 long g_read_usec;
 
 #define BUFF_LEN 2000
+/* Packet buffers reserve room before and after BUFF_LEN bytes of data so
+ * ESP encapsulation can be added or removed in place. The headroom covers
+ * an IPv4, UDP and ESP header with a 16-byte IV; the tailroom covers the
+ * padding, trailer and ICV. */
+#define ESP_HEADROOM 64
+#define ESP_TAILROOM 64
+#define ESP_PKTBUF_LEN (ESP_HEADROOM + BUFF_LEN + ESP_TAILROOM)
+#define ESP_PKTBUF(pool, i) (&(pool)[(i) * ESP_PKTBUF_LEN + ESP_HEADROOM])
 #define HMAC_SHA_96_BITS 96 /* 12 bytes */
-#define REPLAY_WIN_SIZE 64 /* 64 packets */
 
 #define MULTIHOMING_LOSS_THRESHOLD 5
 
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+/* outbound ESP packets queued for one sendmmsg() call; the iovecs point
+ * into the output worker's packet buffers, one buffer per slot */
+typedef struct _esp_send_batch {
+  int s;                                /* socket shared by the batch */
+  int count;
+  struct mmsghdr msgs[MAX_ESP_BATCH];
+  struct iovec iov[MAX_ESP_BATCH];
+  struct sockaddr_storage dst[MAX_ESP_BATCH];
+  __u8 *pkt[MAX_ESP_BATCH];             /* packet buffer of each slot */
+} esp_send_batch;
+#endif
+
 /* array of Ethernet addresses used by get_eth_addr() */
 #define MAX_ETH_ADDRS 255
 __u8 eth_addrs[6 * MAX_ETH_ADDRS]; /* must be initialized to random values */
@@ -134,10 +165,11 @@ __u16 checksum_udp_packet(__u8 *data,
 void tunreader_shutdown();
 int handle_nsol(__u8 *in, int len, __u8 *out,int *outlen,struct sockaddr *addr);
 int handle_arp(__u8 *in, int len, __u8 *out, int *outlen,struct sockaddr *addr);
-int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
+int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
                     hip_sadb_entry *entry, struct timeval *now);
 int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
-                    hip_sadb_entry *entry, struct ip *iph, struct timeval *now);
+                    hip_sadb_entry *entry, struct ip *iph, struct timeval *now,
+                    int reader);
 
 __u16 rewrite_checksum(__u8 *data, __u16 magic);
 void add_eth_header(__u8 *data, __u64 src, __u64 dst, __u32 type);
@@ -159,7 +191,7 @@ void esp_start_base_exchange(struct sockaddr *lsi);
 void esp_start_expire(__u32 spi);
 void esp_receive_udp_hip_packet(char *buff, int len);
 void esp_signal_loss(__u32 spi, __u32 loss, struct sockaddr *dst);
-__u32 get_next_seqno(hip_sadb_entry *entry);
+void esp_signal_paramprob(__u32 spi);
 int esp_anti_replay_check_initial(hip_sadb_entry *entry, __u32 seqno,
                                   __u32 *sequence_hi);
 __u64 esp_update_anti_replay(hip_sadb_entry *entry, __u32 seqno, __u32 seqno_hi);
@@ -189,6 +221,250 @@ void init_readsp()
   RAND_bytes(eth_addrs, sizeof(eth_addrs));
 }
 
+#ifndef __WIN32__
+/*
+ * init_esp_queues()
+ *
+ * Create the tunreader to ESP output socketpair for each queue. The first
+ * queue uses the global readsp, which unbuffer_packets() also writes to.
+ */
+void init_esp_queues()
+{
+  int i;
+
+  init_readsp();
+  for (i = 0; i < num_esp_queues; i++)
+    {
+      esp_queues[i].index = i;
+      if (i == 0)
+        {
+          esp_queues[i].readsp[0] = readsp[0];
+          esp_queues[i].readsp[1] = readsp[1];
+          continue;
+        }
+#ifdef __MACOSX__
+      if (socketpair(AF_UNIX, SOCK_DGRAM, PF_UNSPEC, esp_queues[i].readsp))
+        {
+#else
+      if (socketpair(AF_UNIX, SOCK_DGRAM, PF_UNIX, esp_queues[i].readsp))
+        {
+#endif
+          printf("socketpair() failed\n");
+        }
+    }
+}
+
+/*
+ * esp_queue_select()
+ *
+ * Choose the ESP output queue for an Ethernet frame from the TAP, by
+ * hashing its destination LSI or HIT. Packets to the same peer (and thus
+ * the same SA) always use the same queue, which keeps them in order.
+ */
+int esp_queue_select(__u8 *frame, int len)
+{
+  __u32 h = 0;
+  int i;
+
+  if (num_esp_queues < 2)
+    {
+      return(0);
+    }
+  if ((len >= 34) && (frame[12] == 0x08) && (frame[13] == 0x00))
+    {
+      /* IPv4 destination */
+      for (i = 30; i < 34; i++)
+        {
+          h = (h * 31) + frame[i];
+        }
+    }
+  else if ((len >= 54) && (frame[12] == 0x86) && (frame[13] == 0xdd))
+    {
+      /* IPv6 destination */
+      for (i = 38; i < 54; i++)
+        {
+          h = (h * 31) + frame[i];
+        }
+    }
+  /* ARP and others use the first queue */
+  return(h % num_esp_queues);
+}
+
+/*
+ * esp_queue_attach_filter()
+ *
+ * Each raw ESP socket receives a copy of every ESP packet, so attach a
+ * socket filter that only accepts packets where (SPI % num_esp_queues)
+ * equals this queue. IPv4 raw sockets include the IP header, IPv6 raw
+ * sockets start with the ESP header. spi_offset is the offset of the ESP
+ * header after the IP header (e.g. the UDP header length).
+ * HIP control packets over UDP have a zero SPI and go to the first queue.
+ */
+int esp_queue_attach_filter(int s, int family, int spi_offset, int queue)
+{
+#ifdef __MACOSX__
+  return(0);
+#else
+  struct sock_filter code4[] = {
+    /* X = IP header length */
+    BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+    /* A = SPI */
+    BPF_STMT(BPF_LD | BPF_W | BPF_IND, spi_offset),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_esp_queues),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, queue, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_filter code6[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, spi_offset),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_esp_queues),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, queue, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog;
+
+  if (family == AF_INET)
+    {
+      prog.len = sizeof(code4) / sizeof(code4[0]);
+      prog.filter = code4;
+    }
+  else
+    {
+      prog.len = sizeof(code6) / sizeof(code6[0]);
+      prog.filter = code6;
+    }
+  if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    {
+      printf("esp_queue_attach_filter() error: %s\n", strerror(errno));
+      return(-1);
+    }
+  return(0);
+#endif /* __MACOSX__ */
+}
+#endif /* !__WIN32__ */
+
+/*
+ * esp_recv_batch()
+ *
+ * Receive up to num datagrams from socket s with one recvmmsg() call,
+ * storing them in bufs[] and their lengths in lens[]. Only the first
+ * datagram is waited for. Returns the number of datagrams received, or
+ * -1 on error.
+ */
+int esp_recv_batch(int s, __u8 **bufs, int *lens, int num)
+{
+#if !defined(__WIN32__) && !defined(__MACOSX__)
+  struct mmsghdr msgs[MAX_ESP_BATCH];
+  struct iovec iov[MAX_ESP_BATCH];
+  int i, n;
+
+  if (num > 1)
+    {
+      memset(msgs, 0, num * sizeof(struct mmsghdr));
+      for (i = 0; i < num; i++)
+        {
+          iov[i].iov_base = bufs[i];
+          iov[i].iov_len = BUFF_LEN;
+          msgs[i].msg_hdr.msg_iov = &iov[i];
+          msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+      if ((n = recvmmsg(s, msgs, num, MSG_WAITFORONE, NULL)) < 0)
+        {
+          return(-1);
+        }
+      for (i = 0; i < n; i++)
+        {
+          lens[i] = msgs[i].msg_len;
+        }
+      return(n);
+    }
+#endif /* !__WIN32__ && !__MACOSX__ */
+#ifdef __WIN32__
+  lens[0] = recv(s, bufs[0], BUFF_LEN, 0);
+#else
+  lens[0] = read(s, bufs[0], BUFF_LEN);
+#endif
+  return((lens[0] < 0) ? -1 : 1);
+}
+
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+/*
+ * esp_batch_flush()
+ *
+ * Send the queued ESP packets using sendmmsg(). A packet that fails is
+ * reported and skipped, like a failed sendto().
+ */
+void esp_batch_flush(esp_send_batch *b)
+{
+  int n, sent = 0;
+
+  while (sent < b->count)
+    {
+      n = sendmmsg(b->s, &b->msgs[sent], b->count - sent, 0);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+          printf("hip_esp_output(): sendmmsg() failed: %s\n",
+                 strerror(errno));
+          n = 1;
+        }
+      sent += n;
+    }
+  b->count = 0;
+}
+
+/*
+ * esp_batch_sendto()
+ *
+ * Queue an ESP packet for socket s and destination dst. The batch is
+ * flushed when it is full or when the socket changes. Returns len.
+ * The data is not copied; it must be in the buffer of this slot or of an
+ * earlier one, which are not reused until the batch is flushed. When a
+ * flush leaves the data in the buffer of a later slot, that buffer is
+ * swapped into slot 0, so the next read cannot overwrite it.
+ */
+int esp_batch_sendto(esp_send_batch *b, int s, __u8 *data, int len,
+                     struct sockaddr *dst)
+{
+  __u8 *p;
+  int i, k;
+
+  if ((b->count > 0) && (b->s != s))
+    {
+      esp_batch_flush(b);
+    }
+  i = b->count++;
+  for (k = 1; (i == 0) && (k < esp_batch); k++)
+    {
+      p = b->pkt[k] - ESP_HEADROOM;
+      if ((data >= p) && (data < p + ESP_PKTBUF_LEN))
+        {
+          b->pkt[k] = b->pkt[0];
+          b->pkt[0] = p + ESP_HEADROOM;
+          break;
+        }
+    }
+  b->s = s;
+  memcpy(&b->dst[i], dst, SALEN(dst));
+  b->iov[i].iov_base = data;
+  b->iov[i].iov_len = len;
+  memset(&b->msgs[i], 0, sizeof(struct mmsghdr));
+  b->msgs[i].msg_hdr.msg_name = &b->dst[i];
+  b->msgs[i].msg_hdr.msg_namelen = SALEN(dst);
+  b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+  b->msgs[i].msg_hdr.msg_iovlen = 1;
+  if (b->count >= esp_batch)
+    {
+      esp_batch_flush(b);
+    }
+  return(len);
+}
+#endif /* !__WIN32__ && !RAW_IP_OUT */
+
 void init_espsp()
 {
   if (espsp[0])
@@ -280,7 +556,7 @@ void send_icmp(struct ip *iph, struct ip_esp_hdr *esph)
  * check_icmp_parameter_problem()
  *
  * Check if the socket has received an ICMP packet with type
- * "Parameter Problem".  If so, send an UPDATE address check.
+ * "Parameter Problem".  If so, have hipd send an UPDATE address check.
  */
 void check_icmp_parameter_problem(int s_esp)
 {
@@ -293,11 +569,7 @@ void check_icmp_parameter_problem(int s_esp)
   struct cmsghdr * chdr;
   struct sock_extended_err *ee_msg;
   struct ip_esp_hdr *esph;
-  struct timeval time1;
-  struct sockaddr *addrcheck;
-  sockaddr_list *l;
   __u32 spi;
-  __u32 nonce;
 
   memset(&msg, 0, sizeof(msg));
   memset(msg_buffer, 0,  sizeof(msg_buffer));
@@ -322,32 +594,16 @@ void check_icmp_parameter_problem(int s_esp)
   esph = (struct ip_esp_hdr *)(msg.msg_iov[0].iov_base);
   spi  = ntohl(esph->spi);
 
-  hip_assoc *hip_a = find_hip_association_by_spi(spi, 2);
-  if (hip_a && (hip_a->icmp_update_status == ICMP_UPDATE_UNSET))
+  for (chdr = CMSG_FIRSTHDR(&msg); chdr != NULL; chdr = CMSG_NXTHDR(&msg, chdr))
     {
-      for (chdr = CMSG_FIRSTHDR(&msg); chdr != NULL; chdr = CMSG_NXTHDR(&msg, chdr))
+      if (chdr->cmsg_type == IP_RECVERR)
         {
-          if (chdr->cmsg_type == IP_RECVERR)
+          ee_msg = (struct sock_extended_err *)CMSG_DATA(chdr);
+          if (ee_msg && (SO_EE_ORIGIN_ICMP == ee_msg->ee_origin) &&
+                        (ICMP_PARAMETERPROB == ee_msg->ee_type))
             {
-              ee_msg = (struct sock_extended_err *)CMSG_DATA(chdr);
-              if (ee_msg && (SO_EE_ORIGIN_ICMP == ee_msg->ee_origin) &&
-                            (ICMP_PARAMETERPROB == ee_msg->ee_type))
-                {
-                  /* perform UPDATE address check */
-                  l = &hip_a->peer_hi->addrs;
-                  addrcheck = SA(&l->addr);
-                  gettimeofday(&time1, NULL);
-                  hip_a->icmp_update_status = ICMP_UPDATE_TRIGGERED;
-                  hip_a->rekey = malloc(sizeof(struct rekey_info));
-                  memset(hip_a->rekey, 0, sizeof(struct rekey_info));
-                  hip_a->rekey->update_id = hip_a->hi->update_id++;
-                  hip_a->rekey->need_ack = TRUE;
-                  hip_a->rekey->rk_time.tv_sec = time1.tv_sec;
-                  RAND_bytes((__u8*)&nonce, sizeof(__u32));
-                  l->nonce = nonce;
-                  hip_send_update(hip_a, NULL, NULL, addrcheck);
-                  break;
-                }
+              esp_signal_paramprob(spi);
+              break;
             }
         }
     }
@@ -460,6 +716,7 @@ int track_spi_for_icmp(__u32 spi, struct timeval *now)
    * icmp to trigger an SA update.
    */
   unknown_spi_entry *unknown_spi = NULL;
+  pthread_mutex_lock(&unknown_spi_lock);
   if (!(unknown_spi = get_unknown_spi_entry(unknown_spi_head, spi)))
     {
       /* Prevent resource exhaustion by only tracking a limited
@@ -493,6 +750,7 @@ int track_spi_for_icmp(__u32 spi, struct timeval *now)
        */
       unknown_spi_head = delete_spi_entry(unknown_spi_head, spi);
     }
+  pthread_mutex_unlock(&unknown_spi_lock);
 
   return rc;
 }
@@ -515,9 +773,24 @@ void *hip_esp_output(void *arg)
   int len, err, flags, raw_len, is_broadcast, s = 0, offset = 0;
   fd_set fd;
   struct timeval timeout, now;
-  __u8 raw_buff[BUFF_LEN];
-  __u8 data[BUFF_LEN];       /* encrypted data buffer */
+  __u8 *pktbufs;             /* data and raw_buff, with head/tailroom */
+  int num_pktbufs = 2;
+  __u8 *raw_buff;            /* frame from the TAP, encrypted in place */
+  __u8 *data;                /* replies and broadcast ESP packets */
+  __u8 *out;                 /* encrypted packet */
+  int reader;                /* lock-free SADB reader slot */
   struct ip *iph;
+#ifdef __WIN32__
+  int *rsp = readsp;
+#else
+  esp_queue *q = arg ? (esp_queue*)arg : &esp_queues[0];
+  int *rsp = q->readsp;
+  int rfd, max_fd, sel;
+#endif
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+  esp_send_batch *ob = NULL;
+  int i;
+#endif
 
   // Local storage for sadb entry members
   int sadb_entry_mode = 0;
@@ -530,7 +803,7 @@ void *hip_esp_output(void *arg)
   OVERLAPPED overlapped = { 0 };
 #endif
   struct ip6_hdr *ip6h;
-  static hip_sadb_entry *entry;
+  hip_sadb_entry *entry;
   struct sockaddr_storage ss_lsi;
   struct sockaddr *lsi = (struct sockaddr*)&ss_lsi;
 #ifndef RAW_IP_OUT
@@ -561,7 +834,43 @@ void *hip_esp_output(void *arg)
     }
 #endif /* RAW_IP_OUT */
 
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+  /* ESP packets are queued here and sent with sendmmsg() */
+  if ((esp_batch > 1) && !(ob = malloc(sizeof(esp_send_batch))))
+    {
+      printf("hip_esp_output() malloc() error\n");
+      exit(1);
+    }
+  if (ob)
+    {
+      num_pktbufs = 1 + esp_batch;
+    }
+#endif
+  if (!(pktbufs = malloc(num_pktbufs * ESP_PKTBUF_LEN)))
+    {
+      printf("hip_esp_output() malloc() error\n");
+      exit(1);
+    }
+  data = ESP_PKTBUF(pktbufs, 0);
+  raw_buff = ESP_PKTBUF(pktbufs, 1);
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+  if (ob)
+    {
+      ob->count = 0;
+      for (i = 0; i < esp_batch; i++)
+        {
+          ob->pkt[i] = ESP_PKTBUF(pktbufs, 1 + i);
+        }
+    }
+#endif
+  if ((reader = hip_sadb_reader_add()) < 0)
+    {
+      printf("hip_esp_output() too many SADB readers\n");
+      exit(1);
+    }
+#ifdef __WIN32__
   init_readsp();
+#endif
   lsi->sa_family = AF_INET;
   get_preferred_lsi(lsi);
   g_tap_lsi = LSI4(lsi);
@@ -590,14 +899,30 @@ void *hip_esp_output(void *arg)
   printf("hip_esp_output() thread (tid %u pid %d) started...\n",
          (unsigned)pthread_self(), getpid());
 #else /* HIP_VPLS */
+#ifdef __WIN32__
   printf("hip_esp_output() thread started...\n");
+#else
+  printf("hip_esp_output() thread %d started...\n", q->index);
+#endif
 #endif /* HIP_VPLS */
   while (g_state == 0)
     {
+      /* no SADB pointers are held from the previous packet */
+      hip_sadb_quiescent(reader);
       /* periodic select loop */
       gettimeofday(&now, NULL);
       FD_ZERO(&fd);
-      FD_SET((unsigned)readsp[1], &fd);
+      FD_SET((unsigned)rsp[1], &fd);
+#ifndef __WIN32__
+      /* in direct mode, the socketpair only carries unbuffered packets
+       * and frames that other workers read from their TAP queue */
+      max_fd = rsp[1];
+      if (esp_direct_tap)
+        {
+          FD_SET((unsigned)q->tapfd, &fd);
+          max_fd = (q->tapfd > max_fd) ? q->tapfd : max_fd;
+        }
+#endif
 #ifdef __MACOSX__
       timeout.tv_sec = 1;
       timeout.tv_usec = 0;
@@ -605,15 +930,28 @@ void *hip_esp_output(void *arg)
       timeout.tv_sec = 0;
       timeout.tv_usec = g_read_usec;
 #endif
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+      /* poll while packets are queued, then send them once idle */
+      if (ob && (ob->count > 0))
+        {
+          timeout.tv_usec = 0;
+        }
+#endif
 #ifdef HIP_VPLS
       endbox_periodic_heartbeat(&now_time, &last_time, &packet_count,
                                 "output", touchHeartbeat);
       endbox_check_hello_time(&now_time);
 #endif
 
+#ifdef __WIN32__
       if ((err =
-             select(readsp[1] + 1, &fd, NULL, NULL,
+             select(rsp[1] + 1, &fd, NULL, NULL,
                     &timeout)) < 0)
+#else
+      if ((err =
+             select(max_fd + 1, &fd, NULL, NULL,
+                    &timeout)) < 0)
+#endif
         {
           if (IS_EINTR_ERROR())
             {
@@ -624,21 +962,35 @@ void *hip_esp_output(void *arg)
       else if (err == 0)
         {
           /* idle cycle */
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+          if (ob && (ob->count > 0))
+            {
+              esp_batch_flush(ob);
+            }
+#endif
           continue;
         }
 
-      /* output data on socket */
-      memset(raw_buff, 0, sizeof(raw_buff));
-      memset(data, 0, sizeof(data));
+      /* output data on socket; buffers are not cleared, since every
+       * byte that is sent has been written for this packet */
       memset(lsi, 0, sizeof(struct sockaddr_storage));
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+      /* read into the buffer of the next batch slot, so that the packet
+       * is encrypted and queued without copying */
+      if (ob)
+        {
+          raw_buff = ob->pkt[ob->count];
+        }
+#endif
 
 #ifdef __WIN32__
       if ((len =
-             recv(readsp[1], raw_buff, BUFF_LEN,
+             recv(rsp[1], raw_buff, BUFF_LEN,
                   0)) == SOCKET_ERROR)
         {
 #else
-      if ((len = read(readsp[1], raw_buff, BUFF_LEN)) < 0)
+      rfd = (esp_direct_tap && FD_ISSET(q->tapfd, &fd)) ? q->tapfd : rsp[1];
+      if ((len = read(rfd, raw_buff, BUFF_LEN)) < 0)
         {
 #endif
           if (IS_EINTR_ERROR())
@@ -649,6 +1001,23 @@ void *hip_esp_output(void *arg)
                  strerror(errno));
           exit(0);
         }
+#ifndef __WIN32__
+      /* the kernel picks the TAP queue by flow, not by peer; hand frames
+       * for another queue's peers to that worker, so each SA is only
+       * encrypted by one worker and its packets stay in order. Don't
+       * block, since that worker may be forwarding to this one. */
+      if ((rfd == q->tapfd) && (num_esp_queues > 1) &&
+          ((sel = esp_queue_select(raw_buff, len)) != q->index))
+        {
+          if ((err = send(esp_queues[sel].readsp[0], raw_buff, len,
+                          MSG_DONTWAIT)) != len)
+            {
+              printf("warning: hip_esp_output: send(%d) to queue %d "
+                     "returned %d\n", len, sel, err);
+            }
+          continue;
+        }
+#endif
       /*
        * IPv4
        */
@@ -739,8 +1108,11 @@ void *hip_esp_output(void *arg)
               pthread_mutex_lock(&entry->rw_lock);
 #if defined RAW_IP_OUT
               offset = sizeof(struct ip);
+              out = data;
 #else
               offset = 0;
+              /* a broadcast is encrypted once for each entry */
+              out = is_broadcast ? data : raw_buff;
 #endif
               if (check_esp_seqno_overflow(entry))
                 {
@@ -748,13 +1120,15 @@ void *hip_esp_output(void *arg)
                 }
               err = hip_esp_encrypt(raw_buff,
                                     raw_len,
-                                    &data[offset],
+                                    out,
+                                    &offset,
                                     &len,
                                     entry,
                                     &now);
+              out = &out[offset];
               if (err < 0)
                 {
-                  entry->dropped++;
+                  hip_sadb_inc_dropped(entry, reader);
                 }
 
 			  // Save entry variables locally for later use
@@ -819,7 +1193,24 @@ void *hip_esp_output(void *arg)
                   log_(WARN, "Continuing after unknown SADB entry mode: %d\n", sadb_entry_mode);
                   continue;
                 }
-              err = sendto(s, data, len, flags,
+#ifndef __WIN32__
+              if (ob && !is_broadcast)
+                {
+                  err = esp_batch_sendto(ob, s, out, len,
+                                         SA(&local_dst_addr_storage));
+                }
+              else if (ob)
+                {
+                  /* broadcasts are encrypted into the shared data
+                   * buffer, send them after the queued packets */
+                  esp_batch_flush(ob);
+                  err = sendto(s, out, len, flags,
+                               SA(&local_dst_addr_storage),
+                               SALEN(&local_dst_addr_storage));
+                }
+              else
+#endif
+              err = sendto(s, out, len, flags,
                            SA(&local_dst_addr_storage),
                            SALEN(&local_dst_addr_storage));
 #endif /* RAW_IP_OUT */
@@ -830,12 +1221,8 @@ void *hip_esp_output(void *arg)
                 }
               else
                 {
-                  hip_sadb_inc_bytes(
-                    entry,
-                    sizeof(struct ip) +
-                    err,
-                    &now,
-                    1);
+                  hip_sadb_inc_bytes(entry, reader,
+                                     sizeof(struct ip) + err, &now);
                 }
 #ifndef RAW_IP_OUT
 /* DMattes: 16-Nov-2012: I don't believe VPLS mode uses multihoming
@@ -848,7 +1235,16 @@ void *hip_esp_output(void *arg)
               for (l = entry->dst_addrs->next; l;
                    l = l->next)
                 {
-                  err = sendto(s, data, len, flags,
+#ifndef __WIN32__
+                  /* queued after the primary packet, sharing its buffer */
+                  if (ob && !is_broadcast)
+                    {
+                      err = esp_batch_sendto(ob, s, out, len,
+                                             SA(&l->addr));
+                    }
+                  else
+#endif
+                  err = sendto(s, out, len, flags,
                                SA(&l->addr),
                                SALEN(&l->addr));
                   if (err < 0)
@@ -897,7 +1293,7 @@ void *hip_esp_output(void *arg)
                           "failed.\n");
                 }
 #else
-              if (write(tapfd, data, len) < 0)
+              if (write(q->tapfd, data, len) < 0)
                 {
                   printf( "hip_esp_output write() " \
                           "failed.\n");
@@ -927,11 +1323,13 @@ void *hip_esp_output(void *arg)
             {
               esp_start_expire(entry->spi);
             }
+          offset = 0;
           err = hip_esp_encrypt(raw_buff, raw_len,
-                                data, &len, entry, &now);
+                                raw_buff, &offset, &len, entry, &now);
+          out = &raw_buff[offset];
           if (err < 0)
             {
-              entry->dropped++;
+              hip_sadb_inc_dropped(entry, reader);
             }
 
 		  // Save entry variables locally for later use
@@ -963,7 +1361,15 @@ void *hip_esp_output(void *arg)
               log_(WARN, "Continuing after unknown SADB entry mode: %d\n", sadb_entry_mode);
               continue;
             }
-          err = sendto(   s, data, len, flags,
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+          if (ob)
+            {
+              err = esp_batch_sendto(ob, s, out, len,
+                                     SA(&local_dst_addr_storage));
+            }
+          else
+#endif
+          err = sendto(   s, out, len, flags,
                           SA(&local_dst_addr_storage),
                           SALEN(&local_dst_addr_storage));
           if (err < 0)
@@ -973,9 +1379,8 @@ void *hip_esp_output(void *arg)
             }
           else
             {
-              hip_sadb_inc_bytes(entry,
-                                 sizeof(struct ip6_hdr) + err,
-                                 &now, 1);
+              hip_sadb_inc_bytes(entry, reader,
+                                 sizeof(struct ip6_hdr) + err, &now);
             }
           /*
            * ARP
@@ -1002,7 +1407,7 @@ void *hip_esp_output(void *arg)
               printf("hip_esp_output WriteFile() failed.\n");
             }
 #else
-          if (write(tapfd, data, len) < 0)
+          if (write(q->tapfd, data, len) < 0)
             {
               printf("hip_esp_output write() failed.\n");
             }
@@ -1035,15 +1440,19 @@ void *hip_esp_output(void *arg)
               pthread_mutex_lock(&entry->rw_lock);
 #ifdef RAW_IP_OUT
               offset = sizeof(struct ip);
+              out = data;
 #else
               offset = 0;
+              out = raw_buff;
 #endif
               err = hip_esp_encrypt(raw_buff,
                                     raw_len,
-                                    &data[offset],
+                                    out,
+                                    &offset,
                                     &len,
                                     entry,
                                     &now);
+              out = &out[offset];
 
               // Save entry variables locally for later use
 #ifdef RAW_IP_OUT
@@ -1097,7 +1506,7 @@ void *hip_esp_output(void *arg)
                   continue;
                 }
 
-              err = sendto(s, data, len, flags,
+              err = sendto(s, out, len, flags,
                            SA(&local_dst_addr_storage),
                            SALEN(&local_dst_addr_storage));
 #endif /* RAW_IP_OUT */
@@ -1108,11 +1517,8 @@ void *hip_esp_output(void *arg)
                 }
               else
                 {
-                  pthread_mutex_lock(&entry->rw_lock);
-                  entry->bytes += sizeof(struct ip) + err;
-                  entry->usetime.tv_sec = now.tv_sec;
-                  entry->usetime.tv_usec = now.tv_usec;
-                  pthread_mutex_unlock(&entry->rw_lock);
+                  hip_sadb_inc_bytes(entry, reader,
+                                     sizeof(struct ip) + err, &now);
                 }
             }
 #endif /* HIP_VPLS */
@@ -1143,6 +1549,13 @@ void *hip_esp_output(void *arg)
         }
 
     }
+#if !defined(__WIN32__) && !defined(RAW_IP_OUT)
+  if (ob)
+    {
+      esp_batch_flush(ob);
+      free(ob);
+    }
+#endif
   /* write some data to flush waiting TAP threads, speed up exit */
   data[0] = 0;
   len = 1;
@@ -1150,9 +1563,11 @@ void *hip_esp_output(void *arg)
   WriteFile(tapfd, data, len, &lenin, &overlapped);
   CloseHandle(tapfd);
 #else
-  err = write(tapfd, data, len);
-  close(tapfd);
+  err = write(q->tapfd, data, len);
+  close(q->tapfd);
 #endif
+  free(pktbufs);
+  hip_sadb_reader_remove(reader);
   printf("hip_esp_output() thread shutdown.\n");
   fflush(stdout);
   tunreader_shutdown();
@@ -1179,8 +1594,11 @@ void *hip_esp_input(void *arg)
   int err, len, max_fd, offset;
   fd_set fd;
   struct timeval timeout, now;
-  __u8 buff[BUFF_LEN];       /* raw, encrypted data buffer */
-  __u8 data[BUFF_LEN];       /* decrypted data buffer */
+  __u8 *buff;                /* raw data buffer, decrypted in place */
+  __u8 *pktbufs;             /* receive buffers with headroom */
+  __u8 *bufs[MAX_ESP_BATCH];
+  int lens[MAX_ESP_BATCH], i, num;
+  int reader;                /* lock-free SADB reader slot */
   struct sockaddr_storage ss_lsi;
   struct sockaddr *lsi = (struct sockaddr*) &ss_lsi;
   struct ip *iph;
@@ -1192,6 +1610,16 @@ void *hip_esp_input(void *arg)
 #ifdef __WIN32__
   DWORD lenin;
   OVERLAPPED overlapped = { 0 };
+  int q_esp = s_esp, q_esp_udp = s_esp_udp;
+  int first_queue = TRUE;
+#else
+  esp_queue *q = arg ? (esp_queue*)arg : &esp_queues[0];
+  int q_esp = q->s_esp, q_esp_udp = q->s_esp_udp;
+#ifndef __MACOSX__
+  int q_esp6 = q->s_esp6;
+#endif
+  /* the first queue also performs the periodic housekeeping */
+  int first_queue = (q->index == 0);
 #endif
 #ifdef HIP_VPLS
   time_t last_time, now_time;
@@ -1205,7 +1633,27 @@ void *hip_esp_input(void *arg)
 #else
   printf("hip_esp_input() thread started...\n");
 #endif
-  g_read_usec = 1000000;
+  if (first_queue)
+    {
+      g_read_usec = 1000000;
+    }
+
+  /* receive buffers for recvmmsg(); the headroom holds the Ethernet
+   * and IP headers that replace the ESP encapsulation */
+  if (!(pktbufs = malloc(esp_batch * ESP_PKTBUF_LEN)))
+    {
+      printf("hip_esp_input() malloc() error\n");
+      exit(1);
+    }
+  for (i = 0; i < esp_batch; i++)
+    {
+      bufs[i] = ESP_PKTBUF(pktbufs, i);
+    }
+  if ((reader = hip_sadb_reader_add()) < 0)
+    {
+      printf("hip_esp_input() too many SADB readers\n");
+      exit(1);
+    }
 
   lsi->sa_family = AF_INET;
   get_preferred_lsi(lsi);
@@ -1221,7 +1669,7 @@ void *hip_esp_input(void *arg)
       mreq.imr_multiaddr.s_addr = 
         LSI4(&static_multicast_entry->dst_addrs->addr);
       mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-      if (setsockopt(s_esp, IPPROTO_IP, IP_ADD_MEMBERSHIP, 
+      if (setsockopt(q_esp, IPPROTO_IP, IP_ADD_MEMBERSHIP, 
                      &mreq, sizeof(mreq)) < 0)
         {
           printf("*** setsockopt(multicast_ttl) error for esp socket in "
@@ -1237,27 +1685,35 @@ void *hip_esp_input(void *arg)
 #endif /* HIP_VPLS */
 
 #ifndef __WIN32__
-  unknown_spi_head = NULL;
-  unknown_spi_entry_count = 0;
+  if (first_queue)
+    {
+      unknown_spi_head = NULL;
+      unknown_spi_entry_count = 0;
+    }
 #endif
 
   while (g_state == 0)
     {
+      /* no SADB pointers are held from the previous batch */
+      hip_sadb_quiescent(reader);
       gettimeofday(&now, NULL);
       FD_ZERO(&fd);
-      FD_SET((unsigned)s_esp, &fd);
-      FD_SET((unsigned)s_esp_udp, &fd);
+      FD_SET((unsigned)q_esp, &fd);
+      FD_SET((unsigned)q_esp_udp, &fd);
 #ifdef __WIN32__
       /* IPv6 ESP not available in Windows. Separate UDP datagram
        * socket not needed. */
-      max_fd = (s_esp > s_esp_udp) ? s_esp : s_esp_udp;
+      max_fd = (q_esp > q_esp_udp) ? q_esp : q_esp_udp;
 #else
-      FD_SET((unsigned)s_esp_udp_dg, &fd);
+      if (first_queue)
+        {
+          FD_SET((unsigned)s_esp_udp_dg, &fd);
+        }
 #ifdef __MACOSX__
-      max_fd = maxof(3, s_esp, s_esp_udp, s_esp_udp_dg);
+      max_fd = maxof(3, q_esp, q_esp_udp, s_esp_udp_dg);
 #else /* __MACOSX__ */
-      FD_SET((unsigned)s_esp6, &fd);
-      max_fd = maxof(4, s_esp, s_esp6, s_esp_udp, s_esp_udp_dg);
+      FD_SET((unsigned)q_esp6, &fd);
+      max_fd = maxof(4, q_esp, q_esp6, q_esp_udp, s_esp_udp_dg);
 #endif /* __MACOSX__ */
 #endif /* __WIN32__ */
 #ifdef __MACOSX__
@@ -1267,8 +1723,6 @@ void *hip_esp_input(void *arg)
       timeout.tv_sec = 0;
       timeout.tv_usec = g_read_usec;
 #endif /* __MACOSX__ */
-      memset(buff, 0, sizeof(buff));
-      memset(data, 0, sizeof(data));
 
       /* periodic functions called every g_read_usec timeout */
 #ifdef HIP_VPLS
@@ -1277,16 +1731,19 @@ void *hip_esp_input(void *arg)
 
 #endif
 
-#ifndef __WIN32__
-	  if ( HCNF.icmp_timeout > 0)
+      if (first_queue)
         {
-          unknown_spi_head = expire_old_unknown_spi_entries(unknown_spi_head, &now);
-        }
+#ifndef __WIN32__
+          if (HCNF.icmp_timeout > 0)
+            {
+              pthread_mutex_lock(&unknown_spi_lock);
+              unknown_spi_head =
+                expire_old_unknown_spi_entries(unknown_spi_head, &now);
+              pthread_mutex_unlock(&unknown_spi_lock);
+            }
 #endif
-
-      hip_remove_expired_lsi_entries(&now);           /* unbuffer packets */
-      hip_remove_expired_sel_entries(&now);           /* this is rate-limited */
-      hip_sadb_expire(&now);
+          /* SA, LSI and selector expiry run in hip_sadb_timers() */
+        }
 
       if ((err =
              select(max_fd + 1, &fd, NULL, NULL,
@@ -1299,218 +1756,226 @@ void *hip_esp_input(void *arg)
           printf("hip_esp_input(): select() error %s\n",
                  strerror(errno));
         }
-      else if (FD_ISSET(s_esp, &fd))
+      else if (FD_ISSET(q_esp, &fd))
         {
-#ifdef __WIN32__
-          len = recv(s_esp, buff, sizeof(buff), 0);
-#else
-          len = read(s_esp, buff, sizeof(buff));
-#endif
-          if (len < 0)
+          num = esp_recv_batch(q_esp, bufs, lens, esp_batch);
+          if (num < 0)
             {
 #ifndef __WIN32__
               if ( HCNF.icmp_timeout > 0)
                 {
                   log_(NORM, "Checking for icmp parameter problems\n");
-                  check_icmp_parameter_problem(s_esp);
+                  check_icmp_parameter_problem(q_esp);
                 }
 #endif
               continue;
             }
-          iph = (struct ip *) &buff[0];
-          esph = (struct ip_esp_hdr *) &buff[sizeof(struct ip)];
-          spi  = ntohl(esph->spi);
-          if (!(entry = hip_sadb_lookup_spi(spi)))
+          for (i = 0; i < num; i++)
             {
-              printf("Warning: SA not found for SPI 0x%x\n", spi);
-#ifndef __WIN32__
-              if (HCNF.icmp_timeout > 0)
+              buff = bufs[i];
+              len = lens[i];
+              iph = (struct ip *) &buff[0];
+              esph = (struct ip_esp_hdr *) &buff[sizeof(struct ip)];
+              spi  = ntohl(esph->spi);
+              if (!(entry = hip_sadb_lookup_spi(spi)))
                 {
-                  if (track_spi_for_icmp(spi, &now))
+                  printf("Warning: SA not found for SPI 0x%x\n", spi);
+#ifndef __WIN32__
+                  if (HCNF.icmp_timeout > 0)
                     {
-                      log_(NORM, "Sending icmp to host\n");
-                      send_icmp(iph, esph);
+                      if (track_spi_for_icmp(spi, &now))
+                        {
+                          log_(NORM, "Sending icmp to host\n");
+                          send_icmp(iph, esph);
+                        }
                     }
-                }
 #endif
-              continue;
-            }
-          pthread_mutex_lock(&entry->rw_lock);
-          err = hip_esp_decrypt(buff, len, data, &offset, &len,
-                                entry, iph, &now);
-          if (err < 0)
-            {
-              entry->dropped++;
-            }
-          pthread_mutex_unlock(&entry->rw_lock);
-          if (err)
-            {
-              continue;
-            }
+                  continue;
+                }
+              pthread_mutex_lock(&entry->rw_lock);
+              err = hip_esp_decrypt(buff, len, buff, &offset, &len,
+                                    entry, iph, &now, reader);
+              if (err < 0)
+                {
+                  hip_sadb_inc_dropped(entry, reader);
+                }
+              pthread_mutex_unlock(&entry->rw_lock);
+              if (err)
+                {
+                  continue;
+                }
 #ifdef __WIN32__
-          if (!WriteFile(tapfd, &data[offset], len, &lenin,
-                         &overlapped))
-            {
-              printf("hip_esp_input() WriteFile() failed.\n");
-              continue;
-            }
+              if (!WriteFile(tapfd, &buff[offset], len, &lenin,
+                             &overlapped))
+                {
+                  printf("hip_esp_input() WriteFile() failed.\n");
+                  continue;
+                }
 #else /* __WIN32__ */
 #ifdef HIP_VPLS
-          packet_count++;
-          iph =
-            (struct ip*) &data[offset +
-                               sizeof(struct eth_hdr)];
-          if (entry->mode == 4)
-            {
-              /* Static multicast SA decrypts incorrectly when AES is used */
-              if ((iph->ip_v != IPVERSION) || (iph->ip_hl != 5))
+              packet_count++;
+              iph =
+                (struct ip*) &buff[offset +
+                                   sizeof(struct eth_hdr)];
+              if (entry->mode == 4)
                 {
-                  printf("hip_esp_input() corrupt multicast packet\n");
-                  continue;
+                  /* Static multicast SA decrypts incorrectly when AES is used */
+                  if ((iph->ip_v != IPVERSION) || (iph->ip_hl != 5))
+                    {
+                      printf("hip_esp_input() corrupt multicast packet\n");
+                      continue;
+                    }
                 }
-            }
-          endbox_ipv4_multicast_write(data, offset, len);
+              endbox_ipv4_multicast_write(buff, offset, len);
 #else /* HIP_VPLS */
-          if (write(tapfd, &data[offset], len) < 0)
-            {
-              printf("hip_esp_input() write() failed.\n");
-            }
+              if (write(q->tapfd, &buff[offset], len) < 0)
+                {
+                  printf("hip_esp_input() write() failed.\n");
+                }
 #endif /* HIP_VPLS */
 #endif /* __WIN32__ */
+            }
         }
-      else if (FD_ISSET(s_esp_udp, &fd))
+      else if (FD_ISSET(q_esp_udp, &fd))
         {
-#ifdef __WIN32__
-          len = recv(s_esp_udp, buff, sizeof(buff), 0);
-#else
-          len = read(s_esp_udp, buff, sizeof(buff));
-#endif /* __WIN32__ */
-
-          if (len < 0)
+          num = esp_recv_batch(q_esp_udp, bufs, lens, esp_batch);
+          if (num < 0)
             {
 #ifndef __WIN32__
               if ( HCNF.icmp_timeout > 0)
                 {
                   log_(NORM, "Checking for icmp parameter problems\n");
-                  check_icmp_parameter_problem(s_esp_udp);
+                  check_icmp_parameter_problem(q_esp_udp);
                 }
 #endif
               continue;
             }
 
-          if (len < (sizeof(struct ip) + sizeof(udphdr)))
-            {
-              continue;                   /* packet too short */
-            }
-          iph = (struct ip*) &buff[0];
-          udph = (udphdr*) &buff[sizeof(struct ip)];
-          esph = (struct ip_esp_hdr *) \
-                 &buff[sizeof(struct ip) + sizeof(udphdr)];
-          spi     = ntohl(esph->spi);
-          /*seq_no = ntohl(esph->seq_no);*/
-
-          /* SOCK_RAW receives all UDP traffic, not just
-           * HIP_UDP_PORT, even though we used bind(). */
-          if (HIP_UDP_PORT != ntohs(udph->dst_port))
+          for (i = 0; i < num; i++)
             {
-              /*	printf("ignoring %d bytes from UDP port
-               * %d\n",
-               *               len, ntohs(udph->dst_port)); */
-              continue;
-            }
+              buff = bufs[i];
+              len = lens[i];
+              if (len < (sizeof(struct ip) + sizeof(udphdr)))
+                {
+                  continue;                   /* packet too short */
+                }
+              iph = (struct ip*) &buff[0];
+              udph = (udphdr*) &buff[sizeof(struct ip)];
+              esph = (struct ip_esp_hdr *) \
+                     &buff[sizeof(struct ip) + sizeof(udphdr)];
+              spi     = ntohl(esph->spi);
+              /*seq_no = ntohl(esph->seq_no);*/
+
+              /* SOCK_RAW receives all UDP traffic, not just
+               * HIP_UDP_PORT, even though we used bind(). */
+              if (HIP_UDP_PORT != ntohs(udph->dst_port))
+                {
+                  /*	printf("ignoring %d bytes from UDP port
+                   * %d\n",
+                   *               len, ntohs(udph->dst_port)); */
+                  continue;
+                }
 
-          /* UDP packet with SPI of zero is a HIP control packet,
-           * send it to the hipd thread via ESP socketpair.
-           */
-          if (0x0 == spi)
-            {
-              esp_receive_udp_hip_packet((char *)buff, len);
-              continue;
-            }
+              /* UDP packet with SPI of zero is a HIP control packet,
+               * send it to the hipd thread via ESP socketpair.
+               */
+              if (0x0 == spi)
+                {
+                  esp_receive_udp_hip_packet((char *)buff, len);
+                  continue;
+                }
 
-          if (!(entry = hip_sadb_lookup_spi(spi)))
-            {
-              printf("Warning: SA not found for SPI 0x%x\n", spi);
-#ifndef __WIN32__
-              if (HCNF.icmp_timeout > 0)
+              if (!(entry = hip_sadb_lookup_spi(spi)))
                 {
-                  if (track_spi_for_icmp(spi, &now))
+                  printf("Warning: SA not found for SPI 0x%x\n", spi);
+#ifndef __WIN32__
+                  if (HCNF.icmp_timeout > 0)
                     {
-                      log_(NORM, "Sending icmp to host\n");
-                      send_icmp(iph, esph);
+                      if (track_spi_for_icmp(spi, &now))
+                        {
+                          log_(NORM, "Sending icmp to host\n");
+                          send_icmp(iph, esph);
+                        }
                     }
-                }
 #endif
-              continue;
-            }
+                  continue;
+                }
 
-          pthread_mutex_lock(&entry->rw_lock);
-          err = hip_esp_decrypt(buff, len, data, &offset, &len,
-                                entry, iph, &now);
-          if (err < 0)
-            {
-              entry->dropped++;
-            }
-          pthread_mutex_unlock(&entry->rw_lock);
-          /* these two locks acquired by hip_sadb_lookup_addr */
-          if (err)
-            {
-              continue;
-            }
+              pthread_mutex_lock(&entry->rw_lock);
+              err = hip_esp_decrypt(buff, len, buff, &offset, &len,
+                                    entry, iph, &now, reader);
+              if (err < 0)
+                {
+                  hip_sadb_inc_dropped(entry, reader);
+                }
+              pthread_mutex_unlock(&entry->rw_lock);
+              if (err)
+                {
+                  continue;
+                }
 
 #ifdef __WIN32__
-          if (!WriteFile(tapfd, &data[offset], len, &lenin,
-                         &overlapped))
-            {
-              printf("hip_esp_input() WriteFile() failed.\n");
-              continue;
-            }
+              if (!WriteFile(tapfd, &buff[offset], len, &lenin,
+                             &overlapped))
+                {
+                  printf("hip_esp_input() WriteFile() failed.\n");
+                  continue;
+                }
 #else
-          if (write(tapfd, &data[offset], len) < 0)
-            {
-              printf("hip_esp_input() write() failed.\n");
-            }
+              if (write(q->tapfd, &buff[offset], len) < 0)
+                {
+                  printf("hip_esp_input() write() failed.\n");
+                }
 #endif
+            }
 
 #ifndef __WIN32__
         }
       else if (FD_ISSET(s_esp_udp_dg, &fd))
         {
-          len = read(s_esp_udp_dg, buff, sizeof(buff));
+          len = read(s_esp_udp_dg, bufs[0], BUFF_LEN);
           /* This data is ignored, it was already received by the
            * s_esp_udp RAW socket. This bound datagram socket
            * prevents ICMP port unreachable messages. */
           continue;
 #ifndef __MACOSX__
         }
-      else if (FD_ISSET(s_esp6, &fd))
+      else if (FD_ISSET(q_esp6, &fd))
         {
-          len = read(s_esp6, buff, sizeof(buff));
-          /* there is no IPv6 header supplied */
-          esph = (struct ip_esp_hdr *) &buff[0];
-          spi     = ntohl(esph->spi);
-          /* seq_no = ntohl(esph->seq_no);*/
-          if (!(entry = hip_sadb_lookup_spi(spi)))
-            {
-              printf("Warning: SA not found for SPI 0x%x\n",
-                     spi);
-              continue;
-            }
-          pthread_mutex_lock(&entry->rw_lock);
-          err = hip_esp_decrypt(buff, len, data, &offset, &len,
-                                entry, NULL, &now);
-          if (err < 0)
-            {
-              entry->dropped++;
-            }
-          pthread_mutex_unlock(&entry->rw_lock);
-          if (err)
+          if ((num = esp_recv_batch(q_esp6, bufs, lens, esp_batch)) < 0)
             {
               continue;
             }
-          if (write(tapfd, &data[offset], len) < 0)
+          for (i = 0; i < num; i++)
             {
-              printf("hip_esp_input() write() failed.\n");
+              buff = bufs[i];
+              len = lens[i];
+              /* there is no IPv6 header supplied */
+              esph = (struct ip_esp_hdr *) &buff[0];
+              spi     = ntohl(esph->spi);
+              /* seq_no = ntohl(esph->seq_no);*/
+              if (!(entry = hip_sadb_lookup_spi(spi)))
+                {
+                  printf("Warning: SA not found for SPI 0x%x\n",
+                         spi);
+                  continue;
+                }
+              pthread_mutex_lock(&entry->rw_lock);
+              err = hip_esp_decrypt(buff, len, buff, &offset, &len,
+                                    entry, NULL, &now, reader);
+              if (err < 0)
+                {
+                  hip_sadb_inc_dropped(entry, reader);
+                }
+              pthread_mutex_unlock(&entry->rw_lock);
+              if (err)
+                {
+                  continue;
+                }
+              if (write(q->tapfd, &buff[offset], len) < 0)
+                {
+                  printf("hip_esp_input() write() failed.\n");
+                }
             }
 #endif /* !__MACOSX__ */
 #endif /* !__WIN32__ */
@@ -1521,6 +1986,8 @@ void *hip_esp_input(void *arg)
         }
     }
 
+  free(pktbufs);
+  hip_sadb_reader_remove(reader);
   printf("hip_esp_input() thread shutdown.\n");
   fflush(stdout);
 #ifndef __WIN32__
@@ -1590,19 +2057,20 @@ void *tunreader(void *arg)
   char buf[BUFF_LEN];
   struct timeval timeout;
   fd_set read_fdset;
+  esp_queue *q = arg ? (esp_queue*)arg : &esp_queues[0];
+  int tapfd = q->tapfd;
 
 #ifdef HIP_VPLS
   time_t last_time, last_hello_time, now_time;
 
   last_time = time(NULL);
   last_hello_time = time(NULL);
-  printf("tunreader() thread (tid %d pid %d) started (%d)...\n",
-         (unsigned)pthread_self(), getpid(), tapfd);
+  printf("tunreader() thread (tid %d pid %d) started (%d/%d)...\n",
+         (unsigned)pthread_self(), getpid(), q->index, tapfd);
 #else
-  printf("tunreader() thread started (%d)...\n", tapfd);
+  printf("tunreader() thread started (%d/%d)...\n", q->index, tapfd);
 #endif
 
-  init_readsp();
   while (g_state == 0)
     {
       FD_ZERO(&read_fdset);
@@ -1611,14 +2079,14 @@ void *tunreader(void *arg)
       timeout.tv_usec = 0;
 #ifdef HIP_VPLS
       now_time = time(NULL);
-      if ((HCNF.endbox_heartbeat_time > 0) &&
+      if ((q->index == 0) && (HCNF.endbox_heartbeat_time > 0) &&
           (now_time - last_time > HCNF.endbox_heartbeat_time))
         {
           printf("tunreader() heartbeat\n");
           last_time = now_time;
           utime("/usr/local/etc/hip/heartbeat_tunreader", NULL);
         }
-      if ((HCNF.endbox_hello_time > 0) &&
+      if ((q->index == 0) && (HCNF.endbox_hello_time > 0) &&
           (now_time - last_hello_time > HCNF.endbox_hello_time))
         {
           last_hello_time = now_time;
@@ -1641,7 +2109,9 @@ void *tunreader(void *arg)
         {
           if ((len = read(tapfd, buf, BUFF_LEN)) > 0)
             {
-              err = write(readsp[0], buf, len);
+              /* steer by destination so per-SA ordering is kept */
+              err = write(esp_queues[esp_queue_select((__u8*)buf, len)].
+                          readsp[0], buf, len);
               if (err != len)
                 {
                   printf("warning: tunreader: write(%d) "
@@ -1868,26 +2338,152 @@ int handle_arp(__u8 *in, int len, __u8 *out, int *outlen, struct sockaddr *addr)
   return(0);
 }
 
+/*
+ * hip_esp_iv_len()
+ *
+ * Length of the IV carried in each ESP packet for an encryption transform.
+ */
+int hip_esp_iv_len(__u32 e_type)
+{
+  switch (e_type)
+    {
+    case SADB_EALG_3DESCBC:
+    case SADB_X_EALG_BLOWFISHCBC:
+      return(8);
+    case SADB_X_EALG_AESCBC:
+      return(16);
+#ifdef HIP_ESP_AES_GCM
+    case SADB_X_EALG_AES_GCM_ICV16:
+      return(8);
+#endif /* HIP_ESP_AES_GCM */
+    default:
+      return(0);
+    }
+}
+
+/*
+ * hip_esp_hmac()
+ *
+ * Compute the HMAC of data using the SA's keyed context. Resetting the
+ * context reuses the inner and outer pads computed in hip_sadb_add().
+ */
+int hip_esp_hmac(hip_sadb_entry *entry, __u8 *data, int len,
+                 __u8 *md, unsigned int *md_len)
+{
+  if (!HMAC_Init_ex(entry->hmac_ctx, NULL, 0, NULL, NULL) ||
+      !HMAC_Update(entry->hmac_ctx, data, len) ||
+      !HMAC_Final(entry->hmac_ctx, md, md_len))
+    {
+      return(-1);
+    }
+  return(0);
+}
+
+/*
+ * hip_esp_cipher_reset()
+ *
+ * Load a new IV into the SA's keyed cipher context. The key is only
+ * expanded again if the context was last used for the other direction,
+ * as with static multicast SAs.
+ */
+int hip_esp_cipher_reset(hip_sadb_entry *entry, __u8 *iv, int enc)
+{
+  __u8 *key = NULL;
+
+  if (entry->cipher_enc != enc)
+    {
+      key = entry->e_key;
+      entry->cipher_enc = enc;
+    }
+  if (!EVP_CipherInit_ex(entry->cipher_ctx, NULL, NULL, key, iv, enc))
+    {
+      return(-1);
+    }
+  return(0);
+}
+
+#ifdef HIP_ESP_AES_GCM
+/*
+ * hip_esp_gcm_crypt()
+ *
+ * in:		entry	the SADB entry
+ *              esp	ESP header, followed by the 8-byte IV
+ *              in	pointer of data to encrypt or decrypt
+ *              out	pointer of where to store the result
+ *              len	length of data, not including the ICV
+ *              enc	1 to encrypt, 0 to decrypt
+ *
+ * out:		Returns 0 on success, -1 on error or ICV mismatch.
+ *
+ * AES-GCM per RFC 4106. The nonce is the salt from the end of the key
+ * followed by the IV, and the ESP header is authenticated as additional
+ * data. The ICV is written after (enc) or read from after (dec) the
+ * ciphertext.
+ */
+int hip_esp_gcm_crypt(hip_sadb_entry *entry, struct ip_esp_hdr *esp,
+                      __u8 *in, __u8 *out, int len, int enc)
+{
+  __u8 nonce[ESP_GCM_NONCE_LEN];
+  int outl;
+
+  memcpy(nonce, &entry->e_key[entry->e_keylen - ESP_GCM_SALT_LEN],
+         ESP_GCM_SALT_LEN);
+  memcpy(&nonce[ESP_GCM_SALT_LEN], esp->enc_data, 8);
+  if (hip_esp_cipher_reset(entry, nonce, enc) < 0)
+    {
+      return(-1);
+    }
+  /* SPI and sequence number are the additional authenticated data */
+  if (!EVP_CipherUpdate(entry->cipher_ctx, NULL, &outl, (__u8*)esp,
+                        sizeof(struct ip_esp_hdr)) ||
+      !EVP_CipherUpdate(entry->cipher_ctx, out, &outl, in, len))
+    {
+      return(-1);
+    }
+  if (!enc && !EVP_CIPHER_CTX_ctrl(entry->cipher_ctx, EVP_CTRL_GCM_SET_TAG,
+                                   ESP_GCM_ICV_LEN, &in[len]))
+    {
+      return(-1);
+    }
+  if (EVP_CipherFinal_ex(entry->cipher_ctx, &out[outl], &outl) <= 0)
+    {
+      return(-1);           /* ICV mismatch when decrypting */
+    }
+  if (enc && !EVP_CIPHER_CTX_ctrl(entry->cipher_ctx, EVP_CTRL_GCM_GET_TAG,
+                                  ESP_GCM_ICV_LEN, &out[len]))
+    {
+      return(-1);
+    }
+  return(0);
+}
+#endif /* HIP_ESP_AES_GCM */
+
 /*
  * hip_esp_encrypt()
  *
- * in:		in	pointer of data to encrypt
+ * in:		in	pointer of data to encrypt, with ESP_TAILROOM after it
  *              len	length of data
  *              out	pointer of where to store encrypted data
+ *              offset	offset where encrypted packet is stored: &out[offset]
  *              outlen	returned length of encrypted data
  *              entry   the SADB entry
  *
  * out:		Encrypted data in out, outlen. entry statistics are modified.
  *              Returns 0 on success, -1 otherwise.
  *
- * Perform actual ESP encryption and authentication of packets.
+ * Perform actual ESP encryption and authentication of packets. When out is
+ * the same buffer as in, the packet is encrypted in place: the ESP (and UDP)
+ * header is written over the Ethernet and IP headers, using the
+ * ESP_HEADROOM before in if needed, and offset is set to its start. The
+ * plaintext is lost, so broadcast packets must use a separate out buffer.
  */
-int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
+int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
                     hip_sadb_entry *entry, struct timeval *now)
 {
-  int alen = 0, elen = 0;
+  int alen = 0, elen = 0, outl, in_place = (out == in);
   unsigned int hmac_md_len;
   int i, iv_len = 0, padlen, location, hdr_len;
+  __u8 next_hdr = 0;
   struct ip *iph = NULL;
   struct ip6_hdr *ip6h = NULL;
   struct ip_esp_hdr *esp;
@@ -1927,11 +2523,13 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
       checksum_fix =
 #endif
       rewrite_checksum((__u8*)iph, entry->hit_magic);
+      next_hdr = iph->ip_p;
       break;
     case AF_INET6:
       ip6h = (struct ip6_hdr*) &in[sizeof(struct eth_hdr)];
       hdr_len = sizeof(struct eth_hdr) + sizeof(struct ip6_hdr);
       /* assume HITs are used as v6 src/dst, no checksum rewrite */
+      next_hdr = ip6h->ip6_nxt;
       break;
 #ifdef HIP_VPLS
     case AF_UNSPEC:
@@ -1946,26 +2544,19 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
   elen = len - hdr_len;
 
 
-  /* setup ESP header, common to all algorithms */
-  if (entry->mode == 3)         /*(HIP_ESP_OVER_UDP)*/
-    {
-      udph = (udphdr*) out;
-      esp = (struct ip_esp_hdr*) &out[sizeof(udphdr)];
-      use_udp = TRUE;
-    }
-  else
-    {
-      esp = (struct ip_esp_hdr*) out;
-    }
-  esp->spi = htonl(entry->spi);
-  esp->seq_no = htonl(get_next_seqno(entry));
-  padlen = 0;
-  *outlen = sizeof(struct ip_esp_hdr);
-
-  if (use_udp)         /* (HIP_ESP_OVER_UDP) */
+#ifndef HIP_VPLS
+  /* Record the address family of this packet, so incoming
+   * replies of the same protocol/ports can be matched to
+   * the same family. This reads the upper-layer ports, so it
+   * is done before the packet is encrypted.
+   */
+  if (hip_add_proto_sel_entry(entry->lsi4, next_hdr,
+                              iph ? (__u8*)(iph + 1) : (__u8*)(ip6h + 1),
+                              family, 0, now  ) < 0)
     {
-      *outlen += sizeof(udphdr);
+      printf("hip_esp_encrypt(): error adding sel entry.\n");
     }
+#endif /* HIP_VPLS */
 
   /*
    * Encryption
@@ -1995,22 +2586,22 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
       break;
     case SADB_X_EALG_AESCBC:
       iv_len = 16;
-      if (!entry->aes_key && entry->e_key)
+      if (!entry->cipher_ctx)
         {
-          entry->aes_key = malloc(sizeof(AES_KEY));
-          if (AES_set_encrypt_key(entry->e_key, 8 *
-                                  entry->e_keylen,
-                                  entry->aes_key))
-            {
-              printf("hip_esp_encrypt: AES key problem!\n");
-            }
+          printf("hip_esp_encrypt: AES key missing.\n");
+          return(-1);
         }
-      else if (!entry->aes_key)
+      break;
+#ifdef HIP_ESP_AES_GCM
+    case SADB_X_EALG_AES_GCM_ICV16:
+      iv_len = 8;
+      if (!entry->cipher_ctx)
         {
-          printf("hip_esp_encrypt: AES key missing.\n");
+          printf("hip_esp_encrypt: AES-GCM key missing.\n");
           return(-1);
         }
       break;
+#endif /* HIP_ESP_AES_GCM */
     default:
       printf("Unsupported encryption transform (%d).\n",
              entry->e_type);
@@ -2021,10 +2612,56 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
       break;
     }
 
+  /* setup ESP header, common to all algorithms */
+  use_udp = (entry->mode == 3);         /*(HIP_ESP_OVER_UDP)*/
+  if (in_place)
+    {
+      /* place the headers so the IV ends where the payload begins */
+      *offset = hdr_len - iv_len - sizeof(struct ip_esp_hdr) -
+                (use_udp ? sizeof(udphdr) : 0);
+    }
+  out = &out[*offset];
+  if (use_udp)
+    {
+      udph = (udphdr*) out;
+      esp = (struct ip_esp_hdr*) &out[sizeof(udphdr)];
+    }
+  else
+    {
+      esp = (struct ip_esp_hdr*) out;
+    }
+  esp->spi = htonl(entry->spi);
+  esp->seq_no = htonl(get_next_seqno(entry));
+  padlen = 0;
+  *outlen = sizeof(struct ip_esp_hdr);
+
+  if (use_udp)         /* (HIP_ESP_OVER_UDP) */
+    {
+      *outlen += sizeof(udphdr);
+    }
+
   /* Add initialization vector (random value) */
+#ifdef HIP_ESP_AES_GCM
+  if (entry->e_type == SADB_X_EALG_AES_GCM_ICV16)
+    {
+      /* GCM is a stream mode, so only pad to 4 bytes */
+      if (hip_esp_next_iv(entry, cbc_iv, iv_len) < 0)
+        {
+          printf("hip_esp_encrypt: IV generation failed.\n");
+          return(-1);
+        }
+      memcpy(esp->enc_data, cbc_iv, iv_len);
+      padlen = 4 - ((elen + 2) % 4);
+    }
+  else
+#endif /* HIP_ESP_AES_GCM */
   if (iv_len > 0)
     {
-      RAND_bytes(cbc_iv, iv_len);
+      if (hip_esp_next_iv(entry, cbc_iv, iv_len) < 0)
+        {
+          printf("hip_esp_encrypt: IV generation failed.\n");
+          return(-1);
+        }
       memcpy(esp->enc_data, cbc_iv, iv_len);
       padlen = iv_len - ((elen + 2) % iv_len);
     }
@@ -2041,23 +2678,12 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
     }
   padinfo = (struct ip_esp_padinfo*) &in[location + padlen];
   padinfo->pad_length = padlen;
-#ifdef HIP_VPLS
-  if (family == AF_UNSPEC)
-    {
-      padinfo->next_hdr = 0;
-    }
-  else
-    {
-      padinfo->next_hdr = (family == AF_INET) ? iph->ip_p : ip6h->ip6_nxt;
-    }
-#else
-  padinfo->next_hdr = (family == AF_INET) ? iph->ip_p : ip6h->ip6_nxt;
-#endif
+  padinfo->next_hdr = next_hdr;
   /* padinfo is encrypted too */
   elen += padlen + 2;
 
   /* Apply the encryption cipher directly into out buffer
-   * to avoid extra copying */
+   * to avoid extra copying; the ciphers allow in == out */
   switch (entry->e_type)
     {
     case SADB_EALG_3DESCBC:
@@ -2072,13 +2698,32 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
                      entry->bf_key, cbc_iv, BF_ENCRYPT);
       break;
     case SADB_EALG_NULL:
-      memcpy(esp->enc_data, &in[hdr_len], elen);
+      if (!in_place)
+        {
+          memcpy(esp->enc_data, &in[hdr_len], elen);
+        }
       break;
     case SADB_X_EALG_AESCBC:
-      AES_cbc_encrypt(&in[hdr_len],
-                      &esp->enc_data[iv_len], elen,
-                      entry->aes_key, cbc_iv, AES_ENCRYPT);
+      if ((hip_esp_cipher_reset(entry, cbc_iv, 1) < 0) ||
+          !EVP_CipherUpdate(entry->cipher_ctx, &esp->enc_data[iv_len],
+                            &outl, &in[hdr_len], elen))
+        {
+          printf("hip_esp_encrypt: AES encryption failed.\n");
+          return(-1);
+        }
+      break;
+#ifdef HIP_ESP_AES_GCM
+    case SADB_X_EALG_AES_GCM_ICV16:
+      /* encrypts and appends the ICV, no separate auth pass */
+      if (hip_esp_gcm_crypt(entry, esp, &in[hdr_len],
+                            &esp->enc_data[iv_len], elen, 1) < 0)
+        {
+          printf("hip_esp_encrypt: AES-GCM encryption failed.\n");
+          return(-1);
+        }
+      *outlen += ESP_GCM_ICV_LEN;
       break;
+#endif /* HIP_ESP_AES_GCM */
     default:
       break;
     }
@@ -2092,28 +2737,36 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
     {
     case SADB_AALG_MD5HMAC:
       alen = HMAC_SHA_96_BITS / 8;           /* 12 bytes */
-      if (!entry->a_key || (entry->a_keylen == 0))
+      if (!entry->hmac_ctx)
         {
           printf("auth err: missing keys\n");
           return(-1);
         }
       elen += sizeof(struct ip_esp_hdr);
-      HMAC(   EVP_md5(), entry->a_key, entry->a_keylen,
-              (__u8*)esp, elen, hmac_md, &hmac_md_len);
+      if (hip_esp_hmac(entry, (__u8*)esp, elen, hmac_md,
+                       &hmac_md_len) < 0)
+        {
+          printf("auth err: HMAC failed\n");
+          return(-1);
+        }
       memcpy(&out[elen + (use_udp ? sizeof(udphdr) : 0)],
              hmac_md, alen);
       *outlen += alen;
       break;
     case SADB_AALG_SHA1HMAC:
       alen = HMAC_SHA_96_BITS / 8;           /* 12 bytes */
-      if (!entry->a_key || (entry->a_keylen == 0))
+      if (!entry->hmac_ctx)
         {
           printf("auth err: missing keys\n");
           return(-1);
         }
       elen += sizeof(struct ip_esp_hdr);
-      HMAC(   EVP_sha1(), entry->a_key, entry->a_keylen,
-              (__u8*)esp, elen, hmac_md, &hmac_md_len);
+      if (hip_esp_hmac(entry, (__u8*)esp, elen, hmac_md,
+                       &hmac_md_len) < 0)
+        {
+          printf("auth err: HMAC failed\n");
+          return(-1);
+        }
       memcpy(&out[elen + (use_udp ? sizeof(udphdr) : 0)],
              hmac_md, alen);
       *outlen += alen;
@@ -2123,24 +2776,11 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
     }
 
 #ifndef HIP_VPLS
-  /* Record the address family of this packet, so incoming
-   * replies of the same protocol/ports can be matched to
-   * the same family.
-   */
-  if (hip_add_proto_sel_entry(LSI4(&entry->lsi),
-                              (__u8)(iph ? iph->ip_p : ip6h->ip6_nxt),
-                              iph ? (__u8*)(iph + 1) : (__u8*)(ip6h + 1),
-                              family, 0, now  ) < 0)
-    {
-      printf("hip_esp_encrypt(): error adding sel entry.\n");
-    }
-
-
   /* Restore the checksum in the input data, in case this is
    * a broadcast packet that needs to be re-sent to some other
    * destination.
    */
-  if (checksum_fix > 0)
+  if ((checksum_fix > 0) && !in_place)
     {
 #ifdef __MACOSX__
       if (iph->ip_p == IPPROTO_UDP)
@@ -2224,16 +2864,21 @@ int hip_esp_encrypt(__u8 *in, int len, __u8 *out, int *outlen,
  *              entry	the SADB entry
  *              iph     IPv4 header or NULL for IPv6
  *              now	pointer to current time (avoid extra gettimeofday call)
+ *              reader	SADB reader slot of the calling thread, for counters
  *
  * out:		New packet is built in out, outlen.
  *              Returns 0 on success, -1 otherwise.
  *
- * Perform authentication and decryption of ESP packets.
+ * Perform authentication and decryption of ESP packets. When out is the
+ * same buffer as in, the payload is decrypted in place and the new
+ * Ethernet and IP headers are written in front of it, over the ESP header
+ * and into the ESP_HEADROOM before in; offset may then be negative.
  */
 int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
-                    hip_sadb_entry *entry, struct ip *iph, struct timeval *now)
+                    hip_sadb_entry *entry, struct ip *iph, struct timeval *now,
+                    int reader)
 {
-  int alen = 0, elen = 0, iv_len = 0;
+  int alen = 0, elen = 0, iv_len = 0, outl, replay;
   unsigned int hmac_md_len;
   struct ip_esp_hdr *esp;
   /*udphdr *udph;*/
@@ -2247,11 +2892,13 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
   int family_out;
   struct tcphdr *tcp = NULL;
   struct udphdr *udp = NULL;
+  struct ip outer_iph;
 #endif /* HIP_VPLS */
   int use_udp = FALSE;
   __u32 new_seqno_hi = 0, loss;
   __u64 shift;
   struct sockaddr_storage dst;
+  int in_place = (out == in);
 
   if (!in || !out || !entry)
     {
@@ -2288,19 +2935,34 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
 #ifdef HIP_VPLS
   *offset = sizeof(struct eth_hdr);        /* Tunnel mode */
 #endif
+  if (in_place)
+    {
+      /* payload is decrypted where the ciphertext begins */
+      *offset = (int)((__u8*)esp->enc_data - in) +
+                hip_esp_iv_len(entry->e_type);
+    }
 
   /*
    *  Preliminary anti-replay check.
    */
-  if (esp_anti_replay_check_initial(entry, ntohl(esp->seq_no),
-                                    &new_seqno_hi))
+  replay = esp_anti_replay_check_initial(entry, ntohl(esp->seq_no),
+                                         &new_seqno_hi);
+  /* skip sequence number check for static multicast SA */
+  if (replay && (entry->mode != 4))
     {
-      /* skip sequence number check for static multicast SA */
-      if (entry->mode != 4) {
-        printf("duplicate sequence number detected: %x\n",
-               ntohl(esp->seq_no));
-        return(-1);
-      }
+      if (replay == 1)
+        {
+          entry->cold->replay_dups++;
+          printf("duplicate sequence number detected: %x\n",
+                 ntohl(esp->seq_no));
+        }
+      else
+        {
+          entry->cold->replay_old++;
+          printf("sequence number older than window: %x\n",
+                 ntohl(esp->seq_no));
+        }
+      return(-1);
     }
 
   /*
@@ -2319,14 +2981,17 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
         {
           elen -= sizeof(udphdr);
         }
-      if (!entry->a_key || (entry->a_keylen == 0))
+      if (!entry->hmac_ctx)
         {
           printf("auth err: missing keys\n");
           return(-1);
         }
-      HMAC(   EVP_md5(), entry->a_key, entry->a_keylen,
-              (__u8*)esp, elen + sizeof(struct ip_esp_hdr),
-              hmac_md, &hmac_md_len);
+      if (hip_esp_hmac(entry, (__u8*)esp, elen + sizeof(struct ip_esp_hdr),
+                       hmac_md, &hmac_md_len) < 0)
+        {
+          printf("auth err: HMAC failed\n");
+          return(-1);
+        }
       if (memcmp(&in[len - alen], hmac_md, alen) != 0)
         {
           printf("auth err: MD5 auth failure\n");
@@ -2344,14 +3009,17 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
         {
           elen -= sizeof(udphdr);
         }
-      if (!entry->a_key || (entry->a_keylen == 0))
+      if (!entry->hmac_ctx)
         {
           printf("auth err: missing keys\n");
           return(-1);
         }
-      HMAC(   EVP_sha1(), entry->a_key, entry->a_keylen,
-              (__u8*)esp, elen + sizeof(struct ip_esp_hdr),
-              hmac_md, &hmac_md_len);
+      if (hip_esp_hmac(entry, (__u8*)esp, elen + sizeof(struct ip_esp_hdr),
+                       hmac_md, &hmac_md_len) < 0)
+        {
+          printf("auth err: HMAC failed\n");
+          return(-1);
+        }
       if (memcmp(&in[len - alen], hmac_md, alen) != 0)
         {
           printf("auth err: SHA1 auth failure SPI=0x%x\n",
@@ -2362,6 +3030,33 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
     default:
       break;
     }
+#ifdef HIP_ESP_AES_GCM
+  if (entry->e_type == SADB_X_EALG_AES_GCM_ICV16)
+    {
+      /* AEAD: the ICV is verified while decrypting */
+      alen = ESP_GCM_ICV_LEN;
+      elen = len - sizeof(struct ip_esp_hdr) - alen;
+      if (iph)
+        {
+          elen -= sizeof(struct ip);
+        }
+      if (use_udp)             /* HIP_ESP_OVER_UDP */
+        {
+          elen -= sizeof(udphdr);
+        }
+      if (!entry->cipher_ctx || (elen < 8 + 2))
+        {
+          return(-1);
+        }
+      if (hip_esp_gcm_crypt(entry, esp, &esp->enc_data[8], &out[*offset],
+                            elen - 8, 0) < 0)
+        {
+          printf("auth err: AES-GCM auth failure SPI=0x%x\n",
+                 entry->spi);
+          return(-1);
+        }
+    }
+#endif /* HIP_ESP_AES_GCM */
 
   /* update anti-replay window now that integrity has been verified */
 #ifndef HIP_VPLS
@@ -2432,22 +3127,17 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
       break;
     case SADB_X_EALG_AESCBC:
       iv_len = 16;
-      if (!entry->aes_key && entry->e_key)
-        {
-          entry->aes_key = malloc(sizeof(AES_KEY));
-          if (AES_set_decrypt_key(entry->e_key, 8 *
-                                  entry->e_keylen,
-                                  entry->aes_key))
-            {
-              printf("hip_esp_decrypt: AES key problem!\n");
-            }
-        }
-      else if (!entry->aes_key)
+      if (!entry->cipher_ctx)
         {
           printf("hip_esp_decrypt: AES key missing.\n");
           return(-1);
         }
       break;
+#ifdef HIP_ESP_AES_GCM
+    case SADB_X_EALG_AES_GCM_ICV16:
+      iv_len = 8;
+      break;
+#endif /* HIP_ESP_AES_GCM */
     default:
       printf("Unsupported decryption algorithm (%d)\n",
              entry->e_type);
@@ -2468,13 +3158,25 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
                      entry->bf_key, cbc_iv, BF_DECRYPT);
       break;
     case SADB_EALG_NULL:
-      memcpy(&out[*offset], esp->enc_data, elen);
+      if (!in_place)
+        {
+          memcpy(&out[*offset], esp->enc_data, elen);
+        }
       /* padinfo = (struct ip_esp_padinfo*) &in[len - alen - 2]; */
       break;
     case SADB_X_EALG_AESCBC:
-      AES_cbc_encrypt(&esp->enc_data[iv_len], &out[*offset], elen,
-                      entry->aes_key, cbc_iv, AES_DECRYPT);
+      if ((hip_esp_cipher_reset(entry, cbc_iv, 0) < 0) ||
+          !EVP_CipherUpdate(entry->cipher_ctx, &out[*offset], &outl,
+                            &esp->enc_data[iv_len], elen))
+        {
+          printf("hip_esp_decrypt: AES decryption failed.\n");
+          return(-1);
+        }
       break;
+#ifdef HIP_ESP_AES_GCM
+    case SADB_X_EALG_AES_GCM_ICV16:
+      break;            /* already decrypted during authentication */
+#endif /* HIP_ESP_AES_GCM */
     default:
       return(-1);
     }
@@ -2487,8 +3189,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
   /* determine address family for new packet based on
    * decrypted upper layer protocol header
    */
-  family_out = hip_select_family_by_proto(LSI4(
-                                            &entry->lsi),
+  family_out = hip_select_family_by_proto(entry->lsi4,
                                           padinfo->next_hdr,
                                           &out[*offset], now);
 
@@ -2503,7 +3204,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
           tcp = (struct tcphdr*)&out[*offset];
           sum = htons(tcp->th_sum);
           sum =
-            csum_hip_revert(  LSI4(&entry->lsi),
+            csum_hip_revert(  entry->lsi4,
                               htonl(g_tap_lsi),
                               sum, htons(entry->hit_magic));
           tcp->th_sum = htons(sum);
@@ -2512,7 +3213,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
           udp = (struct udphdr*)&out[*offset];
           sum = htons(udp->uh_sum);
           sum =
-            csum_hip_revert(  LSI4(&entry->lsi),
+            csum_hip_revert(  entry->lsi4,
                               htonl(g_tap_lsi),
                               sum, htons(entry->hit_magic));
           udp->uh_sum = htons(sum);
@@ -2522,7 +3223,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
           tcp = (struct tcphdr*)&out[*offset];
           sum = htons(tcp->check);
           sum =
-            csum_hip_revert(  LSI4(&entry->lsi),
+            csum_hip_revert(  entry->lsi4,
                               htonl(g_tap_lsi),
                               sum, htons(entry->hit_magic));
           tcp->check = htons(sum);
@@ -2531,7 +3232,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
           udp = (struct udphdr*)&out[*offset];
           sum = htons(udp->check);
           sum =
-            csum_hip_revert(  LSI4(&entry->lsi),
+            csum_hip_revert(  entry->lsi4,
                               htonl(g_tap_lsi),
                               sum, htons(entry->hit_magic));
           udp->check = htons(sum);
@@ -2541,6 +3242,13 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
         }
     }
 
+  /* the new headers may overwrite the outer IP header */
+  if (iph)
+    {
+      memcpy(&outer_iph, iph, sizeof(struct ip));
+      iph = &outer_iph;
+    }
+
   /* set offset to index the beginning of the packet */
   if (family_out == AF_INET)         /* offset = 20 */
     {
@@ -2553,8 +3261,8 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
 
   /* Ethernet header */
   dst_mac = get_eth_addr(family_out,
-                         (family_out == AF_INET) ? SA2IP(&entry->lsi) :
-                         SA2IP(&entry->dst_hit));
+                         (family_out == AF_INET) ? (__u8*)&entry->lsi4 :
+                         (__u8*)SA2IP6(&entry->cold->dst_hit));
   add_eth_header(&out[*offset], dst_mac, g_tap_mac,
                  (family_out == AF_INET) ? 0x0800 : 0x86dd);
 
@@ -2562,7 +3270,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
   if (family_out == AF_INET)
     {
       add_ipv4_header(&out[*offset + sizeof(struct eth_hdr)],
-                      LSI4(&entry->lsi), htonl(g_tap_lsi), iph,
+                      entry->lsi4, htonl(g_tap_lsi), iph,
                       (__u16)(sizeof(struct ip) + elen),
                       padinfo->next_hdr);
       *outlen = sizeof(struct eth_hdr) + sizeof(struct ip) + elen;
@@ -2570,7 +3278,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
   else
     {
       add_ipv6_header(&out[*offset + sizeof(struct eth_hdr)],
-                      SA(&entry->src_hit), SA(&entry->dst_hit),
+                      SA(&entry->cold->src_hit), SA(&entry->cold->dst_hit),
                       NULL, iph, (__u16)elen, padinfo->next_hdr);
       *outlen = sizeof(struct eth_hdr) + sizeof(struct ip6_hdr) +
                 elen;
@@ -2586,7 +3294,7 @@ int hip_esp_decrypt(__u8 *in, int len, __u8 *out, int *offset, int *outlen,
 
   /* previously, this happened after write(), but there
    * is some problem with using the entry ptr then */
-  hip_sadb_inc_bytes(entry, *outlen - sizeof(struct eth_hdr), now, 0);
+  hip_sadb_inc_bytes(entry, reader, *outlen - sizeof(struct eth_hdr), now);
   return(0);
 }
 
@@ -2874,20 +3582,14 @@ void esp_signal_loss(__u32 spi, __u32 loss, struct sockaddr *dst)
   esp_send_to_hipd((char*) msg, len, "esp_signal_loss()");
 }
 
-/*
- * update the sequence number counters in the sadb entry and return the next
- * sequence number
- */
-__u32 get_next_seqno(hip_sadb_entry *entry)
+/* send an ESP_ICMP_PARAMPROB message, which results in a
+ * call to start_icmp_update() in hipd */
+void esp_signal_paramprob(__u32 spi)
 {
-  __u32 r = ++entry->sequence;
-  /* overflow of lower 32 bits */
-  if (r == 0)
-    {
-      r = ++entry->sequence;           /* don't use zero */
-      entry->sequence_hi++;
-    }
-  return(r);
+  espmsg msg;
+  msg.message_type = ESP_ICMP_PARAMPROB;
+  msg.message_data = htonl(spi);
+  esp_send_to_hipd((char*) &msg, sizeof(msg), "esp_signal_paramprob()");
 }
 
 /*
@@ -2896,16 +3598,18 @@ __u32 get_next_seqno(hip_sadb_entry *entry)
  * Determine the high-order bits of a 64-bit ESN based on anti-replay packet
  * window and received lower bits.
  *
- * Returns 0 if the check passes, 1 if the check fails.
+ * Returns 0 if the check passes, 1 if the packet is a duplicate, 2 if the
+ * packet is older than the window.
  * Returns value high-order ESN bits in  sequqnce_hi.
  */
 int esp_anti_replay_check_initial(hip_sadb_entry *entry, __u32 seqno,
                                   __u32 *sequence_hi)
 {
+  __u32 win_size = entry->replay_win_words * REPLAY_WIN_WORD;
   /* T: top of window */
   __u32 replay_win_maxl = (__u32)(entry->replay_win_max & 0xFFFFFFFF);
   /* B: botttom of window */
-  __u64 replay_win_min = entry->replay_win_max - REPLAY_WIN_SIZE + 1;
+  __u64 replay_win_min = entry->replay_win_max - win_size + 1;
   __u32 replay_win_minl = (__u32)(replay_win_min & 0xFFFFFFFF);
   __u64 shift, esn;
   int do_replay_check;
@@ -2913,7 +3617,7 @@ int esp_anti_replay_check_initial(hip_sadb_entry *entry, __u32 seqno,
   *sequence_hi = entry->sequence_hi;
 
   /* RFC 4303 Appendix A Case A: window within one subspace */
-  if (replay_win_maxl >= REPLAY_WIN_SIZE - 1)
+  if (replay_win_maxl >= win_size - 1)
     {
       do_replay_check = 1;
       if (seqno >= replay_win_minl)
@@ -2924,6 +3628,11 @@ int esp_anti_replay_check_initial(hip_sadb_entry *entry, __u32 seqno,
               do_replay_check = 0;
             }
         }
+      else if ((__u32)(replay_win_maxl - seqno) < 0x80000000)
+        {
+          /* seq number just behind the window, not a wrap around */
+          return(2);
+        }
       else
         {
           /* assume seq number wrap around to next subspace */
@@ -2964,7 +3673,8 @@ int esp_anti_replay_check_initial(hip_sadb_entry *entry, __u32 seqno,
     {
       esn = ((__u64)(*sequence_hi) << 32) | seqno;
       shift = entry->replay_win_max - esn;
-      if ((entry->replay_win_map >> (__u32)shift) & 0x1)
+      if ((entry->replay_win_map[shift / REPLAY_WIN_WORD] >>
+           (shift % REPLAY_WIN_WORD)) & 0x1)
         {
           return(1);               /* drop packet - duplicate detected */
         }
@@ -2977,26 +3687,53 @@ int esp_anti_replay_check_initial(hip_sadb_entry *entry, __u32 seqno,
  * initial checks. Under normal conditions, returns 1 as the next received
  * packet is the next sequence number; return value > 1 indicates window
  * shifting, and 0 indicates received packet within window.
+ *
+ * The bitmap is shifted a whole word at a time, then by the remaining bits,
+ * so the cost is one pass over the window regardless of the shift.
  */
 __u64 esp_update_anti_replay(hip_sadb_entry *entry, __u32 seqno,
                              __u32 seqno_hi)
 {
   __u64 esn = ((__u64)seqno_hi << 32) | seqno;
-  __u64 shift;
+  __u64 shift, *map = entry->replay_win_map;
+  int i, words = (int)entry->replay_win_words;
+  int word_shift, bit_shift;
+
   if (esn > entry->replay_win_max)
     {
       /* shift window to the left, new max seq no received */
       shift = esn - entry->replay_win_max;
-      entry->replay_win_map = entry->replay_win_map << shift;
+      if (shift >= (__u64)words * REPLAY_WIN_WORD)
+        {
+          memset(map, 0, words * sizeof(__u64));
+        }
+      else
+        {
+          word_shift = (int)(shift / REPLAY_WIN_WORD);
+          bit_shift = (int)(shift % REPLAY_WIN_WORD);
+          for (i = words - 1; i >= word_shift; i--)
+            {
+              map[i] = map[i - word_shift] << bit_shift;
+              if (bit_shift && (i > word_shift))
+                {
+                  map[i] |= map[i - word_shift - 1] >>
+                            (REPLAY_WIN_WORD - bit_shift);
+                }
+            }
+          for (; i >= 0; i--)
+            {
+              map[i] = 0;
+            }
+        }
       entry->replay_win_max = esn;
-      entry->replay_win_map |= 0x1;
+      map[0] |= 0x1;
       entry->sequence_hi = seqno_hi;
     }
   else
     {
       /* update bit corresponding to esn in window */
       shift = entry->replay_win_max - esn;
-      entry->replay_win_map |= 0x1 << shift;
+      map[shift / REPLAY_WIN_WORD] |= (__u64)0x1 << (shift % REPLAY_WIN_WORD);
       return(0);
     }
   return(shift);
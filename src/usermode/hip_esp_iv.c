@@ -0,0 +1,130 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2005-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  hip_esp_iv.c
+ *
+ *  \brief  ESP sequence numbers and per-SA IV generation.
+ *
+ *  Outgoing CBC SAs with ESP_IV_COUNTER encrypt the 64-bit sequence
+ *  number instead of calling RAND_bytes() for every packet; AES-GCM SAs
+ *  use the sequence number itself. These are kept apart from hip_esp.c
+ *  so that util/esp_iv_test.c can check them on their own.
+ *
+ */
+#include <string.h>     /* memcpy() */
+#ifdef __WIN32__
+#include <winsock2.h>   /* htonl() */
+#else
+#include <arpa/inet.h>  /* htonl() */
+#endif
+#include <openssl/rand.h> /* RAND_bytes() */
+#include <hip/hip_types.h>
+#include <hip/hip_proto.h> /* HIP_ESP_AES_GCM */
+#include <hip/hip_sadb.h>
+
+/*
+ * get_next_seqno()
+ *
+ * Update the sequence number counters in the sadb entry and return the
+ * next sequence number.
+ */
+__u32 get_next_seqno(hip_sadb_entry *entry)
+{
+  __u32 r = ++entry->sequence;
+  /* overflow of lower 32 bits */
+  if (r == 0)
+    {
+      r = ++entry->sequence;           /* don't use zero */
+      entry->sequence_hi++;
+    }
+  return(r);
+}
+
+/*
+ * hip_esp_iv_init()
+ *
+ * Key the SA's IV counter encryption with a new random key and salt,
+ * replacing any previous one. Returns 0 on success, -1 on error.
+ */
+int hip_esp_iv_init(hip_sadb_entry *entry)
+{
+  __u8 iv_key[16];
+  int err = -1;
+
+  if (entry->iv_ctx)
+    {
+      EVP_CIPHER_CTX_free(entry->iv_ctx);
+    }
+  if ((RAND_bytes(iv_key, sizeof(iv_key)) == 1) &&
+      (RAND_bytes(entry->iv_salt, sizeof(entry->iv_salt)) == 1) &&
+      (entry->iv_ctx = EVP_CIPHER_CTX_new()) &&
+      EVP_EncryptInit_ex(entry->iv_ctx, EVP_aes_128_ecb(), NULL,
+                         iv_key, NULL))
+    {
+      EVP_CIPHER_CTX_set_padding(entry->iv_ctx, 0);
+      err = 0;
+    }
+  memset(iv_key, 0, sizeof(iv_key));
+  return(err);
+}
+
+/*
+ * hip_esp_next_iv()
+ *
+ * Produce the IV for the next outgoing packet. With ESP_IV_COUNTER the
+ * CBC IV is the SA's random salt and 64-bit sequence number, encrypted
+ * with a random per-SA key (NIST SP 800-38A, Appendix C). The sequence
+ * number never repeats within an SA, so the IVs are unique and
+ * unpredictable without taking the RAND_bytes() lock for every packet.
+ * The AES-GCM IV is the sequence number itself, which only has to be
+ * unique (RFC 4106). Must be called after the packet's sequence number
+ * is assigned.
+ */
+int hip_esp_next_iv(hip_sadb_entry *entry, __u8 *iv, int iv_len)
+{
+  __u8 block[16];
+  int outl;
+
+#ifdef HIP_ESP_AES_GCM
+  if (entry->e_type == SADB_X_EALG_AES_GCM_ICV16)
+    {
+      ((__u32*)iv)[0] = htonl(entry->sequence_hi);
+      ((__u32*)iv)[1] = htonl(entry->sequence);
+      return(0);
+    }
+#endif /* HIP_ESP_AES_GCM */
+  if (!entry->iv_ctx)
+    {
+      return((RAND_bytes(iv, iv_len) == 1) ? 0 : -1);
+    }
+  memcpy(block, entry->iv_salt, sizeof(entry->iv_salt));
+  ((__u32*)block)[2] = htonl(entry->sequence_hi);
+  ((__u32*)block)[3] = htonl(entry->sequence);
+  if (!EVP_EncryptUpdate(entry->iv_ctx, block, &outl, block, sizeof(block)))
+    {
+      return(-1);
+    }
+  memcpy(iv, block, iv_len);
+  return(0);
+}
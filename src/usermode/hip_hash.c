@@ -0,0 +1,512 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2005-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  hip_hash.c
+ *
+ *  \brief  Resizable hash tables with lock-free readers, used by the SADB.
+ *
+ *  Tables double in size when the load factor exceeds HIP_HASH_MAX_LOAD.
+ *  Instead of rehashing everything at once, the old bucket array is kept
+ *  and HIP_HASH_REHASH_STEP of its buckets are copied into the new one on
+ *  each insert or housekeeping call, so no single write stalls the data
+ *  plane. Readers search the new array, then the old one.
+ *
+ *  Bucket indexes come from SipHash-2-4 with a random key, so a peer
+ *  choosing SPIs or addresses cannot aim them all at one chain.
+ *
+ */
+#include <stdio.h>      /* printf() */
+#include <stdlib.h>     /* malloc() */
+#include <string.h>     /* memset() */
+#include <hip/hip_hash.h>
+
+static __u8 hip_hash_secret[HIP_HASH_KEY_LEN];
+
+/*
+ * Local function declarations
+ */
+hip_hash_buckets *hip_hash_alloc_buckets(__u32 size);
+void hip_hash_free_buckets(void *p);
+void hip_hash_grow(hip_hash_table *t);
+
+/*
+ * hip_hash_seed()
+ *
+ * Set the key used by hip_hash_key(); call once before any table is used.
+ */
+void hip_hash_seed(const __u8 *key)
+{
+  memcpy(hip_hash_secret, key, HIP_HASH_KEY_LEN);
+}
+
+#define ROTL64(x, b) (__u64)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+  do { \
+      v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+      v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+      v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+      v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+static __u64 hip_hash_load64(const __u8 *p)
+{
+  return((__u64)p[0] | ((__u64)p[1] << 8) | ((__u64)p[2] << 16) |
+         ((__u64)p[3] << 24) | ((__u64)p[4] << 32) | ((__u64)p[5] << 40) |
+         ((__u64)p[6] << 48) | ((__u64)p[7] << 56));
+}
+
+/*
+ * hip_hash_key()
+ *
+ * Keyed SipHash-2-4 of len bytes of data, folded to 32 bits.
+ */
+__u32 hip_hash_key(const void *data, int len)
+{
+  const __u8 *in = (const __u8*)data;
+  __u64 k0 = hip_hash_load64(&hip_hash_secret[0]);
+  __u64 k1 = hip_hash_load64(&hip_hash_secret[8]);
+  __u64 v0 = 0x736f6d6570736575ULL ^ k0;
+  __u64 v1 = 0x646f72616e646f6dULL ^ k1;
+  __u64 v2 = 0x6c7967656e657261ULL ^ k0;
+  __u64 v3 = 0x7465646279746573ULL ^ k1;
+  __u64 b = ((__u64)len) << 56, m;
+
+  for (; len >= 8; len -= 8, in += 8)
+    {
+      m = hip_hash_load64(in);
+      v3 ^= m;
+      SIPROUND;
+      SIPROUND;
+      v0 ^= m;
+    }
+  switch (len)
+    {
+    case 7: b |= ((__u64)in[6]) << 48;  /* fall through */
+    case 6: b |= ((__u64)in[5]) << 40;  /* fall through */
+    case 5: b |= ((__u64)in[4]) << 32;  /* fall through */
+    case 4: b |= ((__u64)in[3]) << 24;  /* fall through */
+    case 3: b |= ((__u64)in[2]) << 16;  /* fall through */
+    case 2: b |= ((__u64)in[1]) << 8;   /* fall through */
+    case 1: b |= ((__u64)in[0]);
+      break;
+    default:
+      break;
+    }
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  b = v0 ^ v1 ^ v2 ^ v3;
+  return((__u32)(b ^ (b >> 32)));
+}
+
+/*
+ * hip_hash_alloc_buckets()
+ *
+ * Allocate an empty bucket array; size must be a power of two.
+ */
+hip_hash_buckets *hip_hash_alloc_buckets(__u32 size)
+{
+  hip_hash_buckets *h;
+
+  h = calloc(1, sizeof(hip_hash_buckets) +
+             (size - 1) * sizeof(hip_hash_node*));
+  if (h)
+    {
+      h->mask = size - 1;
+    }
+  return(h);
+}
+
+/*
+ * hip_hash_free_buckets()
+ *
+ * Free a bucket array and any nodes still chained to it, but not the items.
+ */
+void hip_hash_free_buckets(void *p)
+{
+  hip_hash_buckets *h = (hip_hash_buckets*)p;
+  hip_hash_node *n, *next;
+  __u32 i;
+
+  for (i = 0; i <= h->mask; i++)
+    {
+      for (n = h->b[i]; n; n = next)
+        {
+          next = n->next;
+          free(n);
+        }
+    }
+  free(h);
+}
+
+/*
+ * hip_hash_init()
+ *
+ * Initialize a table with at least size buckets. Matching items against
+ * lookup keys is done by match; memory that lock-free readers may still
+ * hold is handed to retire instead of being freed.
+ */
+int hip_hash_init(hip_hash_table *t, __u32 size, hip_hash_match_fn match,
+                  hip_hash_retire_fn retire)
+{
+  __u32 n;
+
+  for (n = HIP_HASH_MIN_SIZE; n < size; n <<= 1)
+    {
+      ;
+    }
+  memset(t, 0, sizeof(hip_hash_table));
+  if (!(t->cur = hip_hash_alloc_buckets(n)))
+    {
+      printf("hip_hash_init(): malloc error\n");
+      return(-1);
+    }
+  t->match = match;
+  t->retire = retire;
+  return(0);
+}
+
+/*
+ * hip_hash_destroy()
+ *
+ * Free a table that no reader is using, calling free_item on each item
+ * when it is non-NULL.
+ */
+void hip_hash_destroy(hip_hash_table *t, void (*free_item)(void *item))
+{
+  hip_hash_node *n;
+  __u32 i;
+
+  if (free_item && t->cur)
+    {
+      for (i = 0; i <= t->cur->mask; i++)
+        {
+          for (n = t->cur->b[i]; n; n = n->next)
+            {
+              free_item(n->item);
+            }
+        }
+    }
+  /* items in migrated old buckets were also in cur */
+  if (free_item && t->old)
+    {
+      for (i = t->migrate_pos; i <= t->old->mask; i++)
+        {
+          for (n = t->old->b[i]; n; n = n->next)
+            {
+              free_item(n->item);
+            }
+        }
+    }
+  if (t->cur)
+    {
+      hip_hash_free_buckets(t->cur);
+    }
+  if (t->old)
+    {
+      hip_hash_free_buckets(t->old);
+    }
+  memset(t, 0, sizeof(hip_hash_table));
+}
+
+/*
+ * hip_hash_lookup()
+ *
+ * Return the item matching key, or NULL. Lock-free.
+ */
+void *hip_hash_lookup(hip_hash_table *t, __u32 hash, const void *key)
+{
+  hip_hash_buckets *cur, *old;
+  hip_hash_node *n;
+
+  cur = HIP_HASH_LOAD(t->cur);
+  old = HIP_HASH_LOAD(t->old);
+  for (n = HIP_HASH_LOAD(cur->b[hash & cur->mask]); n;
+       n = HIP_HASH_LOAD(n->next))
+    {
+      if ((n->hash == hash) && t->match(n->item, key))
+        {
+          return(n->item);
+        }
+    }
+  if (!old || (old == cur))
+    {
+      return(NULL);
+    }
+  for (n = HIP_HASH_LOAD(old->b[hash & old->mask]); n;
+       n = HIP_HASH_LOAD(n->next))
+    {
+      if ((n->hash == hash) && t->match(n->item, key))
+        {
+          return(n->item);
+        }
+    }
+  return(NULL);
+}
+
+/*
+ * hip_hash_insert()
+ *
+ * Link a new item into the table; the caller has checked that no item
+ * with the same key exists. The item must be complete, since readers may
+ * find it as soon as it is linked. Also continues any pending resize.
+ */
+int hip_hash_insert(hip_hash_table *t, __u32 hash, void *item)
+{
+  hip_hash_node *n;
+
+  if (!(n = malloc(sizeof(hip_hash_node))))
+    {
+      return(-1);
+    }
+  hip_hash_insert_node(t, n, hash, item);
+  return(0);
+}
+
+/*
+ * hip_hash_insert_node()
+ *
+ * Same as hip_hash_insert(), using a chain node allocated by the caller,
+ * so that a set of inserts can be prepared and then done without failing.
+ */
+void hip_hash_insert_node(hip_hash_table *t, hip_hash_node *n, __u32 hash,
+                          void *item)
+{
+  hip_hash_node **head;
+
+  n->hash = hash;
+  n->item = item;
+  head = &t->cur->b[hash & t->cur->mask];
+  n->next = *head;
+  HIP_HASH_STORE(*head, n);
+  t->count++;
+
+  if (t->old)
+    {
+      hip_hash_rehash_step(t);
+    }
+  else if (t->count > HIP_HASH_MAX_LOAD * (t->cur->mask + 1))
+    {
+      hip_hash_grow(t);
+    }
+}
+
+/*
+ * hip_hash_unlink()
+ *
+ * Unlink and retire the node holding the item matching key from one bucket
+ * array. Returns the item, or NULL if not found.
+ */
+static void *hip_hash_unlink(hip_hash_table *t, hip_hash_buckets *h,
+                             __u32 hash, const void *key)
+{
+  hip_hash_node *n, **prev;
+  void *item;
+
+  prev = &h->b[hash & h->mask];
+  for (n = *prev; n; prev = &n->next, n = n->next)
+    {
+      if ((n->hash == hash) && t->match(n->item, key))
+        {
+          break;
+        }
+    }
+  if (!n)
+    {
+      return(NULL);
+    }
+  /* readers already on this node continue along its next pointer */
+  HIP_HASH_STORE(*prev, n->next);
+  item = n->item;
+  t->retire(n, free);
+  return(item);
+}
+
+/*
+ * hip_hash_remove()
+ *
+ * Unlink the item matching key from the table and return it, or NULL if
+ * not found. The caller retires the item itself. Never resizes the table,
+ * so walks over the table stay valid across removals.
+ */
+void *hip_hash_remove(hip_hash_table *t, __u32 hash, const void *key)
+{
+  void *item, *old_item = NULL;
+
+  item = hip_hash_unlink(t, t->cur, hash, key);
+  /* during a resize the item may be in either array, or both */
+  if (t->old)
+    {
+      old_item = hip_hash_unlink(t, t->old, hash, key);
+    }
+  if (!item)
+    {
+      item = old_item;
+    }
+  if (item)
+    {
+      t->count--;
+    }
+  return(item);
+}
+
+/*
+ * hip_hash_grow()
+ *
+ * Start doubling the table. Items move over in hip_hash_rehash_step().
+ */
+void hip_hash_grow(hip_hash_table *t)
+{
+  hip_hash_buckets *h;
+
+  if (t->old)
+    {
+      return;
+    }
+  if (!(h = hip_hash_alloc_buckets((t->cur->mask + 1) << 1)))
+    {
+      return;           /* try again on the next insert */
+    }
+  t->migrate_pos = 0;
+  /* publish old before cur, so a reader that sees the new array also
+   * sees the old one */
+  HIP_HASH_STORE(t->old, t->cur);
+  HIP_HASH_STORE(t->cur, h);
+  hip_hash_rehash_step(t);
+}
+
+/*
+ * hip_hash_rehash_step()
+ *
+ * Copy the next HIP_HASH_REHASH_STEP buckets of a resizing table into the
+ * new bucket array, and retire the old array once all have been copied.
+ * The old chains are left intact for readers still walking them.
+ * Returns 1 while a resize is in progress, 0 otherwise.
+ */
+int hip_hash_rehash_step(hip_hash_table *t)
+{
+  hip_hash_buckets *old = t->old;
+  hip_hash_node *n, *copy, *copies, **head;
+  __u32 i, end;
+
+  if (!old)
+    {
+      return(0);
+    }
+  end = t->migrate_pos + HIP_HASH_REHASH_STEP;
+  for (i = t->migrate_pos; (i <= old->mask) && (i < end); i++)
+    {
+      /* copy the whole chain first, so a failed malloc leaves nothing
+       * behind and the bucket is simply retried later */
+      copies = NULL;
+      for (n = old->b[i]; n; n = n->next)
+        {
+          if (!(copy = malloc(sizeof(hip_hash_node))))
+            {
+              while ((copy = copies))
+                {
+                  copies = copy->next;
+                  free(copy);
+                }
+              return(1);
+            }
+          copy->hash = n->hash;
+          copy->item = n->item;
+          copy->next = copies;
+          copies = copy;
+        }
+      while ((copy = copies))
+        {
+          copies = copy->next;
+          head = &t->cur->b[copy->hash & t->cur->mask];
+          copy->next = *head;
+          HIP_HASH_STORE(*head, copy);
+        }
+      /* readers skip the old buckets below migrate_pos when walking */
+      HIP_HASH_STORE(t->migrate_pos, i + 1);
+    }
+  if (t->migrate_pos <= old->mask)
+    {
+      return(1);
+    }
+  HIP_HASH_STORE(t->old, NULL);
+  t->retire(old, hip_hash_free_buckets);
+  return(0);
+}
+
+/*
+ * hip_hash_first()
+ *
+ * Begin a walk over all items, returning the first or NULL. Lock-free;
+ * a walk that runs concurrently with a resize may return an item twice.
+ */
+void *hip_hash_first(hip_hash_table *t, hip_hash_iter *it)
+{
+  it->cur = HIP_HASH_LOAD(t->cur);
+  it->old = HIP_HASH_LOAD(t->old);
+  it->old_start = HIP_HASH_LOAD(t->migrate_pos);
+  it->bucket = 0;
+  it->in_old = 0;
+  it->node = NULL;
+  return(hip_hash_next(it));
+}
+
+/*
+ * hip_hash_next()
+ *
+ * Return the next item of a walk, or NULL when done.
+ */
+void *hip_hash_next(hip_hash_iter *it)
+{
+  hip_hash_buckets *h;
+
+  if (it->node)
+    {
+      it->node = HIP_HASH_LOAD(it->node->next);
+    }
+  while (!it->node)
+    {
+      h = it->in_old ? it->old : it->cur;
+      if (it->bucket > h->mask)
+        {
+          if (it->in_old || !it->old || (it->old == it->cur))
+            {
+              return(NULL);
+            }
+          /* items in old buckets below old_start are also in cur */
+          it->in_old = 1;
+          it->bucket = it->old_start;
+          continue;
+        }
+      it->node = HIP_HASH_LOAD(h->b[it->bucket]);
+      it->bucket++;
+    }
+  return(it->node->item);
+}
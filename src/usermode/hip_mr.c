@@ -88,7 +88,6 @@
 
 #define BUFSIZE 2048
 #define MR_TIMEOUT_US 500000 /* microsecond timeout for mobile_router select()*/
-#define MAX_MR_CLIENTS MAX_CONNECTIONS
 #define MAX_EIFACES 8
 
 #endif
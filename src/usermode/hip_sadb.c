@@ -32,6 +32,7 @@
 #include <stdio.h>      /* printf() */
 #include <stdlib.h>     /* malloc() */
 #include <string.h>     /* memset() */
+#include <openssl/rand.h> /* RAND_bytes() */
 #ifdef __WIN32__
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -56,6 +57,8 @@
 #include <hip/hip_service.h>
 #include <hip/hip_types.h>
 #include <hip/hip_sadb.h>
+#include <hip/hip_hash.h>
+#include <hip/hip_timer.h>
 #include <hip/hip_funcs.h> /* gettimeofday() for win32 */
 #include <hip/hip_usermode.h>
 
@@ -64,51 +67,146 @@
  * Globals
  */
 extern int readsp[2];
-extern long g_read_usec;
 extern void esp_start_expire(__u32 spi);
 
-/* the SADB hash table
- * each entry has a rw_lock, and there is one lock for each hash chain */
-hip_sadb_entry *hip_sadb[SADB_SIZE] = {0};
-hip_mutex_t hip_sadb_locks[SADB_SIZE];
-/* the SADB destination cache hash table
- * each dst_entry has a rw_lock, and there is one lock for each hash chain */
-hip_sadb_dst_entry *hip_sadb_dst[SADB_SIZE] = {0};
-hip_mutex_t hip_sadb_dst_locks[SADB_SIZE];
+/* the SADB hash table, keyed by SPI
+ * Tables are read without locks by the ESP threads. Writers are serialized
+ * by hip_sadb_write_lock and publish changes with release stores; unlinked
+ * entries are freed only after every registered reader has passed through
+ * a quiescent state (see hip_sadb_quiescent()). Each entry has a rw_lock
+ * protecting its mutable per-packet state. The tables grow as needed, see
+ * hip_hash.c. */
+hip_hash_table hip_sadb;
+hip_mutex_t hip_sadb_write_lock;
+/* the SADB destination cache hash table, keyed by address, same rules */
+hip_hash_table hip_sadb_dst;
+
+/* grace period tracking for lock-free readers */
+#define SADB_LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define SADB_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+typedef struct _hip_sadb_retired
+{
+  struct _hip_sadb_retired *next;
+  __u64 epoch;                          /* global epoch when unlinked */
+  void *ptr;
+  void (*free_fn)(void *ptr);
+} hip_sadb_retired;
+static __u64 hip_sadb_epoch = 1;
+static __u64 hip_sadb_reader_epochs[SADB_MAX_READERS];  /* 0 = unused slot */
+static hip_sadb_retired *hip_sadb_retired_list = NULL;
+/* SA traffic counters, one chunked array per reader slot so that the
+ * ESP threads count packets without locks or shared cache lines. Each
+ * chunk is allocated by the reader that owns it; SA counter indexes are
+ * handed out and recycled by writers. */
+#define SADB_CTR_MAX (SADB_CTR_CHUNK * SADB_CTR_CHUNKS)
+#define SADB_CTR_SET(f, v) __atomic_store_n(&(f), (v), __ATOMIC_RELAXED)
+#define SADB_CTR_GET(f) __atomic_load_n(&(f), __ATOMIC_RELAXED)
+static hip_sadb_counters *hip_sadb_ctrs[SADB_MAX_READERS][SADB_CTR_CHUNKS];
+static __u32 *hip_sadb_ctr_free = NULL;         /* recycled indexes */
+static __u32 hip_sadb_ctr_num_free = 0, hip_sadb_ctr_max_free = 0;
+static __u32 hip_sadb_ctr_next = 0;             /* next unused index */
+static hip_mutex_t hip_sadb_ctr_lock;           /* protects the above */
 /* the temporary LSI table and embargoed packet buffer */
 hip_lsi_entry *lsi_temp = NULL;
 /* the protocol selector table for determining address family
- * one lock for each hash chain; entries do not change much, only the time
+ * same rules as hip_sadb; entries do not change much, only the time
  * which is not critical */
-hip_proto_sel_entry *hip_proto_sel[PROTO_SEL_SIZE] = {0};
-hip_mutex_t hip_proto_sel_locks[PROTO_SEL_SIZE];
+hip_hash_table hip_proto_sel;
+typedef struct _hip_proto_sel_key
+{
+  __u32 selector;
+  int family;                   /* AF_UNSPEC matches any family */
+} hip_proto_sel_key;
+/* expiry timers for SAs, LSI entries and protocol selectors, run by the
+ * hip_sadb_timers() thread; protected by hip_sadb_write_lock */
+hip_timer_wheel hip_sadb_wheel;
+/* work found by the timer callbacks that is done after dropping the lock,
+ * since it writes to sockets read by threads that may be waiting for it */
+static __u32 hip_sadb_expired_spis[SADB_TIMER_BATCH];
+static int hip_sadb_num_expired = 0;
+static hip_lsi_entry *hip_lsi_unbuffer[SADB_TIMER_BATCH];
+static int hip_lsi_num_unbuffer = 0;
+/* operations applied per hold of hip_sadb_write_lock by hip_sadb_apply() */
+#define SADB_APPLY_CHUNK 64
+/* state of one operation in hip_sadb_apply() */
+typedef struct _hip_sadb_prep
+{
+  hip_sadb_entry *entry;                /* new entry, until linked */
+  hip_hash_node *node;                  /* SADB node for the new entry */
+  hip_sadb_dst_entry *dst[2];           /* destination cache LSI, HIT */
+  hip_hash_node *dst_node[2];
+  hip_sadb_entry *old;                  /* entry being deleted */
+  int replaces;                         /* add follows delete of its SPI */
+} hip_sadb_prep;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* OpenSSL before 1.1.0 has no HMAC_CTX allocation functions */
+static HMAC_CTX *HMAC_CTX_new(void)
+{
+  HMAC_CTX *ctx = malloc(sizeof(HMAC_CTX));
+  if (ctx)
+    {
+      HMAC_CTX_init(ctx);
+    }
+  return(ctx);
+}
+
+static void HMAC_CTX_free(HMAC_CTX *ctx)
+{
+  HMAC_CTX_cleanup(ctx);
+  free(ctx);
+}
+#endif
 
 /*
  * Local function delcarations
  */
 hip_lsi_entry *create_lsi_entry(struct sockaddr *lsi);
+void hip_sadb_expire_timer(hip_timer *t, struct timeval *now);
+void hip_lsi_timer(hip_timer *t, struct timeval *now);
+void hip_proto_sel_timer(hip_timer *t, struct timeval *now);
 void free_addr_list(sockaddr_list *a);
 int hip_sadb_delete_entry(hip_sadb_entry *entry, int unlink);
+void hip_sadb_free_entry(void *p);
+void hip_sadb_retire(void *p, void (*free_fn)(void *ptr));
+hip_sadb_retired *hip_sadb_reclaim();
+void hip_sadb_free_retired(hip_sadb_retired *r);
+__u32 hip_sadb_ctr_alloc();
+void hip_sadb_ctr_release(__u32 index);
+int hip_sadb_init_keys(hip_sadb_entry *entry, __u8 *e_key, __u8 *a_key);
 hip_lsi_entry *hip_lookup_lsi_by_addr(struct sockaddr *addr);
 hip_lsi_entry *hip_lookup_lsi(struct sockaddr *lsi);
-int hip_sadb_add_dst_entry(struct sockaddr *addr, hip_sadb_entry *entry);
-int hip_sadb_delete_dst_entry(struct sockaddr *addr);
+void hip_sadb_add_dst_entry(struct sockaddr *addr, hip_sadb_entry *entry,
+                            hip_sadb_prep *p, int i);
+int hip_sadb_delete_dst_entry(struct sockaddr *addr, hip_sadb_entry *entry);
+int hip_sadb_prepare(hip_sadb_op *op, hip_sadb_prep *p, struct timeval *now);
+void hip_sadb_prep_free(hip_sadb_prep *p);
+void hip_sadb_link(hip_sadb_prep *p, struct timeval *now);
+void hip_sadb_unlink(hip_sadb_entry *entry);
+void hip_sadb_unlink_dst(hip_sadb_entry *entry);
+int hip_sadb_check_ops(hip_sadb_op *ops, int num, hip_sadb_prep *prep);
+int hip_sadb_apply_chunk(hip_sadb_op *ops, hip_sadb_prep *prep, int num,
+                         struct timeval *now);
 
 hip_proto_sel_entry *hip_lookup_sel_entry(__u32 lsi, __u8 proto, __u8 *header,
                                           int dir);
 __u32 hip_proto_header_to_selector(__u32 lsi, __u8 proto, __u8 *header,int dir);
-hip_proto_sel_entry *hip_remove_proto_sel_entry(hip_proto_sel_entry *prev,
-                                                hip_proto_sel_entry *entry);
+
 /*
  * sadb_hashfn()
  *
  * SADB entries are index by hash of their SPI.
- * Since SPIs are assumedly randomly allocated, distribution of this should
- * be uniform and the hash function given here is very simple (and fast!).
+ * The peer chooses our outgoing SPIs, so a keyed hash is used to keep them
+ * from being aimed at a single chain.
  */
-int sadb_hashfn(__u32 spi)
+__u32 sadb_hashfn(__u32 spi)
 {
-  return(spi % SADB_SIZE);
+  return(hip_hash_key(&spi, sizeof(spi)));
+}
+
+static int sadb_match_spi(const void *item, const void *key)
+{
+  return(((const hip_sadb_entry*)item)->spi == *(const __u32*)key);
 }
 
 /*
@@ -117,41 +215,27 @@ int sadb_hashfn(__u32 spi)
  * A destination cache mainains IP to SADB entry mappings, for efficient
  * lookup for outgoing packets.
  */
-int sadb_dst_hashfn(struct sockaddr *dst)
+__u32 sadb_dst_hashfn(struct sockaddr *dst)
 {
-  __u32 addr;
-  struct sockaddr_in6 *addr6;
+  return(hip_hash_key(SA2IP(dst), SAIPLEN(dst)));
+}
 
-  if (dst->sa_family == AF_INET)
-    {
-      addr = htonl(((struct sockaddr_in*)dst)->sin_addr.s_addr);
-    }
-  else
-    {
-      addr6 = (struct sockaddr_in6*)dst;
-#ifdef __MACOSX__
-      addr = addr6->sin6_addr.__u6_addr.__u6_addr32[0];
-      addr ^= addr6->sin6_addr.__u6_addr.__u6_addr32[1];
-      addr ^= addr6->sin6_addr.__u6_addr.__u6_addr32[2];
-      addr ^= addr6->sin6_addr.__u6_addr.__u6_addr32[3];
-#else
-#ifdef __WIN32__
-      addr =  (*((__u32 *)&addr6->sin6_addr.s6_addr[0]));
-      addr ^= (*((__u32 *)&addr6->sin6_addr.s6_addr[2]));
-      addr ^= (*((__u32 *)&addr6->sin6_addr.s6_addr[4]));
-      addr ^= (*((__u32 *)&addr6->sin6_addr.s6_addr[6]));
-#else
-#if !defined(__MACOSX__)
-      addr = addr6->sin6_addr.s6_addr32[0];
-      addr ^= addr6->sin6_addr.s6_addr32[1];
-      addr ^= addr6->sin6_addr.s6_addr32[2];
-      addr ^= addr6->sin6_addr.s6_addr32[3];
-#endif
-#endif
-#endif
-    }
+static int sadb_match_dst(const void *item, const void *key)
+{
+  const hip_sadb_dst_entry *d = (const hip_sadb_dst_entry*)item;
+  struct sockaddr *addr = (struct sockaddr*)key;
 
-  return(addr % SADB_SIZE);
+  return((addr->sa_family == d->addr.ss_family) &&
+         (memcmp(SA2IP(addr), SA2IP(&d->addr), SAIPLEN(addr)) == 0));
+}
+
+static int sadb_match_proto_sel(const void *item, const void *key)
+{
+  const hip_proto_sel_entry *e = (const hip_proto_sel_entry*)item;
+  const hip_proto_sel_key *k = (const hip_proto_sel_key*)key;
+
+  return((e->selector == k->selector) &&
+         ((k->family == AF_UNSPEC) || (e->family == k->family)));
 }
 
 /*
@@ -161,20 +245,26 @@ int sadb_dst_hashfn(struct sockaddr *dst)
  */
 void hip_sadb_init()
 {
-  int i;
-  for (i = 0; i < SADB_SIZE; i++)
+  __u8 key[HIP_HASH_KEY_LEN];
+  struct timeval now;
+
+  RAND_bytes(key, sizeof(key));
+  hip_hash_seed(key);
+  memset(key, 0, sizeof(key));
+  if ((hip_hash_init(&hip_sadb, SADB_SIZE, sadb_match_spi,
+                     hip_sadb_retire) < 0) ||
+      (hip_hash_init(&hip_sadb_dst, SADB_SIZE, sadb_match_dst,
+                     hip_sadb_retire) < 0) ||
+      (hip_hash_init(&hip_proto_sel, PROTO_SEL_SIZE, sadb_match_proto_sel,
+                     hip_sadb_retire) < 0))
     {
-      hip_sadb[i] = NULL;
-      hip_sadb_dst[i] = NULL;
-      pthread_mutex_init(&hip_sadb_locks[i], NULL);
-      pthread_mutex_init(&hip_sadb_dst_locks[i], NULL);
+      printf("hip_sadb_init(): error allocating hash tables\n");
     }
+  gettimeofday(&now, NULL);
+  hip_timer_wheel_init(&hip_sadb_wheel, &now);
+  pthread_mutex_init(&hip_sadb_write_lock, NULL);
+  pthread_mutex_init(&hip_sadb_ctr_lock, NULL);
   lsi_temp = NULL;
-  for (i = 0; i < PROTO_SEL_SIZE; i++)
-    {
-      hip_proto_sel[i] = NULL;
-      pthread_mutex_init(&hip_proto_sel_locks[i], NULL);
-    }
 }
 
 /*
@@ -184,39 +274,39 @@ void hip_sadb_init()
  */
 void hip_sadb_deinit()
 {
-  hip_sadb_entry *e, *e_n;
-  hip_sadb_dst_entry *d, *d_n;
-  hip_proto_sel_entry *s, *s_n;
   hip_lsi_entry *l;
-  int i;
-  for (i = 0; i < SADB_SIZE; i++)
-    {
-      /* pthread_mutex_lock(&hip_sadb_locks[i]); */
-      e = hip_sadb[i];
-      while (e)
-        {
-          /* pthread_mutex_lock(&e->rw_lock); */
-          e_n = e->next;
-          hip_sadb_delete_entry(e, FALSE);
-          e = e_n;
-        }
-      /* pthread_mutex_unlock(&hip_sadb_locks[i]); */
-      pthread_mutex_destroy(&hip_sadb_locks[i]);
+  hip_sadb_retired *r;
+  int i, j;
 
-      /* pthread_mutex_lock(&hip_sadb_dst_locks[i]); */
-      d = hip_sadb_dst[i];
-      while (d)
+  hip_hash_destroy(&hip_sadb, hip_sadb_free_entry);
+  hip_hash_destroy(&hip_sadb_dst, free);
+  hip_hash_destroy(&hip_proto_sel, free);
+  /* the ESP threads have exited, so retired entries can go now */
+  while ((r = hip_sadb_retired_list))
+    {
+      hip_sadb_retired_list = r->next;
+      r->free_fn(r->ptr);
+      free(r);
+    }
+  pthread_mutex_destroy(&hip_sadb_write_lock);
+  for (i = 0; i < SADB_MAX_READERS; i++)
+    {
+      for (j = 0; j < SADB_CTR_CHUNKS; j++)
         {
-          /* pthread_mutex_lock(&d->rw_lock); */
-          d_n = d->next;
-          pthread_mutex_unlock(&d->rw_lock);
-          pthread_mutex_destroy(&d->rw_lock);
-          free(d);
-          d = d_n;
+          if (hip_sadb_ctrs[i][j])
+            {
+              free(hip_sadb_ctrs[i][j]);
+              hip_sadb_ctrs[i][j] = NULL;
+            }
         }
-      /* pthread_mutex_unlock(&hip_sadb_dst_locks[i]); */
-      pthread_mutex_destroy(&hip_sadb_dst_locks[i]);
     }
+  if (hip_sadb_ctr_free)
+    {
+      free(hip_sadb_ctr_free);
+      hip_sadb_ctr_free = NULL;
+    }
+  hip_sadb_ctr_num_free = hip_sadb_ctr_max_free = hip_sadb_ctr_next = 0;
+  pthread_mutex_destroy(&hip_sadb_ctr_lock);
 
   l = lsi_temp;
   while (l)
@@ -225,20 +315,6 @@ void hip_sadb_deinit()
       free(l);
       l = lsi_temp;
     }
-
-  for (i = 0; i < PROTO_SEL_SIZE; i++)
-    {
-      /* pthread_mutex_lock(&hip_proto_sel_locks[i]); */
-      s = hip_proto_sel[i];
-      while (s)
-        {
-          s_n = s->next;
-          free(s);
-          s = s_n;
-        }
-      pthread_mutex_unlock(&hip_proto_sel_locks[i]);
-      pthread_mutex_destroy(&hip_proto_sel_locks[i]);
-    }
 }
 
 /*
@@ -255,144 +331,280 @@ int hip_sadb_add(__u32 mode, int direction,
                  __u8 *a_key, __u32 a_type, __u32 a_keylen,
                  __u32 lifetime)
 {
-  hip_sadb_entry *entry, *prev = NULL;
-  hip_lsi_entry *lsi_entry;
-  int hash, err, key_len;
-  __u8 key1[8], key2[8], key3[8];       /* for 3-DES */
-  struct timeval now;
+  hip_sadb_op op;
+
+  op.op = SADB_OP_ADD;
+  op.spi = spi;
+  op.mode = mode;
+  op.direction = direction;
+  op.src_hit = src_hit;
+  op.dst_hit = dst_hit;
+  op.src = src;
+  op.dst = dst;
+  op.src_lsi = src_lsi;
+  op.dst_lsi = dst_lsi;
+  op.spinat = spinat;
+  op.e_key = e_key;
+  op.e_type = e_type;
+  op.e_keylen = e_keylen;
+  op.a_key = a_key;
+  op.a_type = a_type;
+  op.a_keylen = a_keylen;
+  op.lifetime = lifetime;
+  return(hip_sadb_apply(&op, 1));
+}
+
+/*
+ * hip_sadb_prepare()
+ *
+ * Build the SADB entry for an add operation, with its keys and crypto
+ * contexts, and allocate the table nodes and destination cache entries
+ * needed to link it, so that hip_sadb_link() cannot fail. Called without
+ * hip_sadb_write_lock; the entry is not visible to other threads yet.
+ * Returns 0 on success, -1 on error.
+ */
+int hip_sadb_prepare(hip_sadb_op *op, hip_sadb_prep *p, struct timeval *now)
+{
+  hip_sadb_entry *entry;
+  hip_sadb_cold *cold;
   struct sockaddr *peer_lsi;
+  int i;
 
   /* type is currently ignored */
-  if (!src || !dst || !a_key)
+  if (!op->src || !op->dst || !op->a_key)
     {
       return(-1);
     }
-
-  gettimeofday(&now, NULL);
-
-  hash = sadb_hashfn(spi);
-  pthread_mutex_lock(&hip_sadb_locks[hash]);       /* lock this chain */
-  for (entry = hip_sadb[sadb_hashfn(spi)]; entry; entry = entry->next)
+  /* AES-GCM keys are followed by a 4-byte salt */
+  if ((op->e_type == SADB_X_EALG_AES_GCM_ICV16) &&
+      (op->e_keylen != (16 + 4)))
     {
-      if (entry->spi == spi)
-        {
-          goto hip_sadb_add_error_nofree;               /* already exists */
-        }
-      prev = entry;
+      printf("sadb_add() invalid AES-GCM key length: %d\n", op->e_keylen);
+      return(-1);
     }
-
-  entry = malloc(sizeof(hip_sadb_entry));
-  if (!entry)
+  /* 1 = incoming, 2 = outgoing */
+  if (!((op->direction == 1) || (op->direction == 2)))
     {
-      goto hip_sadb_add_error_nofree;           /* no buffer space available */
+      printf("sadb_add() invalid direction specified: %d\n",
+             op->direction);
+      return(-1);
     }
-  /* add the new entry */
-  memset(entry, 0, sizeof(hip_sadb_entry));
+
+  entry = (hip_sadb_entry*)calloc(1, sizeof(hip_sadb_entry));
+  cold = (hip_sadb_cold*)calloc(1, sizeof(hip_sadb_cold));
+  if (!entry || !cold)
+    {
+      free(entry);
+      free(cold);
+      return(-1);               /* no buffer space available */
+    }
+  p->entry = entry;
+  entry->cold = cold;
+  cold->entry = entry;
+  entry->ctr_index = SADB_CTR_NONE;
+  hip_timer_init(&cold->exp_timer, hip_sadb_expire_timer);
   pthread_mutex_init(&entry->rw_lock, NULL);
-  pthread_mutex_lock(&entry->rw_lock);
-  entry->mode = mode;
-  entry->direction = direction;
-  entry->next = NULL;
-  entry->spi = spi;
-  entry->spinat = spinat;
-  entry->hit_magic = checksum_magic((const hip_hit*)(SA2IP(src_hit)),
-                                    (const hip_hit*)(SA2IP(dst_hit)));
-  entry->src_addrs = (sockaddr_list*)malloc(sizeof(sockaddr_list));
-  entry->dst_addrs = (sockaddr_list*)malloc(sizeof(sockaddr_list));
-  memset(&entry->src_hit, 0, sizeof(struct sockaddr_storage));
-  memset(&entry->dst_hit, 0, sizeof(struct sockaddr_storage));
-  memset(&entry->lsi, 0, sizeof(struct sockaddr_storage));
-  entry->a_type = a_type;
-  entry->e_type = e_type;
-  entry->a_keylen = a_keylen;
-  entry->e_keylen = e_keylen;
-  entry->a_key = (__u8*)malloc(a_keylen);
-  if (e_keylen > 0)
-    {
-      entry->e_key = (__u8*)malloc(e_keylen);
-    }
-  entry->lifetime = lifetime;
-  entry->exptime.tv_sec = now.tv_sec + lifetime;
-  entry->exptime.tv_usec = now.tv_usec;
-  entry->bytes = 0;
-  entry->packets = 0;
-  entry->lost = 0;
-  entry->dropped = 0;
-  entry->usetime.tv_sec = 0;
-  entry->usetime.tv_usec = 0;
-  entry->sequence = 0;
-  entry->sequence_hi = 0;
-  entry->replay_win_max = 0;
-  entry->replay_win_map = 0;
+  entry->mode = op->mode;
+  entry->direction = op->direction;
+  entry->spi = op->spi;
+  entry->spinat = op->spinat;
+  entry->hit_magic = checksum_magic((const hip_hit*)(SA2IP(op->src_hit)),
+                                    (const hip_hit*)(SA2IP(op->dst_hit)));
+  entry->src_addrs = (sockaddr_list*)calloc(1, sizeof(sockaddr_list));
+  entry->dst_addrs = (sockaddr_list*)calloc(1, sizeof(sockaddr_list));
+  entry->a_type = op->a_type;
+  entry->e_type = op->e_type;
+  cold->a_keylen = op->a_keylen;
+  entry->e_keylen = op->e_keylen;
+  if (op->a_keylen > 0)
+    {
+      cold->a_key = (__u8*)malloc(op->a_keylen);
+    }
+  if (op->e_keylen > 0)
+    {
+      entry->e_key = (__u8*)malloc(op->e_keylen);
+    }
+  cold->lifetime = op->lifetime;
+  cold->exptime.tv_sec = now->tv_sec + op->lifetime;
+  cold->exptime.tv_usec = now->tv_usec;
+  entry->iv_gen = esp_iv_gen;
+  entry->replay_win_words = esp_replay_win / REPLAY_WIN_WORD;
+  entry->replay_win_map = (__u64*)calloc(entry->replay_win_words,
+                                         sizeof(__u64));
 
   /* malloc error */
-  if (!entry->src_addrs || !entry->dst_addrs || !entry->a_key)
+  if (!entry->src_addrs || !entry->dst_addrs || !entry->replay_win_map ||
+      ((op->a_keylen > 0) && !cold->a_key))
     {
-      goto hip_sadb_add_error;
+      goto hip_sadb_prepare_error;
     }
-  if ((e_keylen > 0) && !entry->e_key)
+  if ((op->e_keylen > 0) && !entry->e_key)
     {
-      goto hip_sadb_add_error;
+      goto hip_sadb_prepare_error;
     }
 
   /* copy addresses, HITs */
-  memset(entry->src_addrs, 0, sizeof(sockaddr_list));
-  memset(entry->dst_addrs, 0, sizeof(sockaddr_list));
-  memcpy(&entry->src_addrs->addr, src, SALEN(src));
-  memcpy(&entry->dst_addrs->addr, dst, SALEN(dst));
-  memcpy(&entry->src_hit, src_hit, SALEN(src_hit));
-  memcpy(&entry->dst_hit, dst_hit, SALEN(dst_hit));
+  memcpy(&entry->src_addrs->addr, op->src, SALEN(op->src));
+  memcpy(&entry->dst_addrs->addr, op->dst, SALEN(op->dst));
+  memcpy(&cold->src_hit, op->src_hit, SALEN(op->src_hit));
+  memcpy(&cold->dst_hit, op->dst_hit, SALEN(op->dst_hit));
 
-  /* 1 = incoming, 2 = outgoing */
-  if (!((direction == 1) || (direction == 2)))
+  /* copy keys and set up the per-SA crypto contexts */
+  if (hip_sadb_init_keys(entry, op->e_key, op->a_key) < 0)
     {
-      printf("sadb_add() invalid direction specified: %d\n",
-             direction);
-      goto hip_sadb_add_error;
+      goto hip_sadb_prepare_error;
     }
-  peer_lsi = (direction == 1) ? src_lsi : dst_lsi;
-  memcpy(&entry->lsi, peer_lsi, SALEN(peer_lsi));
-  if (entry->lsi.ss_family == AF_INET)
+  peer_lsi = (op->direction == 1) ? op->src_lsi : op->dst_lsi;
+  memcpy(&cold->lsi, peer_lsi, SALEN(peer_lsi));
+  if (cold->lsi.ss_family == AF_INET)
     {
       /* LSI parameters are in network byte order, but here
        * they are used in host byte order */
-      LSI4(SA(&entry->lsi)) = ntohl(LSI4(SA(&entry->lsi)));
+      LSI4(SA(&cold->lsi)) = ntohl(LSI4(SA(&cold->lsi)));
+      entry->lsi4 = LSI4(SA(&cold->lsi));
+    }
+
+  /* memory for linking the entry into the SADB and destination cache */
+  if (!(p->node = malloc(sizeof(hip_hash_node))))
+    {
+      goto hip_sadb_prepare_error;
+    }
+  if (op->direction == 2)
+    {
+      for (i = 0; i < 2; i++)
+        {
+          p->dst[i] = calloc(1, sizeof(hip_sadb_dst_entry));
+          p->dst_node[i] = malloc(sizeof(hip_hash_node));
+          if (!p->dst[i] || !p->dst_node[i])
+            {
+              goto hip_sadb_prepare_error;
+            }
+        }
+    }
+  return(0);
+
+hip_sadb_prepare_error:
+  /* take care of deallocation */
+  hip_sadb_prep_free(p);
+  return(-1);
+}
+
+/*
+ * hip_sadb_prep_free()
+ *
+ * Free whatever hip_sadb_prepare() allocated that was not used to link
+ * the entry, including the entry itself if it was never linked.
+ */
+void hip_sadb_prep_free(hip_sadb_prep *p)
+{
+  int i;
+
+  if (p->entry)
+    {
+      hip_sadb_free_entry(p->entry);
+      p->entry = NULL;
     }
+  free(p->node);
+  p->node = NULL;
+  for (i = 0; i < 2; i++)
+    {
+      free(p->dst[i]);
+      free(p->dst_node[i]);
+      p->dst[i] = NULL;
+      p->dst_node[i] = NULL;
+    }
+}
+
+/*
+ * hip_sadb_link()
+ *
+ * Link a prepared entry into the SADB and, for outgoing SAs, the
+ * destination cache, and start its expiry timer. Caller holds
+ * hip_sadb_write_lock and has checked that the SPI is not in use.
+ */
+void hip_sadb_link(hip_sadb_prep *p, struct timeval *now)
+{
+  hip_sadb_entry *entry = p->entry;
+  hip_sadb_cold *cold = entry->cold;
+  hip_lsi_entry *lsi_entry;
+  struct timeval unbuffer_time;
 
-  if (direction == 2)         /* outgoing */
+  entry->ctr_index = hip_sadb_ctr_alloc();
+  if (entry->direction == 2)         /* outgoing */
     {           /* add to destination cache for easy lookup via address */
-      hip_sadb_add_dst_entry(SA(&entry->lsi), entry);
-      hip_sadb_add_dst_entry(dst_hit, entry);
-      if ((lsi_entry = hip_lookup_lsi(SA(&entry->lsi))))
+      hip_sadb_add_dst_entry(SA(&cold->lsi), entry, p, 0);
+      hip_sadb_add_dst_entry(SA(&cold->dst_hit), entry, p, 1);
+      if ((lsi_entry = hip_lookup_lsi(SA(&cold->lsi))))
         {
           lsi_entry->send_packets = 1;
           /* Once an incoming SA is added (outgoing is always
            * added first in hipd) then we need to send unbuffered
            * packets.
-           * While that could be done here, instead we decrease
-           * the timeout of hip_esp_input so it is done later.
+           * While that could be done here, instead the LSI timer
+           * is set so it is done a little later.
            * Otherwise, experience shows a race condition where
            * the first unbuffered packet arrives at the peer
            * before its SAs are built. */
-          g_read_usec = 200000;
+          unbuffer_time.tv_sec = now->tv_sec +
+                                 (now->tv_usec + LSI_UNBUFFER_DELAY) / 1000000;
+          unbuffer_time.tv_usec = (now->tv_usec + LSI_UNBUFFER_DELAY) %
+                                  1000000;
+          hip_timer_add(&hip_sadb_wheel, &lsi_entry->timer, &unbuffer_time);
         }
     }
 
-  /* copy keys */
-  memcpy(entry->a_key, a_key, a_keylen);
-  if (e_keylen > 0)
+  /* finally, link the new entry into the table; readers may see it as
+   * soon as it is linked, so it must be complete */
+  hip_hash_insert_node(&hip_sadb, p->node, sadb_hashfn(entry->spi), entry);
+  p->node = NULL;
+  p->entry = NULL;
+  hip_timer_add(&hip_sadb_wheel, &cold->exp_timer, &cold->exptime);
+}
+
+/*
+ * hip_sadb_init_keys()
+ *
+ * Copy the keys into a new SADB entry and prepare the crypto state that
+ * is reused for every packet: 3-DES and Blowfish key schedules, a keyed
+ * EVP cipher context for AES, a keyed HMAC context, and the IV generator
+ * for outgoing CBC SAs. The entry's e_type, a_type, key lengths,
+ * direction and iv_gen must already be set.
+ * Returns 0 on success, -1 on error.
+ */
+int hip_sadb_init_keys(hip_sadb_entry *entry, __u8 *e_key, __u8 *a_key)
+{
+  int err, key_len, enc = (entry->direction == 2);
+  __u8 key1[8], key2[8], key3[8];       /* for 3-DES */
+  const EVP_CIPHER *cipher = NULL;
+  const EVP_MD *md = NULL;
+
+  if (entry->cold->a_keylen > 0)
     {
-      memcpy(entry->e_key, e_key, e_keylen);
+      memcpy(entry->cold->a_key, a_key, entry->cold->a_keylen);
     }
-  if ((e_keylen > 0) && (e_type == SADB_EALG_3DESCBC))
+  if (entry->e_keylen > 0)
     {
-      key_len = e_keylen / 3;
+      memcpy(entry->e_key, e_key, entry->e_keylen);
+    }
+
+  switch (entry->e_type)
+    {
+    case SADB_EALG_3DESCBC:
+      if (entry->e_keylen == 0)
+        {
+          break;
+        }
+      key_len = entry->e_keylen / 3;
       memcpy(key1, &e_key[0], key_len);
       memcpy(key2, &e_key[8], key_len);
       memcpy(key3, &e_key[16], key_len);
       DES_set_odd_parity((DES_cblock*)key1);
       DES_set_odd_parity((DES_cblock*)key2);
       DES_set_odd_parity((DES_cblock*)key3);
+      if (!(entry->ks = malloc(3 * sizeof(DES_key_schedule))))
+        {
+          return(-1);
+        }
       err = DES_set_key_checked((DES_cblock*)key1, &entry->ks[0]);
       err += DES_set_key_checked((DES_cblock*)key2, &entry->ks[1]);
       err += DES_set_key_checked((DES_cblock*)key3, &entry->ks[2]);
@@ -400,72 +612,373 @@ int hip_sadb_add(__u32 mode, int direction,
         {
           printf("hip_sadb_add: Warning - 3DES key problem.\n");
         }
+      break;
+    case SADB_X_EALG_BLOWFISHCBC:
+      if (entry->e_keylen == 0)
+        {
+          break;
+        }
+      if (!(entry->bf_key = malloc(sizeof(BF_KEY))))
+        {
+          return(-1);
+        }
+      BF_set_key(entry->bf_key, entry->e_keylen, e_key);
+      break;
+    case SADB_X_EALG_AESCBC:
+      switch (entry->e_keylen)
+        {
+        case 16:
+          cipher = EVP_aes_128_cbc();
+          break;
+        case 24:
+          cipher = EVP_aes_192_cbc();
+          break;
+        case 32:
+          cipher = EVP_aes_256_cbc();
+          break;
+        default:
+          printf("hip_sadb_add: invalid AES key length %d.\n",
+                 entry->e_keylen);
+          return(-1);
+        }
+      break;
+#ifdef HIP_ESP_AES_GCM
+    case SADB_X_EALG_AES_GCM_ICV16:
+      cipher = EVP_aes_128_gcm();
+      break;
+#endif /* HIP_ESP_AES_GCM */
+    default:
+      break;
+    }
+
+  /* AES keys are expanded once, per packet only the IV is set */
+  if (cipher)
+    {
+      if (!(entry->cipher_ctx = EVP_CIPHER_CTX_new()) ||
+          !EVP_CipherInit_ex(entry->cipher_ctx, cipher, NULL, NULL, NULL,
+                             enc))
+        {
+          return(-1);
+        }
+#ifdef HIP_ESP_AES_GCM
+      if ((entry->e_type == SADB_X_EALG_AES_GCM_ICV16) &&
+          !EVP_CIPHER_CTX_ctrl(entry->cipher_ctx, EVP_CTRL_GCM_SET_IVLEN,
+                               ESP_GCM_NONCE_LEN, NULL))
+        {
+          return(-1);
+        }
+#endif /* HIP_ESP_AES_GCM */
+      if (!EVP_CipherInit_ex(entry->cipher_ctx, NULL, NULL, entry->e_key,
+                             NULL, enc))
+        {
+          printf("hip_sadb_add: Warning - AES key problem.\n");
+          return(-1);
+        }
+      EVP_CIPHER_CTX_set_padding(entry->cipher_ctx, 0);
+      entry->cipher_enc = enc;
     }
-  else if ((e_keylen > 0) && (e_type == SADB_X_EALG_AESCBC))
+
+  /* outgoing CBC IVs come from an encrypted counter, keyed once */
+  if ((entry->iv_gen == ESP_IV_COUNTER) && enc &&
+      ((entry->e_type == SADB_EALG_3DESCBC) ||
+       (entry->e_type == SADB_X_EALG_BLOWFISHCBC) ||
+       (entry->e_type == SADB_X_EALG_AESCBC)))
     {
-      /* AES key differs for encryption/decryption, so we set
-       * it upon first use in the SA */
-      entry->aes_key = NULL;
+      if (hip_esp_iv_init(entry) < 0)
+        {
+          return(-1);
+        }
     }
-  else if ((e_keylen > 0) && (e_type == SADB_X_EALG_BLOWFISHCBC))
+  else
     {
-      entry->bf_key = malloc(sizeof(BF_KEY));
-      BF_set_key(entry->bf_key, e_keylen, e_key);
+      entry->iv_gen = ESP_IV_RANDOM;
     }
 
-  /* finally, link the new entry into the chain */
-  if (prev)
+  /* the HMAC inner and outer pads are computed once */
+  switch (entry->a_type)
     {
-      prev->next = entry;
+    case SADB_AALG_MD5HMAC:
+      md = EVP_md5();
+      break;
+    case SADB_AALG_SHA1HMAC:
+      md = EVP_sha1();
+      break;
+    default:
+      break;
     }
-  else
+  if (md && (entry->cold->a_keylen > 0))
     {
-      hip_sadb[hash] = entry;
+      if (!(entry->hmac_ctx = HMAC_CTX_new()) ||
+          !HMAC_Init_ex(entry->hmac_ctx, entry->cold->a_key,
+                        entry->cold->a_keylen,
+                        md, NULL))
+        {
+          return(-1);
+        }
     }
-  pthread_mutex_unlock(&entry->rw_lock);
-  pthread_mutex_unlock(&hip_sadb_locks[hash]);       /* release chain lock */
   return(0);
-
-hip_sadb_add_error:
-  /* take care of deallocation */
-  hip_sadb_delete_entry(entry, FALSE);
-hip_sadb_add_error_nofree:
-  pthread_mutex_unlock(&hip_sadb_locks[hash]);
-  return(-1);
 }
 
 /*
  * hip_sadb_delete()
  *
  * Remove an SADB entry from the SADB hash table.
- * First free dynamically-allocated elements, then unlink the entry and
- * either replace it or zero it.
  */
 int hip_sadb_delete(__u32 spi)
 {
-  hip_sadb_entry *entry;
+  hip_sadb_op op;
+
+  memset(&op, 0, sizeof(op));
+  op.op = SADB_OP_DELETE;
+  op.spi = spi;
+  return(hip_sadb_apply(&op, 1));
+}
+
+/*
+ * hip_sadb_unlink()
+ *
+ * Remove an entry from the SADB, set its LSI entry to expire, and retire
+ * it. Destination cache entries are left to hip_sadb_unlink_dst(), so
+ * that a replacement SA can take them over first. Caller holds
+ * hip_sadb_write_lock.
+ */
+void hip_sadb_unlink(hip_sadb_entry *entry)
+{
   hip_lsi_entry *lsi_entry;
 
-  if (!(entry = hip_sadb_lookup_spi(spi)))
+  /* set LSI entry to expire */
+  if ((lsi_entry = hip_lookup_lsi(SA(&entry->cold->lsi))))
     {
-      return(-1);
+      lsi_entry->creation_time.tv_sec = 0;
+      hip_timer_add(&hip_sadb_wheel, &lsi_entry->timer,
+                    &lsi_entry->creation_time);
     }
 
-  pthread_mutex_lock(&entry->rw_lock);
+  hip_sadb_delete_entry(entry, TRUE);
+}
+
+/*
+ * hip_sadb_unlink_dst()
+ *
+ * Remove the destination cache entries of an unlinked outgoing SA, unless
+ * they now point to another SA. Caller holds hip_sadb_write_lock, and the
+ * entry has not been reclaimed yet.
+ */
+void hip_sadb_unlink_dst(hip_sadb_entry *entry)
+{
   if (entry->direction == 2)         /* outgoing */
     {
-      hip_sadb_delete_dst_entry(SA(&entry->lsi));
-      hip_sadb_delete_dst_entry(SA(&entry->dst_hit));
+      hip_sadb_delete_dst_entry(SA(&entry->cold->lsi), entry);
+      hip_sadb_delete_dst_entry(SA(&entry->cold->dst_hit), entry);
     }
+}
 
-  /* set LSI entry to expire */
-  if ((lsi_entry = hip_lookup_lsi(SA(&entry->lsi))))
+/*
+ * hip_sadb_op_cmp()
+ *
+ * qsort() comparison for pointers to SADB operations, ordering them by SPI
+ * and then by their position in the caller's array.
+ */
+static int hip_sadb_op_cmp(const void *a, const void *b)
+{
+  const hip_sadb_op *x = *(const hip_sadb_op**)a;
+  const hip_sadb_op *y = *(const hip_sadb_op**)b;
+
+  if (x->spi != y->spi)
     {
-      lsi_entry->creation_time.tv_sec = 0;
+      return((x->spi < y->spi) ? -1 : 1);
     }
+  return((x < y) ? -1 : (x > y));
+}
 
-  hip_sadb_delete_entry(entry, TRUE);
-  return(0);
+/*
+ * hip_sadb_check_ops()
+ *
+ * Check that a set of SADB operations is consistent by itself: an SPI may
+ * appear once, or be deleted and then added again. Marks the adds that
+ * replace a deleted SA. Returns 0 if the set is valid, -1 otherwise.
+ */
+int hip_sadb_check_ops(hip_sadb_op *ops, int num, hip_sadb_prep *prep)
+{
+  hip_sadb_op **s;
+  int i, err = 0;
+
+  for (i = 0; i < num; i++)
+    {
+      if ((ops[i].op != SADB_OP_ADD) && (ops[i].op != SADB_OP_DELETE))
+        {
+          return(-1);
+        }
+    }
+  if (num < 2)
+    {
+      return(0);
+    }
+  if (!(s = malloc(num * sizeof(hip_sadb_op*))))
+    {
+      return(-1);
+    }
+  for (i = 0; i < num; i++)
+    {
+      s[i] = &ops[i];
+    }
+  qsort(s, num, sizeof(hip_sadb_op*), hip_sadb_op_cmp);
+  for (i = 1; i < num; i++)
+    {
+      if (s[i]->spi != s[i - 1]->spi)
+        {
+          continue;
+        }
+      if ((s[i - 1]->op != SADB_OP_DELETE) || (s[i]->op != SADB_OP_ADD) ||
+          ((i > 1) && (s[i - 2]->spi == s[i]->spi)))
+        {
+          printf("hip_sadb_apply() conflicting operations for SPI 0x%x\n",
+                 s[i]->spi);
+          err = -1;
+          break;
+        }
+      prep[s[i] - ops].replaces = TRUE;
+    }
+  free(s);
+  return(err);
+}
+
+/*
+ * hip_sadb_apply_chunk()
+ *
+ * Apply part of a set of SADB operations, checked by hip_sadb_check_ops(),
+ * as one transaction. The new entries are built before taking
+ * hip_sadb_write_lock, which is then held only to look up the SPIs and
+ * swap the table pointers. Returns 0 on success, -1 on error.
+ */
+int hip_sadb_apply_chunk(hip_sadb_op *ops, hip_sadb_prep *prep, int num,
+                         struct timeval *now)
+{
+  hip_sadb_entry *entry;
+  hip_sadb_retired *retired;
+  int i, err = -1;
+
+  /* build the new entries without holding the lock */
+  for (i = 0; i < num; i++)
+    {
+      if ((ops[i].op == SADB_OP_ADD) &&
+          (hip_sadb_prepare(&ops[i], &prep[i], now) < 0))
+        {
+          goto hip_sadb_apply_chunk_out;
+        }
+    }
+
+  pthread_mutex_lock(&hip_sadb_write_lock);       /* serialize writers */
+  for (i = 0; i < num; i++)
+    {
+      entry = hip_sadb_lookup_spi(ops[i].spi);
+      if (ops[i].op == SADB_OP_DELETE)
+        {
+          if (!(prep[i].old = entry))
+            {
+              goto hip_sadb_apply_chunk_unlock; /* not found */
+            }
+        }
+      else if (entry && !prep[i].replaces)
+        {
+          goto hip_sadb_apply_chunk_unlock;     /* already exists */
+        }
+    }
+  for (i = 0; i < num; i++)
+    {
+      if (ops[i].op == SADB_OP_DELETE)
+        {
+          hip_sadb_unlink(prep[i].old);
+        }
+    }
+  for (i = 0; i < num; i++)
+    {
+      if (ops[i].op == SADB_OP_ADD)
+        {
+          hip_sadb_link(&prep[i], now);
+        }
+    }
+  for (i = 0; i < num; i++)
+    {
+      if (ops[i].op == SADB_OP_DELETE)
+        {
+          hip_sadb_unlink_dst(prep[i].old);
+        }
+    }
+  err = 0;
+
+hip_sadb_apply_chunk_unlock:
+  retired = hip_sadb_reclaim();
+  pthread_mutex_unlock(&hip_sadb_write_lock);
+  hip_sadb_free_retired(retired);
+hip_sadb_apply_chunk_out:
+  for (i = 0; i < num; i++)
+    {
+      hip_sadb_prep_free(&prep[i]);
+    }
+  return(err);
+}
+
+/*
+ * hip_sadb_apply()
+ *
+ * Install and remove a set of SAs, with their destination cache entries,
+ * as one transaction: either all operations succeed or none is done.
+ * Old SAs are removed before new ones are linked, and a new outgoing SA
+ * takes over the destination cache entries of the one it replaces, so
+ * the ESP output threads never miss them.
+ * Sets larger than SADB_APPLY_CHUNK are applied a chunk at a time, so
+ * that other writers, such as the SADB timer thread, are not held off
+ * for the whole set; a delete is kept in the same chunk as an add that
+ * directly follows it. Each chunk is all or nothing, and the first chunk
+ * that fails ends the call, leaving the chunks before it applied.
+ * Returns 0 on success, -1 on error.
+ */
+int hip_sadb_apply(hip_sadb_op *ops, int num)
+{
+  hip_sadb_prep one, *prep;
+  struct timeval now;
+  int i, n, err = 0;
+
+  if (num <= 0)
+    {
+      return((num == 0) ? 0 : -1);
+    }
+  if (num == 1)
+    {
+      memset(&one, 0, sizeof(one));
+      prep = &one;
+    }
+  else if (!(prep = (hip_sadb_prep*)calloc(num, sizeof(hip_sadb_prep))))
+    {
+      return(-1);
+    }
+  gettimeofday(&now, NULL);
+  if (hip_sadb_check_ops(ops, num, prep) < 0)
+    {
+      err = -1;
+    }
+
+  for (i = 0; (i < num) && (err == 0); i += n)
+    {
+      n = num - i;
+      if (n > SADB_APPLY_CHUNK)
+        {
+          n = SADB_APPLY_CHUNK;
+          if ((ops[i + n - 1].op == SADB_OP_DELETE) &&
+              (ops[i + n].op == SADB_OP_ADD))
+            {
+              n++;
+            }
+        }
+      err = hip_sadb_apply_chunk(&ops[i], &prep[i], n, &now);
+    }
+
+  if (prep != &one)
+    {
+      free(prep);
+    }
+  return(err);
 }
 
 /*
@@ -482,20 +995,22 @@ int hip_sadb_add_del_addr(__u32 spi, struct sockaddr *addr, int flags)
 {
   hip_sadb_entry *e;
   sockaddr_list **l;
-  int hash, err;
+  int err;
 
   if ((flags < 0) || (flags > 4))
     {
       return(-1);           /* invalid flags */
     }
+  pthread_mutex_lock(&hip_sadb_write_lock);
   e = hip_sadb_lookup_spi(spi);
   if (!e)
     {
+      pthread_mutex_unlock(&hip_sadb_write_lock);
       return(-1);           /* sadb entry not found */
 
     }
-  hash = sadb_hashfn(spi);
-  pthread_mutex_lock(&hip_sadb_locks[hash]);
+  /* the ESP threads read the address lists under the entry lock */
+  pthread_mutex_lock(&e->rw_lock);
   l = (flags == 1 || flags == 3) ? &e->src_addrs : &e->dst_addrs;
   err = 0;
   /* add source or destination address to entry */
@@ -511,77 +1026,347 @@ int hip_sadb_add_del_addr(__u32 spi, struct sockaddr *addr, int flags)
     {
       delete_address_from_list(l, addr, 0);
     }
-  pthread_mutex_unlock(&hip_sadb_locks[hash]);
-  return(err);
+  pthread_mutex_unlock(&e->rw_lock);
+  pthread_mutex_unlock(&hip_sadb_write_lock);
+  return(err);
+}
+
+/*
+ * hip_sadb_delete_entry()
+ *
+ * Deallocate a SADB entry, perform unlinking from table if unlink is TRUE.
+ * When unlinking, the caller holds hip_sadb_write_lock and the entry is
+ * freed once the ESP threads can no longer reference it. Otherwise the
+ * entry was never visible to them and it is freed immediately.
+ */
+int hip_sadb_delete_entry(hip_sadb_entry *entry, int unlink)
+{
+  if (!entry)
+    {
+      return(-1);
+    }
+
+  if (!unlink)
+    {
+      hip_sadb_free_entry(entry);
+      return(0);
+    }
+
+  if (!hip_hash_remove(&hip_sadb, sadb_hashfn(entry->spi), &entry->spi))
+    {
+      return(-1);
+    }
+  hip_timer_del(&entry->cold->exp_timer);
+  hip_sadb_retire(entry, hip_sadb_free_entry);
+  return(0);
+}
+
+/*
+ * hip_sadb_free_entry()
+ *
+ * Free an SADB entry and its keys once no thread can reference it.
+ */
+void hip_sadb_free_entry(void *p)
+{
+  hip_sadb_entry *entry = (hip_sadb_entry*)p;
+
+  /* free address lists */
+  if (entry->src_addrs)
+    {
+      free_addr_list(entry->src_addrs);
+    }
+  if (entry->dst_addrs)
+    {
+      free_addr_list(entry->dst_addrs);
+    }
+
+  /* securely erase keys */
+  if (entry->cold && entry->cold->a_key)
+    {
+      memset(entry->cold->a_key, 0, entry->cold->a_keylen);
+      free(entry->cold->a_key);
+    }
+  if (entry->e_key)
+    {
+      memset(entry->e_key, 0, entry->e_keylen);
+      free(entry->e_key);
+    }
+  if (entry->bf_key)
+    {
+      memset(entry->bf_key, 0, sizeof(BF_KEY));
+      free(entry->bf_key);
+    }
+  if (entry->ks)
+    {
+      memset(entry->ks, 0, 3 * sizeof(DES_key_schedule));
+      free(entry->ks);
+    }
+  if (entry->cipher_ctx)
+    {
+      EVP_CIPHER_CTX_free(entry->cipher_ctx);
+    }
+  if (entry->hmac_ctx)
+    {
+      HMAC_CTX_free(entry->hmac_ctx);
+    }
+  if (entry->iv_ctx)
+    {
+      EVP_CIPHER_CTX_free(entry->iv_ctx);
+    }
+  if (entry->replay_win_map)
+    {
+      free(entry->replay_win_map);
+    }
+  if (entry->cold)
+    {
+      free(entry->cold);
+    }
+  hip_sadb_ctr_release(entry->ctr_index);
+
+  pthread_mutex_destroy(&entry->rw_lock);
+  free(entry);
+}
+
+/*
+ * hip_sadb_retire()
+ *
+ * Queue an unlinked SADB or destination cache entry to be freed after a
+ * grace period. Caller holds hip_sadb_write_lock.
+ */
+void hip_sadb_retire(void *p, void (*free_fn)(void *ptr))
+{
+  hip_sadb_retired *r = malloc(sizeof(hip_sadb_retired));
+
+  if (!r)
+    {
+      printf("hip_sadb_retire() malloc() error, leaking entry\n");
+      return;
+    }
+  r->ptr = p;
+  r->free_fn = free_fn;
+  /* readers that record this epoch or later cannot see the entry */
+  r->epoch = __atomic_add_fetch(&hip_sadb_epoch, 1, __ATOMIC_SEQ_CST);
+  r->next = hip_sadb_retired_list;
+  SADB_STORE(hip_sadb_retired_list, r);
+}
+
+/*
+ * hip_sadb_reclaim()
+ *
+ * Unlink retired entries that every registered reader has passed by and
+ * return them, so the caller can free them with hip_sadb_free_retired()
+ * after dropping hip_sadb_write_lock, which it holds here.
+ */
+hip_sadb_retired *hip_sadb_reclaim()
+{
+  hip_sadb_retired *r, *prev, *next, *done = NULL;
+  __u64 e, oldest = ~(__u64)0;
+  int i;
+
+  if (!hip_sadb_retired_list)
+    {
+      return(NULL);
+    }
+  for (i = 0; i < SADB_MAX_READERS; i++)
+    {
+      e = __atomic_load_n(&hip_sadb_reader_epochs[i], __ATOMIC_SEQ_CST);
+      if (e && (e < oldest))
+        {
+          oldest = e;
+        }
+    }
+  for (prev = NULL, r = hip_sadb_retired_list; r; r = next)
+    {
+      next = r->next;
+      if (r->epoch > oldest)
+        {
+          prev = r;
+          continue;
+        }
+      if (prev)
+        {
+          prev->next = next;
+        }
+      else
+        {
+          SADB_STORE(hip_sadb_retired_list, next);
+        }
+      r->next = done;
+      done = r;
+    }
+  return(done);
+}
+
+/*
+ * hip_sadb_free_retired()
+ *
+ * Free a list of entries returned by hip_sadb_reclaim().
+ */
+void hip_sadb_free_retired(hip_sadb_retired *r)
+{
+  hip_sadb_retired *next;
+
+  for (; r; r = next)
+    {
+      next = r->next;
+      r->free_fn(r->ptr);
+      free(r);
+    }
+}
+
+/*
+ * hip_sadb_reader_add()
+ *
+ * Register the calling thread as a lock-free SADB reader. Returns a reader
+ * slot for hip_sadb_quiescent(), or -1 if all slots are in use.
+ */
+int hip_sadb_reader_add()
+{
+  __u64 unused;
+  int i;
+
+  for (i = 0; i < SADB_MAX_READERS; i++)
+    {
+      unused = 0;
+      if (__atomic_compare_exchange_n(&hip_sadb_reader_epochs[i], &unused,
+                                      __atomic_load_n(&hip_sadb_epoch,
+                                                      __ATOMIC_SEQ_CST),
+                                      FALSE, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_SEQ_CST))
+        {
+          return(i);
+        }
+    }
+  return(-1);
+}
+
+/*
+ * hip_sadb_reader_remove()
+ *
+ * Release a reader slot when the thread exits.
+ */
+void hip_sadb_reader_remove(int reader)
+{
+  if ((reader >= 0) && (reader < SADB_MAX_READERS))
+    {
+      __atomic_store_n(&hip_sadb_reader_epochs[reader], 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * hip_sadb_quiescent()
+ *
+ * Called by a reader between packets, when it holds no pointers obtained
+ * from the SADB or destination cache. Entries retired before this point
+ * may then be freed.
+ */
+void hip_sadb_quiescent(int reader)
+{
+  if ((reader >= 0) && (reader < SADB_MAX_READERS))
+    {
+      __atomic_store_n(&hip_sadb_reader_epochs[reader],
+                       __atomic_load_n(&hip_sadb_epoch, __ATOMIC_SEQ_CST),
+                       __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * hip_sadb_ctr_alloc()
+ *
+ * Pick a traffic counter index for a new SA, or SADB_CTR_NONE if there
+ * are too many SAs.
+ */
+__u32 hip_sadb_ctr_alloc()
+{
+  __u32 index = SADB_CTR_NONE;
+
+  pthread_mutex_lock(&hip_sadb_ctr_lock);
+  if (hip_sadb_ctr_num_free > 0)
+    {
+      index = hip_sadb_ctr_free[--hip_sadb_ctr_num_free];
+    }
+  else if (hip_sadb_ctr_next < SADB_CTR_MAX)
+    {
+      index = hip_sadb_ctr_next++;
+    }
+  pthread_mutex_unlock(&hip_sadb_ctr_lock);
+  if (index == SADB_CTR_NONE)
+    {
+      printf("hip_sadb_ctr_alloc(): no traffic counters left\n");
+    }
+  return(index);
 }
 
 /*
- * hip_sadb_delete_entry()
+ * hip_sadb_ctr_release()
  *
- * Deallocate a SADB entry, perform unlinking from chain if unlink is TRUE.
- * Caller should hold lock on entry, which will be released and destroyed here.
+ * Zero the counters of a freed SA and recycle its index. The SA is no
+ * longer visible to the ESP threads, so none of them can be updating it.
  */
-int hip_sadb_delete_entry(hip_sadb_entry *entry, int unlink)
+void hip_sadb_ctr_release(__u32 index)
 {
-  hip_sadb_entry *last, *e;
-  int hash;
-  if (!entry)
+  hip_sadb_counters *chunk;
+  __u32 *f;
+  int i;
+
+  if (index >= SADB_CTR_MAX)
     {
-      return(-1);
+      return;
     }
-
-  if (unlink)
+  for (i = 0; i < SADB_MAX_READERS; i++)
     {
-      hash = sadb_hashfn(entry->spi);
-      pthread_mutex_lock(&hip_sadb_locks[hash]);
-      for (last = NULL, e = hip_sadb[hash]; e; last = e, e =
-             e->next)
+      chunk = SADB_LOAD(hip_sadb_ctrs[i][index / SADB_CTR_CHUNK]);
+      if (chunk)
         {
-          if (e == entry)
-            {
-              break;
-            }
+          memset(&chunk[index % SADB_CTR_CHUNK], 0,
+                 sizeof(hip_sadb_counters));
         }
-      if (e)             /* entry was found, unlink it from the chain */
+    }
+  pthread_mutex_lock(&hip_sadb_ctr_lock);
+  if (hip_sadb_ctr_num_free == hip_sadb_ctr_max_free)
+    {
+      f = realloc(hip_sadb_ctr_free,
+                  (hip_sadb_ctr_max_free + SADB_CTR_CHUNK) * sizeof(__u32));
+      if (!f)
         {
-          if (last)
-            {
-              last->next = entry->next;
-            }
-          else
-            {
-              hip_sadb[hash] = entry->next;
-            }
+          pthread_mutex_unlock(&hip_sadb_ctr_lock);
+          return;                       /* index is leaked */
         }
-      pthread_mutex_unlock(&hip_sadb_locks[hash]);
+      hip_sadb_ctr_free = f;
+      hip_sadb_ctr_max_free += SADB_CTR_CHUNK;
     }
+  hip_sadb_ctr_free[hip_sadb_ctr_num_free++] = index;
+  pthread_mutex_unlock(&hip_sadb_ctr_lock);
+}
 
-  /* free address lists */
-  if (entry->src_addrs)
-    {
-      free_addr_list(entry->src_addrs);
-    }
-  if (entry->dst_addrs)
-    {
-      free_addr_list(entry->dst_addrs);
-    }
+/*
+ * hip_sadb_ctr()
+ *
+ * Return the calling reader's counters for an SA, allocating the chunk
+ * holding them on first use, or NULL.
+ */
+static hip_sadb_counters *hip_sadb_ctr(hip_sadb_entry *entry, int reader)
+{
+  hip_sadb_counters *chunk;
+  __u32 index = entry->ctr_index;
 
-  /* securely erase keys */
-  if (entry->a_key)
+  if ((reader < 0) || (reader >= SADB_MAX_READERS) ||
+      (index >= SADB_CTR_MAX))
     {
-      memset(entry->a_key, 0, entry->a_keylen);
-      free(entry->a_key);
+      return(NULL);
     }
-  if (entry->e_key)
+  chunk = hip_sadb_ctrs[reader][index / SADB_CTR_CHUNK];
+  if (!chunk)
     {
-      memset(entry->e_key, 0, entry->e_keylen);
-      free(entry->e_key);
+      /* only this reader stores to its own chunk table */
+      chunk = calloc(SADB_CTR_CHUNK, sizeof(hip_sadb_counters));
+      if (!chunk)
+        {
+          return(NULL);
+        }
+      SADB_STORE(hip_sadb_ctrs[reader][index / SADB_CTR_CHUNK], chunk);
     }
-
-  pthread_mutex_unlock(&entry->rw_lock);
-  pthread_mutex_destroy(&entry->rw_lock);
-  free(entry);
-  return(0);
+  return(&chunk[index % SADB_CTR_CHUNK]);
 }
 
 void free_addr_list(sockaddr_list *a)
@@ -599,10 +1384,12 @@ void free_addr_list(sockaddr_list *a)
  * create_lsi_entry()
  *
  * Allocate a new LSI entry and link it in the global list lsi_temp.
+ * Caller holds hip_sadb_write_lock.
  */
 hip_lsi_entry *create_lsi_entry(struct sockaddr *lsi)
 {
   hip_lsi_entry *entry, *tmp;
+  struct timeval expires;
 
   entry = (hip_lsi_entry*) malloc(sizeof(hip_lsi_entry));
   if (!entry)
@@ -626,6 +1413,10 @@ hip_lsi_entry *create_lsi_entry(struct sockaddr *lsi)
   entry->next_packet = 0;
   entry->send_packets = 0;
   gettimeofday(&entry->creation_time, NULL);
+  hip_timer_init(&entry->timer, hip_lsi_timer);
+  expires.tv_sec = entry->creation_time.tv_sec + LSI_ENTRY_LIFETIME + 1;
+  expires.tv_usec = entry->creation_time.tv_usec;
+  hip_timer_add(&hip_sadb_wheel, &entry->timer, &expires);
 
   /* add it to the list */
   if (!lsi_temp)
@@ -644,44 +1435,55 @@ hip_lsi_entry *create_lsi_entry(struct sockaddr *lsi)
 }
 
 /*
- * hip_remove_expired_lsi_entries()
+ * hip_lsi_timer()
  *
  * LSI entries are only used temporarily, for embargoed packets that are
- * buffered. This checks the
- * creation time and removes those entries older than LSI_ENTRY_LIFETIME.
+ * buffered. Their timer fires shortly after the SA is added, to send the
+ * buffered packets, and LSI_ENTRY_LIFETIME after the entry was created,
+ * to remove it.
  */
-void hip_remove_expired_lsi_entries(struct timeval *now)
+void hip_lsi_timer(hip_timer *t, struct timeval *now)
 {
-  hip_lsi_entry *entry, *tmp, *prev = NULL;
+  hip_lsi_entry *entry = hip_timer_entry(t, hip_lsi_entry, timer);
+  hip_lsi_entry *l, *prev = NULL;
+  struct timeval expires;
 
-  entry = lsi_temp;
-  while (entry)
+  if ((now->tv_sec - entry->creation_time.tv_sec) <= LSI_ENTRY_LIFETIME)
     {
-      if (entry->send_packets)
+      if (entry->send_packets &&
+          (hip_lsi_num_unbuffer < SADB_TIMER_BATCH))
         {
-          unbuffer_packets(entry);
+          hip_lsi_unbuffer[hip_lsi_num_unbuffer++] = entry;
         }
-      if ((now->tv_sec - entry->creation_time.tv_sec) >
-          LSI_ENTRY_LIFETIME)
+      expires.tv_sec = entry->creation_time.tv_sec + LSI_ENTRY_LIFETIME + 1;
+      expires.tv_usec = entry->creation_time.tv_usec;
+      if (entry->send_packets &&
+          (hip_lsi_num_unbuffer == SADB_TIMER_BATCH))
         {
-          /* unlink the entry */
-          if (prev)
-            {
-              prev->next = entry->next;
-            }
-          else
-            {
-              lsi_temp = entry->next;
-            }
-          /* delete the entry */
-          tmp = entry;
-          entry = entry->next;
-          free(tmp);
-          continue;
+          expires = *now;           /* no room, unbuffer on the next tick */
         }
-      prev = entry;
-      entry = entry->next;
+      hip_timer_add(&hip_sadb_wheel, t, &expires);
+      return;
+    }
+
+  /* unlink and delete the entry */
+  for (l = lsi_temp; l && (l != entry); prev = l, l = l->next)
+    {
+      ;
+    }
+  if (!l)
+    {
+      return;
+    }
+  if (prev)
+    {
+      prev->next = entry->next;
+    }
+  else
+    {
+      lsi_temp = entry->next;
     }
+  free(entry);
 }
 
 /*
@@ -695,22 +1497,30 @@ int buffer_packet(struct sockaddr *lsi, __u8 *data, int len)
   int is_new_entry = FALSE;
   hip_lsi_entry *entry;
 
+  /* the LSI list is changed by hipd and the timer thread */
+  pthread_mutex_lock(&hip_sadb_write_lock);
   /* find entry, or create a new one */
   if (!(entry = hip_lookup_lsi(lsi)))
     {
-      entry = create_lsi_entry(lsi);
+      if (!(entry = create_lsi_entry(lsi)))
+        {
+          pthread_mutex_unlock(&hip_sadb_write_lock);
+          return(FALSE);
+        }
       is_new_entry = TRUE;
     }
 
   /* add packet to queue if there is room */
   if ((len + entry->next_packet) > LSI_PKT_BUFFER_SIZE)
     {
+      pthread_mutex_unlock(&hip_sadb_write_lock);
       return(FALSE);
     }
   /* TODO: log packet buffer overflow, drop newer/older packets? */
   memcpy(&entry->packet_buffer[entry->next_packet], data, len);
   entry->num_packets++;
   entry->next_packet += len;
+  pthread_mutex_unlock(&hip_sadb_write_lock);
   return(is_new_entry);
 }
 
@@ -729,7 +1539,6 @@ void unbuffer_packets(hip_lsi_entry *entry)
   char ipstr[5];
   __u32 lsi;
 
-  g_read_usec = 1000000;
   entry->send_packets = 0;
   if (entry->num_packets > 0)
     {
@@ -783,7 +1592,8 @@ void unbuffer_packets(hip_lsi_entry *entry)
       if (send(readsp[0], data, len, 0) < 0)
         {
 #else
-      if (write(readsp[0], data, len) < 0)
+      if (write(esp_queues[esp_queue_select(data, len)].readsp[0],
+                data, len) < 0)
         {
 #endif
           printf("unbuffer_packets: write error: %s",
@@ -822,24 +1632,12 @@ hip_lsi_entry *hip_lookup_lsi(struct sockaddr *lsi)
 /*
  * hip_sadb_lookup_spi()
  *
- * Lookup an SADB entry based on SPI, for incoming ESP packets.
+ * Lookup an SADB entry based on SPI, for incoming ESP packets. Lock-free;
+ * the caller is a registered reader or holds hip_sadb_write_lock.
  */
 hip_sadb_entry *hip_sadb_lookup_spi(__u32 spi)
 {
-  hip_sadb_entry *e;
-  int hash;
-
-  hash = sadb_hashfn(spi);
-  pthread_mutex_lock(&hip_sadb_locks[hash]);
-  for (e = hip_sadb[hash]; e; e = e->next)
-    {
-      if (e->spi == spi)
-        {
-          break;
-        }
-    }
-  pthread_mutex_unlock(&hip_sadb_locks[hash]);
-  return(e);
+  return(hip_hash_lookup(&hip_sadb, sadb_hashfn(spi), &spi));
 }
 
 /*
@@ -847,115 +1645,53 @@ hip_sadb_entry *hip_sadb_lookup_spi(__u32 spi)
  *
  * Add an address to the destination cache, pointing to corresponding
  * SADB entry. This allows quick lookups based on address (LSI), since
- * the SADB hashes on SPI.
+ * the SADB hashes on SPI. Uses the destination entry and node that
+ * hip_sadb_prepare() allocated in slot i. Caller holds hip_sadb_write_lock.
  */
-int hip_sadb_add_dst_entry(struct sockaddr *addr, hip_sadb_entry *entry)
+void hip_sadb_add_dst_entry(struct sockaddr *addr, hip_sadb_entry *entry,
+                            hip_sadb_prep *p, int i)
 {
-  hip_sadb_dst_entry *d, *last = NULL;
-  int hash;
-
-  if (!addr || !entry)
-    {
-      return(-1);
-    }
+  hip_sadb_dst_entry *d;
+  __u32 hash;
 
   hash = sadb_dst_hashfn(addr);
-  pthread_mutex_lock(&hip_sadb_dst_locks[hash]);       /* lock this chain */
 
-  /* search to prevent duplicate entries */
-  for (d = hip_sadb_dst[hash]; d; d = d->next)
+  /* dst entry already exists with same address, just
+   * update the entry ptr and return */
+  if ((d = hip_hash_lookup(&hip_sadb_dst, hash, addr)))
     {
-      last = d;
-      if (!d->sadb_entry)
-        {
-          continue;
-        }
-      /* dst entry already exists with same address, just
-       * update the entry ptr and return */
-      if (!memcmp(SA2IP(&d->addr), SA2IP(addr), SAIPLEN(addr)))
-        {
-          pthread_mutex_lock(&d->rw_lock);
-          d->sadb_entry = entry;
-          pthread_mutex_unlock(&d->rw_lock);
-          pthread_mutex_unlock(&hip_sadb_dst_locks[hash]);
-          return(0);
-        }
+      SADB_STORE(d->sadb_entry, entry);
+      return;
     }
 
-  d = (hip_sadb_dst_entry*) malloc(sizeof(hip_sadb_dst_entry));
-  if (!d)
-    {
-      pthread_mutex_unlock(&hip_sadb_dst_locks[hash]);
-      return(-1);           /* no buffer space available */
-    }
-  memset(d, 0, sizeof(hip_sadb_dst_entry));
-  pthread_mutex_init(&d->rw_lock, NULL);
-  pthread_mutex_lock(&d->rw_lock);
+  d = p->dst[i];
   d->sadb_entry = entry;
-  d->next = NULL;
   memcpy(&d->addr, addr, SALEN(addr));
 
-  /* link new entry into the chain */
-  if (last)
-    {
-      last->next = d;
-    }
-  else
-    {
-      hip_sadb_dst[hash] = d;
-    }
-  pthread_mutex_unlock(&d->rw_lock);
-  pthread_mutex_unlock(&hip_sadb_dst_locks[hash]);
-  return(0);
+  /* link new entry into the table */
+  hip_hash_insert_node(&hip_sadb_dst, p->dst_node[i], hash, d);
+  p->dst[i] = NULL;
+  p->dst_node[i] = NULL;
 }
 
 /*
  * hip_sadb_delete_dst_entry()
  *
- * Delete an SADB entry based on destination address (LSI).
+ * Delete the destination cache entry for an address (LSI) if it points to
+ * the given SADB entry. Caller holds hip_sadb_write_lock.
  */
-int hip_sadb_delete_dst_entry(struct sockaddr *addr)
+int hip_sadb_delete_dst_entry(struct sockaddr *addr, hip_sadb_entry *entry)
 {
-  hip_sadb_dst_entry *e, *last;
-  int hash;
+  hip_sadb_dst_entry *e;
+  __u32 hash = sadb_dst_hashfn(addr);
 
-  /* unlink from chain */
-  hash = sadb_dst_hashfn(addr);
-  pthread_mutex_lock(&hip_sadb_dst_locks[hash]);
-  for (last = NULL, e = hip_sadb_dst[hash]; e; last = e, e = e->next)
-    {
-      pthread_mutex_lock(&e->rw_lock);
-      if ((addr->sa_family == e->addr.ss_family) &&
-          (memcmp(SA2IP(addr), SA2IP(&e->addr),
-                  SAIPLEN(addr)) == 0))
-        {
-          /* keep this entry's lock */
-          break;
-        }
-      pthread_mutex_unlock(&e->rw_lock);
-    }
-  if (!e)
+  e = hip_hash_lookup(&hip_sadb_dst, hash, addr);
+  if (!e || (e->sadb_entry != entry))
     {
-      pthread_mutex_unlock(&hip_sadb_dst_locks[hash]);
       return(-1);           /* dst entry not found */
     }
-  if (last)
-    {
-      last->next = e->next;
-    }
-  else
-    {
-      hip_sadb_dst[hash] = e->next;
-    }
-  pthread_mutex_unlock(&hip_sadb_dst_locks[hash]);
-
-  /* entry is locked at this point */
-  e->sadb_entry = NULL;
-  e->next = NULL;
-  memset(&e->addr, 0, sizeof(e->addr));
-  pthread_mutex_unlock(&e->rw_lock);
-  pthread_mutex_destroy(&e->rw_lock);
-  free(e);
+  hip_hash_remove(&hip_sadb_dst, hash, addr);
+  hip_sadb_retire(e, free);
   return(0);
 }
 
@@ -963,32 +1699,15 @@ int hip_sadb_delete_dst_entry(struct sockaddr *addr)
  * hip_sadb_lookup_addr()
  *
  * Lookup an SADB entry based on destination address (LSI), for outgoing
- * ESP packets. Uses the destination cache.
+ * ESP packets. Uses the destination cache. Lock-free; the caller is a
+ * registered reader or holds hip_sadb_write_lock.
  */
 hip_sadb_entry *hip_sadb_lookup_addr(struct sockaddr *addr)
 {
   hip_sadb_dst_entry *e;
-  hip_sadb_entry *r;
-  int hash;
-
-  hash = sadb_dst_hashfn(addr);
-  pthread_mutex_lock(&hip_sadb_dst_locks[hash]);
-  for (r = NULL, e = hip_sadb_dst[hash]; e; e = e->next)
-    {
-      pthread_mutex_lock(&e->rw_lock);
-      if ((addr->sa_family == e->addr.ss_family) &&
-          (memcmp(SA2IP(addr), SA2IP(&e->addr),
-                  SAIPLEN(addr)) == 0))
-        {
-          r = e->sadb_entry;
-          pthread_mutex_unlock(&e->rw_lock);
-          break;
-        }
-      pthread_mutex_unlock(&e->rw_lock);
-    }
-  pthread_mutex_unlock(&hip_sadb_dst_locks[hash]);
 
-  return(r);
+  e = hip_hash_lookup(&hip_sadb_dst, sadb_dst_hashfn(addr), addr);
+  return(e ? SADB_LOAD(e->sadb_entry) : NULL);
 }
 
 /*
@@ -999,84 +1718,123 @@ hip_sadb_entry *hip_sadb_lookup_addr(struct sockaddr *addr)
  */
 hip_sadb_entry *hip_sadb_get_next(hip_sadb_entry *placemark)
 {
-  int i, return_next = 0;
+  int return_next = 0;
   hip_sadb_entry *e, *r = NULL;
+  hip_hash_iter it;
 
   /* step through entire hash table */
-  for (i = 0; i < SADB_SIZE; i++)
+  for (e = hip_hash_first(&hip_sadb, &it); e; e = hip_hash_next(&it))
     {
-      pthread_mutex_lock(&hip_sadb_locks[i]);
-      for (e = hip_sadb[i]; e; e = e->next)
+      if (e->direction != 2)                     /* only outgoing entries */
         {
-          if (e->direction != 2)                 /* only outgoing entries */
-            {
-              continue;
-            }
-          if (!placemark)                 /* just use first outgoing entry */
+          continue;
+        }
+      if (!placemark)                     /* just use first outgoing entry */
+        {
+          r = e;
+        }
+      else
+        {
+          if (return_next)                         /* this is the next entry */
             {
               r = e;
             }
-          else
+          else if (e == placemark)
             {
-              if (return_next)                     /* this is the next entry */
-                {
-                  r = e;
-                }
-              else if (e == placemark)
-                {
-                  /* search for placemark, and set flag to
-                   * return the next entry */
-                  return_next = 1;
-                }
+              /* search for placemark, and set flag to
+               * return the next entry */
+              return_next = 1;
             }
-          if (r)
-            {
-              break;
-            }                             /* stop searching */
         }
-      pthread_mutex_unlock(&hip_sadb_locks[i]);
       if (r)
         {
           break;
-        }                         /* done */
+        }                                 /* stop searching */
     }
   return(r);
 }
 
 /*
- * hip_sadb_expire()
+ * hip_sadb_expire_timer()
  *
- * Check the lifetime of SAs and generate expire messages.
+ * Called when an SA reaches its lifetime, to generate an expire message.
  */
-void hip_sadb_expire(struct timeval *now)
+void hip_sadb_expire_timer(hip_timer *t, struct timeval *now)
 {
-  int i;
-  hip_sadb_entry *e;
-  __u32 spi;
+  hip_sadb_cold *c = hip_timer_entry(t, hip_sadb_cold, exp_timer);
 
-  for (i = 0; i < SADB_SIZE; i++)
+  if (hip_sadb_num_expired == SADB_TIMER_BATCH)
     {
-      spi = 0;
-      pthread_mutex_lock(&hip_sadb_locks[i]);
-      for (e = hip_sadb[i]; e; e = e->next)
+      hip_timer_add(&hip_sadb_wheel, t, now);       /* try the next tick */
+      return;
+    }
+  hip_sadb_expired_spis[hip_sadb_num_expired++] = c->entry->spi;
+  /* wait another lifetime before expiring this SA again;
+   * this causes only one expire message to be sent */
+  c->exptime.tv_sec = now->tv_sec + (time_t)c->lifetime;
+  hip_timer_add(&hip_sadb_wheel, t, &c->exptime);
+}
+
+/*
+ * hip_sadb_timers()
+ *
+ * Thread that runs the SADB timer wheel, expiring SAs, LSI entries, and
+ * protocol selectors, so this housekeeping stays off the packet path.
+ */
+#ifdef __WIN32__
+void hip_sadb_timers(void *arg)
+#else
+void *hip_sadb_timers(void *arg)
+#endif
+{
+  struct timeval now;
+#ifndef __WIN32__
+  struct timeval timeout;
+#endif
+  hip_sadb_retired *retired;
+  int i;
+
+  printf("hip_sadb_timers() thread started...\n");
+  while (g_state == 0)
+    {
+      gettimeofday(&now, NULL);
+      pthread_mutex_lock(&hip_sadb_write_lock);
+      hip_timer_run(&hip_sadb_wheel, &now);
+      /* keep resizing tables that no longer see any inserts, and free
+       * entries deleted by hipd once the readers have moved on */
+      hip_hash_rehash_step(&hip_sadb);
+      hip_hash_rehash_step(&hip_sadb_dst);
+      hip_hash_rehash_step(&hip_proto_sel);
+      retired = hip_sadb_reclaim();
+      pthread_mutex_unlock(&hip_sadb_write_lock);
+      hip_sadb_free_retired(retired);
+
+      /* LSI entries are only freed by this thread */
+      for (i = 0; i < hip_sadb_num_expired; i++)
         {
-          if (now->tv_sec > e->exptime.tv_sec)
-            {
-              /* wait another lifetime before expiring this SA
-               * again;
-               * this causes only one expire message to be
-               *sent */
-              e->exptime.tv_sec = now->tv_sec +
-                                  (time_t)e->lifetime;
-              spi = e->spi;
-            }
+          esp_start_expire(hip_sadb_expired_spis[i]);
         }
-      pthread_mutex_unlock(&hip_sadb_locks[i]);
-      if (spi > 0)
+      hip_sadb_num_expired = 0;
+      for (i = 0; i < hip_lsi_num_unbuffer; i++)
         {
-          esp_start_expire(spi);
+          unbuffer_packets(hip_lsi_unbuffer[i]);
         }
+      hip_lsi_num_unbuffer = 0;
+
+#ifdef __WIN32__
+      Sleep(HIP_TIMER_TICK_MS);
+#else
+      timeout.tv_sec = 0;
+      timeout.tv_usec = HIP_TIMER_TICK_MS * 1000;
+      select(0, NULL, NULL, NULL, &timeout);
+#endif
     }
+  printf("hip_sadb_timers() thread shutdown.\n");
+  fflush(stdout);
+#ifndef __WIN32__
+  pthread_exit((void *) 0);
+  return(NULL);
+#endif
 }
 
 /*
@@ -1086,16 +1844,21 @@ void hip_sadb_expire(struct timeval *now)
  */
 int hip_sadb_get_usage(__u32 spi, __u64 *bytes, struct timeval *usetime)
 {
-  hip_sadb_entry *entry = hip_sadb_lookup_spi(spi);
-  if (!entry)
+  hip_sadb_entry *entry;
+  hip_sadb_counters sum;
+
+  /* called by hipd, which is not a registered reader */
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  if (!(entry = hip_sadb_lookup_spi(spi)))
     {
+      pthread_mutex_unlock(&hip_sadb_write_lock);
       return(-1);           /* not found */
     }
-  pthread_mutex_lock(&entry->rw_lock);
-  *bytes = entry->bytes;
-  usetime->tv_sec = entry->usetime.tv_sec;
-  usetime->tv_usec = entry->usetime.tv_usec;
-  pthread_mutex_unlock(&entry->rw_lock);
+  hip_sadb_get_counters(entry, &sum);
+  pthread_mutex_unlock(&hip_sadb_write_lock);
+  *bytes = sum.bytes;
+  usetime->tv_sec = sum.usetime.tv_sec;
+  usetime->tv_usec = sum.usetime.tv_usec;
   return(0);
 }
 
@@ -1106,37 +1869,121 @@ int hip_sadb_get_usage(__u32 spi, __u64 *bytes, struct timeval *usetime)
  */
 int hip_sadb_get_lost(__u32 spi, __u32 *lost)
 {
-  hip_sadb_entry *entry = hip_sadb_lookup_spi(spi);
-  if (!entry)
+  hip_sadb_entry *entry;
+
+  /* called by hipd, which is not a registered reader */
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  if (!(entry = hip_sadb_lookup_spi(spi)))
     {
+      pthread_mutex_unlock(&hip_sadb_write_lock);
       return(-1);           /* not found */
     }
   pthread_mutex_lock(&entry->rw_lock);
   *lost = entry->lost;
   pthread_mutex_unlock(&entry->rw_lock);
+  pthread_mutex_unlock(&hip_sadb_write_lock);
+  return(0);
+}
+
+/*
+ * hip_sadb_get_replay_drops()
+ *
+ * Retrieve the number of packets dropped by the anti-replay window for the
+ * SADB entry matching the given SPI, split into duplicates and packets that
+ * were older than the window.
+ */
+int hip_sadb_get_replay_drops(__u32 spi, __u32 *dups, __u32 *old)
+{
+  hip_sadb_entry *entry;
+
+  /* called by hipd, which is not a registered reader */
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  if (!(entry = hip_sadb_lookup_spi(spi)))
+    {
+      pthread_mutex_unlock(&hip_sadb_write_lock);
+      return(-1);           /* not found */
+    }
+  pthread_mutex_lock(&entry->rw_lock);
+  *dups = entry->cold->replay_dups;
+  *old = entry->cold->replay_old;
+  pthread_mutex_unlock(&entry->rw_lock);
+  pthread_mutex_unlock(&hip_sadb_write_lock);
   return(0);
 }
 
+/*
+ * hip_sadb_get_counters()
+ *
+ * Sum the traffic counters kept by each ESP thread for an entry; the
+ * use time is the latest one. Caller holds hip_sadb_write_lock.
+ */
+void hip_sadb_get_counters(hip_sadb_entry *entry, hip_sadb_counters *sum)
+{
+  hip_sadb_counters *chunk, *c;
+  __u32 index = entry->ctr_index;
+  struct timeval t;
+  int i;
+
+  memset(sum, 0, sizeof(hip_sadb_counters));
+  if (index >= SADB_CTR_MAX)
+    {
+      return;
+    }
+  for (i = 0; i < SADB_MAX_READERS; i++)
+    {
+      chunk = SADB_LOAD(hip_sadb_ctrs[i][index / SADB_CTR_CHUNK]);
+      if (!chunk)
+        {
+          continue;
+        }
+      c = &chunk[index % SADB_CTR_CHUNK];
+      sum->bytes += SADB_CTR_GET(c->bytes);
+      sum->packets += SADB_CTR_GET(c->packets);
+      sum->dropped += SADB_CTR_GET(c->dropped);
+      t.tv_sec = SADB_CTR_GET(c->usetime.tv_sec);
+      t.tv_usec = SADB_CTR_GET(c->usetime.tv_usec);
+      if ((t.tv_sec > sum->usetime.tv_sec) ||
+          ((t.tv_sec == sum->usetime.tv_sec) &&
+           (t.tv_usec > sum->usetime.tv_usec)))
+        {
+          sum->usetime = t;
+        }
+    }
+}
+
 /*
  * hip_sadb_inc_bytes()
  *
  * Increments bytes used, number of packets, and last used timestamp for an
- * entry.
+ * entry, in the counters of the calling reader; no lock is needed.
  */
-void hip_sadb_inc_bytes(hip_sadb_entry *entry, __u64 bytes, struct timeval *now,
-                        int lock)
+void hip_sadb_inc_bytes(hip_sadb_entry *entry, int reader, __u64 bytes,
+                        struct timeval *now)
 {
-  if (lock)
+  hip_sadb_counters *c = hip_sadb_ctr(entry, reader);
+
+  if (!c)
     {
-      pthread_mutex_lock(&entry->rw_lock);
+      return;
     }
-  entry->bytes += bytes;
-  entry->packets++;
-  entry->usetime.tv_sec = now->tv_sec;
-  entry->usetime.tv_usec = now->tv_usec;
-  if (lock)
+  SADB_CTR_SET(c->bytes, c->bytes + bytes);
+  SADB_CTR_SET(c->packets, c->packets + 1);
+  SADB_CTR_SET(c->usetime.tv_sec, now->tv_sec);
+  SADB_CTR_SET(c->usetime.tv_usec, now->tv_usec);
+}
+
+/*
+ * hip_sadb_inc_dropped()
+ *
+ * Count a packet dropped by an ESP thread for an entry.
+ */
+void hip_sadb_inc_dropped(hip_sadb_entry *entry, int reader)
+{
+  hip_sadb_counters *c = hip_sadb_ctr(entry, reader);
+
+  if (c)
     {
-      pthread_mutex_unlock(&entry->rw_lock);
+      SADB_CTR_SET(c->dropped, c->dropped + 1);
     }
 }
 
@@ -1244,75 +2091,68 @@ int hip_select_family_by_proto(__u32 lsi, __u8 proto, __u8 *header,
 int hip_add_proto_sel_entry(__u32 lsi, __u8 proto, __u8 *header, int family,
                             int dir, struct timeval *now)
 {
-  int hash;
-  hip_proto_sel_entry *e, *last = NULL;
-  __u32 selector = hip_proto_header_to_selector(lsi, proto, header, dir);
+  __u32 hash;
+  hip_proto_sel_entry *e;
+  hip_proto_sel_key key;
+  struct timeval expires;
 
-  hash = hip_proto_sel_hash(selector);
-  pthread_mutex_lock(&hip_proto_sel_locks[hash]);       /* lock this chain */
+  key.selector = hip_proto_header_to_selector(lsi, proto, header, dir);
+  key.family = family;
+  hash = hip_hash_key(&key.selector, sizeof(key.selector));
 
-  for (e = hip_proto_sel[hash]; e; e = e->next)
+  /* entry already exists, update time */
+  if ((e = hip_hash_lookup(&hip_proto_sel, hash, &key)))
     {
-      last = e;
-      if (e->family != family)
-        {
-          continue;
-        }
-      if (e->selector != selector)
-        {
-          continue;
-        }
-      /* entry already exists, update time */
       e->last_used.tv_sec = now->tv_sec;
-      pthread_mutex_unlock(&hip_proto_sel_locks[hash]);
+      return(0);
+    }
+
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  /* check again, another ESP thread may have added it */
+  if ((e = hip_hash_lookup(&hip_proto_sel, hash, &key)))
+    {
+      e->last_used.tv_sec = now->tv_sec;
+      pthread_mutex_unlock(&hip_sadb_write_lock);
       return(0);
     }
 
   e = malloc(sizeof(hip_proto_sel_entry));
   if (!e)
     {
-      pthread_mutex_unlock(&hip_proto_sel_locks[hash]);
+      pthread_mutex_unlock(&hip_sadb_write_lock);
       return(-1);           /* no buffer space available */
     }
 
   /* add the new entry */
   memset(e, 0, sizeof(hip_proto_sel_entry));
-  e->next = NULL;
-  e->selector = selector;
+  e->selector = key.selector;
   e->family = family;
   e->last_used.tv_sec = now->tv_sec;
+  hip_timer_init(&e->timer, hip_proto_sel_timer);
 
-  if (last)
-    {
-      last->next = e;
-    }
-  else
+  if (hip_hash_insert(&hip_proto_sel, hash, e) < 0)
     {
-      hip_proto_sel[hash] = e;
+      free(e);
+      pthread_mutex_unlock(&hip_sadb_write_lock);
+      return(-1);
     }
-  pthread_mutex_unlock(&hip_proto_sel_locks[hash]);
+  expires.tv_sec = now->tv_sec + PROTO_SEL_ENTRY_LIFETIME + 1;
+  expires.tv_usec = 0;
+  hip_timer_add(&hip_sadb_wheel, &e->timer, &expires);
+  pthread_mutex_unlock(&hip_sadb_write_lock);
   return(0);
 }
 
 hip_proto_sel_entry *hip_lookup_sel_entry(__u32 lsi, __u8 proto, __u8 *header,
                                           int dir)
 {
-  hip_proto_sel_entry *e;
-  int hash;
-  __u32 selector = hip_proto_header_to_selector(lsi, proto, header, dir);
+  hip_proto_sel_key key;
 
-  hash = hip_proto_sel_hash(selector);
-  pthread_mutex_lock(&hip_proto_sel_locks[hash]);       /* lock this chain */
-
-  for (e = hip_proto_sel[hash]; e; e = e->next)
-    {
-      if (selector == e->selector)
-        {
-          break;
-        }
-    }
-  pthread_mutex_unlock(&hip_proto_sel_locks[hash]);
-  return(e);
+  key.selector = hip_proto_header_to_selector(lsi, proto, header, dir);
+  key.family = AF_UNSPEC;
+  return(hip_hash_lookup(&hip_proto_sel,
+                         hip_hash_key(&key.selector, sizeof(key.selector)),
+                         &key));
 }
 
 __u32 hip_proto_header_to_selector(__u32 lsi, __u8 proto, __u8 *header, int dir)
@@ -1360,112 +2200,63 @@ __u32 hip_proto_header_to_selector(__u32 lsi, __u8 proto, __u8 *header, int dir)
 }
 
 /*
- * hip_remove_expired_sel_entries()
+ * hip_proto_sel_timer()
+ *
+ * Remove a protocol selector entry that has not been used for
+ * PROTO_SEL_ENTRY_LIFETIME; the ESP threads only update last_used, so
+ * the timer is pushed back here when the entry is still in use.
  */
-void hip_remove_expired_sel_entries(struct timeval *now)
+void hip_proto_sel_timer(hip_timer *t, struct timeval *now)
 {
-  static unsigned int last = 0;
-  int i;
-  hip_proto_sel_entry *entry, *prev, *next;
+  hip_proto_sel_entry *entry = hip_timer_entry(t, hip_proto_sel_entry, timer);
+  hip_proto_sel_key key;
+  struct timeval expires;
 
-
-  /* rate limit - every 30 seconds */
-  if ((last > 0) && ((now->tv_sec - last) < 30))
+  if ((now->tv_sec - entry->last_used.tv_sec) <= PROTO_SEL_ENTRY_LIFETIME)
     {
+      expires.tv_sec = entry->last_used.tv_sec + PROTO_SEL_ENTRY_LIFETIME + 1;
+      expires.tv_usec = 0;
+      hip_timer_add(&hip_sadb_wheel, t, &expires);
       return;
     }
-  else
-    {
-      last = now->tv_sec;
-    }
-
-
-  for (i = 0; i < PROTO_SEL_SIZE; i++)
-    {
-      prev = NULL;
-      pthread_mutex_lock(&hip_proto_sel_locks[i]);
-      entry = hip_proto_sel[i];           /* traverse list in each bucket */
-      while (entry)
-        {
-          next = entry->next;
-          /* check for expiration */
-          if ((now->tv_sec - entry->last_used.tv_sec) >
-              PROTO_SEL_ENTRY_LIFETIME)
-            {
-              free(entry);
-              if (prev)
-                {
-                  prev->next = next;
-                }
-              else
-                {
-                  hip_proto_sel[i] = next;
-                }
-            }
-          else
-            {
-              prev = entry;
-            }
-          entry = next;
-        }
-      pthread_mutex_unlock(&hip_proto_sel_locks[i]);
-    }
-}
-
-hip_proto_sel_entry *hip_remove_proto_sel_entry(hip_proto_sel_entry *prev,
-                                                hip_proto_sel_entry *entry)
-{
-  hip_proto_sel_entry *next;
-
-  if (prev)         /* unlink the entry from the list */
-    {
-      prev->next = entry->next;
-      memset(entry, 0, sizeof(hip_proto_sel_entry));
-      free(entry);
-      return(prev->next);
-    }
-  else if (entry->next)           /* replace entry in table w/next in list */
+  key.selector = entry->selector;
+  key.family = entry->family;
+  if (hip_hash_remove(&hip_proto_sel,
+                      hip_hash_key(&key.selector, sizeof(key.selector)),
+                      &key) == entry)
     {
-      next = entry->next;
-      memcpy(entry, next, sizeof(hip_proto_sel_entry));
-      memset(next, 0, sizeof(hip_proto_sel_entry));
-      free(next);           /* remove duplicate */
-      return(entry);
-    }
-  else           /* no prev or next, just erase single entry */
-    {
-      memset(entry, 0, sizeof(hip_proto_sel_entry));
-      return(NULL);
+      hip_sadb_retire(entry, free);
     }
 }
 
 /* debug */
 void print_sadb()
 {
-  int i;
+  int i = 0;
   hip_sadb_entry *entry;
+  hip_hash_iter it;
 
-  for (i = 0; i < SADB_SIZE; i++)
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  for (entry = hip_hash_first(&hip_sadb, &it); entry;
+       entry = hip_hash_next(&it), i++)
     {
-      for (entry = hip_sadb[i]; entry; entry = entry->next)
-        {
-          pthread_mutex_lock(&entry->rw_lock);
-          printf("entry(%d): ", i);
-          printf(
-            "SPI=0x%x dir=%d magic=0x%x mode=%d lsi=%x ",
-            entry->spi,
-            entry->direction,
-            entry->hit_magic,
-            entry->mode,
-            ((struct sockaddr_in*)&entry->lsi)->sin_addr.
-            s_addr);
-          printf("a_type=%d e_type=%d a_keylen=%d "
-                 "e_keylen=%d lifetime=%llu seq=%d\n",
-                 entry->a_type, entry->e_type,
-                 entry->a_keylen, entry->e_keylen,
-                 entry->lifetime, entry->sequence  );
-          pthread_mutex_unlock(&entry->rw_lock);
-        }
+      pthread_mutex_lock(&entry->rw_lock);
+      printf("entry(%d): ", i);
+      printf(
+        "SPI=0x%x dir=%d magic=0x%x mode=%d lsi=%x ",
+        entry->spi,
+        entry->direction,
+        entry->hit_magic,
+        entry->mode,
+        ((struct sockaddr_in*)&entry->cold->lsi)->sin_addr.
+        s_addr);
+      printf("a_type=%d e_type=%d a_keylen=%d "
+             "e_keylen=%d lifetime=%llu seq=%d\n",
+             entry->a_type, entry->e_type,
+             entry->cold->a_keylen, entry->e_keylen,
+             entry->cold->lifetime, entry->sequence  );
+      pthread_mutex_unlock(&entry->rw_lock);
     }
+  pthread_mutex_unlock(&hip_sadb_write_lock);
 }
 
@@ -43,6 +43,7 @@
 #include <hip/hip_service.h>
 #include <hip/hip_types.h>
 #include <hip/hip_sadb.h>               /* access to SADB */
+#include <hip/hip_hash.h>
 #include <hip/hip_status.h>
 #include <hip/hip_funcs.h>      /* pthread_mutex_lock() */
 #include <hip/hip_globals.h>    /* HCNF */
@@ -59,7 +60,6 @@ void dump_sadb(char *buff, int *tlv_len, __u32 spi);
 void dump_dst_entries(char *buff, int *tlv_len);
 void dump_lsi_entries(char *buff, int *tlv_len);
 void dump_all_spi(char *buff, int *tlv_len);
-extern int sadb_hashfn(__u32 spi);
 
 #define STATBUFSIZE 4096
 
@@ -240,8 +240,8 @@ void handle_status_request(int type, char *buff, int *len)
   *len = (char*)t - buff;
 }
 
-extern hip_sadb_entry *hip_sadb[SADB_SIZE];
-extern hip_mutex_t hip_sadb_locks[SADB_SIZE];
+extern hip_hash_table hip_sadb;
+extern hip_mutex_t hip_sadb_write_lock;
 
 int sockaddr_list_length(sockaddr_list *l)
 {
@@ -256,114 +256,101 @@ int sockaddr_list_length(sockaddr_list *l)
 void dump_sadb(char *buff, int *tlv_len, __u32 spi)
 {
   hip_sadb_entry *entry;
+  hip_sadb_counters ctrs;
   struct status_tlv *t = (struct status_tlv*)buff;
-  int i = 0, len = 0, n;
+  int len = 0, n;
   char *p;
   sockaddr_list *l;
+  hip_hash_iter it;
 
-  if (spi > 0)
+  /* holding the write lock keeps entries from being freed */
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  for (entry = hip_hash_first(&hip_sadb, &it); entry;
+       entry = hip_hash_next(&it))
     {
-      i = sadb_hashfn(spi);
-    }
-
-  for (; i < SADB_SIZE; i++)
-    {
-      pthread_mutex_lock(&hip_sadb_locks[i]);
-      for (entry = hip_sadb[i]; entry; entry = entry->next)
+      if ((spi > 0) && (entry->spi != spi))
         {
-          if ((spi > 0) && (entry->spi != spi))
-            {
-              continue;
-            }
-          pthread_mutex_lock(&entry->rw_lock);
-          t->tlv_type = htons(HIP_STATUS_REPLY_SADB);
-          t->tlv_len = 0;
-          p = (char *)(t + 1);
-          len = 0;
-          ADD_ITEM(p, entry->spi, len);
-          ADD_ITEM(p, entry->direction, len);
-          ADD_ITEM(p, entry->hit_magic, len);
-          ADD_ITEM(p, entry->mode, len);
-          ADD_ITEM(p, entry->lsi, len);
-          ADD_ITEM(p, entry->a_type, len);
-          ADD_ITEM(p, entry->e_type, len);
-          ADD_ITEM(p, entry->a_keylen, len);
-          ADD_ITEM(p, entry->e_keylen, len);
-          ADD_ITEM(p, entry->lifetime, len);
-          ADD_ITEM(p, entry->bytes, len);
-          ADD_ITEM(p, entry->sequence, len);
-          /*ADD_ITEM(p, entry->replay_win, len);
-           *  ADD_ITEM(p, entry->replay_map, len);
-           *  ADD_ITEM(p, entry->iv, len);*/
-          n = sockaddr_list_length(entry->src_addrs);
-          ADD_ITEM(p, n, len);
-          n = sockaddr_list_length(entry->dst_addrs);
-          ADD_ITEM(p, n, len);
-          t->tlv_len = htons((__u16)len);
-          t = (struct status_tlv *)(p + len);
+          continue;
+        }
+      pthread_mutex_lock(&entry->rw_lock);
+      t->tlv_type = htons(HIP_STATUS_REPLY_SADB);
+      t->tlv_len = 0;
+      p = (char *)(t + 1);
+      len = 0;
+      ADD_ITEM(p, entry->spi, len);
+      ADD_ITEM(p, entry->direction, len);
+      ADD_ITEM(p, entry->hit_magic, len);
+      ADD_ITEM(p, entry->mode, len);
+      ADD_ITEM(p, entry->cold->lsi, len);
+      ADD_ITEM(p, entry->a_type, len);
+      ADD_ITEM(p, entry->e_type, len);
+      ADD_ITEM(p, entry->cold->a_keylen, len);
+      ADD_ITEM(p, entry->e_keylen, len);
+      ADD_ITEM(p, entry->cold->lifetime, len);
+      hip_sadb_get_counters(entry, &ctrs);
+      ADD_ITEM(p, ctrs.bytes, len);
+      ADD_ITEM(p, entry->sequence, len);
+      /*ADD_ITEM(p, entry->replay_win, len);
+       *  ADD_ITEM(p, entry->replay_map, len);
+       *  ADD_ITEM(p, entry->iv, len);*/
+      n = sockaddr_list_length(entry->src_addrs);
+      ADD_ITEM(p, n, len);
+      n = sockaddr_list_length(entry->dst_addrs);
+      ADD_ITEM(p, n, len);
+      t->tlv_len = htons((__u16)len);
+      t = (struct status_tlv *)(p + len);
 
-          /* addresses */
-          t->tlv_type = htons(HIP_STATUS_REPLY_ADDR);
-          t->tlv_len = 0;
-          p = (char *)(t + 1);
-          len = 0;
-          for (l = entry->src_addrs; l; l = l->next)
-            {
-              ADD_ITEM(p, l->addr, len);
-            }
-          for (l = entry->dst_addrs; l; l = l->next)
-            {
-              ADD_ITEM(p, l->addr, len);
-            }
-          /* TODO: add NAT variables here */
-          t->tlv_len = htons((__u16)len);
-          t = (struct status_tlv *)(p + len);
-          pthread_mutex_unlock(&entry->rw_lock);
-          /* buffer size check */
-          if (((char *)t - buff) > (STATBUFSIZE - len))
-            {
-              break;
-            }
+      /* addresses */
+      t->tlv_type = htons(HIP_STATUS_REPLY_ADDR);
+      t->tlv_len = 0;
+      p = (char *)(t + 1);
+      len = 0;
+      for (l = entry->src_addrs; l; l = l->next)
+        {
+          ADD_ITEM(p, l->addr, len);
         }
-      pthread_mutex_unlock(&hip_sadb_locks[i]);
+      for (l = entry->dst_addrs; l; l = l->next)
+        {
+          ADD_ITEM(p, l->addr, len);
+        }
+      /* TODO: add NAT variables here */
+      t->tlv_len = htons((__u16)len);
+      t = (struct status_tlv *)(p + len);
+      pthread_mutex_unlock(&entry->rw_lock);
       /* buffer size check */
       if (((char *)t - buff) > (STATBUFSIZE - len))
         {
           break;
         }
-
     }
+  pthread_mutex_unlock(&hip_sadb_write_lock);
   *tlv_len = (char*)t - buff;
 }
 
-extern hip_sadb_dst_entry *hip_sadb_dst[SADB_SIZE];
-extern hip_mutex_t hip_sadb_dst_locks[SADB_SIZE];
+extern hip_hash_table hip_sadb_dst;
 
 void dump_dst_entries(char *buff, int *tlv_len)
 {
   hip_sadb_dst_entry *entry;
   struct status_tlv *t = (struct status_tlv*)buff;
-  int i, len;
+  int len;
   char *p;
+  hip_hash_iter it;
 
-  for (i = 0; i < SADB_SIZE; i++)
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  for (entry = hip_hash_first(&hip_sadb_dst, &it); entry;
+       entry = hip_hash_next(&it))
     {
-      pthread_mutex_lock(&hip_sadb_dst_locks[i]);
-      for (entry = hip_sadb_dst[i]; entry; entry = entry->next)
-        {
-          pthread_mutex_lock(&entry->rw_lock);
-          t->tlv_type = htons(HIP_STATUS_REPLY_DST_ENTRY);
-          t->tlv_len = 0;
-          p = (char *)(t + 1);
-          len = 0;
-          ADD_ITEM(p, entry->addr, len);
-          ADD_ITEM(p, entry->sadb_entry->spi, len);
-          t->tlv_len = htons((__u16)len);
-          t = (struct status_tlv *)(p + len);
-          pthread_mutex_unlock(&entry->rw_lock);
-        }
-      pthread_mutex_unlock(&hip_sadb_dst_locks[i]);
+      t->tlv_type = htons(HIP_STATUS_REPLY_DST_ENTRY);
+      t->tlv_len = 0;
+      p = (char *)(t + 1);
+      len = 0;
+      ADD_ITEM(p, entry->addr, len);
+      ADD_ITEM(p, entry->sadb_entry->spi, len);
+      t->tlv_len = htons((__u16)len);
+      t = (struct status_tlv *)(p + len);
     }
+  pthread_mutex_unlock(&hip_sadb_write_lock);
   *tlv_len = (char*)t - buff;
 }
 
@@ -375,6 +362,7 @@ void dump_lsi_entries(char *buff, int *tlv_len)
   int len;
   char *p;
 
+  pthread_mutex_lock(&hip_sadb_write_lock);
   for (l = lsi_temp; l; l = l->next)
     {
       t->tlv_type = htons(HIP_STATUS_REPLY_LSI_ENTRY);
@@ -391,6 +379,7 @@ void dump_lsi_entries(char *buff, int *tlv_len)
       t->tlv_len = htons((__u16)len);
       t = (struct status_tlv *)(p + len);
     }
+  pthread_mutex_unlock(&hip_sadb_write_lock);
 
   *tlv_len = (char*)t - buff;
 }
@@ -400,23 +389,23 @@ void dump_all_spi(char *buff, int *tlv_len)
 {
   hip_sadb_entry *entry;
   struct status_tlv *t = (struct status_tlv*)buff;
-  int i, len;
+  int len;
   char *p;
+  hip_hash_iter it;
 
-  for (i = 0; i < SADB_SIZE; i++)
+  pthread_mutex_lock(&hip_sadb_write_lock);
+  for (entry = hip_hash_first(&hip_sadb, &it); entry;
+       entry = hip_hash_next(&it))
     {
-      for (entry = hip_sadb[i]; entry; entry = entry->next)
-        {
-          t->tlv_type = htons(HIP_STATUS_REPLY_ALL_SPI);
-          t->tlv_len = 0;
-          p = (char *)(t + 1);
-          len = 0;
-          ADD_ITEM(p, entry->spi, len);
-          t->tlv_len = htons((__u16)len);
-          t = (struct status_tlv *)(p + len);
-        }
-
+      t->tlv_type = htons(HIP_STATUS_REPLY_ALL_SPI);
+      t->tlv_len = 0;
+      p = (char *)(t + 1);
+      len = 0;
+      ADD_ITEM(p, entry->spi, len);
+      t->tlv_len = htons((__u16)len);
+      t = (struct status_tlv *)(p + len);
     }
+  pthread_mutex_unlock(&hip_sadb_write_lock);
   *tlv_len = (char*)t - buff;
 }
 
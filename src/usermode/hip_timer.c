@@ -0,0 +1,296 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2005-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ *  \file  hip_timer.c
+ *
+ *  \brief  Hierarchical timer wheel for SADB and hipd housekeeping.
+ *
+ *  Four levels of 64 slots; level 0 slots are one tick apart, and each
+ *  higher level slot spans a whole lower level. When level 0 wraps, the
+ *  next slot of level 1 is cascaded down, and so on. Adding, deleting and
+ *  firing a timer are O(1), so expiry costs are proportional to the
+ *  number of timers that actually expire.
+ *
+ */
+#include <stdio.h>      /* printf() */
+#include <string.h>     /* memset() */
+#include <hip/hip_timer.h>
+
+/*
+ * Local function declarations
+ */
+static void hip_timer_file(hip_timer_wheel *w, hip_timer *t);
+static void hip_timer_unlink(hip_timer *t);
+
+static __u64 hip_timer_ticks(struct timeval *tv)
+{
+  return((((__u64)tv->tv_sec * 1000) + (tv->tv_usec / 1000)) /
+         HIP_TIMER_TICK_MS);
+}
+
+/*
+ * hip_timer_wheel_init()
+ *
+ * Initialize an empty wheel starting at the current time.
+ */
+void hip_timer_wheel_init(hip_timer_wheel *w, struct timeval *now)
+{
+  int l, i;
+
+  w->tick = hip_timer_ticks(now);
+  for (l = 0; l < HIP_TIMER_LEVELS; l++)
+    {
+      for (i = 0; i < HIP_TIMER_SLOTS; i++)
+        {
+          w->slots[l][i].next = &w->slots[l][i];
+          w->slots[l][i].prev = &w->slots[l][i];
+        }
+    }
+}
+
+/*
+ * hip_timer_init()
+ *
+ * Prepare an unarmed timer that calls fn when it expires.
+ */
+void hip_timer_init(hip_timer *t, void (*fn)(hip_timer *t, struct timeval *now))
+{
+  memset(t, 0, sizeof(hip_timer));
+  t->fn = fn;
+}
+
+/*
+ * hip_timer_pending()
+ *
+ * Returns TRUE if the timer is armed.
+ */
+int hip_timer_pending(hip_timer *t)
+{
+  return(t->next != NULL);
+}
+
+static void hip_timer_unlink(hip_timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = NULL;
+  t->prev = NULL;
+}
+
+/*
+ * hip_timer_file()
+ *
+ * Link a timer into the slot for its expiry relative to the wheel's
+ * current tick.
+ */
+static void hip_timer_file(hip_timer_wheel *w, hip_timer *t)
+{
+  __u64 delta, idx;
+  hip_timer *head;
+  int l;
+
+  delta = t->expires - w->tick;
+  idx = t->expires;
+  if (delta > HIP_TIMER_MAX_TICKS)
+    {
+      delta = HIP_TIMER_MAX_TICKS;
+      idx = w->tick + HIP_TIMER_MAX_TICKS;
+    }
+  for (l = 0; l < HIP_TIMER_LEVELS - 1; l++)
+    {
+      if (delta < (1ULL << ((l + 1) * HIP_TIMER_SLOT_BITS)))
+        {
+          break;
+        }
+    }
+  head = &w->slots[l][(idx >> (l * HIP_TIMER_SLOT_BITS)) &
+                      HIP_TIMER_SLOT_MASK];
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+/*
+ * hip_timer_add()
+ *
+ * Arm a timer to expire at the given time, or at the next run if that
+ * time has passed. Re-arms the timer if it was already pending.
+ */
+void hip_timer_add(hip_timer_wheel *w, hip_timer *t, struct timeval *expires)
+{
+  if (t->next)
+    {
+      hip_timer_unlink(t);
+    }
+  t->expires = hip_timer_ticks(expires);
+  if (t->expires < w->tick)
+    {
+      t->expires = w->tick;
+    }
+  hip_timer_file(w, t);
+}
+
+/*
+ * hip_timer_reduce()
+ *
+ * Like hip_timer_add(), but leaves a pending timer alone when it already
+ * expires no later than the given time.
+ */
+void hip_timer_reduce(hip_timer_wheel *w, hip_timer *t,
+                      struct timeval *expires)
+{
+  if (t->next && (t->expires <= hip_timer_ticks(expires)))
+    {
+      return;
+    }
+  hip_timer_add(w, t, expires);
+}
+
+/*
+ * hip_timer_del()
+ *
+ * Disarm a timer; does nothing if it is not pending.
+ */
+void hip_timer_del(hip_timer *t)
+{
+  if (t->next)
+    {
+      hip_timer_unlink(t);
+    }
+}
+
+/*
+ * hip_timer_cascade()
+ *
+ * Move the timers of one higher level slot down to the levels below.
+ * Returns the slot index, which is zero when the next level must also be
+ * cascaded.
+ */
+static int hip_timer_cascade(hip_timer_wheel *w, int level)
+{
+  hip_timer *head, *t;
+  int idx;
+
+  idx = (w->tick >> (level * HIP_TIMER_SLOT_BITS)) & HIP_TIMER_SLOT_MASK;
+  head = &w->slots[level][idx];
+  while ((t = head->next) != head)
+    {
+      hip_timer_unlink(t);
+      hip_timer_file(w, t);
+    }
+  return(idx);
+}
+
+/*
+ * hip_timer_run()
+ *
+ * Advance the wheel to now, calling the function of every expired timer.
+ * A callback may add or delete any timer, including its own.
+ */
+void hip_timer_run(hip_timer_wheel *w, struct timeval *now)
+{
+  __u64 target = hip_timer_ticks(now);
+  hip_timer work, *t, *head;
+  int l, idx;
+
+  while (w->tick <= target)
+    {
+      idx = w->tick & HIP_TIMER_SLOT_MASK;
+      if (idx == 0)
+        {
+          for (l = 1; l < HIP_TIMER_LEVELS; l++)
+            {
+              if (hip_timer_cascade(w, l) != 0)
+                {
+                  break;
+                }
+            }
+        }
+      /* take the whole slot, so timers re-armed by the callbacks
+       * for this tick are not run again */
+      head = &w->slots[0][idx];
+      if (head->next == head)
+        {
+          w->tick++;
+          continue;
+        }
+      work.next = head->next;
+      work.prev = head->prev;
+      work.next->prev = &work;
+      work.prev->next = &work;
+      head->next = head;
+      head->prev = head;
+      w->tick++;
+
+      while ((t = work.next) != &work)
+        {
+          hip_timer_unlink(t);
+          if (t->expires >= w->tick)
+            {
+              hip_timer_file(w, t);               /* parked, not yet due */
+              continue;
+            }
+          t->fn(t, now);
+        }
+    }
+}
+
+/*
+ * hip_timer_next()
+ *
+ * Returns the number of milliseconds from now until hip_timer_run() has
+ * work to do, which is either a non-empty level 0 slot or a cascade from
+ * the higher levels, but at most max_ms. Used as a sleep timeout.
+ */
+int hip_timer_next(hip_timer_wheel *w, struct timeval *now, int max_ms)
+{
+  __u64 t, now_ms, due_ms;
+  hip_timer *head;
+
+  for (t = w->tick; t < w->tick + HIP_TIMER_SLOTS; t++)
+    {
+      if ((t & HIP_TIMER_SLOT_MASK) == 0)
+        {
+          break;
+        }
+      head = &w->slots[0][t & HIP_TIMER_SLOT_MASK];
+      if (head->next != head)
+        {
+          break;
+        }
+    }
+  now_ms = ((__u64)now->tv_sec * 1000) + (now->tv_usec / 1000);
+  due_ms = t * HIP_TIMER_TICK_MS;
+  if (due_ms <= now_ms)
+    {
+      return(0);
+    }
+  if (due_ms - now_ms < (__u64)max_ms)
+    {
+      return((int)(due_ms - now_ms));
+    }
+  return(max_ms);
+}
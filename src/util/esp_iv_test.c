@@ -0,0 +1,155 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2002-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  esp_iv_test.c
+ *
+ *  \brief  ESP IV generator test program.
+ *
+ * This file is outside of the normal build process and must be compiled
+ * by hand using gcc, from this directory:
+ *
+ *   gcc -I../include -o esp_iv_test esp_iv_test.c ../usermode/hip_esp_iv.c \
+ *       -lcrypto
+ *
+ * It drives the per-SA IV generator of usermode/hip_esp_iv.c the way
+ * hip_esp_encrypt() does, for counter-mode CBC SAs and for AES-GCM SAs.
+ * The sequence number is started just below the 32-bit wrap, and CBC SAs
+ * are re-seeded and run over the same sequence numbers again. Every IV is
+ * kept and the program fails if any of them repeats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <hip/hip_types.h>
+#include <hip/hip_proto.h>
+#include <hip/hip_sadb.h>
+
+#define NUM_IVS (1 << 20)               /* IVs per run, half before the wrap */
+#define MAX_IV_LEN 16
+
+static int iv_len;
+
+static int iv_cmp(const void *a, const void *b)
+{
+  return(memcmp(a, b, iv_len));
+}
+
+/*
+ * run_ivs()
+ *
+ * Generate NUM_IVS IVs into ivs, starting from sequence number seq.
+ * Returns 0, or -1 if the generator fails or the sequence did not wrap.
+ */
+static int run_ivs(hip_sadb_entry *entry, __u32 seq, __u8 *ivs)
+{
+  int i;
+
+  entry->sequence = seq;
+  entry->sequence_hi = 0;
+  for (i = 0; i < NUM_IVS; i++)
+    {
+      get_next_seqno(entry);
+      if (hip_esp_next_iv(entry, &ivs[i * iv_len], iv_len) < 0)
+        {
+          printf("hip_esp_next_iv() failed\n");
+          return(-1);
+        }
+    }
+  if (entry->sequence_hi != 1)
+    {
+      printf("sequence number did not wrap\n");
+      return(-1);
+    }
+  return(0);
+}
+
+/*
+ * test_sa()
+ *
+ * Check the IVs of one SA type across the sequence number wrap and, for
+ * CBC, across re-seeding. Returns the number of repeated IVs, or -1.
+ */
+static int test_sa(char *name, __u32 e_type, int len, int reseed)
+{
+  hip_sadb_entry entry;
+  __u8 *ivs;
+  int i, n = 0, runs = reseed ? 2 : 1, repeats = 0;
+  __u32 seq = 0xFFFFFFFF - (NUM_IVS / 2);
+
+  memset(&entry, 0, sizeof(entry));
+  entry.e_type = e_type;
+  entry.direction = 2;
+  entry.iv_gen = ESP_IV_COUNTER;
+  iv_len = len;
+  if (!(ivs = malloc(runs * NUM_IVS * iv_len)))
+    {
+      return(-1);
+    }
+
+  for (i = 0; i < runs; i++)
+    {
+      if (reseed && (hip_esp_iv_init(&entry) < 0))
+        {
+          printf("hip_esp_iv_init() failed\n");
+          free(ivs);
+          return(-1);
+        }
+      if (run_ivs(&entry, seq, &ivs[n * iv_len]) < 0)
+        {
+          free(ivs);
+          return(-1);
+        }
+      n += NUM_IVS;
+    }
+
+  qsort(ivs, n, iv_len, iv_cmp);
+  for (i = 1; i < n; i++)
+    {
+      if (memcmp(&ivs[(i - 1) * iv_len], &ivs[i * iv_len], iv_len) == 0)
+        {
+          repeats++;
+        }
+    }
+  printf("%-8s %d IVs, %d repeated\n", name, n, repeats);
+  if (entry.iv_ctx)
+    {
+      EVP_CIPHER_CTX_free(entry.iv_ctx);
+    }
+  free(ivs);
+  return(repeats);
+}
+
+int main(int argc, char *argv[])
+{
+  int err = 0;
+
+  err |= test_sa("AES-CBC", SADB_X_EALG_AESCBC, 16, 1);
+  err |= test_sa("3DES-CBC", SADB_EALG_3DESCBC, 8, 1);
+#ifdef HIP_ESP_AES_GCM
+  err |= test_sa("AES-GCM", SADB_X_EALG_AES_GCM_ICV16, 8, 0);
+#endif
+  printf("%s\n", err ? "FAILED" : "PASSED");
+  return(err ? 1 : 0);
+}
@@ -0,0 +1,237 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2002-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  hash_bench.c
+ *
+ *  \brief  SADB hash table benchmark program.
+ *
+ * This file is outside of the normal build process and must be compiled
+ * by hand using gcc, from this directory:
+ *
+ *   gcc -O2 -I../include -o hash_bench hash_bench.c ../usermode/hip_hash.c
+ *
+ * For each table size it inserts that many random SPIs into a table from
+ * usermode/hip_hash.c, which grows and hashes with keyed SipHash, and into
+ * the fixed array of SADB_SIZE chains indexed by spi % SADB_SIZE that the
+ * SADB used before. It then times NUM_LOOKUPS lookups of random SPIs
+ * present in both, and prints the average time per lookup and the longest
+ * chain of each table.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <hip/hip_hash.h>
+
+#define SADB_SIZE 512                   /* chains of the old fixed table */
+#define NUM_LOOKUPS (4 * 1024 * 1024)
+
+typedef struct _bench_entry
+{
+  struct _bench_entry *next;            /* chain of the fixed table */
+  __u32 spi;
+} bench_entry;
+
+static bench_entry *fixed_table[SADB_SIZE];
+static volatile __u32 found;            /* keeps lookups from being elided */
+
+static double now_ns()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec * 1e9 + t.tv_nsec);
+}
+
+static __u32 random32()
+{
+  return(((__u32)(rand() & 0xFFFF) << 16) | (rand() & 0xFFFF));
+}
+
+static int match_spi(const void *item, const void *key)
+{
+  return(((const bench_entry*)item)->spi == *(const __u32*)key);
+}
+
+/* nothing is read concurrently, so retired memory is freed at once */
+static void retire_now(void *ptr, void (*free_fn)(void *ptr))
+{
+  free_fn(ptr);
+}
+
+static __u32 spi_hash(__u32 spi)
+{
+  return(hip_hash_key(&spi, sizeof(spi)));
+}
+
+static bench_entry *fixed_lookup(__u32 spi)
+{
+  bench_entry *e;
+
+  for (e = fixed_table[spi % SADB_SIZE]; e; e = e->next)
+    {
+      if (e->spi == spi)
+        {
+          break;
+        }
+    }
+  return(e);
+}
+
+/*
+ * longest_chain()
+ *
+ * Return the length of the longest chain in the fixed table, or with
+ * t set, in the current bucket array of t.
+ */
+static int longest_chain(hip_hash_table *t)
+{
+  hip_hash_node *n;
+  bench_entry *e;
+  int i, len, max = 0, size = t ? t->cur->mask + 1 : SADB_SIZE;
+
+  for (i = 0; i < size; i++)
+    {
+      len = 0;
+      if (t)
+        {
+          for (n = t->cur->b[i]; n; n = n->next)
+            {
+              len++;
+            }
+        }
+      else
+        {
+          for (e = fixed_table[i]; e; e = e->next)
+            {
+              len++;
+            }
+        }
+      if (len > max)
+        {
+          max = len;
+        }
+    }
+  return(max);
+}
+
+/*
+ * bench_size()
+ *
+ * Fill both tables with num entries and time lookups in each.
+ */
+static int bench_size(int num)
+{
+  hip_hash_table table;
+  bench_entry *entries;
+  __u32 *keys, spi;
+  double t, t_hash, t_fixed;
+  int i;
+
+  entries = calloc(num, sizeof(bench_entry));
+  keys = malloc(NUM_LOOKUPS * sizeof(__u32));
+  if (!entries || !keys ||
+      (hip_hash_init(&table, 0, match_spi, retire_now) < 0))
+    {
+      printf("malloc error\n");
+      return(-1);
+    }
+  memset(fixed_table, 0, sizeof(fixed_table));
+  for (i = 0; i < num; i++)
+    {
+      do
+        {
+          spi = random32();
+        }
+      while ((spi == 0) || fixed_lookup(spi));
+      entries[i].spi = spi;
+      entries[i].next = fixed_table[spi % SADB_SIZE];
+      fixed_table[spi % SADB_SIZE] = &entries[i];
+      if (hip_hash_insert(&table, spi_hash(spi), &entries[i]) < 0)
+        {
+          printf("hip_hash_insert() failed\n");
+          return(-1);
+        }
+    }
+  /* finish migrating, as the ESP housekeeping call would */
+  while (table.old)
+    {
+      hip_hash_rehash_step(&table);
+    }
+  for (i = 0; i < NUM_LOOKUPS; i++)
+    {
+      keys[i] = entries[random32() % num].spi;
+    }
+
+  t = now_ns();
+  for (i = 0; i < NUM_LOOKUPS; i++)
+    {
+      if (hip_hash_lookup(&table, spi_hash(keys[i]), &keys[i]))
+        {
+          found++;
+        }
+    }
+  t_hash = (now_ns() - t) / NUM_LOOKUPS;
+  t = now_ns();
+  for (i = 0; i < NUM_LOOKUPS; i++)
+    {
+      if (fixed_lookup(keys[i]))
+        {
+          found++;
+        }
+    }
+  t_fixed = (now_ns() - t) / NUM_LOOKUPS;
+
+  printf("%7d %10.0f ns (max chain %2d) %10.0f ns (max chain %4d)\n",
+         num, t_hash, longest_chain(&table), t_fixed, longest_chain(NULL));
+  hip_hash_destroy(&table, NULL);
+  free(entries);
+  free(keys);
+  return(0);
+}
+
+int main(int argc, char *argv[])
+{
+  __u8 key[HIP_HASH_KEY_LEN];
+  int i, sizes[] = { 100, 1000, 10000, 100000 };
+
+  srand(time(NULL));
+  for (i = 0; i < HIP_HASH_KEY_LEN; i++)
+    {
+      key[i] = rand() & 0xFF;
+    }
+  hip_hash_seed(key);
+
+  printf("    SAs        growing table             %d fixed chains\n",
+         SADB_SIZE);
+  for (i = 0; i < 4; i++)
+    {
+      if (bench_size(sizes[i]) < 0)
+        {
+          return(1);
+        }
+    }
+  return(0);
+}
@@ -71,6 +71,7 @@
 #include <hip/hip_proto.h>
 #include <hip/hip_globals.h>
 #include <hip/hip_funcs.h>
+#include <hip/hip_hash.h>
 #ifdef __WIN32__
 #include <WinDNS.h>
 #define NS_MAXDNAME DNS_MAX_NAME_LENGTH
@@ -194,10 +195,11 @@ int add_addresses_from_dns(char *name, hi_node *hi)
  * The configured transforms are arrays ordered by preference; the mask is a
  * bitmask used to quickly determine whether or not a transform is supported.
  */
-__u16 conf_transforms_to_mask()
+__u32 conf_transforms_to_mask()
 {
   int i;
-  __u16 transform, mask = 0;
+  __u16 transform;
+  __u32 mask = 0;
 
   for (i = 0; i < SUITE_ID_MAX; i++)
     {
@@ -206,6 +208,10 @@ __u16 conf_transforms_to_mask()
         {
           break;
         }
+      if (ESP_AEAD(transform))
+        {
+          continue;
+        }
       mask |= (1 << transform);
     }
   for (i = 0; i < SUITE_ID_MAX; i++)
@@ -215,6 +221,12 @@ __u16 conf_transforms_to_mask()
         {
           break;
         }
+#ifndef HIP_ESP_AES_GCM
+      if (ESP_AEAD(transform))
+        {
+          continue;
+        }
+#endif
       mask |= (1 << (ESP_OFFSET + transform));
     }
   return(mask);
@@ -348,13 +360,15 @@ int key_data_to_hi(const __u8 *data, __u8 alg, int hi_length, __u8 di_type,
 {
   int offset = 0, key_len = 0;
   char t;
-  __u16 e_len = 0;
+  __u16 e_len = 0, curve;
+  __u8 point[1 + 2 * HIP_ECDSA_SIZE];
+  EC_POINT *pub;
   hi_node *hi;
 
-  /* for DSA:			for RSA:
-   * T		1		E		1 or 3
-   * Q		20		N (pub modulus) variable
-   * P		64 + T*8
+  /* for DSA:			for RSA:		for ECDSA:
+   * T		1		E		1 or 3	curve	2
+   * Q		20		N (pub modulus) variable	X	32
+   * P		64 + T*8					Y	32
    * G		64 + T*8
    * Y (pub_key)	64 + T*8
    */
@@ -423,6 +437,23 @@ int key_data_to_hi(const __u8 *data, __u8 alg, int hi_length, __u8 di_type,
             }
         }
       break;
+    case HI_ALG_ECDSA:
+      /* the point is rejected below unless it is on the curve,
+       * so the length checks are not relaxed by OPT.permissive */
+      key_len = HIP_ECDSA_SIZE;
+      if ((hi_length < 2 + (2 * key_len)) ||
+          (max_length < 2 + (2 * key_len)))
+        {
+          log_(WARN, "ECDSA HI length too short: %d\n", hi_length);
+          return(-1);
+        }
+      curve = (data[0] << 8) | data[1];
+      if (curve != HI_ECC_CURVE_NIST_P256)
+        {
+          log_(WARN, "ECDSA HI has unsupported curve %u\n", curve);
+          return(-1);
+        }
+      break;
     default:
       log_(WARN, "Invalid HI type in RDATA: %u\n", alg);
       if (!OPT.permissive)
@@ -452,6 +483,11 @@ int key_data_to_hi(const __u8 *data, __u8 alg, int hi_length, __u8 di_type,
       log_(WARN, "Parsing HI and RSA already exists.\n");
       return(-1);
     }
+  else if ((alg == HI_ALG_ECDSA) && hi->ecdsa)
+    {
+      log_(WARN, "Parsing HI and ECDSA already exists.\n");
+      return(-1);
+    }
   hi->algorithm_id = alg;
   hi->size = key_len;
 
@@ -489,6 +525,32 @@ int key_data_to_hi(const __u8 *data, __u8 alg, int hi_length, __u8 di_type,
 #endif
       offset += key_len;
       break;
+    case HI_ALG_ECDSA:
+      /* get X and Y, EC_POINT_oct2point() checks that it is on the curve */
+      offset = 2;
+      point[0] = POINT_CONVERSION_UNCOMPRESSED;
+      memcpy(&point[1], &data[offset], 2 * key_len);
+      hi->ecdsa = EC_KEY_new_by_curve_name(HIP_ECDSA_CURVE);
+      pub = hi->ecdsa ? EC_POINT_new(EC_KEY_get0_group(hi->ecdsa)) : NULL;
+      if (!pub ||
+          !EC_POINT_oct2point(EC_KEY_get0_group(hi->ecdsa), pub, point,
+                              sizeof(point), NULL) ||
+          !EC_KEY_set_public_key(hi->ecdsa, pub))
+        {
+          log_(WARN, "Invalid ECDSA HI public key.\n");
+          EC_POINT_free(pub);
+          EC_KEY_free(hi->ecdsa);
+          hi->ecdsa = NULL;
+          return(-1);
+        }
+      EC_POINT_free(pub);
+#ifndef HIP_VPLS
+      log_(NORM, "Found ECDSA HI with public key: 0x");
+      print_hex((char *)&data[offset], 2 * key_len);
+      log_(NORM, "\n");
+#endif
+      offset += 2 * key_len;
+      break;
     default:
       break;
     }
@@ -775,61 +837,193 @@ hi_node* find_host_identity(hi_node* hi_head, const hip_hit hitr)
   return (NULL);
 }
 
+#ifndef HITGEN
+static int hip_assoc_count;             /* allocated associations */
+static void hip_assoc_hash_grow();
+
 /*
- * function init_hip_assoc()
+ * function hip_assoc_take()
  *
- * in:		my_host_id = pointer to one of my HIs to copy into the assoc.
- *              peer_hit = pointer to peer's HIT, or NULL, for copying any
- *                              attributes from peer_hi_head
- * out:		Returns pointer to a new hip_assoc, or NULL if error.
+ * Take the entry at the head of a slab's free list.
+ */
+static hip_assoc *hip_assoc_take(hip_assoc_slab *slab)
+{
+  hip_assoc *hip_a = slab->free;
+
+  slab->free = hip_a->free_next;
+  hip_a->free_next = NULL;
+  hip_a->allocated = TRUE;
+  slab->used++;
+  if (hip_a->slot >= max_hip_assoc)
+    {
+      max_hip_assoc = hip_a->slot + 1;
+    }
+  hip_assoc_count++;
+  return(hip_a);
+}
+
+/*
+ * function hip_assoc_alloc()
  *
- * Initialize a hip_assoc by copying the given HI (mine) and allocating the
- * peer's HI.
+ * out:		Returns a zeroed association, or NULL if none is available.
+ *
+ * Take an entry from the lowest slab that has one free, so that the
+ * associations stay packed at the start of the slabs and the slabs at
+ * the end can be released. A new slab is created when all are full.
  */
-#ifndef HITGEN
-hip_assoc *init_hip_assoc(hi_node *my_host_id, const hip_hit *peer_hit)
+static hip_assoc *hip_assoc_alloc()
 {
+  int s, i;
+  hip_assoc_slab *slab = NULL;
   hip_assoc *hip_a;
-  hi_node *stored_hi;
-  int i, num;
 
-  /* Create another HIP association by finding
-   * an unused slot in the hip_assoc_table.
-   */
-  num = -1;
-  for (i = 0; i < max_hip_assoc; i++)
+  for (s = 0; s < HIP_ASSOC_MAX_SLABS; s++)
     {
-      if (hip_assoc_table[i].state == UNASSOCIATED)
+      slab = hip_assoc_slabs[s];
+      if (!slab)
         {
-          num = i;
-          free_hip_assoc(&hip_assoc_table[i]);
-          if (num == max_hip_assoc)
+          slab = (hip_assoc_slab*) calloc(1, sizeof(hip_assoc_slab));
+          if (!slab)
+            {
+              log_(WARN, "Unable to allocate more associations.\n");
+              return(NULL);
+            }
+          for (i = HIP_ASSOC_SLAB_SIZE - 1; i >= 0; i--)
             {
-              max_hip_assoc++;
+              slab->a[i].slot = (s << HIP_ASSOC_SLAB_BITS) + i;
+              slab->a[i].free_next = slab->free;
+              slab->free = &slab->a[i];
             }
+          hip_assoc_slabs[s] = slab;
+          break;
+        }
+      if (slab->free)
+        {
+          break;
+        }
+    }
+  if (s == HIP_ASSOC_MAX_SLABS)
+    {
+      return(NULL);
+    }
+
+  hip_a = hip_assoc_take(slab);
+  hip_assoc_hash_grow();
+  return(hip_a);
+}
+
+/*
+ * function hip_assoc_release()
+ *
+ * Return an emptied association to the free list of its slab.
+ */
+static void hip_assoc_release(hip_assoc *hip_a, int slot)
+{
+  hip_assoc_slab *slab = hip_assoc_slabs[slot >> HIP_ASSOC_SLAB_BITS];
+
+  hip_a->slot = slot;
+  hip_a->allocated = FALSE;
+  hip_a->free_next = slab->free;
+  slab->free = hip_a;
+  slab->used--;
+  hip_assoc_count--;
+  /* reduce maximum entry in table when necessary */
+  while ((max_hip_assoc > 0) && !HIP_ASSOC(max_hip_assoc - 1)->allocated)
+    {
+      max_hip_assoc--;
+    }
+}
+
+/*
+ * function hip_assoc_trim()
+ *
+ * Release empty slabs beyond max_hip_assoc. This is not done by
+ * free_hip_assoc() because callers iterating over the associations
+ * may still look at a freed entry.
+ */
+void hip_assoc_trim()
+{
+  int s;
+
+  for (s = HIP_ASSOC_MAX_SLABS - 1; s > 0; s--)
+    {
+      if (!hip_assoc_slabs[s])
+        {
+          continue;
+        }
+      if (hip_assoc_slabs[s]->used > 0)
+        {
           break;
         }
+      free(hip_assoc_slabs[s]);
+      hip_assoc_slabs[s] = NULL;
     }
-  if (num < 0)
+}
+
+/*
+ * function free_hip_associations()
+ *
+ * Frees all associations in the association table by calling free_hip_assoc()
+ * on them.
+ */
+void free_hip_associations()
+{
+  int i;
+  for (i = 0; i < max_hip_assoc; i++)
     {
-      num = max_hip_assoc;
-      if (num == MAX_CONNECTIONS)
+      if (HIP_ASSOC(i)->state != UNASSOCIATED)
         {
-          log_(WARN, "Max number of connections reached.\n");
-          return(NULL);
+          free_hip_assoc(HIP_ASSOC(i));
         }
-      else
+    }
+}
+#endif /* HITGEN */
+
+#ifndef HITGEN
+/*
+ * function hip_assoc_new()
+ *
+ * out:		Returns an empty association from the table, or NULL if full.
+ *
+ * When the table is full, reuse an association that was never started.
+ */
+static hip_assoc *hip_assoc_new()
+{
+  hip_assoc *hip_a;
+  int i;
+
+  hip_a = hip_assoc_alloc();
+  for (i = 0; !hip_a && (i < max_hip_assoc); i++)
+    {
+      if (HIP_ASSOC(i)->allocated &&
+          (HIP_ASSOC(i)->state == UNASSOCIATED))
         {
-          max_hip_assoc++;
+          free_hip_assoc(HIP_ASSOC(i));
+          hip_a = hip_assoc_alloc();
         }
     }
+  if (!hip_a)
+    {
+      log_(WARN, "Max number of connections reached.\n");
+    }
+  return(hip_a);
+}
 
-  hip_a = &(hip_assoc_table[num]);
+/*
+ * function hip_assoc_setup()
+ *
+ * Fill in an empty association by copying the given HI (mine) and
+ * allocating the peer's HI. Returns -1 if memory could not be allocated.
+ */
+static int hip_assoc_setup(hip_assoc *hip_a, hi_node *my_host_id,
+                           const hip_hit *peer_hit)
+{
+  hi_node *stored_hi;
 
   /* Create my Host Identity state */
   if (!(hip_a->hi = create_new_hi_node()))
     {
-      return(NULL);
+      return(-1);
     }
   memcpy(hip_a->hi->hit, my_host_id->hit, sizeof(hip_hit));
   memcpy(&hip_a->hi->lsi, &my_host_id->lsi,
@@ -837,6 +1031,7 @@ hip_assoc *init_hip_assoc(hi_node *my_host_id, const hip_hit *peer_hit)
   hip_a->hi->size         = my_host_id->size;
   hip_a->hi->dsa          = my_host_id->dsa;
   hip_a->hi->rsa          = my_host_id->rsa;
+  hip_a->hi->ecdsa        = my_host_id->ecdsa;
   hip_a->hi->r1_gen_count = my_host_id->r1_gen_count;
   hip_a->hi->update_id    = my_host_id->update_id;
   hip_a->hi->algorithm_id = my_host_id->algorithm_id;
@@ -851,7 +1046,7 @@ hip_assoc *init_hip_assoc(hi_node *my_host_id, const hip_hit *peer_hit)
   /* Create the peer's HI */
   if (!(hip_a->peer_hi = create_new_hi_node()))
     {
-      return(NULL);
+      return(-1);
     }
   if (peer_hit)
     {
@@ -908,45 +1103,83 @@ hip_assoc *init_hip_assoc(hi_node *my_host_id, const hip_hit *peer_hit)
   hip_a->dh_group_id      = HCNF.dh_group;
   hip_a->dh               = NULL;
   hip_a->peer_dh          = NULL;
+  hip_a->ec               = NULL;
+  hip_a->peer_ec          = NULL;
   hip_a->keymat_index     = 0;
   memset(hip_a->keymat, 0, sizeof(hip_a->keymat));
   hip_a->preserve_outbound_policy = FALSE;
   hip_a->udp              = FALSE;
-
-  return(hip_a);
+  return(0);
 }
 
-#endif /* HITGEN */
+/*
+ * function init_hip_assoc()
+ *
+ * in:		my_host_id = pointer to one of my HIs to copy into the assoc.
+ *              peer_hit = pointer to peer's HIT, or NULL, for copying any
+ *                              attributes from peer_hi_head
+ * out:		Returns pointer to a new hip_assoc, or NULL if error.
+ *
+ * Initialize a hip_assoc by copying the given HI (mine) and allocating the
+ * peer's HI.
+ */
+hip_assoc *init_hip_assoc(hi_node *my_host_id, const hip_hit *peer_hit)
+{
+  hip_assoc *hip_a;
 
+  if (!(hip_a = hip_assoc_new()))
+    {
+      return(NULL);
+    }
+  if (hip_assoc_setup(hip_a, my_host_id, peer_hit) < 0)
+    {
+      return(NULL);
+    }
+  hip_assoc_index(hip_a);
+  return(hip_a);
+}
 
 /*
- * function free_hip_assoc()
+ * function init_pending_hip_assoc()
  *
- * in:		hip_a = the HIP association to delete.
- * out:		Returns the index of the emptied entry in the hip_assoc_table,
- *              or -1 on error.
+ * in:		my_host_id, peer_hit = as for init_hip_assoc()
+ * out:		Returns pointer to a new hip_assoc, or NULL if error.
  *
- * Frees dynamic memory structures contained in a HIP association entry.
+ * Initialize an association that is kept out of the table, so that a
+ * crypto worker can fill it in without hipd seeing it half done. It is
+ * later put in the table by adopt_hip_assoc(), or discarded by
+ * free_pending_hip_assoc().
  */
-#ifndef HITGEN
-int free_hip_assoc(hip_assoc *hip_a)
+hip_assoc *init_pending_hip_assoc(hi_node *my_host_id,
+                                  const hip_hit *peer_hit)
 {
-  int i;
+  hip_assoc *hip_a;
 
-  /* locate the association in the table */
-  for (i = 0; i < max_hip_assoc; i++)
+  if (!(hip_a = (hip_assoc*) calloc(1, sizeof(hip_assoc))))
     {
-      if (hip_a == &hip_assoc_table[i])
-        {
-          break;
-        }
+      log_(WARN, "Unable to allocate a pending association.\n");
+      return(NULL);
     }
-  /* return error if something went wrong */
-  if ((i > max_hip_assoc) || (i > MAX_CONNECTIONS))
+  hip_a->slot = -1;
+  if (hip_assoc_setup(hip_a, my_host_id, peer_hit) < 0)
     {
-      return(-1);
+      free_pending_hip_assoc(hip_a);
+      return(NULL);
     }
+  return(hip_a);
+}
 
+#endif /* HITGEN */
+
+
+#ifndef HITGEN
+/*
+ * function hip_assoc_free_state()
+ *
+ * Frees the dynamic memory structures contained in an association.
+ */
+static void hip_assoc_free_state(hip_assoc *hip_a)
+{
   /* do not DSA_free(hip_a->hi->dsa), there is only one copy */
   if (hip_a->hi)
     {
@@ -977,10 +1210,7 @@ int free_hip_assoc(hip_assoc *hip_a)
     }
   if (hip_a->rekey)
     {
-      if (hip_a->rekey->dh)
-        {
-          unuse_dh_entry(hip_a->rekey->dh);
-        }
+      unuse_dh_entry(hip_a->rekey->dh, hip_a->rekey->ec);
       free(hip_a->rekey);
     }
   if (hip_a->peer_rekey)
@@ -989,51 +1219,75 @@ int free_hip_assoc(hip_assoc *hip_a)
         {
           DH_free(hip_a->peer_rekey->dh);
         }
+      if (hip_a->peer_rekey->ec)
+        {
+          EC_KEY_free(hip_a->peer_rekey->ec);
+        }
       free(hip_a->peer_rekey);
     }
   if (hip_a->mh)
     {
       free(hip_a->mh);
     }
-  unuse_dh_entry(hip_a->dh);
+  unuse_dh_entry(hip_a->dh, hip_a->ec);
   if (hip_a->peer_dh)
     {
       DH_free(hip_a->peer_dh);
     }
+  if (hip_a->peer_ec)
+    {
+      EC_KEY_free(hip_a->peer_ec);
+    }
   if (hip_a->dh_secret)
     {
       memset(hip_a->dh_secret, 0, sizeof(*hip_a->dh_secret));
       free(hip_a->dh_secret);
     }
+}
+
+/*
+ * function free_hip_assoc()
+ *
+ * in:		hip_a = the HIP association to delete.
+ * out:		Returns the slot number of the emptied entry, or -1 on error.
+ *
+ * Frees dynamic memory structures contained in a HIP association entry,
+ * and returns the entry to the free list.
+ */
+int free_hip_assoc(hip_assoc *hip_a)
+{
+  int i = hip_a->slot;
+
+  /* return error if something went wrong */
+  if (!hip_a->allocated)
+    {
+      return(-1);
+    }
+
+  hip_assoc_free_state(hip_a);
+  hip_assoc_unindex(hip_a);
+  hip_timer_del(&hip_a->timer);
   /* erase any residual keying material, set ptrs to NULL  */
   memset(hip_a, 0, sizeof(hip_assoc));
   /* prevent the deleted entry from being used */
   hip_a->state = UNASSOCIATED;
-  /* reduce maximum entry in table when necessary */
-  if (i == (max_hip_assoc - 1))
-    {
-      max_hip_assoc--;
-    }
+  hip_assoc_release(hip_a, i);
 
   return(i);
 }
 
 /*
- * function free_hip_associations()
+ * function free_pending_hip_assoc()
  *
- * Frees all associations in the association table by calling free_hip_assoc()
- * on them.
+ * in:		hip_a = an association from init_pending_hip_assoc()
+ *
+ * Frees a pending association that was not adopted into the table.
  */
-void free_hip_associations()
+void free_pending_hip_assoc(hip_assoc *hip_a)
 {
-  int i;
-  for (i = 0; i < max_hip_assoc; i++)
-    {
-      if (hip_assoc_table[i].state != UNASSOCIATED)
-        {
-          free_hip_assoc(&hip_assoc_table[i]);
-        }
-    }
+  hip_assoc_free_state(hip_a);
+  memset(hip_a, 0, sizeof(hip_assoc));
+  free(hip_a);
 }
 #endif /* HITGEN */
 
@@ -1051,6 +1305,10 @@ void free_hi_node(hi_node *hi)
     {
       RSA_free(hi->rsa);
     }
+  if (hi->ecdsa)
+    {
+      EC_KEY_free(hi->ecdsa);
+    }
   pthread_mutex_destroy(&hi->addrs_mutex);
   if (hi->copies != NULL)
     {
@@ -1079,66 +1337,50 @@ void free_hi_node(hi_node *hi)
 }
 
 /*
- * function replace_hip_assoc()
+ * function adopt_hip_assoc()
  *
- * in:		a_old = the old HIP assocation entry to replace
- *              a_new = the new HIP assocation entry
+ * in:		a_old = the old HIP assocation entry to replace, or NULL
+ *              a_new = a pending association from init_pending_hip_assoc()
  *
- * out:		None.
+ * out:		Returns the table entry now holding a_new's state, or NULL if
+ *              the table is full, in which case a_new is left to the caller.
  *
- * Replace HIP association number i with the given entry.
+ * Move a pending association into the table, either into a new entry or
+ * in place of a_old so that pointers to a_old remain valid. a_new is
+ * freed once its state has been moved.
  */
 #ifndef HITGEN
-void replace_hip_assoc(hip_assoc *a_old, hip_assoc *a_new)
+hip_assoc *adopt_hip_assoc(hip_assoc *a_old, hip_assoc *a_new)
 {
+  hip_assoc *hip_a;
   int i;
 
-  /* out with the old */
-  if ((i = free_hip_assoc(a_old)) < 0)
+  if (a_old)
     {
-      log_(WARN, "Error replacing HIP association.\n");
-      return;
+      /* out with the old */
+      if ((i = free_hip_assoc(a_old)) < 0)
+        {
+          log_(WARN, "Error replacing HIP association.\n");
+          return(NULL);
+        }
+      /* the freed entry is at the head of its slab's free list */
+      hip_a = hip_assoc_take(hip_assoc_slabs[i >> HIP_ASSOC_SLAB_BITS]);
     }
-
-  /* in with the new */
-  a_old->hi = a_new->hi;
-  a_old->peer_hi = a_new->peer_hi;
-  a_old->state = a_new->state;
-  a_old->state_time.tv_sec = a_new->state_time.tv_sec;
-  a_old->state_time.tv_usec = a_new->state_time.tv_usec;
-  a_old->use_time.tv_sec = a_new->use_time.tv_sec;
-  a_old->use_time.tv_usec = a_new->use_time.tv_usec;
-  a_old->spi_in = a_new->spi_in;
-  a_old->spi_out = a_new->spi_out;
-  memcpy(&a_old->cookie_r, &a_new->cookie_r, sizeof(hipcookie));
-  // 14-Nov-2012 -- Need to copy in cookie solution
-  a_old->cookie_j = a_new->cookie_j;
-  memcpy(&a_old->rexmt_cache, &a_new->rexmt_cache,
-         sizeof(struct hip_packet_entry));
-  a_old->opaque = a_new->opaque;
-  a_old->regs = a_new->regs;
-  a_old->rekey = a_new->rekey;
-  a_old->peer_rekey = a_new->peer_rekey;
-  a_old->mh = a_new->mh;
-  a_old->hip_transform = a_new->hip_transform;
-  a_old->esp_transform = a_new->esp_transform;
-  a_old->dh_group_id = a_new->dh_group_id;
-  a_old->dh = a_new->dh;
-  a_old->peer_dh = a_new->peer_dh;
-  a_old->dh_secret = a_new->dh_secret;
-  a_old->keymat_index = a_new->keymat_index;
-  memcpy(a_old->keymat, a_new->keymat, KEYMAT_SIZE);
-  memcpy(a_old->keys, a_new->keys, NUMKEYS * sizeof(struct key_entry));
-  a_old->preserve_outbound_policy = a_new->preserve_outbound_policy;
-  a_old->udp = a_new->udp;
-
-  /* "free" the old entry (don't call free_hip_assoc) */
-  memset(a_new, 0, sizeof(hip_assoc));
-  /* reduce maximum entry in table when necessary */
-  if (a_new == &hip_assoc_table[max_hip_assoc - 1])
+  else if (!(hip_a = hip_assoc_new()))
     {
-      max_hip_assoc--;
+      return(NULL);
     }
+
+  /* in with the new, keeping the slab bookkeeping of the entry */
+  i = hip_a->slot;
+  memcpy(hip_a, a_new, sizeof(hip_assoc));
+  hip_a->allocated = TRUE;
+  hip_a->slot = i;
+  hip_a->free_next = NULL;
+  free(a_new);
+  hip_assoc_index(hip_a);
+  hip_assoc_wakeup(hip_a);
+  return(hip_a);
 }
 
 #endif /* HITGEN */
@@ -1182,6 +1424,9 @@ void set_state(hip_assoc *hip_a, int state)
       gettimeofday(&hip_a->state_time, NULL);
     }
   hip_a->state = state;
+#ifndef HITGEN
+  hip_assoc_wakeup(hip_a);
+#endif
 }
 
 /*
@@ -1555,7 +1800,8 @@ __u32 receive_hip_dns_response(unsigned char *buff, int len)
       p += 4;
       /* convert algorithm from IPSECKEY RR to HIP algorithm type */
       pk_alg =  (pk_alg == HIP_RR_PKALG_DSA) ? HI_ALG_DSA : \
-               ((pk_alg == HIP_RR_PKALG_RSA) ? HI_ALG_RSA : 0);
+               ((pk_alg == HIP_RR_PKALG_RSA) ? HI_ALG_RSA : \
+               ((pk_alg == HIP_RR_PKALG_ECDSA) ? HI_ALG_ECDSA : 0));
 
       /* ignore unknown algorithms and HIT sizes */
       hi = NULL;
@@ -1855,90 +2101,325 @@ int hex_to_bin(char *src, char *dst, int dst_len)
   return(total);
 }
 
+/*
+ * Puzzle solving
+ *
+ * J is tried as a counter instead of random numbers. The SHA-1 input
+ * I | HIT-I | HIT-R | J is a single 64-byte block where only the last two
+ * message words (J) change, so the first ten rounds are computed once per
+ * puzzle and every call of puzzle_try_lanes() finishes the block for
+ * PUZZLE_LANES consecutive values of J. The lane loops are written so
+ * that the compiler can vectorize them (multi-buffer SHA-1). A solution
+ * has zeroes in the bits that validate_solution() checks with
+ * compare_bits(), the low K bits of the last 8 bytes of the hash.
+ */
+#define PUZZLE_LANES 8
+#define PUZZLE_BATCH (1 << 16) /* tries between checks for done/timeout */
+#define PUZZLE_MAX_THREADS 16
+#define ROTL32(x, b) (__u32)(((x) << (b)) | ((x) >> (32 - (b))))
+
+typedef struct _puzzle_search {
+  __u32 w[16];                  /* message words, W10 | W11 is J */
+  __u32 mid[5];                 /* state after rounds 0-9 */
+  __u64 mask;                   /* K bits that must be zero */
+  int threads;
+  time_t deadline;
+  volatile int done;            /* set when solved or giving up */
+  __u8 solution[8];
+  __u64 tries;
+#ifndef __WIN32__
+  pthread_mutex_t mutex;
+#endif
+} puzzle_search;
+
+typedef struct _puzzle_worker {
+  puzzle_search *ps;
+  __u32 j_hi;                   /* first W10 searched by this thread */
+  __u32 j_lo;                   /* first W11 */
+} puzzle_worker;
+
+#define PUZZLE_ROUNDS(first, last, F, K) \
+  for (t = first; t < last; t++) \
+    { \
+      for (l = 0; l < PUZZLE_LANES; l++) \
+        { \
+          if (t >= 16) \
+            { \
+              x = w[(t - 3) & 15][l] ^ w[(t - 8) & 15][l] ^ \
+                  w[(t - 14) & 15][l] ^ w[t & 15][l]; \
+              w[t & 15][l] = ROTL32(x, 1); \
+            } \
+          x = ROTL32(a[l], 5) + (F) + e[l] + K + w[t & 15][l]; \
+          e[l] = d[l]; \
+          d[l] = c[l]; \
+          c[l] = ROTL32(b[l], 30); \
+          b[l] = a[l]; \
+          a[l] = x; \
+        } \
+    }
+
+/*
+ * puzzle_try_lanes()
+ *
+ * in:		ps = the puzzle
+ *              j_hi, j_lo = J of the first lane, the others add 1 to j_lo
+ *
+ * out:		Returns the lane whose J solves the puzzle, or -1.
+ */
+static int puzzle_try_lanes(const puzzle_search *ps, __u32 j_hi, __u32 j_lo)
+{
+  __u32 a[PUZZLE_LANES], b[PUZZLE_LANES], c[PUZZLE_LANES];
+  __u32 d[PUZZLE_LANES], e[PUZZLE_LANES], w[16][PUZZLE_LANES];
+  __u32 x, h[2];
+  __u64 v;
+  int t, l;
+
+  for (l = 0; l < PUZZLE_LANES; l++)
+    {
+      for (t = 0; t < 16; t++)
+        {
+          w[t][l] = ps->w[t];
+        }
+      w[10][l] = j_hi;
+      w[11][l] = j_lo + l;
+      a[l] = ps->mid[0];
+      b[l] = ps->mid[1];
+      c[l] = ps->mid[2];
+      d[l] = ps->mid[3];
+      e[l] = ps->mid[4];
+    }
+  PUZZLE_ROUNDS(10, 20, (b[l] & c[l]) | (~b[l] & d[l]), 0x5A827999);
+  PUZZLE_ROUNDS(20, 40, b[l] ^ c[l] ^ d[l], 0x6ED9EBA1);
+  PUZZLE_ROUNDS(40, 60, (b[l] & c[l]) | (b[l] & d[l]) | (c[l] & d[l]),
+                0x8F1BBCDC);
+  PUZZLE_ROUNDS(60, 80, b[l] ^ c[l] ^ d[l], 0xCA62C1D6);
+
+  /* the last 8 bytes of the hash are H3 | H4 */
+  for (l = 0; l < PUZZLE_LANES; l++)
+    {
+      h[0] = htonl(d[l] + 0x10325476);
+      h[1] = htonl(e[l] + 0xC3D2E1F0);
+      memcpy(&v, h, 8);
+      if ((v & ps->mask) == 0)
+        {
+          return(l);
+        }
+    }
+  return(-1);
+}
+
+/*
+ * puzzle_thread()
+ *
+ * in:		arg = the puzzle_worker
+ *
+ * Searches for a solution until one is found by any thread, the puzzle
+ * lifetime has passed, or hipd is exiting. Each thread starts at its own
+ * J and, when the low word wraps, skips ahead by the number of threads.
+ */
+static void *puzzle_thread(void *arg)
+{
+  puzzle_worker *pw = (puzzle_worker*) arg;
+  puzzle_search *ps = pw->ps;
+  __u32 j_hi = pw->j_hi, j_lo = pw->j_lo;
+  __u64 tries = 0;
+  int i, l;
+
+  while (!ps->done)
+    {
+      for (i = 0; i < PUZZLE_BATCH; i += PUZZLE_LANES)
+        {
+          if ((l = puzzle_try_lanes(ps, j_hi, j_lo)) >= 0)
+            {
+              break;
+            }
+          j_lo += PUZZLE_LANES;
+          if (j_lo < PUZZLE_LANES)
+            {
+              j_hi += ps->threads;
+            }
+        }
+      tries += i;
+#ifndef __WIN32__
+      pthread_mutex_lock(&ps->mutex);
+#endif
+      if (ps->done)
+        {
+          /* solved by another thread */
+        }
+      else if (l >= 0)
+        {
+          j_hi = htonl(j_hi);
+          j_lo = htonl(j_lo + l);
+          memcpy(&ps->solution[0], &j_hi, 4);
+          memcpy(&ps->solution[4], &j_lo, 4);
+          tries += l + 1;
+          ps->done = 1;
+        }
+      else if ((g_state != 0) || (time(NULL) > ps->deadline))
+        {
+          ps->done = -1;
+        }
+      if (ps->done)
+        {
+          ps->tries += tries;
+        }
+#ifndef __WIN32__
+      pthread_mutex_unlock(&ps->mutex);
+#endif
+    }
+  return(NULL);
+}
+
 /* solve_puzzle()
  *
  * in:		cookie = the cookie to solve (K, lifetime, random I, OPAQUE)
  *              solution = pointer to where to store the solution, if found
  *
- * out:		returns 0 if solved, -ERANGE if exceeds max_tries
+ * out:		returns 0 if solved, -ERANGE if not solved within the
+ *              puzzle lifetime
  *
- * Solve the cookie puzzle in max_tries and store the solution, otherwise
- * return error.
+ * Solve the cookie puzzle using puzzle_threads threads and store the
+ * solution, otherwise return error.
  */
 int solve_puzzle(hipcookie *cookie, __u64 *solution,
                  hip_hit *hit_i, hip_hit *hit_r)
 {
-  /* For birthday cookie */
-  unsigned int i = 0, lifetime_sec;
-  int done = 0;
-  const char zero[8] = { 0x0,0x0,0x0,0x0,0x0,0x0,0x0,0x0 };
-  unsigned char ij[48] = {0};
-  unsigned char ij_part1[40] = {0};
+  unsigned int lifetime_sec;
+  unsigned char ij[64] = {0};
   unsigned char md[SHA_DIGEST_LENGTH] = {0};
-  SHA_CTX c;
-  int k;
+  __u32 a, b, c, d, e, x, j[2];
+  puzzle_search ps;
+  puzzle_worker pw[PUZZLE_MAX_THREADS];
+  int i, t;
   struct timeval time1, time2;
-
-  /* create the first part of the hash material that doesn't change */
-  memcpy(&ij_part1[0], &(cookie->i), 8);
-  memcpy(&ij_part1[8], hit_i, sizeof(hip_hit));
-  memcpy(&ij_part1[24], hit_r, sizeof(hip_hit));
+#ifndef __WIN32__
+  pthread_t threads[PUZZLE_MAX_THREADS];
+#endif
 
   log_(NORM, "Using cookie from R1: ");
   print_cookie(cookie);
-  log_(NORM, "Calculating Ltrunc(SHA1(I|Rand),K)...");
+  log_(NORM, "Calculating Ltrunc(SHA1(I|J),K)...");
 
-  k = cookie->k;
-  if (k == 0)
+  if (cookie->k == 0)
     {
       log_(NORM, "Cookie has zero difficulty, using zero solution.\n");
       *solution = 0;
       return(0);
     }
+  else if (cookie->k > 64)
+    {
+      log_(WARN, "Cookie difficulty %u is too high.\n", cookie->k);
+      return(-ERANGE);
+    }
   lifetime_sec = 1 << (cookie->lifetime - 32);
   gettimeofday(&time1, NULL);
 
-  /* Solve cookie puzzle */
-  while (!done && g_state == 0)
+  /* I | HIT-I | HIT-R | J, padded to one SHA-1 block of 48 bytes */
+  memset(&ps, 0, sizeof(ps));
+  memcpy(&ij[0], &(cookie->i), 8);
+  memcpy(&ij[8], hit_i, sizeof(hip_hit));
+  memcpy(&ij[24], hit_r, sizeof(hip_hit));
+  ij[48] = 0x80;
+  ij[62] = (48 * 8) >> 8;
+  ij[63] = (48 * 8) & 0xFF;
+  for (t = 0; t < 16; t++)
+    {
+      memcpy(&x, &ij[t * 4], 4);
+      ps.w[t] = ntohl(x);
+    }
+
+  /* rounds 0-9 only use I and the HITs */
+  a = 0x67452301;
+  b = 0xEFCDAB89;
+  c = 0x98BADCFE;
+  d = 0x10325476;
+  e = 0xC3D2E1F0;
+  for (t = 0; t < 10; t++)
+    {
+      x = ROTL32(a, 5) + ((b & c) | (~b & d)) + e + 0x5A827999 + ps.w[t];
+      e = d;
+      d = c;
+      c = ROTL32(b, 30);
+      b = a;
+      a = x;
+    }
+  ps.mid[0] = a;
+  ps.mid[1] = b;
+  ps.mid[2] = c;
+  ps.mid[3] = d;
+  ps.mid[4] = e;
+  ps.mask = 0xFFFFFFFFFFFFFFFFll >> (64 - cookie->k);
+  ps.deadline = time1.tv_sec + lifetime_sec;
+
+  ps.threads = HCNF.puzzle_threads;
+#ifdef __WIN32__
+  ps.threads = 1;
+#else
+  if (ps.threads < 1)
     {
-      if ((++i) % 5000)             /* check progress every so often */
-        {
-          gettimeofday(&time2, NULL);
-          if (TDIFF(time2, time1) > (int)lifetime_sec)
-            {
-              log_(WARN, "Couldn't solve puzzle within ");
-              log_(NORM, "lifetime of %d (%d tries).\n",
-                   lifetime_sec, i);
-              return(-ERANGE);
-            }
-        }
-      memcpy(ij, ij_part1, 40);
-      RAND_bytes(&ij[40], 8);
-      SHA1_Init(&c);
-      SHA1_Update(&c, ij, 48);
-      SHA1_Final(md, &c);
+      ps.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#endif
+  if (ps.threads < 1)
+    {
+      ps.threads = 1;
+    }
+  else if (ps.threads > PUZZLE_MAX_THREADS)
+    {
+      ps.threads = PUZZLE_MAX_THREADS;
+    }
 
-      if (!OPT.daemon && (D_VERBOSE == OPT.debug) &&
-          ((i % 10000) == 0))
-        {
-          printf(".");
-          fflush(stdout);
-        }
-      if (compare_bits((char*)md, SHA_DIGEST_LENGTH, zero, 8,
-                       k) == 0)
+  /* start from a random J, keeping the low word aligned to the lanes */
+  RAND_bytes((unsigned char*)j, sizeof(j));
+  j[1] &= ~(PUZZLE_LANES - 1);
+  for (i = 0; i < ps.threads; i++)
+    {
+      pw[i].ps = &ps;
+      pw[i].j_hi = j[0] + i;
+      pw[i].j_lo = j[1];
+    }
+
+#ifndef __WIN32__
+  pthread_mutex_init(&ps.mutex, NULL);
+  for (i = 1; i < ps.threads; i++)
+    {
+      if (pthread_create(&threads[i], NULL, puzzle_thread, &pw[i]))
         {
-          gettimeofday(&time2, NULL);
-          log_(NORM, "found match in %d tries (~%d seconds).\n",
-               i, TDIFF(time2, time1));
-          done = 1;
+          log_(WARN, "Unable to start puzzle thread: %s\n",
+               strerror(errno));
+          break;
         }
     }
+  t = i;
+  puzzle_thread(&pw[0]);
+  for (i = 1; i < t; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+  pthread_mutex_destroy(&ps.mutex);
+#else
+  puzzle_thread(&pw[0]);
+#endif
+
+  gettimeofday(&time2, NULL);
+  if (ps.done < 0)
+    {
+      log_(WARN, "Couldn't solve puzzle within ");
+      log_(NORM, "lifetime of %d (%llu tries).\n",
+           lifetime_sec, ps.tries);
+      return(-ERANGE);
+    }
+  log_(NORM, "found match in %llu tries (~%d seconds, %d threads).\n",
+       ps.tries, TDIFF(time2, time1), ps.threads);
 
-  memcpy(solution, &ij[40], 8);
+  memcpy(solution, ps.solution, 8);
+  memcpy(&ij[40], ps.solution, 8);
+  SHA1(ij, 48, md);
   log_(NORM, "MD=");
   print_hex(md, sizeof(md));
   log_(NORM, "\nIJ=");
-  print_hex(ij, sizeof(ij));
+  print_hex(ij, 48);
   log_(NORM, "\n");
 
   return(0);
@@ -2135,6 +2616,15 @@ int khi_hi_input(hi_node *hi, __u8 *out)
       location += bn2bin_safe(hi->rsa->n, &out[location],
                               RSA_size(hi->rsa));
       break;
+    case HI_ALG_ECDSA:   /* RFC 7401 */
+      /* Encode curve, X, Y */
+      out[0] = 0x0;
+      out[1] = HI_ECC_CURVE_NIST_P256;
+      if (ec2bin_safe(hi->ecdsa, &out[2], hi->size) < 0)
+        {
+          return(-1);
+        }
+      break;
     default:
       return(-1);
     }
@@ -2195,6 +2685,14 @@ int hi_to_hit(hi_node *hi, hip_hit hit)
           len++;
         }
       break;
+    case HI_ALG_ECDSA:   /* RFC 7401 */
+      if (!hi->ecdsa)
+        {
+          log_(WARN, "hi_to_hit(): NULL ecdsa\n");
+          return(-1);
+        }
+      len = sizeof(khi_context_id) + 2 + (2 * hi->size);
+      break;
     default:
       log_(WARN, "hi_to_hit(): invalid algorithm (%d)\n",
            hi->algorithm_id);
@@ -2212,7 +2710,12 @@ int hi_to_hit(hi_node *hi, hip_hit hit)
       return(-1);
     }
   memcpy(&data[0], khi_context_id, sizeof(khi_context_id));
-  khi_hi_input(hi, &data[sizeof(khi_context_id)]);
+  if (khi_hi_input(hi, &data[sizeof(khi_context_id)]) < 0)
+    {
+      log_(WARN, "hi_to_hit(): error encoding HI\n");
+      free(data);
+      return(-1);
+    }
   /* Compute the hash */
   SHA1_Init(&ctx);
   SHA1_Update(&ctx, data, len);
@@ -2722,120 +3225,344 @@ int eight_byte_align(int location)
     }
 }
 
+#ifndef HITGEN
+/* chains of associations, one bucket array per index */
+static hip_assoc **hip_assoc_hash[HIP_ASSOC_NUM_IDX];
+static __u32 hip_assoc_hash_mask;       /* number of buckets - 1 */
+
+static __u32 hip_assoc_hash_hits(const hip_hit peer, const hip_hit mine)
+{
+  __u8 buf[2 * HIT_SIZE];
+
+  memcpy(buf, peer, HIT_SIZE);
+  if (!mine)
+    {
+      return(hip_hash_key(buf, HIT_SIZE));
+    }
+  memcpy(&buf[HIT_SIZE], mine, HIT_SIZE);
+  return(hip_hash_key(buf, sizeof(buf)));
+}
+
+static __u32 hip_assoc_hash_addrs(struct sockaddr *peer, struct sockaddr *mine)
+{
+  __u8 buf[32];
+  int len = SAIPLEN(peer);
+
+  memcpy(buf, SA2IP(peer), len);
+  memcpy(&buf[len], SA2IP(mine), SAIPLEN(mine));
+  return(hip_hash_key(buf, len + (SAIPLEN(mine))));
+}
+
 /*
- * Return pointer to hip association (none if not found)
+ * hip_assoc_key()
+ *
+ * Compute the hash of the current value of index idx of an association.
+ * Returns 0 when the association has no key for this index.
  */
-hip_assoc* find_hip_association(struct sockaddr *src, struct sockaddr *dst,
-                                hiphdr* hiph)
+static int hip_assoc_key(hip_assoc *hip_a, int idx, __u32 *hash)
 {
-  int i;
-  hip_assoc* hip_a;
+  if ((idx == HIP_ASSOC_IDX_SPI_IN) || (idx == HIP_ASSOC_IDX_SPI_OUT))
+    {
+      *hash = hip_hash_key((idx == HIP_ASSOC_IDX_SPI_IN) ?
+                           &hip_a->spi_in : &hip_a->spi_out, sizeof(__u32));
+      return(1);
+    }
+  if (!hip_a->hi || !hip_a->peer_hi)
+    {
+      return(0);
+    }
+  switch (idx)
+    {
+    case HIP_ASSOC_IDX_HITS:
+      *hash = hip_assoc_hash_hits(hip_a->peer_hi->hit, hip_a->hi->hit);
+      break;
+    case HIP_ASSOC_IDX_PEER:
+      *hash = hip_assoc_hash_hits(hip_a->peer_hi->hit, NULL);
+      break;
+    default:
+      *hash = hip_assoc_hash_addrs(HIPA_DST(hip_a), HIPA_SRC(hip_a));
+      break;
+    }
+  return(1);
+}
 
-  for (i = 0; i < max_hip_assoc; i++)
+static void hip_assoc_unlink(hip_assoc *hip_a, int idx)
+{
+  hip_assoc **p;
+
+  p = &hip_assoc_hash[idx][hip_a->idx_hash[idx] & hip_assoc_hash_mask];
+  for (; *p; p = &(*p)->idx_next[idx])
     {
-      hip_a = &(hip_assoc_table[i]);
-      /* state and identities must exist */
-      if ((hip_a->state == 0) || !hip_a->hi || !hip_a->peer_hi)
-        {
-          continue;
-        }
-      /*
-       * src must match peer_hi->addrs.addr
-       * dst must match hi->addrs.addr
-       * hit_send must match peer_hi->hit
-       * hit_recv must match hi->hit
-       */
-      /* even though hi->addrs is a list, only consider
-       * the first (preferred) address in the list */
-      if (!(memcmp(SA2IP(HIPA_DST(hip_a)), SA2IP(src), SAIPLEN(src)))
-          &&
-          !(memcmp(SA2IP(HIPA_SRC(hip_a)), SA2IP(dst), SAIPLEN(dst)))
-          &&
-          (hits_equal(hip_a->peer_hi->hit, hiph->hit_sndr)) &&
-          (hits_equal(hip_a->hi->hit, hiph->hit_rcvr)))
+      if (*p == hip_a)
         {
-          return (hip_a);
+          *p = hip_a->idx_next[idx];
+          break;
         }
     }
-  return(NULL);
+  hip_a->idx_next[idx] = NULL;
+  hip_a->idx_linked &= ~(1 << idx);
 }
 
 /*
- * Return pointer to hip association (none if not found)
+ * function hip_assoc_index()
+ *
+ * in:		hip_a = the HIP association whose HITs, SPIs or preferred
+ *                      addresses may have changed
+ * out:		None.
+ *
+ * Move the association to the hash chains matching its current keys.
+ * Must be called after changing hi->hit, peer_hi->hit, spi_in, spi_out,
+ * HIPA_SRC() or HIPA_DST() of an association, otherwise the
+ * find_hip_association*() functions will not find it.
  */
-hip_assoc* find_hip_association2(hiphdr* hiph)
+void hip_assoc_index(hip_assoc *hip_a)
 {
-  int i;
-  hip_assoc* hip_a;
+  int idx;
+  __u32 hash;
 
-  for (i = 0; i < max_hip_assoc; i++)
+  if (!hip_assoc_hash[0])
+    {
+      return;
+    }
+  for (idx = 0; idx < HIP_ASSOC_NUM_IDX; idx++)
     {
-      hip_a = &(hip_assoc_table[i]);
-      if ((hip_a->state == 0) || !hip_a->hi || !hip_a->peer_hi)
+      if (!hip_assoc_key(hip_a, idx, &hash))
         {
+          if (hip_a->idx_linked & (1 << idx))
+            {
+              hip_assoc_unlink(hip_a, idx);
+            }
           continue;
         }
-      if ((hits_equal(hip_a->peer_hi->hit, hiph->hit_sndr)) &&
-          (hits_equal(hip_a->hi->hit, hiph->hit_rcvr)))
+      if (hip_a->idx_linked & (1 << idx))
         {
-          return (hip_a);
+          if (hip_a->idx_hash[idx] == hash)
+            {
+              continue;
+            }
+          hip_assoc_unlink(hip_a, idx);
         }
+      hip_a->idx_hash[idx] = hash;
+      hip_a->idx_next[idx] = hip_assoc_hash[idx][hash & hip_assoc_hash_mask];
+      hip_assoc_hash[idx][hash & hip_assoc_hash_mask] = hip_a;
+      hip_a->idx_linked |= (1 << idx);
     }
-  return(NULL);
 }
 
 /*
- * Return pointer to hip association (none if not found)
- * Lookup based only on IPs
+ * function hip_assoc_hash_grow()
+ *
+ * Double the buckets of the hash indexes once the number of associations
+ * exceeds HIP_ASSOC_HASH_LOAD per bucket, and create the first buckets.
+ * The chains are rebuilt from the stored hash values. If memory is
+ * short the old buckets are kept; the chains just get longer.
  */
-hip_assoc* find_hip_association3(struct sockaddr *src, struct sockaddr *dst)
+static void hip_assoc_hash_grow()
 {
-  int i;
-  hip_assoc* hip_a;
+  __u32 size, i;
+  int idx;
+  hip_assoc **b[HIP_ASSOC_NUM_IDX], *hip_a;
 
-  for (i = 0; i < max_hip_assoc; i++)
+  if (!hip_assoc_hash[0])
+    {
+      size = HIP_ASSOC_HASH_MIN;
+    }
+  else if (hip_assoc_count > (int)(HIP_ASSOC_HASH_LOAD *
+                                   (hip_assoc_hash_mask + 1)))
+    {
+      size = 2 * (hip_assoc_hash_mask + 1);
+    }
+  else
     {
-      hip_a = &(hip_assoc_table[i]);
-      if ((hip_a->state == 0) || !hip_a->hi || !hip_a->peer_hi)
+      return;
+    }
+
+  for (idx = 0; idx < HIP_ASSOC_NUM_IDX; idx++)
+    {
+      if (!(b[idx] = (hip_assoc**) calloc(size, sizeof(hip_assoc*))))
         {
-          continue;
+          while (--idx >= 0)
+            {
+              free(b[idx]);
+            }
+          return;
         }
-      /*
-       * src must match peer_hi->addrs.addr
-       * dst must match hi->addrs.addr
-       * even though hi->addrs is a list, only consider
-       * the first (preferred) address in the list */
-      if (!(memcmp(SA2IP(HIPA_DST(hip_a)), SA2IP(src), SAIPLEN(src)))
-          &&
-          !(memcmp(SA2IP(HIPA_SRC(hip_a)), SA2IP(dst), SAIPLEN(dst))))
+    }
+  for (i = 0; i < (__u32)max_hip_assoc; i++)
+    {
+      hip_a = HIP_ASSOC(i);
+      for (idx = 0; idx < HIP_ASSOC_NUM_IDX; idx++)
         {
-          return (hip_a);
+          if (!(hip_a->idx_linked & (1 << idx)))
+            {
+              continue;
+            }
+          hip_a->idx_next[idx] = b[idx][hip_a->idx_hash[idx] & (size - 1)];
+          b[idx][hip_a->idx_hash[idx] & (size - 1)] = hip_a;
         }
     }
-  return(NULL);
+  for (idx = 0; idx < HIP_ASSOC_NUM_IDX; idx++)
+    {
+      free(hip_assoc_hash[idx]);
+      hip_assoc_hash[idx] = b[idx];
+    }
+  hip_assoc_hash_mask = size - 1;
 }
 
 /*
- * Return pointer to hip association (none if not found)
+ * function hip_assoc_unindex()
+ *
+ * Remove the association from all hash indexes.
  */
-hip_assoc* find_hip_association4(hip_hit hit)
+void hip_assoc_unindex(hip_assoc *hip_a)
 {
-  int i;
-  hip_assoc* hip_a;
+  int idx;
 
-  for (i = 0; i < max_hip_assoc; i++)
+  for (idx = 0; idx < HIP_ASSOC_NUM_IDX; idx++)
     {
-      hip_a = &(hip_assoc_table[i]);
-      if ((hip_a->state == 0) || !hip_a->hi || !hip_a->peer_hi)
+      if (hip_a->idx_linked & (1 << idx))
         {
-          continue;
-        }
-      if ((hits_equal(hip_a->peer_hi->hit, hit)))
-        {
-          return (hip_a);
+          hip_assoc_unlink(hip_a, idx);
         }
     }
-  return(NULL);
+}
+
+/*
+ * Returns TRUE if the association may be returned by a lookup.
+ */
+#define HIP_ASSOC_VALID(h) ((h)->state && (h)->hi && (h)->peer_hi)
+
+/*
+ * Several entries may share a key (e.g. while an I2 replaces an existing
+ * association), so chains are searched completely and the entry with the
+ * lowest slot wins, as with a linear scan.
+ */
+#define HIP_ASSOC_FOREACH(h, idx, hash) \
+  for (h = hip_assoc_hash[idx] ? \
+         hip_assoc_hash[idx][(hash) & hip_assoc_hash_mask] : NULL; h; \
+       h = h->idx_next[idx]) \
+    if (h->idx_hash[idx] == (hash))
+
+#define HIP_ASSOC_BEST(best, h) \
+  if (!best || (h->slot < best->slot)) \
+    { \
+      best = h; \
+    }
+
+/*
+ * Return pointer to hip association (none if not found)
+ */
+hip_assoc* find_hip_association(struct sockaddr *src, struct sockaddr *dst,
+                                hiphdr* hiph)
+{
+  __u32 hash;
+  hip_assoc *hip_a, *best = NULL;
+
+  hash = hip_assoc_hash_hits(hiph->hit_sndr, hiph->hit_rcvr);
+  HIP_ASSOC_FOREACH(hip_a, HIP_ASSOC_IDX_HITS, hash)
+  {
+    /* state and identities must exist */
+    if (!HIP_ASSOC_VALID(hip_a))
+      {
+        continue;
+      }
+    /*
+     * src must match peer_hi->addrs.addr
+     * dst must match hi->addrs.addr
+     * hit_send must match peer_hi->hit
+     * hit_recv must match hi->hit
+     */
+    /* even though hi->addrs is a list, only consider
+     * the first (preferred) address in the list */
+    if (!(memcmp(SA2IP(HIPA_DST(hip_a)), SA2IP(src), SAIPLEN(src)))
+        &&
+        !(memcmp(SA2IP(HIPA_SRC(hip_a)), SA2IP(dst), SAIPLEN(dst)))
+        &&
+        (hits_equal(hip_a->peer_hi->hit, hiph->hit_sndr)) &&
+        (hits_equal(hip_a->hi->hit, hiph->hit_rcvr)))
+      {
+        HIP_ASSOC_BEST(best, hip_a);
+      }
+  }
+  return(best);
+}
+
+/*
+ * Return pointer to hip association (none if not found)
+ */
+hip_assoc* find_hip_association2(hiphdr* hiph)
+{
+  __u32 hash;
+  hip_assoc *hip_a, *best = NULL;
+
+  hash = hip_assoc_hash_hits(hiph->hit_sndr, hiph->hit_rcvr);
+  HIP_ASSOC_FOREACH(hip_a, HIP_ASSOC_IDX_HITS, hash)
+  {
+    if (!HIP_ASSOC_VALID(hip_a))
+      {
+        continue;
+      }
+    if ((hits_equal(hip_a->peer_hi->hit, hiph->hit_sndr)) &&
+        (hits_equal(hip_a->hi->hit, hiph->hit_rcvr)))
+      {
+        HIP_ASSOC_BEST(best, hip_a);
+      }
+  }
+  return(best);
+}
+
+/*
+ * Return pointer to hip association (none if not found)
+ * Lookup based only on IPs
+ */
+hip_assoc* find_hip_association3(struct sockaddr *src, struct sockaddr *dst)
+{
+  __u32 hash;
+  hip_assoc *hip_a, *best = NULL;
+
+  hash = hip_assoc_hash_addrs(src, dst);
+  HIP_ASSOC_FOREACH(hip_a, HIP_ASSOC_IDX_ADDRS, hash)
+  {
+    if (!HIP_ASSOC_VALID(hip_a))
+      {
+        continue;
+      }
+    /*
+     * src must match peer_hi->addrs.addr
+     * dst must match hi->addrs.addr
+     * even though hi->addrs is a list, only consider
+     * the first (preferred) address in the list */
+    if (!(memcmp(SA2IP(HIPA_DST(hip_a)), SA2IP(src), SAIPLEN(src)))
+        &&
+        !(memcmp(SA2IP(HIPA_SRC(hip_a)), SA2IP(dst), SAIPLEN(dst))))
+      {
+        HIP_ASSOC_BEST(best, hip_a);
+      }
+  }
+  return(best);
+}
+
+/*
+ * Return pointer to hip association (none if not found)
+ */
+hip_assoc* find_hip_association4(hip_hit hit)
+{
+  __u32 hash;
+  hip_assoc *hip_a, *best = NULL;
+
+  hash = hip_assoc_hash_hits(hit, NULL);
+  HIP_ASSOC_FOREACH(hip_a, HIP_ASSOC_IDX_PEER, hash)
+  {
+    if (!HIP_ASSOC_VALID(hip_a))
+      {
+        continue;
+      }
+    if ((hits_equal(hip_a->peer_hi->hit, hit)))
+      {
+        HIP_ASSOC_BEST(best, hip_a);
+      }
+  }
+  return(best);
 }
 
 /*
@@ -2846,27 +3573,31 @@ hip_assoc* find_hip_association4(hip_hit hit)
  */
 hip_assoc* find_hip_association_by_spi(__u32 spi, int dir)
 {
-  int i;
-  hip_assoc* hip_a;
-
-  for (i = 0; i < max_hip_assoc; i++)
-    {
-      hip_a = &(hip_assoc_table[i]);
-      if (hip_a->state == 0)
-        {
-          continue;
-        }
-      if (((dir == 0) || (dir == 1)) && (hip_a->spi_in == spi))
-        {
-          return(hip_a);
-        }
-      else if (((dir == 0) ||
-                (dir == 2)) && (hip_a->spi_out == spi))
-        {
-          return(hip_a);
-        }
-    }
-  return(NULL);
+  __u32 hash;
+  hip_assoc *hip_a, *best = NULL;
+
+  hash = hip_hash_key(&spi, sizeof(__u32));
+  if ((dir == 0) || (dir == 1))
+    {
+      HIP_ASSOC_FOREACH(hip_a, HIP_ASSOC_IDX_SPI_IN, hash)
+      {
+        if (hip_a->state && (hip_a->spi_in == spi))
+          {
+            HIP_ASSOC_BEST(best, hip_a);
+          }
+      }
+    }
+  if ((dir == 0) || (dir == 2))
+    {
+      HIP_ASSOC_FOREACH(hip_a, HIP_ASSOC_IDX_SPI_OUT, hash)
+      {
+        if (hip_a->state && (hip_a->spi_out == spi))
+          {
+            HIP_ASSOC_BEST(best, hip_a);
+          }
+      }
+    }
+  return(best);
 }
 
 hip_assoc *search_registrations(hip_hit hit, __u8 type)
@@ -2911,7 +3642,7 @@ hip_assoc *search_registrations2(__u8 type, int state)
 
   for (i = 0; i < max_hip_assoc; i++)
     {
-      hip_a = &(hip_assoc_table[i]);
+      hip_a = HIP_ASSOC(i);
       if ((hip_a->state == 0) || !hip_a->regs ||
           !hip_a->regs->reginfos)
         {
@@ -2934,6 +3665,7 @@ hip_assoc *search_registrations2(__u8 type, int state)
     }
   return(NULL);
 }
+#endif /* HITGEN */
 
 /*
  * Initialize OpenSSL crypto library.
@@ -3272,6 +4004,40 @@ int bn2bin_safe(const BIGNUM *a, unsigned char *to, int len)
   return(len);
 }
 
+/*
+ * function ec2bin_safe()
+ *
+ * in:		ec = EC key holding the public point
+ *              to = destination buffer, at least 2 * len bytes
+ *              len = size in bytes of one coordinate
+ *
+ * out:		Returns 2 * len, or -1 on error.
+ *
+ * Writes the public point as x | y, each padded with leading zeroes
+ * to len bytes, which is the encoding used by ECDSA HIs.
+ */
+int ec2bin_safe(const EC_KEY *ec, unsigned char *to, int len)
+{
+  BIGNUM *x, *y;
+  int err = -1;
+
+  x = BN_new();
+  y = BN_new();
+  if (x && y &&
+      EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(ec),
+                                          EC_KEY_get0_public_key(ec),
+                                          x, y, NULL) &&
+      (BN_num_bytes(x) <= len) && (BN_num_bytes(y) <= len))
+    {
+      bn2bin_safe(x, to, len);
+      bn2bin_safe(y, &to[len], len);
+      err = 2 * len;
+    }
+  BN_free(x);
+  BN_free(y);
+  return(err);
+}
+
 /*
  * function print_hex()
  *
@@ -302,6 +302,23 @@ void parse_xml_hostid(xmlNodePtr node, hi_node *hi)
               BN_hex2bn(&hi->rsa->iqmp, data);
             }
           break;
+        case HI_ALG_ECDSA:
+          if (strcmp((char *)node->name, "PUB") == 0)
+            {
+              EC_POINT *pub;
+              pub = EC_POINT_hex2point(EC_KEY_get0_group(hi->ecdsa),
+                                       data, NULL, NULL);
+              EC_KEY_set_public_key(hi->ecdsa, pub);
+              EC_POINT_free(pub);
+            }
+          else if (strcmp((char *)node->name, "PRIV") == 0)
+            {
+              BIGNUM *priv = NULL;
+              BN_hex2bn(&priv, data);
+              EC_KEY_set_private_key(hi->ecdsa, priv);
+              BN_free(priv);
+            }
+          break;
         default:
           break;
         }
@@ -395,9 +412,9 @@ int read_peer_identities_from_hipcfg()
   int rc, i;
   char name[255];
   sockaddr_list *l;
-  struct peer_node nodes[MAX_CONNECTIONS], *np;
+  struct peer_node nodes[MAX_HITS], *np;
 
-  rc = hipcfg_getPeerNodes(nodes, MAX_CONNECTIONS);
+  rc = hipcfg_getPeerNodes(nodes, MAX_HITS);
   if (rc < 0)
     {
       return(-1);
@@ -543,6 +560,10 @@ int read_identities_file(char *filename, int mine)
             case HI_ALG_RSA:
               hi->rsa = RSA_new();
               break;
+            case HI_ALG_ECDSA:
+              hi->ecdsa = EC_KEY_new_by_curve_name(HIP_ECDSA_CURVE);
+              hi->size = HIP_ECDSA_SIZE;
+              break;
             default:
               if (mine)
                 {
@@ -715,6 +736,21 @@ void xmlNewChild_from_bn(xmlNodePtr node, BIGNUM *bn, char *name)
   OPENSSL_free(cp);
 }
 
+/*
+ * function xmlNewChild_from_ec_pub()
+ *
+ * Helper to add an EC public key as a child of the given XML node,
+ * stored as the hex string of the uncompressed point.
+ */
+void xmlNewChild_from_ec_pub(xmlNodePtr node, EC_KEY *ec, char *name)
+{
+  char *cp = EC_POINT_point2hex(EC_KEY_get0_group(ec),
+                                EC_KEY_get0_public_key(ec),
+                                POINT_CONVERSION_UNCOMPRESSED, NULL);
+  xmlNewChild(node, NULL, BAD_CAST name, BAD_CAST cp);
+  OPENSSL_free(cp);
+}
+
 /*
  * function hi_to_xml()
  *
@@ -799,6 +835,13 @@ int hi_to_xml(xmlNodePtr root_node, hi_node *h, int mine)
           xmlNewChild_from_bn(hi, h->rsa->dmp1, "dmp1");
           xmlNewChild_from_bn(hi, h->rsa->dmq1, "dmq1");
           xmlNewChild_from_bn(hi, h->rsa->iqmp, "iqmp");
+          break;
+        case HI_ALG_ECDSA:
+          xmlNewChild_from_ec_pub(hi, h->ecdsa, "PUB");
+          xmlNewChild_from_bn(hi,
+                              (BIGNUM *)EC_KEY_get0_private_key(h->ecdsa),
+                              "PRIV");
+          break;
         default:
           break;
         }
@@ -993,6 +1036,16 @@ int read_conf_file(char *filename)
         {
           sscanf(data, "%d", &HCNF.cookie_difficulty);
         }
+      else if (strcmp((char *)node->name,
+                      "cookie_difficulty_max") == 0)
+        {
+          sscanf(data, "%d", &HCNF.cookie_difficulty_max);
+        }
+      else if (strcmp((char *)node->name,
+                      "cookie_adapt_rate") == 0)
+        {
+          sscanf(data, "%d", &HCNF.cookie_adapt_rate);
+        }
       else if (strcmp((char *)node->name,
                       "cookie_lifetime") == 0)
         {
@@ -1018,6 +1071,49 @@ int read_conf_file(char *filename)
         {
           sscanf(data, "%d", &HCNF.icmp_timeout);
         }
+      else if (strcmp((char *)node->name, "esp_queues") == 0)
+        {
+          sscanf(data, "%d", &HCNF.esp_queues);
+        }
+      else if (strcmp((char *)node->name,
+                      "esp_tap_socketpair") == 0)
+        {
+          if (strncmp(data, "yes", 3) == 0)
+            {
+              HCNF.esp_tap_socketpair = TRUE;
+            }
+          else
+            {
+              HCNF.esp_tap_socketpair = FALSE;
+            }
+        }
+      else if (strcmp((char *)node->name, "esp_batch") == 0)
+        {
+          sscanf(data, "%d", &HCNF.esp_batch);
+        }
+      else if (strcmp((char *)node->name, "esp_replay_window") == 0)
+        {
+          sscanf(data, "%d", &HCNF.esp_replay_window);
+        }
+      else if (strcmp((char *)node->name, "esp_iv_counter") == 0)
+        {
+          if (strncmp(data, "yes", 3) == 0)
+            {
+              HCNF.esp_iv_counter = TRUE;
+            }
+          else
+            {
+              HCNF.esp_iv_counter = FALSE;
+            }
+        }
+      else if (strcmp((char *)node->name, "crypto_workers") == 0)
+        {
+          sscanf(data, "%d", &HCNF.crypto_workers);
+        }
+      else if (strcmp((char *)node->name, "puzzle_threads") == 0)
+        {
+          sscanf(data, "%d", &HCNF.puzzle_threads);
+        }
       else if (strcmp((char *)node->name, "preferred_hi") == 0)
         {
           HCNF.preferred_hi = (char *)malloc(MAX_HI_NAMESIZE);
@@ -1076,10 +1172,22 @@ int read_conf_file(char *filename)
         {
           sscanf(data, "%d", &HCNF.dh_lifetime);
         }
+      else if (strcmp((char *)node->name, "dh_pool_low") == 0)
+        {
+          sscanf(data, "%d", &HCNF.dh_pool_low);
+        }
+      else if (strcmp((char *)node->name, "dh_pool_high") == 0)
+        {
+          sscanf(data, "%d", &HCNF.dh_pool_high);
+        }
       else if (strcmp((char *)node->name, "r1_lifetime") == 0)
         {
           sscanf(data, "%d", &HCNF.r1_lifetime);
         }
+      else if (strcmp((char *)node->name, "r1_cache_size") == 0)
+        {
+          sscanf(data, "%d", &HCNF.r1_cache_size);
+        }
       else if (strcmp((char *)node->name,
                       "failure_timeout") == 0)
         {
@@ -1126,8 +1234,21 @@ int read_conf_file(char *filename)
               if (strcmp((char *)child->name, "id") == 0)
                 {
                   sscanf(data2, "%d", &tmp);
-                  trns[t] = (__u16)tmp;
-                  t++;
+                  if (!SUITE_ID_SUPPORTED(tmp))
+                    {
+                      log_(WARN, "Unsupported transform %d ignored.\n",
+                           tmp);
+                    }
+                  else if ((trns == HCNF.hip_transforms) && ESP_AEAD(tmp))
+                    {
+                      log_(WARN, "Transform %d is ESP-only, ignored "
+                           "in <hip_sa>.\n", tmp);
+                    }
+                  else
+                    {
+                      trns[t] = (__u16)tmp;
+                      t++;
+                    }
                 }                 /* end if <id> */
               xmlFree(data2);
             }             /* end for */
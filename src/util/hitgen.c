@@ -38,6 +38,7 @@
 #include <openssl/sha.h>
 #include <openssl/dsa.h>
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
 #include <openssl/rand.h>
 #include <libxml/encoding.h>
 #include <libxml/xmlIO.h>
@@ -106,10 +107,21 @@ int generate_HI(xmlNodePtr root_node, hi_options *opts)
   BIO *bp;
   DSA *dsa = NULL;
   RSA *rsa = NULL;
+  EC_KEY *ec = NULL;
+  char *cp;
 
   printf("Generating a %d-bit %s key\n",
          opts->bitsize, HI_TYPESTR(opts->type));
-  if (opts->bitsize < 512)
+  if (opts->type == HI_ALG_ECDSA)
+    {
+      if (opts->bitsize != (8 * HIP_ECDSA_SIZE))
+        {
+          printf("Error: ECDSA keys use the %d-bit P-256 curve.\n",
+                 8 * HIP_ECDSA_SIZE);
+          return(-1);
+        }
+    }
+  else if (opts->bitsize < 512)
     {
       printf("Error: bit size too small. ");
       printf("512 bits is the minimum size\n");
@@ -154,6 +166,14 @@ int generate_HI(xmlNodePtr root_node, hi_options *opts)
           exit(1);
         }
       break;
+    case HI_ALG_ECDSA:
+      ec = EC_KEY_new_by_curve_name(HIP_ECDSA_CURVE);
+      if (!ec || !EC_KEY_generate_key(ec))
+        {
+          fprintf(stderr, "EC_KEY_generate_key() failed.\n");
+          exit(1);
+        }
+      break;
     default:
       printf("Error: generate_HI() got invalid HI type\n");
       exit(1);
@@ -202,6 +222,16 @@ int generate_HI(xmlNodePtr root_node, hi_options *opts)
       xmlNewChild(hi, NULL, BAD_CAST "iqmp",
                   BAD_CAST BN_bn2hex(rsa->iqmp));
       break;
+    case HI_ALG_ECDSA:
+      cp = EC_POINT_point2hex(EC_KEY_get0_group(ec),
+                              EC_KEY_get0_public_key(ec),
+                              POINT_CONVERSION_UNCOMPRESSED, NULL);
+      xmlNewChild(hi, NULL, BAD_CAST "PUB", BAD_CAST cp);
+      OPENSSL_free(cp);
+      cp = BN_bn2hex(EC_KEY_get0_private_key(ec));
+      xmlNewChild(hi, NULL, BAD_CAST "PRIV", BAD_CAST cp);
+      OPENSSL_free(cp);
+      break;
     default:
       break;
     }
@@ -217,6 +247,7 @@ int generate_HI(xmlNodePtr root_node, hi_options *opts)
   hostid.size = (opts->bitsize) / 8;
   hostid.rsa = rsa;
   hostid.dsa = dsa;
+  hostid.ecdsa = ec;
 
   hit.ss_family = AF_INET6;
   hitp = SA2IP(&hit);
@@ -258,6 +289,10 @@ int generate_HI(xmlNodePtr root_node, hi_options *opts)
         {
           RSA_print(bp, rsa, 0);
         }
+      if (ec)
+        {
+          EC_KEY_print(bp, ec, 0);
+        }
       BIO_free(bp);
     }
 
@@ -473,7 +508,7 @@ void print_hitgen_usage()
   printf("[-noinput] ");
   printf("[-file <file>] ");
   printf("[-append]\n");
-  printf("\t\t[-type DSA|RSA] ");
+  printf("\t\t[-type DSA|RSA|ECDSA] ");
   printf("[-bits|length <NN>] ");
   printf("[-anon] ");
   printf("[-incoming]\n");
@@ -488,7 +523,8 @@ void print_hitgen_usage()
   printf(" -file <file> \t write output to the specified file\n");
   printf(" -append\t append identity if file already exists\n");
   printf("Host identitiy generation:\n");
-  printf(" -type \tfollowed by \"DSA\" or \"RSA\" specifies key type\n");
+  printf(" -type \tfollowed by \"DSA\", \"RSA\" or \"ECDSA\" specifies key "
+         "type\n");
   printf(" -bits \t\t specifies the length in bits for (P,G,Y)\n");
   printf(" -length \t specifies the length in bytes for (P,G,Y)\n");
   printf(" -anon \t\t sets the anonymous flag for this HI\n");
@@ -603,6 +639,10 @@ int main(int argc, char *argv[])
             {
               opts.type = HI_ALG_RSA;
             }
+          else if (strcmp(*argv, "ECDSA") == 0)
+            {
+              opts.type = HI_ALG_ECDSA;
+            }
           else
             {
               printf("Invalid HI type.\n");
@@ -845,7 +885,9 @@ int main(int argc, char *argv[])
             {
               opts.type = HI_ALG_RSA;
             }
-          opts.bitsize = default_sizes[i];
+          /* ECDSA has a fixed key size */
+          opts.bitsize = (opts.type == HI_ALG_ECDSA) ?
+                         (8 * HIP_ECDSA_SIZE) : default_sizes[i];
           sprintf(opts.name, "%s-%d", basename, opts.bitsize);
           generate_HI(root_node, &opts);
         }
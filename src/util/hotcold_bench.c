@@ -0,0 +1,296 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2002-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  hotcold_bench.c
+ *
+ *  \brief  SADB entry layout benchmark program.
+ *
+ * This file is outside of the normal build process and must be compiled
+ * by hand using gcc, from this directory:
+ *
+ *   gcc -O2 -D_GNU_SOURCE -I../include -o hotcold_bench hotcold_bench.c \
+ *       ../usermode/hip_sadb.c ../usermode/hip_hash.c \
+ *       ../usermode/hip_timer.c ../usermode/hip_esp_iv.c -lcrypto -lpthread
+ *
+ * It models the SADB accesses hip_esp_output() makes per packet, for SAs
+ * picked at random, with two entry layouts:
+ *   old  the former single hip_sadb_entry of about 1 KB, copied below,
+ *        with the traffic counters updated under the entry lock;
+ *   new  the hot hip_sadb_entry with its cold record, and the traffic
+ *        counters kept per ESP thread by hip_sadb_inc_bytes().
+ * Run it as "hotcold_bench [threads]"; each thread registers as an SADB
+ * reader and sends NUM_PACKETS packets. The program prints the average
+ * time per packet for each layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <hip/hip_types.h>
+#include <hip/hip_funcs.h>
+#include <hip/hip_usermode.h>
+#include <hip/hip_sadb.h>
+
+#define NUM_PACKETS (8 * 1024 * 1024)   /* per thread and layout */
+#define MAX_THREADS 8
+
+/* globals and functions of hip_esp.c, hip_util.c used by hip_sadb.c */
+int esp_replay_win = 64;
+int esp_iv_gen = ESP_IV_COUNTER;
+int g_state = 0;
+esp_queue esp_queues[MAX_ESP_QUEUES];
+
+int esp_queue_select(__u8 *frame, int len)
+{
+  return(0);
+}
+
+void esp_start_expire(__u32 spi)
+{
+}
+
+__u16 checksum_magic(const hip_hit *i, const hip_hit *r)
+{
+  return(0);
+}
+
+sockaddr_list *add_address_to_list(sockaddr_list **list, struct sockaddr *addr,
+                                   int ifi)
+{
+  return(NULL);
+}
+
+void delete_address_from_list(sockaddr_list **list, struct sockaddr *addr,
+                              int ifi)
+{
+}
+
+/* hip_sadb_entry before it was split into hot and cold records */
+typedef struct _old_sadb_entry
+{
+  __u32 spi;                            /* primary index into SADB */
+  __u32 spinat;                         /* spinat for mobile router */
+  __u32 mode;           /* ESP mode :  0-default 1-transport 2-tunnel 3-beet */
+  int direction;                        /* 1-in/2-out */
+  __u16 hit_magic;                      /* for quick checksum calculation */
+  sockaddr_list *src_addrs;             /* source addresses             */
+  sockaddr_list *dst_addrs;             /* destination addresses        */
+  struct sockaddr_storage src_hit;       /* source HIT */
+  struct sockaddr_storage dst_hit;       /* destination HIT */
+  struct sockaddr_storage lsi;          /* peer's IPv4 <prefix>.x.x.x LSI */
+  __u32 a_type;                         /* crypto parameters            */
+  __u32 e_type;
+  __u32 a_keylen;
+  __u32 e_keylen;
+  __u8 *a_key;                          /* raw crypto keys */
+  __u8 *e_key;
+  __u64 lifetime;                       /* seconds until expiration */
+  struct timeval exptime;               /* expiration timestamp */
+  hip_timer exp_timer;                  /* fires at exptime */
+  __u64 bytes;                          /* bytes tx/rx */
+  __u32 packets;                        /* number of packets tx/rx*/
+  __u32 lost;                           /* number of packets lost */
+  __u32 dropped;                        /* number of packets dropped */
+  struct timeval usetime;               /* last used timestamp */
+  __u32 sequence;                       /* outgoing or highest received seq no*/
+  __u32 sequence_hi;                    /* high-order bits of 64-bit ESN */
+  __u32 replay_dups;                    /* duplicates dropped by window */
+  __u32 replay_old;                     /* dropped as older than window */
+  __u64 replay_win_max;                 /* right side of received window */
+  __u32 replay_win_words;               /* window size in 64-bit words */
+  __u64 *replay_win_map;                /* anti-replay bitmap, bit 0 = max */
+  char iv[8];
+  DES_key_schedule ks[3];               /* 3-DES keys */
+  BF_KEY *bf_key;                       /* BLOWFISH key */
+  EVP_CIPHER_CTX *cipher_ctx;           /* keyed AES-CBC/GCM context */
+  int cipher_enc;                       /* cipher_ctx keyed to encrypt */
+  HMAC_CTX *hmac_ctx;                   /* keyed HMAC, reset per packet */
+  int iv_gen;                           /* ESP_IV_RANDOM or ESP_IV_COUNTER */
+  EVP_CIPHER_CTX *iv_ctx;               /* encrypts the CBC IV counter */
+  __u8 iv_salt[8];                      /* random high half of IV counter */
+  hip_mutex_t rw_lock;
+} old_sadb_entry;
+
+/* read the fields hip_esp_encrypt() uses and assign a sequence number */
+#define ESP_ENCRYPT_FIELDS(e, lsi) \
+  (e->spi + e->mode + e->direction + e->e_type + e->a_type + e->e_keylen + \
+   e->hit_magic + e->iv_gen + e->cipher_enc + e->iv_salt[0] + lsi + \
+   (long)e->cipher_ctx + (long)e->hmac_ctx + (long)e->iv_ctx + \
+   (long)e->e_key + (long)e->bf_key + (long)e->src_addrs + \
+   (long)e->dst_addrs + (++e->sequence))
+
+static old_sadb_entry **old_entries;
+static hip_sadb_entry **new_entries;
+static __u32 *picks;                    /* SA used for each packet */
+static int num_sas;
+static volatile long sink;
+
+static double now_ns()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec * 1e9 + t.tv_nsec);
+}
+
+static void *send_old(void *arg)
+{
+  old_sadb_entry *e;
+  struct timeval now;
+  long acc = 0;
+  int i;
+
+  gettimeofday(&now, NULL);
+  for (i = 0; i < NUM_PACKETS; i++)
+    {
+      e = old_entries[picks[i]];
+      pthread_mutex_lock(&e->rw_lock);
+      acc += ESP_ENCRYPT_FIELDS(e, LSI4(&e->lsi));
+      pthread_mutex_unlock(&e->rw_lock);
+      pthread_mutex_lock(&e->rw_lock);
+      e->bytes += 1400;
+      e->packets++;
+      e->usetime.tv_sec = now.tv_sec;
+      e->usetime.tv_usec = now.tv_usec;
+      pthread_mutex_unlock(&e->rw_lock);
+    }
+  sink += acc;
+  return(NULL);
+}
+
+static void *send_new(void *arg)
+{
+  hip_sadb_entry *e;
+  struct timeval now;
+  long acc = 0;
+  int i, reader = hip_sadb_reader_add();
+
+  gettimeofday(&now, NULL);
+  for (i = 0; i < NUM_PACKETS; i++)
+    {
+      e = new_entries[picks[i]];
+      pthread_mutex_lock(&e->rw_lock);
+      acc += ESP_ENCRYPT_FIELDS(e, e->lsi4);
+      pthread_mutex_unlock(&e->rw_lock);
+      hip_sadb_inc_bytes(e, reader, 1400, &now);
+    }
+  hip_sadb_reader_remove(reader);
+  sink += acc;
+  return(NULL);
+}
+
+/*
+ * run_threads()
+ *
+ * Run fn in num threads and return the average time per packet.
+ */
+static double run_threads(void *(*fn)(void*), int num)
+{
+  pthread_t threads[MAX_THREADS];
+  double t;
+  int i;
+
+  t = now_ns();
+  for (i = 0; i < num; i++)
+    {
+      pthread_create(&threads[i], NULL, fn, NULL);
+    }
+  for (i = 0; i < num; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+  return((now_ns() - t) / ((double)num * NUM_PACKETS));
+}
+
+int main(int argc, char *argv[])
+{
+  int i, k, num_threads = 1, sizes[] = { 1000, 10000, 100000, 1000000 };
+  double t_old, t_new;
+
+  if (argc > 1)
+    {
+      num_threads = atoi(argv[1]);
+    }
+  if ((num_threads < 1) || (num_threads > MAX_THREADS))
+    {
+      printf("usage: %s [threads, 1-%d]\n", argv[0], MAX_THREADS);
+      return(1);
+    }
+  if (!(picks = malloc(NUM_PACKETS * sizeof(__u32))))
+    {
+      return(1);
+    }
+
+  printf("entry size: old %d bytes, new %d + %d bytes cold\n",
+         (int)sizeof(old_sadb_entry), (int)sizeof(hip_sadb_entry),
+         (int)sizeof(hip_sadb_cold));
+  printf("    SAs   old layout   hot/cold   (%d threads)\n", num_threads);
+  for (k = 0; k < 4; k++)
+    {
+      num_sas = sizes[k];
+      old_entries = malloc(num_sas * sizeof(old_sadb_entry*));
+      new_entries = malloc(num_sas * sizeof(hip_sadb_entry*));
+      if (!old_entries || !new_entries)
+        {
+          return(1);
+        }
+      for (i = 0; i < num_sas; i++)
+        {
+          old_entries[i] = calloc(1, sizeof(old_sadb_entry));
+          new_entries[i] = calloc(1, sizeof(hip_sadb_entry));
+          if (!old_entries[i] || !new_entries[i] ||
+              !(new_entries[i]->cold = calloc(1, sizeof(hip_sadb_cold))))
+            {
+              return(1);
+            }
+          pthread_mutex_init(&old_entries[i]->rw_lock, NULL);
+          pthread_mutex_init(&new_entries[i]->rw_lock, NULL);
+          new_entries[i]->ctr_index = i;
+        }
+      srand(1);
+      for (i = 0; i < NUM_PACKETS; i++)
+        {
+          picks[i] = ((__u32)rand() * 2654435761u) % num_sas;
+        }
+
+      t_old = run_threads(send_old, num_threads);
+      t_new = run_threads(send_new, num_threads);
+      printf("%7d %9.1f ns %8.1f ns\n", num_sas, t_old, t_new);
+
+      for (i = 0; i < num_sas; i++)
+        {
+          pthread_mutex_destroy(&old_entries[i]->rw_lock);
+          pthread_mutex_destroy(&new_entries[i]->rw_lock);
+          free(old_entries[i]);
+          free(new_entries[i]->cold);
+          free(new_entries[i]);
+        }
+      free(old_entries);
+      free(new_entries);
+    }
+  free(picks);
+  return(0);
+}
@@ -0,0 +1,201 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2002-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  puzzle_bench.c
+ *
+ *  \brief  Puzzle solver benchmark program.
+ *
+ * This file is outside of the normal build process and must be compiled
+ * by hand using gcc, from this directory, linking hip_util.c the same way
+ * as hitgen:
+ *
+ *   gcc -O3 -DHITGEN -I../include -I/usr/include/libxml2 -o puzzle_bench \
+ *       puzzle_bench.c hip_util.c ../protocol/hip_globals.c \
+ *       -lxml2 -lcrypto -lpthread
+ *
+ * Run it as "puzzle_bench [max K] [threads]". For each difficulty K from
+ * 10 up to max K (default 20) it solves random puzzles with solve_puzzle(),
+ * using the given number of threads (default 0, one per CPU), and then
+ * with the previous solver, which is copied below. Every solution is
+ * checked with validate_solution(). The program prints solutions per
+ * second and the hash rate this implies, 2^K hashes per solution on
+ * average.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <openssl/sha.h>
+#include <openssl/rand.h>
+#include <hip/hip_types.h>
+#include <hip/hip_funcs.h>
+#include <hip/hip_globals.h>
+
+#define MAX_OLD_K 20                    /* the old solver is too slow above */
+
+/* defined by hitgen.c for hip_util.c */
+int g_state;
+int netlsp[2];
+
+/*
+ * old_solve_puzzle()
+ *
+ * solve_puzzle() before J became a counter: a random J and a full SHA-1
+ * of I | HIT-I | HIT-R | J for every try, checking the clock on every
+ * try but one in 5000.
+ */
+static int old_solve_puzzle(hipcookie *cookie, __u64 *solution,
+                            hip_hit *hit_i, hip_hit *hit_r)
+{
+  unsigned int i = 0, lifetime_sec;
+  int done = 0;
+  const char zero[8] = { 0x0,0x0,0x0,0x0,0x0,0x0,0x0,0x0 };
+  unsigned char ij[48] = {0};
+  unsigned char ij_part1[40] = {0};
+  unsigned char md[SHA_DIGEST_LENGTH] = {0};
+  SHA_CTX c;
+  struct timeval time1, time2;
+
+  memcpy(&ij_part1[0], &(cookie->i), 8);
+  memcpy(&ij_part1[8], hit_i, sizeof(hip_hit));
+  memcpy(&ij_part1[24], hit_r, sizeof(hip_hit));
+  lifetime_sec = 1 << (cookie->lifetime - 32);
+  gettimeofday(&time1, NULL);
+
+  while (!done && g_state == 0)
+    {
+      if ((++i) % 5000)
+        {
+          gettimeofday(&time2, NULL);
+          if (TDIFF(time2, time1) > (int)lifetime_sec)
+            {
+              return(-ERANGE);
+            }
+        }
+      memcpy(ij, ij_part1, 40);
+      RAND_bytes(&ij[40], 8);
+      SHA1_Init(&c);
+      SHA1_Update(&c, ij, 48);
+      SHA1_Final(md, &c);
+      if (compare_bits((char*)md, SHA_DIGEST_LENGTH, zero, 8,
+                       cookie->k) == 0)
+        {
+          done = 1;
+        }
+    }
+  memcpy(solution, &ij[40], 8);
+  return(done ? 0 : -ERANGE);
+}
+
+static double now_sec()
+{
+  struct timeval t;
+
+  gettimeofday(&t, NULL);
+  return(t.tv_sec + t.tv_usec / 1e6);
+}
+
+/*
+ * run_solver()
+ *
+ * Solve num random puzzles of difficulty k and return the solutions per
+ * second, or -1 if any solution fails validate_solution().
+ */
+static double run_solver(int (*solve)(hipcookie*, __u64*, hip_hit*, hip_hit*),
+                         int k, int num)
+{
+  hipcookie cookie;
+  hip_hit hit_i, hit_r;
+  __u64 solution;
+  double start;
+  int i;
+
+  memset(&cookie, 0, sizeof(cookie));
+  cookie.k = k;
+  cookie.lifetime = 32 + 10;            /* 1024 seconds */
+  start = now_sec();
+  for (i = 0; i < num; i++)
+    {
+      RAND_bytes((unsigned char*)&cookie.i, sizeof(cookie.i));
+      RAND_bytes(hit_i, sizeof(hip_hit));
+      RAND_bytes(hit_r, sizeof(hip_hit));
+      if ((solve(&cookie, &solution, &hit_i, &hit_r) < 0) ||
+          (validate_solution(&cookie, &cookie, &hit_i, &hit_r,
+                             solution) < 0))
+        {
+          printf("K=%d: no valid solution\n", k);
+          return(-1);
+        }
+    }
+  return(num / (now_sec() - start));
+}
+
+int main(int argc, char *argv[])
+{
+  int k, num, max_k = MAX_OLD_K;
+  double s_new, s_old;
+
+  if (argc > 1)
+    {
+      max_k = atoi(argv[1]);
+    }
+  if (argc > 2)
+    {
+      HCNF.puzzle_threads = atoi(argv[2]);
+    }
+  if ((max_k < 10) || (max_k > 32))
+    {
+      printf("usage: %s [max K, 10-32] [threads]\n", argv[0]);
+      return(1);
+    }
+
+  printf(" K    new sol/s  new Mhash/s    old sol/s  old Mhash/s\n");
+  for (k = 10; k <= max_k; k++)
+    {
+      /* about the same number of hashes for every K */
+      num = (1 << 22) >> k;
+      if (num < 4)
+        {
+          num = 4;
+        }
+      if ((s_new = run_solver(solve_puzzle, k, num)) < 0)
+        {
+          return(1);
+        }
+      printf("%2d %12.1f %12.2f", k, s_new, s_new * (1 << k) / 1e6);
+      if (k <= MAX_OLD_K)
+        {
+          if ((s_old = run_solver(old_solve_puzzle, k, (num + 7) / 8)) < 0)
+            {
+              return(1);
+            }
+          printf(" %12.1f %12.2f", s_old, s_old * (1 << k) / 1e6);
+        }
+      printf("\n");
+      fflush(stdout);
+    }
+  return(0);
+}
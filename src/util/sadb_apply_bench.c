@@ -0,0 +1,245 @@
+/* -*- Mode:cc-mode; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/* vim: set ai sw=2 ts=2 et cindent cino={1s: */
+/*
+ * Host Identity Protocol
+ * Copyright (c) 2002-2012 the Boeing Company
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *  \file  sadb_apply_bench.c
+ *
+ *  \brief  SADB rekey benchmark program.
+ *
+ * This file is outside of the normal build process and must be compiled
+ * by hand using gcc, from this directory:
+ *
+ *   gcc -O2 -D_GNU_SOURCE -I../include -o sadb_apply_bench \
+ *       sadb_apply_bench.c ../usermode/hip_sadb.c ../usermode/hip_hash.c \
+ *       ../usermode/hip_timer.c ../usermode/hip_esp_iv.c -lcrypto -lpthread
+ *
+ * It installs NUM_ASSOC associations (an outgoing and an incoming SA each)
+ * and rekeys all of them NUM_REKEY times, replacing every SA with a new
+ * SPI. Run it as "sadb_apply_bench" to use hip_sadb_delete() and
+ * hip_sadb_add() for each SA, or as "sadb_apply_bench batch" to pass each
+ * rekey to hip_sadb_apply() as one set. Meanwhile another thread stands in
+ * for the SADB timer thread and takes hip_sadb_write_lock every
+ * millisecond. The program prints the time per rekey and the longest time
+ * that thread waited for the lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <hip/hip_types.h>
+#include <hip/hip_funcs.h>
+#include <hip/hip_usermode.h>
+#include <hip/hip_sadb.h>
+
+#define NUM_ASSOC 10000
+#define NUM_REKEY 5
+
+/* globals and functions of hip_esp.c, hip_util.c used by hip_sadb.c */
+int esp_replay_win = 64;
+int esp_iv_gen = ESP_IV_COUNTER;
+int g_state = 0;
+esp_queue esp_queues[MAX_ESP_QUEUES];
+extern hip_mutex_t hip_sadb_write_lock;
+
+int esp_queue_select(__u8 *frame, int len)
+{
+  return(0);
+}
+
+void esp_start_expire(__u32 spi)
+{
+}
+
+__u16 checksum_magic(const hip_hit *i, const hip_hit *r)
+{
+  return(0);
+}
+
+sockaddr_list *add_address_to_list(sockaddr_list **list, struct sockaddr *addr,
+                                   int ifi)
+{
+  return(NULL);
+}
+
+void delete_address_from_list(sockaddr_list **list, struct sockaddr *addr,
+                              int ifi)
+{
+}
+
+static struct sockaddr_storage hits[NUM_ASSOC][2], lsis[NUM_ASSOC][2];
+static struct sockaddr_storage addrs[2];
+static __u8 e_key[16], a_key[20];
+static volatile int stop = 0;
+static double max_wait = 0.0;
+
+static double now_ms()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec * 1e3 + t.tv_nsec / 1e6);
+}
+
+/*
+ * lock_poller()
+ *
+ * Take hip_sadb_write_lock every millisecond, as the SADB timer thread
+ * does, and record the longest wait for it.
+ */
+static void *lock_poller(void *arg)
+{
+  double t;
+
+  while (!stop)
+    {
+      t = now_ms();
+      pthread_mutex_lock(&hip_sadb_write_lock);
+      t = now_ms() - t;
+      pthread_mutex_unlock(&hip_sadb_write_lock);
+      if (t > max_wait)
+        {
+          max_wait = t;
+        }
+      usleep(1000);
+    }
+  return(NULL);
+}
+
+/*
+ * fill_op()
+ *
+ * Describe adding or deleting an SA of association i.
+ */
+static void fill_op(hip_sadb_op *o, int op, int i, int direction, __u32 spi)
+{
+  memset(o, 0, sizeof(hip_sadb_op));
+  o->op = op;
+  o->spi = spi;
+  o->direction = direction;
+  o->src_hit = SA(&hits[i][direction == 1]);
+  o->dst_hit = SA(&hits[i][direction == 2]);
+  o->src = SA(&addrs[0]);
+  o->dst = SA(&addrs[1]);
+  o->src_lsi = SA(&lsis[i][0]);
+  o->dst_lsi = SA(&lsis[i][1]);
+  o->e_key = e_key;
+  o->e_type = SADB_X_EALG_AESCBC;
+  o->e_keylen = sizeof(e_key);
+  o->a_key = a_key;
+  o->a_type = SADB_AALG_SHA1HMAC;
+  o->a_keylen = sizeof(a_key);
+  o->lifetime = 3600;
+}
+
+/*
+ * add_op()
+ *
+ * Add one SA with hip_sadb_add().
+ */
+static int add_op(hip_sadb_op *o)
+{
+  return(hip_sadb_add(o->mode, o->direction, o->src_hit, o->dst_hit,
+                      o->src, o->dst, o->src_lsi, o->dst_lsi, o->spi, 0,
+                      o->e_key, o->e_type, o->e_keylen, o->a_key, o->a_type,
+                      o->a_keylen, o->lifetime));
+}
+
+int main(int argc, char *argv[])
+{
+  static hip_sadb_op ops[4 * NUM_ASSOC];
+  int i, j, n, gen, batch = (argc > 1) && !strcmp(argv[1], "batch");
+  double start, elapsed;
+  pthread_t poller;
+
+  for (i = 0; i < NUM_ASSOC; i++)
+    {
+      for (j = 0; j < 2; j++)
+        {
+          hits[i][j].ss_family = AF_INET6;
+          SA2IP6(&hits[i][j])->s6_addr32[0] = htonl(0x20010010);
+          SA2IP6(&hits[i][j])->s6_addr32[3] = htonl(i * 2 + j);
+          lsis[i][j].ss_family = AF_INET;
+          LSI4(&lsis[i][j]) = htonl(0x01000000 + i * 2 + j);
+        }
+    }
+  addrs[0].ss_family = addrs[1].ss_family = AF_INET;
+  hip_sadb_init();
+
+  /* generation 0 of the SAs */
+  for (i = 0; i < NUM_ASSOC; i++)
+    {
+      fill_op(&ops[0], SADB_OP_ADD, i, 2, 0x10000 + 2 * i);
+      fill_op(&ops[1], SADB_OP_ADD, i, 1, 0x10000 + 2 * i + 1);
+      if ((add_op(&ops[0]) < 0) || (add_op(&ops[1]) < 0))
+        {
+          printf("hip_sadb_add() failed\n");
+          return(1);
+        }
+    }
+
+  pthread_create(&poller, NULL, lock_poller, NULL);
+  start = now_ms();
+  for (gen = 1; gen <= NUM_REKEY; gen++)
+    {
+      /* delete each SA of the previous generation, then add its successor */
+      for (i = 0, n = 0; i < NUM_ASSOC; i++)
+        {
+          for (j = 0; j < 2; j++)
+            {
+              fill_op(&ops[n++], SADB_OP_DELETE, i, 2 - j,
+                      0x10000 + (gen - 1) * 2 * NUM_ASSOC + 2 * i + j);
+              fill_op(&ops[n++], SADB_OP_ADD, i, 2 - j,
+                      0x10000 + gen * 2 * NUM_ASSOC + 2 * i + j);
+            }
+        }
+      if (batch)
+        {
+          if (hip_sadb_apply(ops, n) < 0)
+            {
+              printf("hip_sadb_apply() failed\n");
+              return(1);
+            }
+          continue;
+        }
+      for (i = 0; i < n; i += 2)
+        {
+          if ((hip_sadb_delete(ops[i].spi) < 0) || (add_op(&ops[i + 1]) < 0))
+            {
+              printf("hip_sadb_delete() or hip_sadb_add() failed\n");
+              return(1);
+            }
+        }
+    }
+  elapsed = now_ms() - start;
+  stop = 1;
+  pthread_join(poller, NULL);
+
+  printf("%s: %.1f ms per rekey of %d SAs, max lock wait %.2f ms\n",
+         batch ? "hip_sadb_apply()" : "per-SA calls", elapsed / NUM_REKEY,
+         2 * NUM_ASSOC, max_wait);
+  return(0);
+}
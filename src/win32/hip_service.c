@@ -945,7 +945,7 @@ void init_hip(DWORD ac, char **av)
   WORD wVer;
   WSADATA wsaData;
   __u32 tunreader_thrd, esp_output_thrd, esp_input_thrd;
-  __u32 hipd_thrd, netlink_thrd, dns_thrd, status_thrd;
+  __u32 hipd_thrd, netlink_thrd, dns_thrd, status_thrd, sadb_timer_thrd;
   int err;
   char hipd_args[255];
   int i;
@@ -1053,6 +1053,11 @@ void init_hip(DWORD ac, char **av)
       printf("Error creating ESP input thread.\n");
       exit(-1);
     }
+  if (!(sadb_timer_thrd = _beginthread(hip_sadb_timers, 0, NULL)))
+    {
+      printf("Error creating SADB timer thread.\n");
+      exit(-1);
+    }
   if (!is_dns_thread_disabled())
     {
       if (!(dns_thrd = _beginthread(hip_dns, 0, NULL)))